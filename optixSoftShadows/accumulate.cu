@@ -0,0 +1,24 @@
+#include <optixu/optixu_math_namespace.h>
+#include "pixel_layout.h"
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Progressive refinement
+//
+// Averages the filtered image into the accumulated one. Frame n
+// of a view is rendered with its own seeds and weighted by
+// 1 / (n + 1), so the first frame replaces what was there.
+//--------------------------------------------------------------
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+rtBuffer<float3, 2> blur_v_buffer;
+rtBuffer<float3, 2> accumulated_buffer;
+rtDeclareVariable(float, accumulation_weight, , );
+
+RT_PROGRAM void accumulate()
+{
+	const float3 color = PIXEL(blur_v_buffer, launch_index);
+	float3 &accumulated = PIXEL(accumulated_buffer, launch_index);
+	accumulated = accumulation_weight >= 1.f ? color : lerp(accumulated, color, accumulation_weight);
+}
@@ -0,0 +1,54 @@
+#include <optixu/optixu_math_namespace.h>
+#include "structs.h"
+#include "pixel_layout.h"
+
+using namespace optix;
+
+#define EPSILON  1.e-1f
+#define FLT_MAX 3.402823466e+38F
+
+//--------------------------------------------------------------
+// Blocker map
+//
+// Nearest and farthest distance from the center of the light to
+// the surfaces seen through every texel, rendered like a shadow
+// map with a few rays spread over each texel. Shadow rays use the
+// same geometry, so it is built from the shadow proxies where
+// available.
+//--------------------------------------------------------------
+
+#define BLOCKER_MAP_SUBSAMPLES 2 // Rays per texel along each axis
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+
+rtBuffer<float2, 2> blocker_map_buffer; // Min and max depth, 0 where no surface is seen
+rtDeclareVariable(rtObject, shadow_geometry, , );
+rtDeclareVariable(BlockerMapFrame, blocker_map_frame, , );
+
+RT_PROGRAM void build_blocker_map()
+{
+	const BlockerMapFrame frame = blocker_map_frame;
+	size_t2 size = blocker_map_buffer.size();
+	float min_depth = FLT_MAX, max_depth = 0.f;
+	for(int i = 0; i < BLOCKER_MAP_SUBSAMPLES; i++)
+	{
+		for(int j = 0; j < BLOCKER_MAP_SUBSAMPLES; j++)
+		{
+			const float2 offset = (make_float2(i, j) + 0.5f) / BLOCKER_MAP_SUBSAMPLES;
+			const float2 uv = (make_float2(launch_index) + offset) / make_float2(size) * 2.f - 1.f;
+			const float3 direction = normalize(frame.w + (uv.x * frame.u + uv.y * frame.v) * frame.tan_half_fov);
+
+			// Closest hit, the object id stays 0 on a miss
+			PerRayData_geometry_hit prd;
+			prd.object_id = 0.f;
+			Ray ray(frame.origin, direction, GEOMETRY_HIT_RAY, EPSILON);
+			rtTrace(shadow_geometry, ray, prd);
+			if(prd.object_id == 0.f) continue;
+
+			const float depth = length(prd.geometry_hit - frame.origin);
+			min_depth = fminf(min_depth, depth);
+			max_depth = fmaxf(max_depth, depth);
+		}
+	}
+	PIXEL(blocker_map_buffer, launch_index) = max_depth > 0.f ? make_float2(min_depth, max_depth) : make_float2(0.f);
+}
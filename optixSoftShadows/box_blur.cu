@@ -0,0 +1,137 @@
+#include <optixu/optixu_math_namespace.h>
+#include "pixel_layout.h"
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Constant-time variable-width blur
+//
+// Approximates the gaussian blur with a cascade of box filters
+// evaluated from per-row (or per-column) prefix sums, so the cost
+// per pixel does not depend on beta. Instead of weighting taps,
+// the boxes are clamped to the run of pixels around the center
+// that share its object id and have a similar normal.
+//--------------------------------------------------------------
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+rtBuffer<float,  2> beta_buffer;
+rtBuffer<float,  2> object_id_buffer;
+rtBuffer<float2, 2> projected_distances_buffer;
+rtBuffer<float3, 2> geometry_normal_buffer;
+rtBuffer<float3, 2> box_input_buffer;
+rtBuffer<float3, 2> box_output_buffer;
+rtBuffer<float4, 2> sat_buffer;     // Inclusive prefix sum of the color (xyz) and pixel count (w)
+rtBuffer<float2, 2> segment_buffer; // First and last pixel of the run the pixel belongs to
+
+// Number of box filters in the cascade
+#define NUM_BOX_PASSES 3
+
+// Minimum dot product between the normals of two neighboring pixels in the same run
+const float normal_threshold = 0.9f;
+
+bool same_surface(const uint2 a, const uint2 b)
+{
+	return PIXEL(object_id_buffer, a) == PIXEL(object_id_buffer, b) &&
+		dot(PIXEL(geometry_normal_buffer, a), PIXEL(geometry_normal_buffer, b)) >= normal_threshold;
+}
+
+// Computes the prefix sums and runs along one row (step = (1, 0)) or column (step = (0, 1))
+void prefix_sum(const uint2 start, const uint2 step, const unsigned int count)
+{
+	float4 sum = make_float4(0.f);
+	float segment_start = 0.f;
+	for(unsigned int i = 0; i < count; i++)
+	{
+		const uint2 pos = make_uint2(start.x + step.x * i, start.y + step.y * i);
+		if(i > 0 && !same_surface(pos, make_uint2(pos.x - step.x, pos.y - step.y)))
+		{
+			segment_start = i;
+		}
+		sum += make_float4(PIXEL(box_input_buffer, pos), 1.f);
+		PIXEL(sat_buffer, pos) = sum;
+		PIXEL(segment_buffer, pos) = make_float2(segment_start, 0.f);
+	}
+
+	// Walk backwards to find where each run ends
+	float segment_end = count - 1;
+	for(int i = count - 1; i >= 0; i--)
+	{
+		const uint2 pos = make_uint2(start.x + step.x * i, start.y + step.y * i);
+		PIXEL(segment_buffer, pos).y = segment_end;
+		if(PIXEL(segment_buffer, pos).x == i)
+		{
+			segment_end = i - 1;
+		}
+	}
+}
+
+RT_PROGRAM void prefix_sum_h()
+{
+	prefix_sum(make_uint2(0, launch_index.y), make_uint2(1, 0), box_input_buffer.size().x);
+}
+
+RT_PROGRAM void prefix_sum_v()
+{
+	prefix_sum(make_uint2(launch_index.x, 0), make_uint2(0, 1), box_input_buffer.size().y);
+}
+
+// Applies one box of the cascade along a row or column. i is the position of the pixel
+// along the row/column and step points to the next pixel.
+void box_blur(const unsigned int i, const uint2 step)
+{
+	const float beta = PIXEL(beta_buffer, launch_index);
+	if(beta == 0.f)
+	{
+		PIXEL(box_output_buffer, launch_index) = PIXEL(box_input_buffer, launch_index);
+		return;
+	}
+
+	// Beta is a distance in the plane of the light, convert it
+	// to pixels using the distance between neighboring pixels
+	const float2 segment = PIXEL(segment_buffer, launch_index);
+	const float2 center = PIXEL(projected_distances_buffer, launch_index);
+	float footprint = 0.f, num_neighbors = 0.f;
+	if(i > segment.x)
+	{
+		footprint += length(center - PIXEL(projected_distances_buffer, make_uint2(launch_index.x - step.x, launch_index.y - step.y)));
+		num_neighbors += 1.f;
+	}
+	if(i < segment.y)
+	{
+		footprint += length(center - PIXEL(projected_distances_buffer, make_uint2(launch_index.x + step.x, launch_index.y + step.y)));
+		num_neighbors += 1.f;
+	}
+	if(num_neighbors == 0.f || footprint == 0.f)
+	{
+		PIXEL(box_output_buffer, launch_index) = PIXEL(box_input_buffer, launch_index);
+		return;
+	}
+	const float sigma = beta * num_neighbors / footprint;
+
+	// A box of width w = 2r + 1 has a variance of (w^2 - 1) / 12, so the width
+	// giving each of the NUM_BOX_PASSES boxes a variance of sigma^2 / NUM_BOX_PASSES
+	const float box_width = sqrtf(12.f * sigma * sigma / NUM_BOX_PASSES + 1.f);
+	const int radius = (int)((box_width - 1.f) * 0.5f + 0.5f);
+
+	// Clamp the box to the run of pixels on the same surface
+	const int lo = max((int)i - radius, (int)segment.x);
+	const int hi = min((int)i + radius, (int)segment.y);
+
+	const uint2 origin = make_uint2(launch_index.x - step.x * i, launch_index.y - step.y * i);
+	float4 sum = PIXEL(sat_buffer, make_uint2(origin.x + step.x * hi, origin.y + step.y * hi));
+	if(lo > 0)
+	{
+		sum -= PIXEL(sat_buffer, make_uint2(origin.x + step.x * (lo - 1), origin.y + step.y * (lo - 1)));
+	}
+	PIXEL(box_output_buffer, launch_index) = make_float3(sum) / sum.w;
+}
+
+RT_PROGRAM void box_blur_h()
+{
+	box_blur(launch_index.x, make_uint2(1, 0));
+}
+
+RT_PROGRAM void box_blur_v()
+{
+	box_blur(launch_index.y, make_uint2(0, 1));
+}
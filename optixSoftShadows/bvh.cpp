@@ -0,0 +1,519 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <emmintrin.h>
+
+//--------------------------------------------------------------
+// Binary build
+//--------------------------------------------------------------
+
+namespace
+{
+	const int NUM_BINS = 12;
+	const int MAX_LEAF_SIZE = 4; // One triangle block
+
+	// Below this depth, nodes are split at the median instead of by SAH. SAH splits can
+	// peel off one triangle at a time, median splits halve, so the binary BVH is at most
+	// MAX_SAH_DEPTH + 31 levels deep and the traversal stack can't overflow.
+	const int MAX_SAH_DEPTH = 48;
+
+	struct Bounds
+	{
+		float3 lower = make_float3(1e30f), upper = make_float3(-1e30f);
+
+		void grow(const float3& p) { lower = fminf(lower, p); upper = fmaxf(upper, p); }
+		void grow(const Bounds& b) { lower = fminf(lower, b.lower); upper = fmaxf(upper, b.upper); }
+		float area() const
+		{
+			const float3 d = fmaxf(upper - lower, make_float3(0.f));
+			return d.x * d.y + d.y * d.z + d.z * d.x;
+		}
+	};
+
+	struct BuildPrimitive
+	{
+		Bounds bounds;
+		float3 centroid;
+		int index;
+	};
+
+	struct BuildNode
+	{
+		Bounds bounds;
+		int children[2]; // Unused for leaves
+		int first, count; // Primitives of leaves, count is 0 for inner nodes
+	};
+
+	float getComponent(const float3& v, int axis)
+	{
+		return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+	}
+
+	int buildBinary(std::vector<BuildNode>& nodes, std::vector<BuildPrimitive>& primitives, int first, int count, int depth)
+	{
+		const int index = (int)nodes.size();
+		nodes.push_back(BuildNode());
+
+		Bounds bounds, centroids;
+		for(int i = first; i < first + count; i++)
+		{
+			bounds.grow(primitives[i].bounds);
+			centroids.grow(primitives[i].centroid);
+		}
+		nodes[index].bounds = bounds;
+		nodes[index].first = first;
+		nodes[index].count = count;
+		if(count <= MAX_LEAF_SIZE) return index;
+
+		// Bin the centroids along the longest axis and split where the SAH cost is lowest
+		const float3 extent = centroids.upper - centroids.lower;
+		const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		const float axisLower = getComponent(centroids.lower, axis);
+		const float axisExtent = getComponent(extent, axis);
+
+		int middle = first + count / 2;
+		if(axisExtent > 0.f && depth >= MAX_SAH_DEPTH)
+		{
+			std::nth_element(primitives.begin() + first, primitives.begin() + middle, primitives.begin() + first + count,
+							 [axis](const BuildPrimitive& a, const BuildPrimitive& b) { return getComponent(a.centroid, axis) < getComponent(b.centroid, axis); });
+		}
+		else if(axisExtent > 0.f)
+		{
+			const float binScale = NUM_BINS * 0.9999f / axisExtent;
+			auto getBin = [&](const BuildPrimitive& primitive) { return (int)((getComponent(primitive.centroid, axis) - axisLower) * binScale); };
+
+			Bounds binBounds[NUM_BINS];
+			int binCounts[NUM_BINS] = {};
+			for(int i = first; i < first + count; i++)
+			{
+				const int bin = getBin(primitives[i]);
+				binBounds[bin].grow(primitives[i].bounds);
+				binCounts[bin]++;
+			}
+
+			// Sweep from the right, then from the left
+			float rightCosts[NUM_BINS];
+			Bounds right;
+			int rightCount = 0;
+			for(int bin = NUM_BINS - 1; bin > 0; bin--)
+			{
+				right.grow(binBounds[bin]);
+				rightCount += binCounts[bin];
+				rightCosts[bin] = right.area() * rightCount;
+			}
+			Bounds left;
+			int leftCount = 0, bestSplit = -1;
+			float bestCost = 1e30f;
+			for(int bin = 1; bin < NUM_BINS; bin++)
+			{
+				left.grow(binBounds[bin - 1]);
+				leftCount += binCounts[bin - 1];
+				const float cost = left.area() * leftCount + rightCosts[bin];
+				if(leftCount > 0 && leftCount < count && cost < bestCost)
+				{
+					bestCost = cost;
+					bestSplit = bin;
+				}
+			}
+
+			if(bestSplit > 0)
+			{
+				middle = (int)(std::partition(primitives.begin() + first, primitives.begin() + first + count,
+											  [&](const BuildPrimitive& primitive) { return getBin(primitive) < bestSplit; }) - primitives.begin());
+			}
+			else
+			{
+				std::nth_element(primitives.begin() + first, primitives.begin() + middle, primitives.begin() + first + count,
+								 [axis](const BuildPrimitive& a, const BuildPrimitive& b) { return getComponent(a.centroid, axis) < getComponent(b.centroid, axis); });
+			}
+		}
+
+		const int leftChild = buildBinary(nodes, primitives, first, middle - first, depth + 1);
+		const int rightChild = buildBinary(nodes, primitives, middle, first + count - middle, depth + 1);
+		nodes[index].children[0] = leftChild;
+		nodes[index].children[1] = rightChild;
+		nodes[index].count = 0;
+		return index;
+	}
+
+	// Converts four packed bytes to floats
+	inline __m128 unpackBytes(const uint8_t bytes[4])
+	{
+		int32_t packed;
+		memcpy(&packed, bytes, sizeof(packed));
+		const __m128i zero = _mm_setzero_si128();
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero));
+	}
+
+	inline __m128 dot3(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+	{
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	}
+}
+
+void WideBVH::addMesh(const MeshData& mesh)
+{
+	for(const int3& index : mesh.indices)
+	{
+		triangles.push_back({ mesh.positions[index.x], mesh.positions[index.y], mesh.positions[index.z] });
+	}
+}
+
+//--------------------------------------------------------------
+// Collapsing into a 4-wide BVH
+//--------------------------------------------------------------
+
+void WideBVH::build()
+{
+	nodes.clear();
+	blocks.clear();
+	binaryNodes.clear();
+	if(triangles.empty()) return;
+
+	std::vector<BuildPrimitive> primitives(triangles.size());
+	for(size_t i = 0; i < triangles.size(); i++)
+	{
+		BuildPrimitive &primitive = primitives[i];
+		primitive.bounds.grow(triangles[i].v0);
+		primitive.bounds.grow(triangles[i].v1);
+		primitive.bounds.grow(triangles[i].v2);
+		primitive.centroid = (primitive.bounds.lower + primitive.bounds.upper) * 0.5f;
+		primitive.index = (int)i;
+	}
+	std::vector<BuildNode> buildNodes;
+	buildNodes.reserve(2 * triangles.size() / MAX_LEAF_SIZE + 1);
+	buildBinary(buildNodes, primitives, 0, (int)primitives.size(), 0);
+
+	// Keep the binary BVH for the scalar traversal
+	primitiveOrder.resize(primitives.size());
+	for(size_t i = 0; i < primitives.size(); i++) primitiveOrder[i] = primitives[i].index;
+	for(const BuildNode &node : buildNodes)
+	{
+		BinaryNode binary;
+		binary.lower = node.bounds.lower;
+		binary.upper = node.bounds.upper;
+		binary.children[0] = node.count > 0 ? -1 : node.children[0];
+		binary.children[1] = node.count > 0 ? -1 : node.children[1];
+		binary.first = node.first;
+		binary.count = node.count;
+		binaryNodes.push_back(binary);
+	}
+
+	auto createBlock = [&](const BuildNode& leaf)
+	{
+		TriangleBlock block = {};
+		for(int j = 0; j < 4; j++)
+		{
+			block.primitives[j] = -1;
+			if(j >= leaf.count) continue; // Zero edges, never hit
+
+			const int primitive = primitives[leaf.first + j].index;
+			const Triangle &triangle = triangles[primitive];
+			const float3 edge1 = triangle.v1 - triangle.v0, edge2 = triangle.v2 - triangle.v0;
+			for(int axis = 0; axis < 3; axis++)
+			{
+				block.v0[axis][j] = getComponent(triangle.v0, axis);
+				block.edge1[axis][j] = getComponent(edge1, axis);
+				block.edge2[axis][j] = getComponent(edge2, axis);
+			}
+			block.primitives[j] = primitive;
+		}
+		blocks.push_back(block);
+		return ~int32_t(blocks.size() - 1);
+	};
+
+	// Pulls up the grandchildren of the largest inner children until a node has
+	// four children. A leaf root becomes a node with a single child.
+	std::function<int32_t(int, int)> collapse = [&](int binaryIndex, int depth) -> int32_t
+	{
+		maxDepth = std::max(maxDepth, depth);
+		std::vector<int> children;
+		if(buildNodes[binaryIndex].count > 0) children.push_back(binaryIndex);
+		else children.assign(buildNodes[binaryIndex].children, buildNodes[binaryIndex].children + 2);
+		while(children.size() < 4)
+		{
+			int largest = -1;
+			for(int i = 0; i < (int)children.size(); i++)
+			{
+				const BuildNode &child = buildNodes[children[i]];
+				if(child.count == 0 && (largest < 0 || child.bounds.area() > buildNodes[children[largest]].bounds.area())) largest = i;
+			}
+			if(largest < 0) break;
+
+			const BuildNode &expanded = buildNodes[children[largest]];
+			children[largest] = expanded.children[0];
+			children.push_back(expanded.children[1]);
+		}
+
+		const int32_t index = (int32_t)nodes.size();
+		nodes.push_back(Node());
+
+		// Quantize conservatively: lower bounds round down, upper bounds round up
+		const Bounds &bounds = buildNodes[binaryIndex].bounds;
+		Node node = {};
+		for(int axis = 0; axis < 3; axis++)
+		{
+			const float lower = getComponent(bounds.lower, axis), upper = getComponent(bounds.upper, axis);
+			float scale = (upper - lower) / 255.f;
+			while(lower + 255.f * scale < upper) scale = std::nextafter(scale, 1e30f);
+			node.lower[axis] = lower;
+			node.scale[axis] = scale;
+
+			for(int i = 0; i < 4; i++)
+			{
+				if(i >= (int)children.size())
+				{
+					node.qlower[axis][i] = node.qupper[axis][i] = 0;
+					continue;
+				}
+				const Bounds &child = buildNodes[children[i]].bounds;
+				const float childLower = getComponent(child.lower, axis), childUpper = getComponent(child.upper, axis);
+				int qlower = scale > 0.f ? std::min(std::max((int)std::floor((childLower - lower) / scale), 0), 255) : 0;
+				int qupper = scale > 0.f ? std::min(std::max((int)std::ceil((childUpper - lower) / scale), 0), 255) : 0;
+				while(qlower > 0 && lower + qlower * scale > childLower) qlower--;
+				while(qupper < 255 && lower + qupper * scale < childUpper) qupper++;
+				node.qlower[axis][i] = (uint8_t)qlower;
+				node.qupper[axis][i] = (uint8_t)qupper;
+			}
+		}
+
+		for(int i = 0; i < 4; i++)
+		{
+			if(i >= (int)children.size()) node.children[i] = EMPTY;
+			else if(buildNodes[children[i]].count > 0) node.children[i] = createBlock(buildNodes[children[i]]);
+			else node.children[i] = collapse(children[i], depth + 1);
+		}
+		nodes[index] = node;
+		return index;
+	};
+	maxDepth = 0;
+	collapse(0, 0);
+
+	// Every node visited pushes at most four children in place of itself
+	if(1 + 3 * maxDepth > STACK_SIZE) throw Exception("CPU BVH is too deep for the traversal stack");
+}
+
+//--------------------------------------------------------------
+// Traversal
+//--------------------------------------------------------------
+
+bool WideBVH::intersect(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	return traverse<false>(origin, direction, tmin, tmax, hit);
+}
+
+bool WideBVH::occluded(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	return traverse<true>(origin, direction, tmin, tmax, hit);
+}
+
+template<bool anyHit>
+bool WideBVH::traverse(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	if(nodes.empty()) return false;
+
+	// Keep the inverse direction finite, so boxes touching the origin give no nan
+	const float tiny = 1e-20f;
+	const float3 safeDirection = make_float3(
+		std::fabs(direction.x) > tiny ? direction.x : std::copysign(tiny, direction.x),
+		std::fabs(direction.y) > tiny ? direction.y : std::copysign(tiny, direction.y),
+		std::fabs(direction.z) > tiny ? direction.z : std::copysign(tiny, direction.z));
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+	const __m128 ix = _mm_set1_ps(1.f / safeDirection.x), iy = _mm_set1_ps(1.f / safeDirection.y), iz = _mm_set1_ps(1.f / safeDirection.z);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), tminv = _mm_set1_ps(tmin);
+
+	// Children still to visit and their entry distance
+	struct Entry
+	{
+		int32_t child;
+		float distance;
+	};
+	Entry stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, tmin };
+
+	bool found = false;
+	while(stackSize > 0)
+	{
+		const Entry entry = stack[--stackSize];
+		if(entry.distance > tmax) continue;
+
+		if(entry.child >= 0)
+		{
+			// Decode the child bounds and clip the ray against all four boxes
+			const Node &node = nodes[entry.child];
+			const __m128 tmaxv = _mm_set1_ps(tmax);
+			__m128 tnear = tminv, tfar = tmaxv;
+			const __m128 o[3] = { ox, oy, oz }, inv[3] = { ix, iy, iz };
+			for(int axis = 0; axis < 3; axis++)
+			{
+				const __m128 lower = _mm_set1_ps(node.lower[axis]), scale = _mm_set1_ps(node.scale[axis]);
+				const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(lower, _mm_mul_ps(unpackBytes(node.qlower[axis]), scale)), o[axis]), inv[axis]);
+				const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(lower, _mm_mul_ps(unpackBytes(node.qupper[axis]), scale)), o[axis]), inv[axis]);
+				tnear = _mm_max_ps(tnear, _mm_min_ps(t0, t1));
+				tfar = _mm_min_ps(tfar, _mm_max_ps(t0, t1));
+			}
+			int bits = _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+			if(!bits) continue;
+
+			// Push the hit children so the nearest is visited first
+			float distances[4];
+			_mm_storeu_ps(distances, tnear);
+			Entry hits[4];
+			int numHits = 0;
+			for(int i = 0; i < 4; i++)
+			{
+				if(!(bits >> i & 1) || node.children[i] == EMPTY) continue;
+				Entry e = { node.children[i], distances[i] };
+				int j = numHits++;
+				for(; j > 0 && hits[j - 1].distance < e.distance; j--) hits[j] = hits[j - 1];
+				hits[j] = e;
+			}
+			assert(stackSize + numHits <= STACK_SIZE);
+			for(int i = 0; i < numHits; i++) stack[stackSize++] = hits[i];
+			continue;
+		}
+
+		// Moller-Trumbore against the four triangles of the leaf
+		const TriangleBlock &block = blocks[~entry.child];
+		const __m128 e1x = _mm_loadu_ps(block.edge1[0]), e1y = _mm_loadu_ps(block.edge1[1]), e1z = _mm_loadu_ps(block.edge1[2]);
+		const __m128 e2x = _mm_loadu_ps(block.edge2[0]), e2y = _mm_loadu_ps(block.edge2[1]), e2z = _mm_loadu_ps(block.edge2[2]);
+		const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		const __m128 det = dot3(e1x, e1y, e1z, px, py, pz);
+		const __m128 invDet = _mm_div_ps(one, det);
+		const __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(block.v0[0])), sy = _mm_sub_ps(oy, _mm_loadu_ps(block.v0[1])), sz = _mm_sub_ps(oz, _mm_loadu_ps(block.v0[2]));
+		const __m128 u = _mm_mul_ps(dot3(sx, sy, sz, px, py, pz), invDet);
+		const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		const __m128 v = _mm_mul_ps(dot3(dx, dy, dz, qx, qy, qz), invDet);
+		const __m128 t = _mm_mul_ps(dot3(e2x, e2y, e2z, qx, qy, qz), invDet);
+
+		// Padding has a zero determinant
+		__m128 mask = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, tminv), _mm_cmplt_ps(t, _mm_set1_ps(tmax))));
+		const int bits = _mm_movemask_ps(mask);
+		if(!bits) continue;
+
+		float distances[4];
+		_mm_storeu_ps(distances, t);
+		for(int j = 0; j < 4; j++)
+		{
+			if((bits >> j & 1) && distances[j] < tmax)
+			{
+				tmax = distances[j];
+				hit.t = tmax;
+				hit.primitive = block.primitives[j];
+				found = true;
+			}
+		}
+		if(anyHit) break;
+	}
+
+	if(found) hit.position = origin + direction * hit.t;
+	return found;
+}
+
+//--------------------------------------------------------------
+// Scalar traversal of the binary BVH
+//--------------------------------------------------------------
+
+bool WideBVH::intersectBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	return traverseBinary<false>(origin, direction, tmin, tmax, hit);
+}
+
+bool WideBVH::occludedBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	return traverseBinary<true>(origin, direction, tmin, tmax, hit);
+}
+
+template<bool anyHit>
+bool WideBVH::traverseBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const
+{
+	if(binaryNodes.empty()) return false;
+
+	const float tiny = 1e-20f;
+	const float3 inverse = make_float3(
+		1.f / (std::fabs(direction.x) > tiny ? direction.x : std::copysign(tiny, direction.x)),
+		1.f / (std::fabs(direction.y) > tiny ? direction.y : std::copysign(tiny, direction.y)),
+		1.f / (std::fabs(direction.z) > tiny ? direction.z : std::copysign(tiny, direction.z)));
+
+	// Entry distance of the ray into a box, above tmax if it misses
+	auto clip = [&](const BinaryNode &node)
+	{
+		const float3 t0 = (node.lower - origin) * inverse, t1 = (node.upper - origin) * inverse;
+		const float3 nearT = fminf(t0, t1), farT = fmaxf(t0, t1);
+		const float tnear = std::max(std::max(nearT.x, nearT.y), std::max(nearT.z, tmin));
+		const float tfar = std::min(std::min(farT.x, farT.y), std::min(farT.z, tmax));
+		return tnear <= tfar ? tnear : INFINITY;
+	};
+
+	// Nodes still to visit and their entry distance
+	struct Entry
+	{
+		int node;
+		float distance;
+	};
+	Entry stack[STACK_SIZE];
+	int stackSize = 0;
+	const float rootDistance = clip(binaryNodes[0]);
+	if(rootDistance > tmax) return false;
+	stack[stackSize++] = { 0, rootDistance };
+
+	bool found = false;
+	while(stackSize > 0)
+	{
+		const Entry entry = stack[--stackSize];
+		if(entry.distance > tmax) continue;
+		const BinaryNode &node = binaryNodes[entry.node];
+
+		if(node.count == 0)
+		{
+			// Push the hit children so the nearer is visited first, as the wide traversal does
+			Entry children[2] = { { node.children[0], clip(binaryNodes[node.children[0]]) }, { node.children[1], clip(binaryNodes[node.children[1]]) } };
+			if(children[0].distance < children[1].distance) std::swap(children[0], children[1]);
+			assert(stackSize + 2 <= STACK_SIZE);
+			for(const Entry &child : children)
+			{
+				if(child.distance <= tmax) stack[stackSize++] = child;
+			}
+			continue;
+		}
+
+		// Moller-Trumbore, one triangle at a time
+		for(int i = node.first; i < node.first + node.count; i++)
+		{
+			const Triangle &triangle = triangles[primitiveOrder[i]];
+			const float3 edge1 = triangle.v1 - triangle.v0, edge2 = triangle.v2 - triangle.v0;
+			const float3 p = cross(direction, edge2);
+			const float det = dot(edge1, p);
+			if(det == 0.f) continue;
+			const float invDet = 1.f / det;
+			const float3 s = origin - triangle.v0;
+			const float u = dot(s, p) * invDet;
+			const float3 q = cross(s, edge1);
+			const float v = dot(direction, q) * invDet;
+			const float t = dot(edge2, q) * invDet;
+			if(u < 0.f || v < 0.f || u + v > 1.f || t <= tmin || t >= tmax) continue;
+
+			tmax = t;
+			hit.t = t;
+			hit.primitive = primitiveOrder[i];
+			found = true;
+			if(anyHit) break;
+		}
+		if(anyHit && found) break;
+	}
+
+	if(found) hit.position = origin + direction * hit.t;
+	return found;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+#include "geometry.h"
+
+#include <stdint.h>
+
+//--------------------------------------------------------------
+// CPU ray queries
+//
+// A binary BVH is built with binned SAH and collapsed into a
+// 4-wide BVH. Each node holds the bounds of its four children
+// quantized to 8 bits relative to the node, so a node fits in a
+// cache line and one ray is tested against all four boxes at
+// once. Leaves hold up to four triangles stored as a structure
+// of arrays, intersected together.
+//--------------------------------------------------------------
+
+struct RayHit
+{
+	float  t;         // Distance along the ray
+	float3 position;  // Hit point
+	int    primitive; // Index of the triangle in the order it was added
+};
+
+class WideBVH
+{
+public:
+	// Adds the triangles of a mesh. Call build() afterwards.
+	void addMesh(const MeshData& mesh);
+	void build();
+
+	int getTriangleCount() const { return (int)triangles.size(); }
+	int getNodeCount() const { return (int)nodes.size(); }
+
+	// Closest hit within (tmin, tmax), like a GEOMETRY_HIT_RAY
+	bool intersect(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+
+	// Any hit within (tmin, tmax), like a SHADOW_RAY. Stops at the first hit found,
+	// which is not necessarily the closest one.
+	bool occluded(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+
+	// The same queries on the binary BVH the 4-wide one was collapsed from,
+	// one box and one triangle at a time. Baseline for benchmarkCpuRays.
+	bool intersectBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+	bool occludedBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+
+private:
+	struct Triangle
+	{
+		float3 v0, v1, v2;
+	};
+
+	// Four children, 64 bytes
+	struct Node
+	{
+		float   lower[3];     // Lower corner of the node
+		float   scale[3];     // Size of one quantization step
+		uint8_t qlower[3][4]; // Child bounds in quantization steps, per axis and child
+		uint8_t qupper[3][4];
+		int32_t children[4];  // Node index, ~block index for leaves, or EMPTY
+	};
+
+	// Up to four triangles, padded with degenerate ones that are never hit
+	struct TriangleBlock
+	{
+		float   v0[3][4];
+		float   edge1[3][4], edge2[3][4];
+		int32_t primitives[4];
+	};
+
+	struct BinaryNode
+	{
+		float3 lower, upper;
+		int children[2];  // Inner nodes only
+		int first, count; // Entries of primitiveOrder of leaves, count is 0 for inner nodes
+	};
+
+	static const int32_t EMPTY = INT32_MIN;
+	static const int STACK_SIZE = 256; // Entries of the traversal stacks, checked by build()
+
+	template<bool anyHit>
+	bool traverse(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+	template<bool anyHit>
+	bool traverseBinary(const float3& origin, const float3& direction, float tmin, float tmax, RayHit& hit) const;
+
+	std::vector<Triangle> triangles;
+	std::vector<Node> nodes;
+	std::vector<TriangleBlock> blocks;
+	std::vector<BinaryNode> binaryNodes;
+	std::vector<int> primitiveOrder; // Triangle of each binary leaf entry
+	int maxDepth = 0;                // Of the 4-wide BVH
+};
@@ -1,4 +1,5 @@
 #include <optixu/optixu_math_namespace.h>
+#include "pixel_layout.h"
 
 using namespace optix;
 
@@ -15,6 +16,6 @@ rtBuffer<float3, 2> difference_buffer;
 
 RT_PROGRAM void calculate_difference()
 {
-	const float3 diff = input_buffer_0[launch_index] - input_buffer_1[launch_index];
-	difference_buffer[launch_index] = make_float3(dot(diff, diff) / 3.f * 20.f);
+	const float3 diff = PIXEL(input_buffer_0, launch_index) - PIXEL(input_buffer_1, launch_index);
+	PIXEL(difference_buffer, launch_index) = make_float3(dot(diff, diff) / 3.f * 20.f);
 }
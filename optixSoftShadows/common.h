@@ -24,6 +24,8 @@
 #include <numeric>
 #include <list>
 #include <map>
+#include <memory>
+#include <chrono>
 
 using namespace optix;
 
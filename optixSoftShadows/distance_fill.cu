@@ -0,0 +1,116 @@
+#include <optixu/optixu_math_namespace.h>
+#include "structs.h"
+#include "pixel_layout.h"
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Distance fill
+//
+// Spreads the light and occluder distances (d1, d2_max) of the
+// occluded pixels into the unoccluded pixels of the same object
+// with a pull-push pyramid. The pull passes average each 2x2
+// block into the next coarser level, keeping only the object
+// with the most data in the block. The push passes then fill the
+// texels lacking data from their parent, coarsest level first,
+// if the parent belongs to the same object. Every pixel is
+// reached in a constant number of taps, however far the nearest
+// occluded pixel is.
+//
+// Texels hold the averaged d1 and d2_max, the amount of data
+// behind them (0 to 1) and their object id.
+//--------------------------------------------------------------
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+
+rtBuffer<float,  2> d1_buffer;
+rtBuffer<float,  2> d2_max_buffer;
+rtBuffer<float,  2> object_id_buffer;
+rtBuffer<float4, 2> distance_pyramid_buffer;
+
+rtDeclareVariable(PyramidLevel, fine_level, , );
+rtDeclareVariable(PyramidLevel, coarse_level, , );
+
+static __device__ __inline__ uint2 pyramid_position(const PyramidLevel &level, uint2 texel)
+{
+	return make_uint2(level.offset.x + texel.x, level.offset.y + texel.y);
+}
+
+static __device__ __inline__ float4 load_texel(const PyramidLevel &level, uint2 texel)
+{
+	if(level.index == 0)
+	{
+		const float d2_max = PIXEL(d2_max_buffer, texel);
+		return make_float4(PIXEL(d1_buffer, texel), d2_max, d2_max > 0.f ? 1.f : 0.f, PIXEL(object_id_buffer, texel));
+	}
+	return PIXEL(distance_pyramid_buffer, pyramid_position(level, texel));
+}
+
+// Launched over the coarse level
+RT_PROGRAM void pull_distances()
+{
+	float4 children[4];
+	int num_children = 0;
+	for(unsigned int y = 0; y < 2; y++)
+	{
+		for(unsigned int x = 0; x < 2; x++)
+		{
+			const uint2 child = make_uint2(launch_index.x * 2 + x, launch_index.y * 2 + y);
+			if(child.x < fine_level.size.x && child.y < fine_level.size.y) children[num_children++] = load_texel(fine_level, child);
+		}
+	}
+
+	// Keep the object with the most data, or the most pixels if none has data
+	float best_object = 0.f, best_score = 0.f;
+	for(int i = 0; i < num_children; i++)
+	{
+		if(children[i].w == 0.f) continue;
+		float score = 0.f;
+		for(int j = 0; j < num_children; j++)
+		{
+			if(children[j].w == children[i].w) score += children[j].z + 1e-3f;
+		}
+		if(score > best_score)
+		{
+			best_score = score;
+			best_object = children[i].w;
+		}
+	}
+
+	float4 texel = make_float4(0.f, 0.f, 0.f, best_object);
+	for(int i = 0; i < num_children; i++)
+	{
+		if(children[i].w != best_object) continue;
+		texel.x += children[i].x * children[i].z;
+		texel.y += children[i].y * children[i].z;
+		texel.z += children[i].z;
+	}
+	if(texel.z > 0.f)
+	{
+		texel.x /= texel.z;
+		texel.y /= texel.z;
+		texel.z = fminf(texel.z, 1.f);
+	}
+	PIXEL(distance_pyramid_buffer, pyramid_position(coarse_level, launch_index)) = texel;
+}
+
+// Launched over the fine level, after the coarse level was pushed
+RT_PROGRAM void push_distances()
+{
+	float4 texel = load_texel(fine_level, launch_index);
+	const float4 parent = load_texel(coarse_level, make_uint2(launch_index.x / 2, launch_index.y / 2));
+	if(texel.z >= 1.f || parent.z == 0.f || parent.w != texel.w) return;
+
+	texel.x = texel.x * texel.z + parent.x * (1.f - texel.z);
+	texel.y = texel.y * texel.z + parent.y * (1.f - texel.z);
+	texel.z = 1.f;
+	if(fine_level.index == 0)
+	{
+		PIXEL(d1_buffer, launch_index) = texel.x;
+		PIXEL(d2_max_buffer, launch_index) = texel.y;
+	}
+	else
+	{
+		PIXEL(distance_pyramid_buffer, pyramid_position(fine_level, launch_index)) = texel;
+	}
+}
@@ -0,0 +1,93 @@
+#include "frames.h"
+#include "util.h"
+
+//--------------------------------------------------------------
+// Frame ring
+//--------------------------------------------------------------
+
+FrameRing::FrameRing(int numFrames)
+	: frames(std::max(numFrames, 3)), writing(-1), latest(-1), presenting(-1), newFrame(false)
+{
+}
+
+Frame &FrameRing::beginWrite()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const int numFrames = (int)frames.size();
+	for(int i = 1; i <= numFrames; i++)
+	{
+		const int frame = (writing + i + numFrames) % numFrames;
+		if(frame != latest && frame != presenting)
+		{
+			writing = frame;
+			break;
+		}
+	}
+	return frames[writing];
+}
+
+void FrameRing::endWrite()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		latest = writing;
+		newFrame = true;
+	}
+	condition.notify_all();
+}
+
+const Frame *FrameRing::acquireLatest()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	presenting = latest;
+	newFrame = false;
+	return presenting >= 0 ? &frames[presenting] : 0;
+}
+
+bool FrameRing::hasNewFrame() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return newFrame;
+}
+
+bool FrameRing::waitForNewFrame(double timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return condition.wait_for(lock, std::chrono::duration<double>(timeout), [this]() { return newFrame; });
+}
+
+//--------------------------------------------------------------
+// Presenters
+//--------------------------------------------------------------
+
+void GLPresenter::present(const Frame &frame)
+{
+	// Float frames are linear, let GL convert them like sutil::displayBufferGL does
+	glEnable(GL_FRAMEBUFFER_SRGB_EXT);
+	glRasterPos2f(0.f, 0.f);
+	glDrawPixels(width, height, GL_RGB, GL_FLOAT, frame.pixels.data());
+	glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+}
+
+void HeadlessPresenter::present(const Frame &frame)
+{
+	const double latency = getElapsedTime() - frame.camera.timestamp;
+	if(numPresented > 0) numSkipped += frame.number - lastNumber - 1;
+	lastNumber = frame.number;
+	numPresented++;
+	totalRenderTime += frame.renderTime;
+	totalLatency += latency;
+	maxLatency = std::max(maxLatency, latency);
+}
+
+void HeadlessPresenter::printStats() const
+{
+	if(numPresented == 0)
+	{
+		printf("No frames presented\n");
+		return;
+	}
+	printf("Presented %u frames (%u rendered but never presented)\n", numPresented, numSkipped);
+	printf("Average render time %.2f ms, input latency %.2f ms average, %.2f ms max\n",
+		   1000.0 * totalRenderTime / numPresented, 1000.0 * totalLatency / numPresented, 1000.0 * maxLatency);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+//--------------------------------------------------------------
+// Frames
+//
+// The render thread renders into a ring of frames while the UI
+// thread presents the newest completed one. Camera input is
+// handed to the render thread as timestamped snapshots, so the
+// latency from input to presentation can be measured.
+//--------------------------------------------------------------
+
+struct CameraSnapshot
+{
+	float3 position;   // Camera position
+	float  pitch, yaw; // Camera orientation (pitch and yaw)
+	double timestamp;  // getElapsedTime() when the snapshot was taken
+};
+
+struct Frame
+{
+	std::vector<float3> pixels;
+	unsigned number = 0;                  // Starts at 1, gaps mean frames were never presented
+	CameraSnapshot camera;                // Input the frame was rendered with
+	double renderTime = 0.0;              // Seconds spent rendering
+	std::vector<std::string> info;        // Overlay lines describing the render settings
+	std::vector<std::string> heatmapInfo; // Value range of the heatmap shown, if any
+};
+
+class FrameRing
+{
+public:
+	FrameRing(int numFrames = 3);
+
+	// Render thread: returns a frame that is neither the newest completed
+	// frame nor the one being presented, and publishes it once written
+	Frame &beginWrite();
+	void endWrite();
+
+	// UI thread: returns the newest completed frame, which stays valid until
+	// the next call. Returns 0 before the first frame has been completed.
+	const Frame *acquireLatest();
+	bool hasNewFrame() const;
+
+	// Blocks until a frame newer than the last acquired one is completed.
+	// Returns false on timeout (in seconds).
+	bool waitForNewFrame(double timeout);
+
+private:
+	std::vector<Frame> frames;
+	int writing, latest, presenting; // Frame indices, -1 if none
+	bool newFrame;
+	mutable std::mutex mutex;
+	std::condition_variable condition;
+};
+
+//--------------------------------------------------------------
+// Presenters
+//--------------------------------------------------------------
+
+class Presenter
+{
+public:
+	virtual ~Presenter() {}
+	virtual void present(const Frame &frame) = 0;
+};
+
+// Draws the frame into the current GL window
+class GLPresenter : public Presenter
+{
+public:
+	void present(const Frame &frame);
+};
+
+// Presents nothing, but keeps statistics on the frames it is given
+class HeadlessPresenter : public Presenter
+{
+public:
+	void present(const Frame &frame);
+
+	unsigned getPresentedCount() const { return numPresented; }
+	void printStats() const;
+
+private:
+	unsigned numPresented = 0, numSkipped = 0, lastNumber = 0;
+	double totalRenderTime = 0.0, totalLatency = 0.0, maxLatency = 0.0;
+};
@@ -1,4 +1,6 @@
 #include <optixu/optixu_math_namespace.h>
+#include "structs.h"
+#include "pixel_layout.h"
 
 using namespace optix;
 
@@ -14,6 +16,7 @@ rtBuffer<float2, 2> projected_distances_buffer;
 rtBuffer<float3, 2> blur_h_buffer;
 rtBuffer<float3, 2> blur_v_buffer;
 rtBuffer<float3, 2> geometry_normal_buffer;
+rtDeclareVariable(SoftShadowParameters, params, , );
 
 float gauss1D(const float x, const float std)
 {
@@ -21,69 +24,81 @@ float gauss1D(const float x, const float std)
 	return expf(-(x * x) / (2.f * std * std)) / (sqrt_2_pi * std);
 }
 
-RT_PROGRAM void blurH()
+// Blurs along one axis, the vertical pass reading the horizontal one.
+// RADIUS 0 loops over the pixel's kernel size. RADIUS above 0 unrolls
+// that many taps on each side, and taps outside the screen, the kernel
+// or the object get a weight of 0 instead of a branch. Both sum the
+// same taps in the same order, so the results match.
+template<int RADIUS, bool VERTICAL>
+__device__ __inline__ void blur()
 {
 	size_t2 screen = diffuse_buffer.size();
-	const float beta = beta_buffer[launch_index];
+	const float beta = PIXEL(beta_buffer, launch_index);
 
 	// TODO: Experiment with different kernel_sizes -- kernel as a function of beta?
-	const int kernel_size = min(beta * 4.0f, 10.0f);
+	const int kernel_size = min(beta * 4.0f, params.max_kernel_radius);
 
 	if(beta == 0.f) {
-		blur_h_buffer[launch_index] = diffuse_buffer[launch_index];
+		const float3 color = PIXEL(diffuse_buffer, launch_index);
+		if(VERTICAL) PIXEL(blur_v_buffer, launch_index) = color;
+		else PIXEL(blur_h_buffer, launch_index) = color;
 		return;
 	}
 
-	float object_id = object_id_buffer[launch_index];
-	float3 geometry_normal = geometry_normal_buffer[launch_index];
+	float object_id = PIXEL(object_id_buffer, launch_index);
+	float3 geometry_normal = PIXEL(geometry_normal_buffer, launch_index);
 	float3 color = make_float3(0.f);
 	float sum = 0.f;
-	float2 center = projected_distances_buffer[launch_index];
-	for(int i = -kernel_size; i <= kernel_size; i++)
+	float2 center = PIXEL(projected_distances_buffer, launch_index);
+	const int taps = RADIUS > 0 ? RADIUS : kernel_size;
+#pragma unroll
+	for(int i = -taps; i <= taps; i++)
 	{
-		// Explointing interger underflow when pos.x < 0
-		const uint2 pos = make_uint2(launch_index.x + i, launch_index.y);
-		if(pos.x >= screen.x || object_id != object_id_buffer[pos]) continue;
-
-		float2 p = projected_distances_buffer[pos];
+		// Explointing interger underflow when the position is negative
+		uint2 pos = VERTICAL ? make_uint2(launch_index.x, launch_index.y + i) : make_uint2(launch_index.x + i, launch_index.y);
+		const bool inside = VERTICAL ? pos.y < screen.y : pos.x < screen.x;
+		float mask = 1.f;
+		if(RADIUS > 0)
+		{
+			pos = inside ? pos : launch_index;
+			mask = inside && abs(i) <= kernel_size && object_id == PIXEL(object_id_buffer, pos) ? 1.f : 0.f;
+		}
+		else if(!inside || object_id != PIXEL(object_id_buffer, pos)) continue;
+
+		float2 p = PIXEL(projected_distances_buffer, pos);
 		const float offset = length(center - p);
 
-		const float w = gauss1D(offset, beta) * dot(geometry_normal, geometry_normal_buffer[pos]);
-		color += diffuse_buffer[pos] * w;
+		const float w = mask * gauss1D(offset, beta) * dot(geometry_normal, PIXEL(geometry_normal_buffer, pos));
+		color += (VERTICAL ? PIXEL(blur_h_buffer, pos) : PIXEL(diffuse_buffer, pos)) * w;
 		sum += w;
 	}
 
-	blur_h_buffer[launch_index] = color / sum;
+	if(VERTICAL) PIXEL(blur_v_buffer, launch_index) = color / sum;
+	else PIXEL(blur_h_buffer, launch_index) = color / sum;
 }
 
-RT_PROGRAM void blurV()
+RT_PROGRAM void blurH()
 {
-	size_t2 screen = diffuse_buffer.size();
-	const float beta = beta_buffer[launch_index];
-	const int kernel_size = min(beta * 4.0f, 10.0f);
-
-	if(beta == 0.f) {
-		blur_v_buffer[launch_index] = diffuse_buffer[launch_index];
-		return;
-	}
-	
-	float object_id = object_id_buffer[launch_index];
-	float3 geometry_normal = geometry_normal_buffer[launch_index];
-	float3 color = make_float3(0.f);
-	float sum = 0.f;
-	float2 center = projected_distances_buffer[launch_index];
-	for(int i = -kernel_size; i <= kernel_size; i++)
-	{
-		const uint2 pos = make_uint2(launch_index.x, launch_index.y + i);
-		if(pos.y >= screen.y || object_id != object_id_buffer[pos]) continue;
-
-		float2 p = projected_distances_buffer[pos];
-		const float offset = length(center - p);
-
-		const float w = gauss1D(offset, beta) * dot(geometry_normal, geometry_normal_buffer[pos]);
-		color += blur_h_buffer[pos] * w;
-		sum += w;
-	}
+	blur<0, false>();
+}
 
-	blur_v_buffer[launch_index] = color / sum;
+RT_PROGRAM void blurV()
+{
+	blur<0, true>();
 }
+
+// Unrolled variants for every radius up to SPECIALIZED_BLUR_RADII
+#define SPECIALIZED_BLUR(radius) \
+	RT_PROGRAM void blurH_##radius() { blur<radius, false>(); } \
+	RT_PROGRAM void blurV_##radius() { blur<radius, true>(); }
+
+SPECIALIZED_BLUR(1)
+SPECIALIZED_BLUR(2)
+SPECIALIZED_BLUR(3)
+SPECIALIZED_BLUR(4)
+SPECIALIZED_BLUR(5)
+SPECIALIZED_BLUR(6)
+SPECIALIZED_BLUR(7)
+SPECIALIZED_BLUR(8)
+SPECIALIZED_BLUR(9)
+SPECIALIZED_BLUR(10)
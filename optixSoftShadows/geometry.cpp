@@ -1,47 +1,484 @@
 #include "geometry.h"
+#include "structs.h"
+
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <tuple>
+#include <xmmintrin.h>
 
 uint objectID = 0;
 
-GeometryInstance createParallelogram(const float3& anchor, const float3& offset1, const float3& offset2, Material material, const float3& color)
+Program getProgram(const std::string& cudaFile, const std::string& name)
+{
+	static std::map<std::pair<std::string, std::string>, Program> programs;
+
+	Program &program = programs[std::make_pair(cudaFile, name)];
+	if(!program)
+	{
+		program = context->createProgramFromPTXString(cudaFiles[cudaFile], name);
+	}
+	return program;
+}
+
+Material createDiffuseMaterial()
+{
+	Material diffuse = context->createMaterial();
+	diffuse->setClosestHitProgram(GROUND_TRUTH_RAY, getProgram("ground_truth", "diffuse"));
+	diffuse->setClosestHitProgram(GEOMETRY_HIT_RAY, getProgram("main", "sample_geometry_hit"));
+	diffuse->setAnyHitProgram(SHADOW_RAY, getProgram("main", "shadow"));
+
+	diffuse["Ka"]->setFloat(0.3f, 0.3f, 0.3f);
+	diffuse["Kd"]->setFloat(0.6f, 0.7f, 0.8f);
+	diffuse["Ks"]->setFloat(0.8f, 0.9f, 0.8f);
+	diffuse["phong_exp"]->setFloat(88);
+	diffuse["reflectivity_n"]->setFloat(0.2f, 0.2f, 0.2f);
+	return diffuse;
+}
+
+//--------------------------------------------------------------
+// Quad soups
+//--------------------------------------------------------------
+
+void QuadSoup::add(const float3& anchorPoint, const float3& offset1, const float3& offset2, const float3& color)
 {
-	Program pgram_bounding_box = context->createProgramFromPTXString(cudaFiles["parallelogram"], "bounds");
-	Program pgram_intersection = context->createProgramFromPTXString(cudaFiles["parallelogram"], "intersect");
+	// Grow by four zero quads at a time. Their normal is zero, so they are never hit.
+	if(numQuads == (int)colors.size())
+	{
+		for(std::vector<float> *component : { &plane[0], &plane[1], &plane[2], &plane[3], &anchor[0], &anchor[1], &anchor[2],
+											  &v1[0], &v1[1], &v1[2], &v2[0], &v2[1], &v2[2] })
+		{
+			component->resize(numQuads + 4, 0.f);
+		}
+		colors.resize(numQuads + 4, make_float3(0.f));
+	}
 
-	Geometry parallelogram = context->createGeometry();
-	parallelogram->setPrimitiveCount(1u);
-	parallelogram->setIntersectionProgram(pgram_intersection);
-	parallelogram->setBoundingBoxProgram(pgram_bounding_box);
+	const float3 normal = normalize(cross(offset1, offset2));
+	const float3 edge1 = offset1 / dot(offset1, offset1);
+	const float3 edge2 = offset2 / dot(offset2, offset2);
+	const int i = numQuads++;
+	plane[0][i] = normal.x; plane[1][i] = normal.y; plane[2][i] = normal.z; plane[3][i] = dot(normal, anchorPoint);
+	anchor[0][i] = anchorPoint.x; anchor[1][i] = anchorPoint.y; anchor[2][i] = anchorPoint.z;
+	v1[0][i] = edge1.x; v1[1][i] = edge1.y; v1[2][i] = edge1.z;
+	v2[0][i] = edge2.x; v2[1][i] = edge2.y; v2[2][i] = edge2.z;
+	colors[i] = color;
+}
+
+int QuadSoup::intersect(const float3& origin, const float3& direction, float tmin, float& tmax) const
+{
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), tminv = _mm_set1_ps(tmin);
+
+	int hit = -1;
+	for(int i = 0; i < numQuads; i += 4)
+	{
+		// Distance to the plane. Parallel rays and padding give inf or nan, which fail every test below.
+		const __m128 nx = _mm_loadu_ps(&plane[0][i]), ny = _mm_loadu_ps(&plane[1][i]), nz = _mm_loadu_ps(&plane[2][i]);
+		const __m128 dt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, nx), _mm_mul_ps(dy, ny)), _mm_mul_ps(dz, nz));
+		const __m128 on = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, nx), _mm_mul_ps(oy, ny)), _mm_mul_ps(oz, nz));
+		const __m128 t = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(&plane[3][i]), on), dt);
+
+		// Position of the hit point along both edges
+		const __m128 px = _mm_sub_ps(_mm_add_ps(ox, _mm_mul_ps(dx, t)), _mm_loadu_ps(&anchor[0][i]));
+		const __m128 py = _mm_sub_ps(_mm_add_ps(oy, _mm_mul_ps(dy, t)), _mm_loadu_ps(&anchor[1][i]));
+		const __m128 pz = _mm_sub_ps(_mm_add_ps(oz, _mm_mul_ps(dz, t)), _mm_loadu_ps(&anchor[2][i]));
+		const __m128 a1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_loadu_ps(&v1[0][i])), _mm_mul_ps(py, _mm_loadu_ps(&v1[1][i]))), _mm_mul_ps(pz, _mm_loadu_ps(&v1[2][i])));
+		const __m128 a2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_loadu_ps(&v2[0][i])), _mm_mul_ps(py, _mm_loadu_ps(&v2[1][i]))), _mm_mul_ps(pz, _mm_loadu_ps(&v2[2][i])));
 
-	float3 normal = normalize(cross(offset1, offset2));
-	float d = dot(normal, anchor);
-	float4 plane = make_float4(normal, d);
+		__m128 mask = _mm_and_ps(_mm_cmpgt_ps(t, tminv), _mm_cmplt_ps(t, _mm_set1_ps(tmax)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(a1, zero), _mm_cmple_ps(a1, one)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(a2, zero), _mm_cmple_ps(a2, one)));
 
-	float3 v1 = offset1 / dot(offset1, offset1);
-	float3 v2 = offset2 / dot(offset2, offset2);
+		int bits = _mm_movemask_ps(mask);
+		if(!bits) continue;
 
-	parallelogram["plane"]->setFloat(plane);
-	parallelogram["anchor"]->setFloat(anchor);
-	parallelogram["v1"]->setFloat(v1);
-	parallelogram["v2"]->setFloat(v2);
+		float distances[4];
+		_mm_storeu_ps(distances, t);
+		for(int j = 0; j < 4; j++)
+		{
+			if((bits >> j & 1) && distances[j] < tmax)
+			{
+				tmax = distances[j];
+				hit = i + j;
+			}
+		}
+	}
+	return hit;
+}
+
+int QuadSoup::intersectScalar(const float3& origin, const float3& direction, float tmin, float& tmax) const
+{
+	int hit = -1;
+	for(int i = 0; i < numQuads; i++)
+	{
+		const float t = (plane[3][i] - (origin.x * plane[0][i] + origin.y * plane[1][i] + origin.z * plane[2][i])) /
+						(direction.x * plane[0][i] + direction.y * plane[1][i] + direction.z * plane[2][i]);
+		if(!(t > tmin && t < tmax)) continue;
+
+		const float px = origin.x + direction.x * t - anchor[0][i];
+		const float py = origin.y + direction.y * t - anchor[1][i];
+		const float pz = origin.z + direction.z * t - anchor[2][i];
+		const float a1 = px * v1[0][i] + py * v1[1][i] + pz * v1[2][i];
+		const float a2 = px * v2[0][i] + py * v2[1][i] + pz * v2[2][i];
+		if(a1 >= 0.f && a1 <= 1.f && a2 >= 0.f && a2 <= 1.f)
+		{
+			tmax = t;
+			hit = i;
+		}
+	}
+	return hit;
+}
+
+void QuadSoup::getTriangles(MeshData& mesh) const
+{
+	for(int i = 0; i < numQuads; i++)
+	{
+		// Undo the scaling of the edges
+		const float3 corner = make_float3(anchor[0][i], anchor[1][i], anchor[2][i]);
+		float3 offset1 = make_float3(v1[0][i], v1[1][i], v1[2][i]);
+		float3 offset2 = make_float3(v2[0][i], v2[1][i], v2[2][i]);
+		offset1 /= dot(offset1, offset1);
+		offset2 /= dot(offset2, offset2);
+
+		const int first = (int)mesh.positions.size();
+		mesh.positions.push_back(corner);
+		mesh.positions.push_back(corner + offset1);
+		mesh.positions.push_back(corner + offset1 + offset2);
+		mesh.positions.push_back(corner + offset2);
+		mesh.indices.push_back(make_int3(first, first + 1, first + 2));
+		mesh.indices.push_back(make_int3(first, first + 2, first + 3));
+	}
+}
+
+GeometryInstance createQuadSoup(const QuadSoup& quads, Material material)
+{
+	const int numQuads = quads.size();
+	Buffer planeBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT4, numQuads);
+	Buffer anchorBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, numQuads);
+	Buffer v1Buffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, numQuads);
+	Buffer v2Buffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, numQuads);
+	Buffer colorBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, numQuads);
+	Buffer objectIdBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_UNSIGNED_INT, numQuads);
+
+	float4 *planes = static_cast<float4*>(planeBuffer->map());
+	float3 *anchors = static_cast<float3*>(anchorBuffer->map());
+	float3 *v1s = static_cast<float3*>(v1Buffer->map());
+	float3 *v2s = static_cast<float3*>(v2Buffer->map());
+	uint *objectIds = static_cast<uint*>(objectIdBuffer->map());
+	for(int i = 0; i < numQuads; i++)
+	{
+		planes[i] = make_float4(quads.plane[0][i], quads.plane[1][i], quads.plane[2][i], quads.plane[3][i]);
+		anchors[i] = make_float3(quads.anchor[0][i], quads.anchor[1][i], quads.anchor[2][i]);
+		v1s[i] = make_float3(quads.v1[0][i], quads.v1[1][i], quads.v1[2][i]);
+		v2s[i] = make_float3(quads.v2[0][i], quads.v2[1][i], quads.v2[2][i]);
+		objectIds[i] = ++objectID;
+	}
+	planeBuffer->unmap();
+	anchorBuffer->unmap();
+	v1Buffer->unmap();
+	v2Buffer->unmap();
+	objectIdBuffer->unmap();
+
+	memcpy(colorBuffer->map(), quads.colors.data(), numQuads * sizeof(float3));
+	colorBuffer->unmap();
+
+	Geometry geometry = context->createGeometry();
+	geometry->setPrimitiveCount((uint)numQuads);
+	geometry->setIntersectionProgram(getProgram("parallelogram", "intersect"));
+	geometry->setBoundingBoxProgram(getProgram("parallelogram", "bounds"));
+	geometry["quad_planes"]->setBuffer(planeBuffer);
+	geometry["quad_anchors"]->setBuffer(anchorBuffer);
+	geometry["quad_v1"]->setBuffer(v1Buffer);
+	geometry["quad_v2"]->setBuffer(v2Buffer);
+	geometry["quad_colors"]->setBuffer(colorBuffer);
+	geometry["quad_object_ids"]->setBuffer(objectIdBuffer);
 
 	GeometryInstance gi = context->createGeometryInstance();
-	gi->setGeometry(parallelogram);
-	gi["object_id"]->setUint(++objectID);
+	gi->setGeometry(geometry);
 	gi->addMaterial(material);
-	gi["diffuse_color"]->setFloat(color);
 	return gi;
 }
 
-GeometryInstance loadMesh(const std::string& filename, Material material, const float3& color, const Matrix4x4 &transformationMatrix)
+std::vector<GeometryInstance> splitQuadSoup(GeometryInstance soup, std::vector<uint>& objectIds)
+{
+	Geometry geometry = soup->getGeometry();
+	const int numQuads = (int)geometry->getPrimitiveCount();
+	Buffer objectIdBuffer = geometry["quad_object_ids"]->getBuffer();
+	const uint *ids = static_cast<const uint*>(objectIdBuffer->map());
+	objectIds.assign(ids, ids + numQuads);
+	objectIdBuffer->unmap();
+
+	std::vector<GeometryInstance> quads;
+	for(int i = 0; i < numQuads; i++)
+	{
+		Geometry quad = context->createGeometry();
+		quad->setPrimitiveIndexOffset((uint)i);
+		quad->setPrimitiveCount(1u);
+		quad->setIntersectionProgram(getProgram("parallelogram", "intersect"));
+		quad->setBoundingBoxProgram(getProgram("parallelogram", "bounds"));
+		for(const char *name : { "quad_planes", "quad_anchors", "quad_v1", "quad_v2", "quad_colors", "quad_object_ids" })
+		{
+			quad[name]->setBuffer(geometry[name]->getBuffer());
+		}
+
+		GeometryInstance gi = context->createGeometryInstance();
+		gi->setGeometry(quad);
+		gi->addMaterial(soup->getMaterial(0));
+		quads.push_back(gi);
+	}
+	return quads;
+}
+
+//--------------------------------------------------------------
+// Meshes
+//--------------------------------------------------------------
+
+// Parses the position and normal index of a face vertex ("v", "v/vt", "v//vn" or "v/vt/vn")
+static void parseFaceVertex(const char *token, int numPositions, int numNormals, int &positionIndex, int &normalIndex)
+{
+	int v = 0, vt = 0, vn = 0;
+	if(sscanf(token, "%d/%d/%d", &v, &vt, &vn) != 3 && sscanf(token, "%d//%d", &v, &vn) != 2)
+	{
+		vn = 0;
+		sscanf(token, "%d", &v);
+	}
+
+	// Indices are 1-based, negative indices are relative to the end of the list
+	positionIndex = v < 0 ? numPositions + v : v - 1;
+	normalIndex = vn < 0 ? numNormals + vn : vn - 1;
+}
+
+void loadObj(const std::string& filename, MeshData& mesh, const Matrix4x4 &transformationMatrix)
+{
+	FILE *file = fopen(filename.c_str(), "r");
+	if(!file)
+	{
+		throw Exception("Could not open mesh file " + filename);
+	}
+
+	mesh.filename = filename;
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	const Matrix4x4 normalMatrix = transformationMatrix.inverse().transpose();
+	std::vector<float3> filePositions, fileNormals;
+	std::unordered_map<long long, int> vertices; // Maps (position, normal) index pairs to mesh vertices
+	bool missingNormals = false;
+
+	char line[1024];
+	while(fgets(line, sizeof(line), file))
+	{
+		float x, y, z;
+		if(sscanf(line, "v %f %f %f", &x, &y, &z) == 3)
+		{
+			filePositions.push_back(make_float3(transformationMatrix * make_float4(x, y, z, 1.f)));
+		}
+		else if(sscanf(line, "vn %f %f %f", &x, &y, &z) == 3)
+		{
+			fileNormals.push_back(normalize(make_float3(normalMatrix * make_float4(x, y, z, 0.f))));
+		}
+		else if(line[0] == 'f' && line[1] == ' ')
+		{
+			// Collect face vertices
+			std::vector<int> face;
+			std::istringstream tokens(line + 2);
+			std::string token;
+			while(tokens >> token)
+			{
+				int positionIndex, normalIndex;
+				parseFaceVertex(token.c_str(), (int)filePositions.size(), (int)fileNormals.size(), positionIndex, normalIndex);
+				if(positionIndex < 0 || positionIndex >= (int)filePositions.size()) continue;
+				if(normalIndex < 0 || normalIndex >= (int)fileNormals.size())
+				{
+					normalIndex = -1;
+					missingNormals = true;
+				}
+
+				const long long key = (long long)positionIndex << 32 | (unsigned int)normalIndex;
+				std::unordered_map<long long, int>::iterator itr = vertices.find(key);
+				if(itr == vertices.end())
+				{
+					itr = vertices.insert(std::make_pair(key, (int)mesh.positions.size())).first;
+					mesh.positions.push_back(filePositions[positionIndex]);
+					mesh.normals.push_back(normalIndex >= 0 ? fileNormals[normalIndex] : make_float3(0.f));
+				}
+				face.push_back(itr->second);
+			}
+
+			// Triangulate polygons as a fan
+			for(size_t i = 2; i < face.size(); i++)
+			{
+				mesh.indices.push_back(make_int3(face[0], face[i - 1], face[i]));
+			}
+		}
+	}
+	fclose(file);
+
+	// Fall back to geometric normals if any vertex lacks a normal
+	if(missingNormals)
+	{
+		mesh.normals.clear();
+	}
+}
+
+Geometry createMeshGeometry(const MeshData& mesh)
 {
-	OptiXMesh mesh;
-	mesh.context = context;
-	mesh.material = material;
-	loadMesh(filename, mesh, transformationMatrix);
+	Buffer vertexBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, mesh.positions.size());
+	memcpy(vertexBuffer->map(), mesh.positions.data(), mesh.positions.size() * sizeof(float3));
+	vertexBuffer->unmap();
+
+	Buffer normalBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, mesh.normals.size());
+	if(!mesh.normals.empty())
+	{
+		memcpy(normalBuffer->map(), mesh.normals.data(), mesh.normals.size() * sizeof(float3));
+		normalBuffer->unmap();
+	}
+
+	Buffer indexBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_INT3, mesh.indices.size());
+	memcpy(indexBuffer->map(), mesh.indices.data(), mesh.indices.size() * sizeof(int3));
+	indexBuffer->unmap();
+
+	Geometry geometry = context->createGeometry();
+	geometry->setPrimitiveCount((uint)mesh.indices.size());
+	geometry->setIntersectionProgram(getProgram("triangle_mesh", "intersect"));
+	geometry->setBoundingBoxProgram(getProgram("triangle_mesh", "bounds"));
+	geometry["vertex_buffer"]->setBuffer(vertexBuffer);
+	geometry["normal_buffer"]->setBuffer(normalBuffer);
+	geometry["index_buffer"]->setBuffer(indexBuffer);
+	return geometry;
+}
 
-	GeometryInstance gi = mesh.geom_instance;
+GeometryInstance createMeshInstance(Geometry geometry, Material material, const float3& color)
+{
+	GeometryInstance gi = context->createGeometryInstance();
+	gi->setGeometry(geometry);
 	gi["object_id"]->setUint(++objectID);
 	gi->addMaterial(material);
 	gi["diffuse_color"]->setFloat(color);
-	return mesh.geom_instance;
-}
\ No newline at end of file
+	return gi;
+}
+
+GeometryInstance createMesh(const MeshData& mesh, Material material, const float3& color)
+{
+	return createMeshInstance(createMeshGeometry(mesh), material, color);
+}
+
+void simplifyMesh(const MeshData& mesh, float maxError, MeshData& proxy)
+{
+	proxy.filename = mesh.filename;
+	proxy.positions.clear();
+	proxy.normals.clear(); // Proxies use geometric normals
+	proxy.indices.clear();
+
+	// Cells whose diagonal is maxError. Each cell is replaced by the average of its
+	// vertices, which lies inside the cell.
+	const float cellSize = maxError / sqrtf(3.f);
+	std::unordered_map<long long, int> cells;
+	std::vector<int> remap(mesh.positions.size());
+	std::vector<int> counts;
+	for(size_t i = 0; i < mesh.positions.size(); i++)
+	{
+		const float3 &p = mesh.positions[i];
+		const long long x = (long long)floorf(p.x / cellSize) & 0x1fffff;
+		const long long y = (long long)floorf(p.y / cellSize) & 0x1fffff;
+		const long long z = (long long)floorf(p.z / cellSize) & 0x1fffff;
+		const long long key = x << 42 | y << 21 | z;
+
+		std::unordered_map<long long, int>::iterator itr = cells.find(key);
+		if(itr == cells.end())
+		{
+			itr = cells.insert(std::make_pair(key, (int)proxy.positions.size())).first;
+			proxy.positions.push_back(make_float3(0.f));
+			counts.push_back(0);
+		}
+		proxy.positions[itr->second] += p;
+		counts[itr->second]++;
+		remap[i] = itr->second;
+	}
+	for(size_t i = 0; i < proxy.positions.size(); i++)
+	{
+		proxy.positions[i] /= float(counts[i]);
+	}
+
+	// Keep the triangles whose corners are still distinct, once each
+	std::set<std::tuple<int, int, int>> triangles;
+	for(const int3 &triangle : mesh.indices)
+	{
+		int corners[3] = { remap[triangle.x], remap[triangle.y], remap[triangle.z] };
+		if(corners[0] == corners[1] || corners[1] == corners[2] || corners[0] == corners[2]) continue;
+
+		std::sort(corners, corners + 3);
+		if(!triangles.insert(std::make_tuple(corners[0], corners[1], corners[2])).second) continue;
+		proxy.indices.push_back(make_int3(remap[triangle.x], remap[triangle.y], remap[triangle.z]));
+	}
+
+	// The merged surface cuts through the mesh by up to maxError, which lets light through
+	// where the mesh blocks it. Move every vertex out along its area-weighted normal by
+	// maxError, so the proxy covers the mesh instead.
+	std::vector<float3> normals(proxy.positions.size(), make_float3(0.f));
+	for(const int3 &triangle : proxy.indices)
+	{
+		const float3 normal = cross(proxy.positions[triangle.y] - proxy.positions[triangle.x], proxy.positions[triangle.z] - proxy.positions[triangle.x]);
+		normals[triangle.x] += normal;
+		normals[triangle.y] += normal;
+		normals[triangle.z] += normal;
+	}
+	for(size_t i = 0; i < proxy.positions.size(); i++)
+	{
+		const float length2 = dot(normals[i], normals[i]);
+		if(length2 > 0.f) proxy.positions[i] += normals[i] * (maxError / sqrtf(length2));
+	}
+
+	// Triangles smaller than a cell, e.g. leaves and blades of grass, collapse and would
+	// stop blocking light. Cells no proxy triangle touches keep the box around the
+	// triangles that collapsed there.
+	std::vector<bool> covered(proxy.positions.size(), false);
+	for(const int3 &triangle : proxy.indices)
+	{
+		covered[triangle.x] = covered[triangle.y] = covered[triangle.z] = true;
+	}
+	std::map<int, std::pair<float3, float3>> boxes;
+	for(const int3 &triangle : mesh.indices)
+	{
+		const int corners[3] = { remap[triangle.x], remap[triangle.y], remap[triangle.z] };
+		if(corners[0] != corners[1] && corners[1] != corners[2] && corners[0] != corners[2]) continue;
+		const int *cell = std::find_if(corners, corners + 3, [&covered](int corner) { return !covered[corner]; });
+		if(cell == corners + 3) continue;
+
+		const float3 &a = mesh.positions[triangle.x], &b = mesh.positions[triangle.y], &c = mesh.positions[triangle.z];
+		std::map<int, std::pair<float3, float3>>::iterator box = boxes.find(*cell);
+		if(box == boxes.end()) box = boxes.insert(std::make_pair(*cell, std::make_pair(a, a))).first;
+		box->second.first = fminf(box->second.first, fminf(a, fminf(b, c)));
+		box->second.second = fmaxf(box->second.second, fmaxf(a, fmaxf(b, c)));
+	}
+
+	// Corners are numbered by their x, y and z bits
+	static const int faces[6][4] = { { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 } };
+	for(const std::pair<const int, std::pair<float3, float3>> &box : boxes)
+	{
+		const int first = (int)proxy.positions.size();
+		for(int corner = 0; corner < 8; corner++)
+		{
+			proxy.positions.push_back(make_float3(corner & 1 ? box.second.second.x : box.second.first.x,
+												  corner & 2 ? box.second.second.y : box.second.first.y,
+												  corner & 4 ? box.second.second.z : box.second.first.z));
+		}
+		for(const int *face : faces)
+		{
+			proxy.indices.push_back(make_int3(first + face[0], first + face[1], first + face[2]));
+			proxy.indices.push_back(make_int3(first + face[0], first + face[2], first + face[3]));
+		}
+	}
+}
+
+GeometryInstance createProxy(const MeshData& proxy, Material material, GeometryInstance mesh)
+{
+	GeometryInstance gi = context->createGeometryInstance();
+	gi->setGeometry(createMeshGeometry(proxy));
+	gi["object_id"]->setUint(mesh["object_id"]->getUint());
+	gi->addMaterial(material);
+	gi["diffuse_color"]->setFloat(make_float3(0.f)); // Only used by shadow rays
+	return gi;
+}
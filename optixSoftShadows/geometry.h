@@ -2,5 +2,76 @@
 
 #include "common.h"
 
-GeometryInstance createParallelogram(const float3& anchor, const float3& offset1, const float3& offset2, Material material, const float3& color);
-GeometryInstance loadMesh(const std::string& filename, Material material, const float3& color, const Matrix4x4 &transformationMatrix = Matrix4x4::identity());
+// Triangle mesh loaded from an .obj file
+struct MeshData
+{
+	std::string filename;
+	std::vector<float3> positions;
+	std::vector<float3> normals; // Empty if the file has no vertex normals
+	std::vector<int3> indices;
+};
+
+// Returns the program with the given name from a compiled cuda file. Programs are cached, so
+// every geometry using the same program shares one instance.
+Program getProgram(const std::string& cudaFile, const std::string& name);
+
+Material createDiffuseMaterial();
+
+// Parallelograms stored as a structure of arrays, one array per component,
+// padded to a multiple of four so four quads can be tested at once
+class QuadSoup
+{
+public:
+	void add(const float3& anchor, const float3& offset1, const float3& offset2, const float3& color);
+	int size() const { return numQuads; }
+	const std::vector<float3>& getColors() const { return colors; }
+
+	// Returns the index of the closest quad hit within (tmin, tmax) and
+	// sets tmax to its distance, or returns -1 if no quad is hit
+	int intersect(const float3& origin, const float3& direction, float tmin, float& tmax) const;
+
+	// Same as intersect(), one quad at a time without SSE. Reference for benchmarkCpuRays.
+	int intersectScalar(const float3& origin, const float3& direction, float tmin, float& tmax) const;
+
+	// Appends two triangles per quad
+	void getTriangles(MeshData& mesh) const;
+
+private:
+	friend GeometryInstance createQuadSoup(const QuadSoup& quads, Material material);
+
+	int numQuads = 0;
+	std::vector<float> plane[4];       // Normal and distance to the origin
+	std::vector<float> anchor[3];
+	std::vector<float> v1[3], v2[3];   // Edges scaled by 1 / length^2
+	std::vector<float3> colors;
+};
+
+// Uploads the quads as a single geometry with one primitive per quad.
+// Every quad gets its own object id.
+GeometryInstance createQuadSoup(const QuadSoup& quads, Material material);
+
+// Creates a geometry instance for every quad of an uploaded quad soup, sharing its buffers,
+// so the quads can be placed in different groups. Also returns the object id of every quad.
+std::vector<GeometryInstance> splitQuadSoup(GeometryInstance soup, std::vector<uint>& objectIds);
+
+// Parses an .obj file on the CPU. Does not touch the OptiX context, so it is safe to call from any thread.
+void loadObj(const std::string& filename, MeshData& mesh, const Matrix4x4 &transformationMatrix = Matrix4x4::identity());
+
+// Uploads a parsed mesh to the OptiX context
+GeometryInstance createMesh(const MeshData& mesh, Material material, const float3& color);
+
+// Uploads a parsed mesh once, so several instances can share it
+Geometry createMeshGeometry(const MeshData& mesh);
+
+// Creates an instance of uploaded mesh geometry with a color and object id of its own
+GeometryInstance createMeshInstance(Geometry geometry, Material material, const float3& color);
+
+// Simplifies a mesh by vertex clustering: vertices in the same grid cell are merged and
+// collapsed triangles are dropped. The result is then inflated by maxError, so it covers
+// the mesh rather than cutting into it. No vertex moves further than 2 * maxError. Cells
+// whose triangles all collapsed are kept as the box around them. Open and thin meshes are
+// only approximated, as inflating moves a sheet rather than thickening it. CPU only.
+void simplifyMesh(const MeshData& mesh, float maxError, MeshData& proxy);
+
+// Uploads a simplified mesh standing in for a full mesh, with the full mesh's color and object id
+GeometryInstance createProxy(const MeshData& proxy, Material material, GeometryInstance mesh);
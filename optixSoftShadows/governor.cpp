@@ -0,0 +1,167 @@
+#include "governor.h"
+
+#include <algorithm>
+#include <math.h>
+
+// Prediction the next better level has to stay under, as a fraction of the target
+static const double upgradeMargin = 0.85;
+
+// Frames in a row the next better level has to fit before climbing to it
+static const int upgradeFrames = 8;
+
+// Weight of the newest frame in the cost model
+static const double smoothing = 0.2;
+
+FrameGovernor::FrameGovernor(double targetTime, const SoftShadowParameters &base, const std::string &logFilename)
+	: targetTime(targetTime), base(base)
+{
+	buildLevels();
+	last = FrameMeasurements();
+	if(!logFilename.empty())
+	{
+		log = fopen(logFilename.c_str(), "w");
+		if(!log) printf("Could not open %s, governor settings are not logged\n", logFilename.c_str());
+		else fprintf(log, "frame,frame_ms,predicted_ms,lit,penumbra,umbra,level,max_num_samples,max_kernel_radius,render_scale,next_predicted_ms\n");
+	}
+}
+
+FrameGovernor::~FrameGovernor()
+{
+	if(log) fclose(log);
+}
+
+void FrameGovernor::setBaseParameters(const SoftShadowParameters &newBase)
+{
+	const bool changed = newBase.max_num_samples != base.max_num_samples || newBase.max_kernel_radius != base.max_kernel_radius;
+	base = newBase;
+	if(changed) buildLevels();
+}
+
+// The sample cap drops first, as it costs the least quality in
+// penumbrae the filter then smooths, then the filter radius cap,
+// and the resolution last
+void FrameGovernor::buildLevels()
+{
+	const float sampleFractions[] = { 1.f, 0.75f, 0.5f, 0.35f, 0.25f };
+	const float radiusFractions[] = { 0.75f, 0.5f };
+	const float scales[] = { 0.875f, 0.75f, 0.625f, 0.5f };
+
+	levels.clear();
+	GovernorSettings settings = { base.max_num_samples, base.max_kernel_radius, 1.f };
+	for(float fraction : sampleFractions)
+	{
+		settings.maxNumSamples = floorf(base.max_num_samples * fraction);
+		levels.push_back(settings);
+	}
+	for(float fraction : radiusFractions)
+	{
+		settings.maxKernelRadius = std::max(floorf(base.max_kernel_radius * fraction), 1.f);
+		levels.push_back(settings);
+	}
+	for(float scale : scales)
+	{
+		settings.renderScale = scale;
+		levels.push_back(settings);
+	}
+	level = std::min(level, (int)levels.size() - 1);
+}
+
+void FrameGovernor::apply(SoftShadowParameters &params) const
+{
+	params.max_num_samples = levels[level].maxNumSamples;
+	params.max_kernel_radius = levels[level].maxKernelRadius;
+}
+
+// Scales the last frame's statistics to the settings. Geometry pixels
+// take one sample-equivalent of work plus their adaptive samples, which
+// grow with the cap in proportion to how much of the cap the penumbra
+// and umbra pixels used in the last frame.
+double FrameGovernor::predict(const GovernorSettings &settings) const
+{
+	const GovernorSettings &measured = levels[level];
+	const double ratio = (settings.renderScale * settings.renderScale) / (measured.renderScale * measured.renderScale);
+	const double pixels = double(last.width) * last.height * ratio;
+
+	const double cap = std::max(measured.maxNumSamples, 1.f);
+	const double penumbraFill = last.numPenumbra > 0.0 ? std::min(last.penumbraSamples / (last.numPenumbra * cap), 1.0) : 0.0;
+	const double umbraFill = last.numUmbra > 0.0 ? std::min(last.umbraSamples / (last.numUmbra * cap), 1.0) : 0.0;
+	const double samples = ratio * (last.numLit + last.numPenumbra + last.numUmbra +
+									settings.maxNumSamples * (penumbraFill * last.numPenumbra + umbraFill * last.numUmbra));
+
+	const double filterWork = pixels * (filterScalesWithRadius ? settings.maxKernelRadius : 1.0);
+	return overheadTime + pixelCost * pixels + filterCost * filterWork + sampleCost * samples;
+}
+
+const GovernorSettings &FrameGovernor::update(const FrameMeasurements &frame)
+{
+	const GovernorSettings &measured = levels[level];
+	const double pixels = double(frame.width) * frame.height;
+	const double samples = frame.numLit + frame.numPenumbra + frame.numUmbra + frame.penumbraSamples + frame.umbraSamples;
+	const double weight = numFrames == 0 ? 1.0 : smoothing;
+	auto blend = [weight](double &average, double value) { average += (value - average) * weight; };
+
+	// Fit the cost of the passes that ran. Reused passes keep their last cost.
+	filterScalesWithRadius = frame.filterScalesWithRadius;
+	if(frame.pixelTime > 0.0) blend(pixelCost, frame.pixelTime / pixels);
+	if(frame.filterTime > 0.0) blend(filterCost, frame.filterTime / (pixels * (filterScalesWithRadius ? measured.maxKernelRadius : 1.0)));
+	if(frame.samplingTime > 0.0 && samples > 0.0) blend(sampleCost, frame.samplingTime / samples);
+	if(frame.pixelTime > 0.0 && frame.samplingTime > 0.0 && frame.filterTime > 0.0)
+	{
+		blend(overheadTime, std::max(frame.frameTime - frame.pixelTime - frame.samplingTime - frame.filterTime, 0.0));
+		numFrames++;
+	}
+	const double predictedThisFrame = predictedTime;
+	last = frame;
+
+	// Drop to the best level that fits right away, climb one level at a time
+	if(numFrames > 0)
+	{
+		int best = (int)levels.size() - 1;
+		for(int i = 0; i < (int)levels.size(); i++)
+		{
+			if(predict(levels[i]) <= targetTime)
+			{
+				best = i;
+				break;
+			}
+		}
+
+		if(best > level)
+		{
+			level = best;
+			framesFitting = 0;
+		}
+		else if(best < level && predict(levels[level - 1]) <= targetTime * upgradeMargin)
+		{
+			if(++framesFitting >= upgradeFrames)
+			{
+				level--;
+				framesFitting = 0;
+			}
+		}
+		else
+		{
+			framesFitting = 0;
+		}
+	}
+
+	// Predictions start from the statistics at the current level, so bring them to the chosen one
+	const GovernorSettings &next = levels[level];
+	const double scaleRatio = (next.renderScale * next.renderScale) / (measured.renderScale * measured.renderScale);
+	last.width = (unsigned)(frame.width * next.renderScale / measured.renderScale + 0.5f);
+	last.height = (unsigned)(frame.height * next.renderScale / measured.renderScale + 0.5f);
+	last.numLit *= scaleRatio;
+	last.numPenumbra *= scaleRatio;
+	last.numUmbra *= scaleRatio;
+	last.penumbraSamples *= scaleRatio * next.maxNumSamples / std::max(measured.maxNumSamples, 1.f);
+	last.umbraSamples *= scaleRatio * next.maxNumSamples / std::max(measured.maxNumSamples, 1.f);
+	predictedTime = predict(next);
+
+	if(log)
+	{
+		fprintf(log, "%d,%.2f,%.2f,%.0f,%.0f,%.0f,%d,%g,%g,%g,%.2f\n", ++numLogged, frame.frameTime, predictedThisFrame,
+				frame.numLit, frame.numPenumbra, frame.numUmbra, level, next.maxNumSamples, next.maxKernelRadius, next.renderScale, predictedTime);
+		fflush(log);
+	}
+	return next;
+}
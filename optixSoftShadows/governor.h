@@ -0,0 +1,93 @@
+#pragma once
+
+#include "structs.h"
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+//--------------------------------------------------------------
+// Frame-time governor
+//
+// Keeps the frame time near a budget by trading quality for
+// time. Quality levels form a ladder: the adaptive sample cap is
+// lowered first, then the filter radius cap, then the render
+// scale. After every frame a cost model is fitted to the pass
+// timings, and the probe statistics of the frame predict what
+// each level would cost for the current view. The governor
+// drops to the best level predicted to fit right away, and only
+// climbs one level at a time once it has fit with a margin for
+// several frames, so settings don't flicker.
+//--------------------------------------------------------------
+
+// Settings the governor controls
+struct GovernorSettings
+{
+	float maxNumSamples;   // Overrides params.max_num_samples
+	float maxKernelRadius; // Overrides params.max_kernel_radius
+	float renderScale;     // Of the screen-sized targets
+};
+
+// Measurements of a rendered frame. Pass times are 0 for passes that were reused.
+struct FrameMeasurements
+{
+	double frameTime;    // ms for the whole frame
+	double pixelTime;    // ms of the passes whose cost depends on the pixel count only
+	double samplingTime; // ms of the adaptive sampling pass
+	double filterTime;   // ms of the blur passes
+	bool filterScalesWithRadius; // False for filters of constant cost per pixel
+	unsigned width, height;      // Resolution rendered
+
+	// Probe statistics: geometry pixels by how many of their probes
+	// were occluded, and the adaptive samples traced for them
+	double numLit, numPenumbra, numUmbra;
+	double penumbraSamples, umbraSamples;
+};
+
+class FrameGovernor
+{
+public:
+	// Logs a CSV row per frame if logFilename isn't empty
+	FrameGovernor(double targetTime, const SoftShadowParameters &base, const std::string &logFilename);
+	~FrameGovernor();
+
+	// The user's parameters, the best level renders with these
+	void setBaseParameters(const SoftShadowParameters &base);
+
+	// Fits the cost model to the frame and chooses the settings of the next one
+	const GovernorSettings &update(const FrameMeasurements &frame);
+
+	// Applies the current settings to the parameters about to be rendered
+	void apply(SoftShadowParameters &params) const;
+
+	const GovernorSettings &getSettings() const { return levels[level]; }
+	int getLevel() const { return level; }
+	int getLevelCount() const { return (int)levels.size(); }
+	double getTargetTime() const { return targetTime; }
+	double getPredictedTime() const { return predictedTime; }
+
+private:
+	double predict(const GovernorSettings &settings) const;
+	void buildLevels();
+
+	double targetTime;
+	SoftShadowParameters base;
+	std::vector<GovernorSettings> levels; // Best quality first
+	int level = 0;
+	int framesFitting = 0;      // Frames in a row the next better level fit with a margin
+	double predictedTime = 0.0; // Of the current level, for the next frame
+
+	// Cost model, running averages in ms
+	double overheadTime = 0.0;  // Per frame
+	double pixelCost = 0.0;     // Per pixel
+	double filterCost = 0.0;    // Per pixel, and per pixel of radius if the filter scales with it
+	double sampleCost = 0.0;    // Per adaptive sample
+	bool filterScalesWithRadius = true;
+	int numFrames = 0;
+
+	// Last probe statistics, at the last resolution
+	FrameMeasurements last;
+
+	FILE *log = 0;
+	int numLogged = 0;
+};
@@ -30,11 +30,11 @@
 #include <optixu/optixu_matrix_namespace.h>
 #include "structs.h"
 #include "random.h"
+#include "pixel_layout.h"
 
 using namespace optix;
 
 #define EPSILON  1.e-1f
-#define NUM_SAMPLES 4000
 
 //--------------------------------------------------------------
 // Variable declarations
@@ -43,7 +43,12 @@ using namespace optix;
 // Input pixel-coordinate
 rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
 
-rtBuffer<float3, 2> diffuse_buffer;             // Diffuse color buffer
+rtBuffer<float3, 2> diffuse_buffer;             // Diffuse color buffer, of the size of the tile
+
+// Tile of the screen and range of samples to render (see ground_truth_farm.h)
+rtDeclareVariable(uint2, screen_size, , );
+rtDeclareVariable(uint2, tile_origin, , );
+rtDeclareVariable(uint2, sample_range, , ); // First sample and count
 
 // Scene geometry objects
 rtDeclareVariable(rtObject, scene_geometry, , );
@@ -70,37 +75,37 @@ rtBuffer<ParallelogramLight> lights;
 
 RT_PROGRAM void trace_ray()
 {
-	size_t2 screen = diffuse_buffer.size(); // Screen size
-	float2 d = make_float2(launch_index) / make_float2(screen) * 2.f - 1.f; // Pixel coordinate in [-1, 1]
+	const uint2 pixel = make_uint2(tile_origin.x + launch_index.x, tile_origin.y + launch_index.y);
+	float2 d = make_float2(pixel) / make_float2(screen_size) * 2.f - 1.f; // Pixel coordinate in [-1, 1]
 	float3 ray_origin = eye;
 	float3 ray_direction = normalize(d.x*U + d.y*V + W);
 
 	// Create ray from camera into scene
 	Ray ray(ray_origin, ray_direction, GROUND_TRUTH_RAY, EPSILON);
 
-	// Per radiance data
+	// Per radiance data. Every range of samples has its own random sequence,
+	// so ranges rendered separately can be merged.
 	PerRayData_ground_truth prd;
-	prd.seed = tea<16>(screen.x*launch_index.y + launch_index.x, 0);//frame_number);
+	prd.seed = tea<16>(screen_size.x*pixel.y + pixel.x, sample_range.x);
 
 	// Trace geometry
 	rtTrace(scene_geometry, ray, prd);
 
 	// Set resulting diffuse color and beta
-	diffuse_buffer[launch_index] = prd.color;
+	PIXEL(diffuse_buffer, launch_index) = prd.color;
 }
 
 //-----------------------------------------------------------------------------
 // Lambertian surface closest-hit
 //-----------------------------------------------------------------------------
 
-rtDeclareVariable(float3, diffuse_color, , );
+rtDeclareVariable(float3, hit_color, attribute hit_color, );
 rtDeclareVariable(float3, Ka, , );
 rtDeclareVariable(float3, Ks, , );
 rtDeclareVariable(float, phong_exp, , );
 rtDeclareVariable(float3, Kd, , );
 rtDeclareVariable(float3, ambient_light_color, , );
 rtDeclareVariable(float, t_hit, rtIntersectionDistance, );
-rtDeclareVariable(uint, object_id, , );
 
 #define FLT_MAX 3.402823466e+38F
 
@@ -127,8 +132,8 @@ RT_PROGRAM void diffuse()
 		}
 		else
 		{
-			const int num_samples = NUM_SAMPLES;
-			const float avg_factor = 1.0f / float(NUM_SAMPLES);
+			const int num_samples = (int)sample_range.y;
+			const float avg_factor = 1.0f / float(num_samples);
 			for(int j = 0; j < num_samples; j++)
 			{
 				// Choose random point on light
@@ -153,7 +158,7 @@ RT_PROGRAM void diffuse()
 					// Set color if we hit the light
 					if(!shadow_prd.hit)
 					{
-						color += Kd * nDl * diffuse_color * avg_factor;
+						color += Kd * nDl * hit_color * avg_factor;
 					}
 				}
 			}
@@ -192,5 +197,5 @@ rtDeclareVariable(float3, bad_color,,);
 
 RT_PROGRAM void exception()
 {
-	diffuse_buffer[launch_index] = bad_color;
+	PIXEL(diffuse_buffer, launch_index) = bad_color;
 }
\ No newline at end of file
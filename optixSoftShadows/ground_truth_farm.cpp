@@ -0,0 +1,587 @@
+// Sockets have to be included before anything including windows.h
+#include "sockets.h"
+#include "ground_truth_farm.h"
+#include "reference_cache.h"
+#include "util.h"
+
+// Written at the start of a progress file, followed by a record per unit
+struct ProgressHeader
+{
+	char magic[4];
+	uint32_t width, height;
+	uint64_t key;
+};
+
+// Followed by width * height float3s
+struct ProgressRecord
+{
+	uint32_t id, numSamples;
+};
+
+static const char progressMagic[4] = { 'G', 'T', 'P', '1' };
+
+// Units a worker holds at once
+static const size_t unitsPerWorker = 2;
+
+//--------------------------------------------------------------
+// Messages
+//--------------------------------------------------------------
+
+static std::string formatFloats(const float *values, int count)
+{
+	std::string text;
+	for(int i = 0; i < count; i++)
+	{
+		char value[32];
+		snprintf(value, sizeof(value), i ? ",%.9g" : "%.9g", values[i]);
+		text += value;
+	}
+	return text;
+}
+
+static bool parseFloats(const std::string &text, float *values, int count)
+{
+	const char *position = text.c_str();
+	for(int i = 0; i < count; i++)
+	{
+		char *end;
+		values[i] = strtof(position, &end);
+		if(end == position || (i + 1 < count ? *end != ',' : *end != '\0')) return false;
+		position = end + 1;
+	}
+	return true;
+}
+
+static std::string formatJob(const GroundTruthJob &job)
+{
+	char header[128];
+	snprintf(header, sizeof(header), "job key=%s scale=%.9g width=%u height=%u", ReferenceCache::getKeyString(job.key).c_str(), job.renderScale, job.width, job.height);
+	return std::string(header) +
+		" eye=" + formatFloats(&job.eye.x, 3) + " U=" + formatFloats(&job.U.x, 3) + " V=" + formatFloats(&job.V.x, 3) + " W=" + formatFloats(&job.W.x, 3) +
+		" light=" + formatFloats(&job.light.corner.x, sizeof(ParallelogramLight) / sizeof(float));
+}
+
+// Calls handle(key, value) for every key=value token after the command
+static bool parseTokens(const std::string &line, std::function<bool(const std::string &key, const std::string &value)> handle)
+{
+	std::istringstream tokens(line);
+	std::string token;
+	tokens >> token;
+	while(tokens >> token)
+	{
+		const size_t equals = token.find('=');
+		if(equals == std::string::npos || !handle(token.substr(0, equals), token.substr(equals + 1))) return false;
+	}
+	return true;
+}
+
+static bool parseJob(const std::string &line, GroundTruthJob &job)
+{
+	int numParsed = 0;
+	const bool valid = parseTokens(line, [&job, &numParsed](const std::string &key, const std::string &value)
+	{
+		numParsed++;
+		if(key == "key") job.key = strtoull(value.c_str(), 0, 16);
+		else if(key == "scale") job.renderScale = strtof(value.c_str(), 0);
+		else if(key == "width") job.width = (unsigned)strtoul(value.c_str(), 0, 10);
+		else if(key == "height") job.height = (unsigned)strtoul(value.c_str(), 0, 10);
+		else if(key == "eye") return parseFloats(value, &job.eye.x, 3);
+		else if(key == "U") return parseFloats(value, &job.U.x, 3);
+		else if(key == "V") return parseFloats(value, &job.V.x, 3);
+		else if(key == "W") return parseFloats(value, &job.W.x, 3);
+		else if(key == "light") return parseFloats(value, &job.light.corner.x, sizeof(ParallelogramLight) / sizeof(float));
+		else return false;
+		return true;
+	});
+	return valid && numParsed == 9;
+}
+
+static bool sendAll(uintptr_t socket, const char *data, size_t size)
+{
+	while(size > 0)
+	{
+		const int sent = (int)send(socket, data, (int)std::min(size, (size_t)1 << 20), MSG_NOSIGNAL);
+		if(sent <= 0) return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+//--------------------------------------------------------------
+// Coordinator
+//--------------------------------------------------------------
+
+GroundTruthFarm::GroundTruthFarm(unsigned short port, double unitTimeout)
+	: stopping(false), unitTimeout(unitTimeout)
+{
+	startSockets();
+	listener = openLoopbackListener(port, 16);
+	if(listener == INVALID_SOCKET_VALUE)
+	{
+		stopSockets();
+		throw Exception("Could not listen on port " + std::to_string(port));
+	}
+
+	thread = std::thread(&GroundTruthFarm::run, this);
+}
+
+GroundTruthFarm::~GroundTruthFarm()
+{
+	stopping = true;
+	thread.join();
+	for(Connection &connection : connections) closesocket(connection.socket);
+	closesocket(listener);
+	if(progress) fclose(progress);
+	stopSockets();
+}
+
+void GroundTruthFarm::render(const GroundTruthJob &newJob, RenderFunc renderUnit, const std::string &progressFilename, std::vector<float3> &pixels)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	job = newJob;
+	jobLine = formatJob(job);
+	jobNumber++;
+
+	// Tiles in row-major order, each split into ranges of samples
+	units.clear();
+	pending.clear();
+	numDone = 0;
+	workerUnits.clear();
+	workerUnits.push_back(std::make_pair(std::string("local"), 0));
+	for(unsigned y = 0; y < job.height; y += GROUND_TRUTH_TILE_SIZE)
+	{
+		for(unsigned x = 0; x < job.width; x += GROUND_TRUTH_TILE_SIZE)
+		{
+			for(unsigned first = 0; first < GROUND_TRUTH_SAMPLES; first += GROUND_TRUTH_RANGE_SAMPLES)
+			{
+				UnitState state;
+				state.unit.id = (unsigned)units.size();
+				state.unit.origin = make_uint2(x, y);
+				state.unit.size = make_uint2(std::min(job.width - x, (unsigned)GROUND_TRUTH_TILE_SIZE), std::min(job.height - y, (unsigned)GROUND_TRUTH_TILE_SIZE));
+				state.unit.firstSample = first;
+				state.unit.numSamples = std::min((unsigned)GROUND_TRUTH_RANGE_SAMPLES, GROUND_TRUTH_SAMPLES - first);
+				state.done = false;
+				units.push_back(state);
+			}
+		}
+	}
+	accumulated.assign(job.width * job.height, make_float3(0.f));
+	loadProgress(progressFilename);
+	for(const UnitState &state : units)
+	{
+		if(!state.done) pending.push_back(state.unit.id);
+	}
+	const size_t numResumed = numDone;
+	if(numResumed > 0) printf("Resuming ground truth from %s, %d of %d units done\n", progressFilename.c_str(), (int)numResumed, (int)units.size());
+	active = true;
+
+	// Render units here while the workers render theirs
+	const double start = getElapsedTime();
+	while(numDone < units.size())
+	{
+		if(pending.empty())
+		{
+			changed.wait_for(lock, std::chrono::milliseconds(100));
+			continue;
+		}
+		const GroundTruthUnit unit = units[pending.front()].unit;
+		pending.pop_front();
+		lock.unlock();
+		std::vector<float3> result;
+		renderUnit(unit, result);
+		lock.lock();
+		if(units[unit.id].done) continue;
+		completeUnit(unit.id, unit.numSamples, result.data());
+		workerUnits[0].second++;
+	}
+	active = false;
+	const double time = getElapsedTime() - start;
+
+	pixels.resize(accumulated.size());
+	for(size_t i = 0; i < pixels.size(); i++) pixels[i] = accumulated[i] / float(GROUND_TRUTH_SAMPLES);
+	if(progress)
+	{
+		fclose(progress);
+		progress = 0;
+		remove(progressFilename.c_str());
+	}
+
+	const double numRays = double(job.width) * job.height * GROUND_TRUTH_SAMPLES * (units.size() - numResumed) / units.size();
+	printf("Ground truth farm: %d units in %.1f s, %.1f M samples/s\n", (int)(units.size() - numResumed), time, numRays / std::max(time, 1e-6) * 1e-6);
+	for(const std::pair<std::string, int> &worker : workerUnits)
+	{
+		if(worker.second > 0) printf("  %-24s %5d units\n", worker.first.c_str(), worker.second);
+	}
+}
+
+bool GroundTruthFarm::waitForWorkers(size_t count, double timeout)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return changed.wait_for(lock, std::chrono::duration<double>(timeout), [this, count]() { return numConnected >= count; });
+}
+
+// Adds the result to the image and the progress file. Called with the mutex held.
+void GroundTruthFarm::completeUnit(unsigned id, unsigned numSamples, const float3 *result)
+{
+	UnitState &state = units[id];
+	const GroundTruthUnit &unit = state.unit;
+	for(unsigned y = 0; y < unit.size.y; y++)
+	{
+		for(unsigned x = 0; x < unit.size.x; x++)
+		{
+			accumulated[(unit.origin.y + y) * job.width + unit.origin.x + x] += result[y * unit.size.x + x] * float(numSamples);
+		}
+	}
+	state.done = true;
+	numDone++;
+
+	if(progress)
+	{
+		const ProgressRecord record = { id, numSamples };
+		fwrite(&record, sizeof(record), 1, progress);
+		fwrite(result, sizeof(float3), unit.size.x * unit.size.y, progress);
+		fflush(progress);
+	}
+	changed.notify_all();
+}
+
+// Merges the units of a progress file of the same job, or starts a new one.
+// A record cut off by a crash, or not matching its unit, is ignored and
+// overwritten along with everything after it.
+void GroundTruthFarm::loadProgress(const std::string &filename)
+{
+	if(progress) fclose(progress);
+	progress = 0;
+
+	long validBytes = 0;
+	FILE *file = fopen(filename.c_str(), "rb");
+	if(file)
+	{
+		ProgressHeader header;
+		if(fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, progressMagic, sizeof(progressMagic)) == 0 &&
+		   header.key == job.key && header.width == job.width && header.height == job.height)
+		{
+			validBytes = sizeof(header);
+			ProgressRecord record;
+			std::vector<float3> result;
+			while(fread(&record, sizeof(record), 1, file) == 1 && record.id < units.size())
+			{
+				const GroundTruthUnit &unit = units[record.id].unit;
+				if(record.numSamples != unit.numSamples)
+				{
+					printf("Ground truth progress: unit %u has %u samples instead of %u, discarding the rest of %s\n", record.id, record.numSamples, unit.numSamples, filename.c_str());
+					break;
+				}
+				result.resize(unit.size.x * unit.size.y);
+				if(fread(result.data(), sizeof(float3), result.size(), file) != result.size()) break;
+				if(!units[record.id].done) completeUnit(record.id, record.numSamples, result.data());
+				validBytes = ftell(file);
+			}
+		}
+		fclose(file);
+	}
+
+	if(validBytes > 0)
+	{
+		progress = fopen(filename.c_str(), "r+b");
+		if(progress) fseek(progress, validBytes, SEEK_SET);
+	}
+	else
+	{
+		progress = fopen(filename.c_str(), "wb");
+		const ProgressHeader header = { { progressMagic[0], progressMagic[1], progressMagic[2], progressMagic[3] }, job.width, job.height, job.key };
+		if(progress) fwrite(&header, sizeof(header), 1, progress);
+	}
+	if(!progress) printf("Could not open %s, the ground truth can't be resumed\n", filename.c_str());
+}
+
+void GroundTruthFarm::run()
+{
+	while(!stopping)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		uintptr_t maxSocket = listener;
+		for(const Connection &connection : connections)
+		{
+			FD_SET(connection.socket, &readable);
+			maxSocket = std::max(maxSocket, connection.socket);
+		}
+
+		// Wake up regularly to hand out requeued units and notice timeouts
+		timeval timeout = { 0, 100000 };
+		const int numReadable = select((int)maxSocket + 1, &readable, 0, 0, &timeout);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if(numReadable > 0 && FD_ISSET(listener, &readable))
+		{
+			sockaddr_in address = {};
+			socklen_t addressSize = sizeof(address);
+			const uintptr_t socket = accept(listener, reinterpret_cast<sockaddr*>(&address), &addressSize);
+			if(socket != INVALID_SOCKET_VALUE)
+			{
+				char host[INET_ADDRSTRLEN] = "?";
+				inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+				setSendTimeout(socket, SOCKET_SEND_TIMEOUT);
+				Connection connection;
+				connection.id = nextConnection++;
+				connection.socket = socket;
+				connection.address = "worker " + std::to_string(connection.id) + " (" + host + ")";
+				connections.push_back(connection);
+				numConnected++;
+				changed.notify_all();
+				printf("Ground truth farm: %s connected\n", connection.address.c_str());
+			}
+		}
+
+		for(size_t i = 0; i < connections.size(); i++)
+		{
+			Connection &connection = connections[i];
+			bool open = true;
+			if(numReadable > 0 && FD_ISSET(connection.socket, &readable))
+			{
+				char data[65536];
+				const int size = (int)recv(connection.socket, data, sizeof(data), 0);
+				if(size <= 0) open = false;
+				else connection.received.append(data, size);
+			}
+
+			// Results and lines
+			while(open)
+			{
+				if(connection.resultBytes > 0)
+				{
+					if(connection.received.size() < connection.resultBytes) break;
+					if(connection.resultAssigned && active && !units[connection.resultId].done)
+					{
+						completeUnit(connection.resultId, connection.resultCount, reinterpret_cast<const float3*>(connection.received.data()));
+						for(std::pair<std::string, int> &worker : workerUnits)
+						{
+							if(worker.first == connection.address) worker.second++;
+						}
+					}
+					connection.received.erase(0, connection.resultBytes);
+					connection.resultBytes = 0;
+					continue;
+				}
+				const size_t end = connection.received.find('\n');
+				if(end == std::string::npos) break;
+				const std::string line = connection.received.substr(0, end);
+				connection.received.erase(0, end + 1);
+				handleLine(connection, line);
+				open = connection.socket != INVALID_SOCKET_VALUE;
+			}
+
+			if(open && active && !connection.assigned.empty() && getElapsedTime() - connection.lastProgress > unitTimeout)
+			{
+				printf("Ground truth farm: %s timed out\n", connection.address.c_str());
+				open = false;
+			}
+			if(!open)
+			{
+				closeConnection(i--);
+				continue;
+			}
+
+			// Send the current job, then keep the worker busy
+			if(active && connection.jobSent != jobNumber)
+			{
+				connection.jobSent = jobNumber;
+				connection.ready = false;
+				connection.assigned.clear();
+				sendLine(connection, jobLine);
+			}
+			if(active && connection.ready) assignUnits(connection);
+		}
+
+		// Send without the lock, so a slow worker doesn't hold up the units rendered here.
+		// Only this thread changes the connections.
+		lock.unlock();
+		std::vector<int> failed;
+		for(Connection &connection : connections)
+		{
+			if(!connection.outgoing.empty() && !sendAll(connection.socket, connection.outgoing.data(), connection.outgoing.size())) failed.push_back(connection.id);
+			connection.outgoing.clear();
+		}
+		if(failed.empty()) continue;
+		lock.lock();
+		for(size_t i = 0; i < connections.size(); i++)
+		{
+			if(std::find(failed.begin(), failed.end(), connections[i].id) != failed.end()) closeConnection(i--);
+		}
+	}
+}
+
+void GroundTruthFarm::handleLine(Connection &connection, const std::string &line)
+{
+	std::istringstream tokens(line);
+	std::string command;
+	tokens >> command;
+
+	if(command == "ready")
+	{
+		connection.ready = connection.jobSent == jobNumber && line == "ready key=" + ReferenceCache::getKeyString(job.key);
+		if(connection.ready)
+		{
+			bool found = false;
+			for(const std::pair<std::string, int> &worker : workerUnits) found = found || worker.first == connection.address;
+			if(!found) workerUnits.push_back(std::make_pair(connection.address, 0));
+		}
+	}
+	else if(command == "result")
+	{
+		unsigned w = 0, h = 0;
+		const bool valid = parseTokens(line, [&connection, &w, &h](const std::string &key, const std::string &value)
+		{
+			if(key == "id") connection.resultId = (unsigned)strtoul(value.c_str(), 0, 10);
+			else if(key == "width") w = (unsigned)strtoul(value.c_str(), 0, 10);
+			else if(key == "height") h = (unsigned)strtoul(value.c_str(), 0, 10);
+			else if(key == "count") connection.resultCount = (unsigned)strtoul(value.c_str(), 0, 10);
+			else return false;
+			return true;
+		});
+
+		// Results of units the worker no longer holds, e.g. of an earlier job, are skipped, but
+		// can't be larger than a unit. Those of units it holds have to match them.
+		std::vector<unsigned>::iterator unit = std::find(connection.assigned.begin(), connection.assigned.end(), connection.resultId);
+		connection.resultAssigned = unit != connection.assigned.end();
+		const bool matches = connection.resultAssigned ?
+			units[*unit].unit.size.x == w && units[*unit].unit.size.y == h && units[*unit].unit.numSamples == connection.resultCount :
+			w <= GROUND_TRUTH_TILE_SIZE && h <= GROUND_TRUTH_TILE_SIZE;
+		if(!valid || w == 0 || h == 0 || !matches)
+		{
+			printf("Ground truth farm: %s sent a malformed result\n", connection.address.c_str());
+			closesocket(connection.socket);
+			connection.socket = INVALID_SOCKET_VALUE;
+			return;
+		}
+		if(connection.resultAssigned) connection.assigned.erase(unit);
+		connection.resultBytes = w * h * sizeof(float3);
+		connection.lastProgress = getElapsedTime();
+	}
+	else if(command == "error")
+	{
+		printf("Ground truth farm: %s: %s\n", connection.address.c_str(), line.c_str() + 6);
+		closesocket(connection.socket);
+		connection.socket = INVALID_SOCKET_VALUE;
+	}
+}
+
+void GroundTruthFarm::assignUnits(Connection &connection)
+{
+	while(connection.assigned.size() < unitsPerWorker && !pending.empty())
+	{
+		const GroundTruthUnit &unit = units[pending.front()].unit;
+		char line[192];
+		snprintf(line, sizeof(line), "unit id=%u x=%u y=%u width=%u height=%u first=%u count=%u",
+				 unit.id, unit.origin.x, unit.origin.y, unit.size.x, unit.size.y, unit.firstSample, unit.numSamples);
+		sendLine(connection, line);
+		if(connection.assigned.empty()) connection.lastProgress = getElapsedTime();
+		connection.assigned.push_back(unit.id);
+		pending.pop_front();
+	}
+}
+
+void GroundTruthFarm::sendLine(Connection &connection, const std::string &line)
+{
+	connection.outgoing += line + "\n";
+}
+
+// Closes the connection and queues its units again, first in line
+void GroundTruthFarm::closeConnection(size_t index)
+{
+	Connection &connection = connections[index];
+	if(connection.socket != INVALID_SOCKET_VALUE) closesocket(connection.socket);
+	if(active)
+	{
+		for(std::vector<unsigned>::reverse_iterator unit = connection.assigned.rbegin(); unit != connection.assigned.rend(); ++unit)
+		{
+			if(!units[*unit].done) pending.push_front(*unit);
+		}
+		if(!connection.assigned.empty()) printf("Ground truth farm: %d units of %s queued again\n", (int)connection.assigned.size(), connection.address.c_str());
+	}
+	printf("Ground truth farm: %s disconnected\n", connection.address.c_str());
+	connections.erase(connections.begin() + index);
+	numConnected--;
+	changed.notify_all();
+}
+
+//--------------------------------------------------------------
+// Worker
+//--------------------------------------------------------------
+
+void runGroundTruthWorker(const std::string &host, unsigned short port,
+						  std::function<std::string(const GroundTruthJob &job)> startJob, GroundTruthFarm::RenderFunc renderUnit)
+{
+	startSockets();
+
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *addresses = 0;
+	uintptr_t socket = INVALID_SOCKET_VALUE;
+	if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) == 0)
+	{
+		socket = ::socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(socket, addresses->ai_addr, (socklen_t)addresses->ai_addrlen) != 0)
+		{
+			closesocket(socket);
+			socket = INVALID_SOCKET_VALUE;
+		}
+		freeaddrinfo(addresses);
+	}
+	if(socket == INVALID_SOCKET_VALUE) throw Exception("Could not connect to " + host + ":" + std::to_string(port));
+	printf("Connected to the ground truth farm at %s:%u\n", host.c_str(), port);
+
+	std::string received;
+	bool hasJob = false;
+	int numUnits = 0;
+	for(;;)
+	{
+		const size_t end = received.find('\n');
+		if(end == std::string::npos)
+		{
+			char data[4096];
+			const int size = (int)recv(socket, data, sizeof(data), 0);
+			if(size <= 0) break;
+			received.append(data, size);
+			continue;
+		}
+		std::string line = received.substr(0, end);
+		received.erase(0, end + 1);
+		if(!line.empty() && line.back() == '\r') line.pop_back();
+
+		std::string reply;
+		if(line.compare(0, 4, "job ") == 0)
+		{
+			GroundTruthJob job;
+			std::string error = parseJob(line, job) ? startJob(job) : "malformed job";
+			hasJob = error.empty();
+			reply = hasJob ? "ready key=" + ReferenceCache::getKeyString(job.key) + "\n" : "error " + error + "\n";
+			if(!hasJob) printf("Rejected job: %s\n", error.c_str());
+			if(!sendAll(socket, reply.data(), reply.size())) break;
+		}
+		else if(line.compare(0, 5, "unit ") == 0 && hasJob)
+		{
+			GroundTruthUnit unit = {};
+			if(sscanf(line.c_str(), "unit id=%u x=%u y=%u width=%u height=%u first=%u count=%u", &unit.id, &unit.origin.x, &unit.origin.y,
+					  &unit.size.x, &unit.size.y, &unit.firstSample, &unit.numSamples) != 7) break;
+
+			const double start = getElapsedTime();
+			std::vector<float3> pixels;
+			renderUnit(unit, pixels);
+			char header[128];
+			snprintf(header, sizeof(header), "result id=%u width=%u height=%u count=%u\n", unit.id, unit.size.x, unit.size.y, unit.numSamples);
+			if(!sendAll(socket, header, strlen(header)) ||
+			   !sendAll(socket, reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float3))) break;
+			printf("Unit %u (%u, %u), samples %u-%u: %.1f ms\n", unit.id, unit.origin.x, unit.origin.y,
+				   unit.firstSample, unit.firstSample + unit.numSamples - 1, 1000.0 * (getElapsedTime() - start));
+			numUnits++;
+		}
+	}
+	closesocket(socket);
+	printf("Ground truth farm closed the connection after %d units\n", numUnits);
+	stopSockets();
+}
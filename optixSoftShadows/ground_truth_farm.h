@@ -0,0 +1,136 @@
+#pragma once
+
+#include "structs.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+
+//--------------------------------------------------------------
+// Ground truth farm
+//
+// Splits a ground truth image into units, a tile of pixels and a
+// range of samples, and hands them to worker processes connecting
+// over TCP. The coordinator renders units itself too. Messages
+// are single lines:
+//
+//   job key=<hex> scale=<s> width=<w> height=<h> eye=<x>,<y>,<z>
+//       U=<...> V=<...> W=<...> light=<15 floats>
+//   ready key=<hex>   or   error <message>
+//   unit id=<n> x=<x> y=<y> width=<w> height=<h> first=<s> count=<c>
+//   result id=<n> width=<w> height=<h> count=<c>
+//
+// A result is followed by width * height * 3 floats, the average
+// of its samples. Results have to match the size and sample count
+// of the unit, a worker sending anything else is dropped. Workers
+// hold up to two units, so they never wait for the next one.
+// Results are merged by their sample counts and appended to a
+// progress file, so an interrupted image resumes where it
+// stopped. The units of a worker that disconnects or stops
+// answering are queued again.
+//--------------------------------------------------------------
+
+#define GROUND_TRUTH_SAMPLES       4000 // Per pixel
+#define GROUND_TRUTH_TILE_SIZE     64   // In pixels
+#define GROUND_TRUTH_RANGE_SAMPLES 1000 // Per unit
+
+struct GroundTruthUnit
+{
+	unsigned id;
+	uint2 origin, size;
+	unsigned firstSample, numSamples;
+};
+
+// View a ground truth image is rendered for
+struct GroundTruthJob
+{
+	uint64_t key; // Reference key, workers check they compute the same one
+	float renderScale;
+	unsigned width, height;
+	float3 eye, U, V, W;
+	ParallelogramLight light;
+};
+
+class GroundTruthFarm
+{
+public:
+	typedef std::function<void(const GroundTruthUnit &unit, std::vector<float3> &pixels)> RenderFunc;
+
+	// Listens on 127.0.0.1:port, throws if the port can't be opened. Workers
+	// that hold units for longer than unitTimeout seconds without a result are dropped.
+	GroundTruthFarm(unsigned short port, double unitTimeout);
+	~GroundTruthFarm();
+
+	// Renders the image with the connected workers, and with renderUnit on
+	// this thread. Resumes from the progress file if it belongs to the job.
+	void render(const GroundTruthJob &job, RenderFunc renderUnit, const std::string &progressFilename, std::vector<float3> &pixels);
+
+	// Waits up to timeout seconds for count workers to connect, returns false if fewer did
+	bool waitForWorkers(size_t count, double timeout);
+
+private:
+	struct Connection
+	{
+		int id;
+		uintptr_t socket;
+		std::string address;
+		std::string received;          // Partial line or result
+		std::string outgoing;          // Lines queued with the mutex held, sent after releasing it
+		int jobSent = -1;              // Job number the worker was sent
+		bool ready = false;            // For the job it was sent
+		std::vector<unsigned> assigned; // Units in flight
+		double lastProgress = 0.0;     // Time of the last result, or of the first unit in flight
+		unsigned resultId = 0, resultCount = 0;
+		size_t resultBytes = 0;        // Of the result being received, 0 if none
+		bool resultAssigned = false;
+	};
+
+	struct UnitState
+	{
+		GroundTruthUnit unit;
+		bool done;
+	};
+
+	void run();
+	void handleLine(Connection &connection, const std::string &line);
+	void assignUnits(Connection &connection);
+	void completeUnit(unsigned id, unsigned numSamples, const float3 *pixels);
+	void closeConnection(size_t index);
+	void sendLine(Connection &connection, const std::string &line);
+	void loadProgress(const std::string &filename);
+
+	uintptr_t listener;
+	std::thread thread;
+	std::atomic<bool> stopping;
+	double unitTimeout;
+	std::vector<Connection> connections; // Only used by the network thread
+	int nextConnection = 1;
+
+	// Job state, guarded by mutex
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool active = false;
+	int jobNumber = 0;
+	std::string jobLine;
+	GroundTruthJob job;
+	std::vector<UnitState> units;
+	std::deque<unsigned> pending;
+	size_t numDone = 0;
+	std::vector<float3> accumulated; // Sum of the averages weighted by their sample counts
+	FILE *progress = 0;
+	std::vector<std::pair<std::string, int>> workerUnits; // Units rendered by each worker
+	size_t numConnected = 0;
+};
+
+// Connects to a farm at host:port and renders the units it sends until the
+// connection closes. startJob prepares a job and returns an error message,
+// empty if the worker can render it.
+void runGroundTruthWorker(const std::string &host, unsigned short port,
+						  std::function<std::string(const GroundTruthJob &job)> startJob, GroundTruthFarm::RenderFunc renderUnit);
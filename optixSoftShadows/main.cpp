@@ -30,6 +30,23 @@
 #include "util.h"
 #include "structs.h"
 #include "scenes.h"
+#include "tasks.h"
+#include "parameters.h"
+#include "pipeline.h"
+#include "frames.h"
+#include "pixel_layout.h"
+#include "pixel_list.h"
+#include "probe_statistics.h"
+#include "reference_cache.h"
+#include "render_service.h"
+#include "governor.h"
+#include "ground_truth_farm.h"
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <random>
 
 #define SCENE_CLASS DefaultScene
 //#define SCENE_CLASS GridScene
@@ -37,22 +54,38 @@
 Context context = 0;
 const int width = 1280, height = 720;
 std::map<std::string, const char*> cudaFiles;
+ThreadPool threadPool;
+std::chrono::high_resolution_clock::time_point startTime;
 
 // Some forward declarations
-void updateCamera();
+void getCameraBasis(const CameraSnapshot &snapshot, float3 &camera_u, float3 &camera_v, float3 &camera_w);
+void updateCamera(const CameraSnapshot &snapshot);
+void moveCamera(float dt);
 void initWindow(int*, char**);
 void destroyContext();
 
-// Camera
-struct
-{
-	float3 position;   // Camera position
-	float  pitch, yaw; // Camera orientation (pitch and yaw)
-} camera;
+// Camera, owned by the UI thread
+CameraSnapshot camera;
 
-const float move_speed = 10.0f;
+const float move_speed = 600.0f; // Units per second
 const float rotation_speed = 0.005f;
 
+// Directory the tuner writes the scenes' presets to
+const char *presetDirectory = "presets";
+
+// Directory of the reference cache and of partially rendered ground truth images
+const char *referenceDirectory = "references";
+
+// Blocker map resolution and field of view in degrees
+const int blockerMapSize = 512;
+const float blockerMapFov = 120.f;
+
+// Frames averaged by the progressive refinement before it stops
+const unsigned maxRefinementFrames = 64;
+
+// Entries of the visibility cache, 16 bytes each
+const RTsize visibilityCacheSize = 1 << 20;
+
 // Mouse state
 int2       mouse_prev_pos;
 int        mouse_button;
@@ -77,14 +110,36 @@ enum
 {
 	GEOMETRY_HIT_PROGRAM,
 	SAMPLE_DISTANCES_PROGRAM,
-	BLUR_D_H_PROGRAM,
+	ADAPTIVE_SAMPLING_PROGRAM,
+	PULL_DISTANCES_PROGRAM,
+	PUSH_DISTANCES_PROGRAM,
 	CALCULATE_BETA_PROGRAM,
 	BLUR_H_PROGRAM,
 	BLUR_V_PROGRAM,
+	BOX_PREFIX_SUM_H_PROGRAM,
+	BOX_BLUR_H_PROGRAM,
+	BOX_PREFIX_SUM_V_PROGRAM,
+	BOX_BLUR_V_PROGRAM,
 	NORMALIZE_PROGRAM,
 	GROUND_TRUTH_PROGRAM,
 	DIFFERENCE_PROGRAM,
-	NUM_PROGRAMS
+	BLOCKER_MAP_PROGRAM,
+	SAMPLE_DISTANCES_BLOCKER_MAP_PROGRAM,
+	SAMPLE_DISTANCES_SPECIALIZED_PROGRAM,
+	SAMPLE_DISTANCES_BLOCKER_MAP_SPECIALIZED_PROGRAM,
+	ADAPTIVE_SAMPLING_SPECIALIZED_PROGRAM,
+	CLEAR_VISIBILITY_CACHE_PROGRAM,
+	COUNT_PIXEL_CLASSES_PROGRAM,
+	SCAN_PIXEL_GROUPS_PROGRAM,
+	SCAN_PIXEL_CLASSES_PROGRAM,
+	ADD_PIXEL_GROUP_STARTS_PROGRAM,
+	COMPACT_PIXELS_PROGRAM,
+	ACCUMULATE_PROGRAM,
+	CLEAR_PROBE_STATISTICS_PROGRAM,
+	REDUCE_PROBE_STATISTICS_PROGRAM,
+	BLUR_H_RADIUS_PROGRAM, // One per radius up to SPECIALIZED_BLUR_RADII
+	BLUR_V_RADIUS_PROGRAM = BLUR_H_RADIUS_PROGRAM + SPECIALIZED_BLUR_RADII,
+	NUM_PROGRAMS = BLUR_V_RADIUS_PROGRAM + SPECIALIZED_BLUR_RADII
 };
 
 // Debug visualization state
@@ -102,30 +157,76 @@ enum State
 	NUM_STATES
 };
 
+// Filter used to blur the sampled soft shadows
+enum FilterBackend
+{
+	GAUSSIAN_FILTER, // Gaussian with a kernel radius of up to max_kernel_radius, cost grows with beta
+	BOX_FILTER,      // Cascade of box filters from prefix sums, constant cost per pixel
+	NUM_FILTER_BACKENDS
+};
+
 // State varaibles
 State state = DEFAULT;
+FilterBackend filterBackend = GAUSSIAN_FILTER;
+bool useBlockerMap = false; // Bound the occluder distances with a map rendered from the light
+bool useVisibilityCache = false; // Share shadow ray results between pixels, views and frames (see visibility_cache.h)
+bool occluderCulling = true; // Trace shadow rays only against objects that can occlude their receiver
+bool pixelCompaction = true; // Launch adaptive sampling and beta over the pixels needing them (see pixel_list.h)
+bool tiledLayout = false; // Store the pixels of the 2D buffers in tiles (see pixel_layout.h)
+bool specializedKernels = true; // Launch the kernel variants compiled for the current constants (see structs.h)
+bool progressiveRefinement = true; // Average new frames into the shown image while the view doesn't change (see accumulate.cu)
+unsigned refinementFrame = 0;      // Frames accumulated since the view last changed, minus one
+uint64_t refinementKey = 0;        // Of what the accumulated frames were rendered from
 bool animateLight = true;
 bool showMenus = true;
-bool generateDifferenceMap = false;
-bool saveScreenshot = false;
+SoftShadowParameters params = getDefaultParameters();
+SoftShadowParameters renderedParams = params; // As uploaded for the last pipeline execution
 Scene *scene = 0;
+ReferenceCache *referenceCache = 0; // Ground truth images already rendered, null if disabled
+GroundTruthFarm *groundTruthFarm = 0; // Shares ground truth images with worker processes, null if disabled
+Buffer groundTruthUnitBuffer;         // Units of the ground truth rendered by this process
+FrameGovernor *frameGovernor = 0;   // Trades quality for a frame time budget, null if disabled
+Buffer visibilityCacheBuffer;        // Allocated when the cache is first enabled
+uint64_t visibilityCacheVersion = 0; // Of the light and geometry the cache holds rays against
+Buffer pixelScanBuffer;       // Per-tile counts of the compaction pass and their coarser levels, grown as needed
+Buffer pixelListStartsBuffer; // First entry of each class in the pixel list, and its size
+unsigned pixelListStarts[NUM_PIXEL_CLASSES + 1] = {}; // Read back from it after each compaction
+
+// Render targets and the passes producing them
+Pipeline pipeline;
+
+// Value range of each heatmap, computed when the heatmap is rendered
+struct HeatmapRange
+{
+	float minValue, maxValue, avgValue;
+};
+std::map<std::string, HeatmapRange> heatmapRanges;
+
+// Settings the UI thread hands to the render thread, guarded by settingsMutex.
+// The render thread copies them at the start of every frame.
+struct RenderSettings
+{
+	CameraSnapshot camera;
+	State state;
+	FilterBackend filterBackend;
+	bool useBlockerMap;
+	bool useVisibilityCache;
+	bool occluderCulling;
+	bool pixelCompaction;
+	bool progressiveRefinement;
+	SoftShadowParameters params;
+	bool animate;
+	bool generateDifferenceMap, saveScreenshot, printPlan; // Requests for the next frame
+};
+
+RenderSettings settings;
+std::mutex settingsMutex;
 
-// CUDA buffers
-Buffer diffuseBuffer;
-Buffer geometryHitBuffer;
-Buffer geometryNormalBuffer;
-Buffer ffnormalBuffer;
-Buffer differenceBuffer;
-Buffer objectIdBuffer;
-Buffer projectedDistancesBuffer;
-Buffer d1Buffer;
-Buffer d2MinBuffer;
-Buffer d2MaxBuffer;
-Buffer betaBuffer;
-Buffer blurHBuffer;
-Buffer blurVBuffer;
-Buffer numSamplesBuffer;
-Buffer heatmapBuffer;
+// The render thread owns the OptiX context while it runs
+std::thread renderThread;
+std::atomic<bool> stopRendering(false), renderFailed(false);
+FrameRing frames;
+GLPresenter glPresenter;
 
 //--------------------------------------------------------------
 // Render loop
@@ -142,209 +243,1383 @@ void drawStrings(std::vector<std::string> strings, int x, int y, int dx, int dy)
 	}
 }
 
-void getBufferMinMax(Buffer buffer, float &minValue, float &maxValue, float &avg)
+void getMinMax(const std::vector<float> &values, float &minValue, float &maxValue, float &avg)
+{
+	minValue = FLT_MAX;
+	maxValue = -FLT_MAX;
+	double sum = 0.0;
+	for(float value : values)
+	{
+		minValue = std::min(value, minValue);
+		maxValue = std::max(value, maxValue);
+		sum += value;
+	}
+	avg = values.empty() ? 0.f : float(sum / values.size());
+}
+
+// Copies the pixels of a 2D buffer in row-major order, whatever the layout
+void readPixels(Buffer buffer, void *output)
 {
-	// Read CUDA buffer data
 	RTsize w, h;
 	buffer->getSize(w, h);
-	RTsize byteSize = w * h * buffer->getElementSize();
-	float *output = reinterpret_cast<float*>(new char[byteSize]);
-	memcpy(output, buffer->map(), byteSize);
+	const RTsize elementSize = buffer->getElementSize();
+	const char *data = static_cast<const char*>(buffer->map());
+	if(!tiledLayout)
+	{
+		memcpy(output, data, w * h * elementSize);
+	}
+	else
+	{
+		for(uint y = 0; y < h; y++)
+		{
+			for(uint x = 0; x < w; x++)
+			{
+				const uint2 index = tiled_pixel_index(make_uint2(x, y), make_uint2((uint)w, (uint)h));
+				memcpy(static_cast<char*>(output) + (y * w + x) * elementSize, data + (index.y * w + index.x) * elementSize, elementSize);
+			}
+		}
+	}
 	buffer->unmap();
+}
 
-	// Extract min and max value
-	minValue = FLT_MAX;
-	maxValue = -FLT_MAX;
-	std::list<float> values;
-	for(int i = 0; i < w*h; i++) {
-		minValue = std::min(output[i], minValue);
-		maxValue = std::max(output[i], maxValue);
-		values.push_back(output[i]);
+template<typename T>
+std::vector<T> readBuffer(Buffer buffer)
+{
+	RTsize w, h;
+	buffer->getSize(w, h);
+	std::vector<T> data(w * h);
+	readPixels(buffer, data.data());
+	return data;
+}
+
+// Copies row-major pixels into a 2D buffer, whatever the layout
+void writePixels(Buffer buffer, const void *input)
+{
+	RTsize w, h;
+	buffer->getSize(w, h);
+	const RTsize elementSize = buffer->getElementSize();
+	char *data = static_cast<char*>(buffer->map());
+	if(!tiledLayout)
+	{
+		memcpy(data, input, w * h * elementSize);
+	}
+	else
+	{
+		for(uint y = 0; y < h; y++)
+		{
+			for(uint x = 0; x < w; x++)
+			{
+				const uint2 index = tiled_pixel_index(make_uint2(x, y), make_uint2((uint)w, (uint)h));
+				memcpy(data + (index.y * w + index.x) * elementSize, static_cast<const char*>(input) + (y * w + x) * elementSize, elementSize);
+			}
+		}
+	}
+	buffer->unmap();
+}
+
+// Nearest neighbor resampling of row-major pixels with the given number of floats each
+void resamplePixels(const float *input, unsigned inputWidth, unsigned inputHeight, unsigned channels,
+					float *output, unsigned outputWidth, unsigned outputHeight)
+{
+	for(unsigned y = 0; y < outputHeight; y++)
+	{
+		for(unsigned x = 0; x < outputWidth; x++)
+		{
+			const unsigned source = (y * inputHeight / outputHeight) * inputWidth + x * inputWidth / outputWidth;
+			std::copy_n(input + source * channels, channels, output + (y * outputWidth + x) * channels);
+		}
+	}
+}
+
+// Saves a 2D buffer as a ppm image, in row-major order
+void saveBufferPPM(const std::string &filename, Buffer buffer)
+{
+	if(!tiledLayout)
+	{
+		sutil::displayBufferPPM(filename.c_str(), buffer);
+		return;
+	}
+
+	RTsize w, h;
+	buffer->getSize(w, h);
+	Buffer linear = context->createBuffer(RT_BUFFER_OUTPUT, buffer->getFormat(), w, h);
+	if(buffer->getFormat() == RT_FORMAT_USER) linear->setElementSize(buffer->getElementSize());
+	readPixels(buffer, linear->map());
+	linear->unmap();
+	sutil::displayBufferPPM(filename.c_str(), linear);
+	linear->destroy();
+}
+
+// Saves a float buffer as little-endian pfm images, which keep the values unclamped.
+// Single- and three-channel buffers give one image, other formats one per channel.
+// Like the buffers, pfm images store the bottom row first.
+void saveBufferPFM(const std::string &filename, Buffer buffer)
+{
+	int numChannels;
+	switch(buffer->getFormat())
+	{
+		case RT_FORMAT_FLOAT: numChannels = 1; break;
+		case RT_FORMAT_FLOAT2: numChannels = 2; break;
+		case RT_FORMAT_FLOAT3: numChannels = 3; break;
+		case RT_FORMAT_FLOAT4: numChannels = 4; break;
+		default: throw Exception("Only float buffers can be saved as pfm");
+	}
+
+	RTsize w, h;
+	buffer->getSize(w, h);
+	std::vector<float> data(w * h * numChannels);
+	readPixels(buffer, data.data());
+
+	const bool split = numChannels != 1 && numChannels != 3;
+	const std::string stem = filename.substr(0, filename.rfind(".pfm"));
+	for(int c = 0; c < (split ? numChannels : 1); c++)
+	{
+		const std::string channelFilename = split ? stem + "." + "xyzw"[c] + ".pfm" : filename;
+		FILE *file = fopen(channelFilename.c_str(), "wb");
+		if(!file) throw Exception("Could not write " + channelFilename);
+		fprintf(file, "%s\n%d %d\n-1.0\n", numChannels == 3 ? "PF" : "Pf", (int)w, (int)h);
+		if(split)
+		{
+			for(size_t i = c; i < data.size(); i += numChannels) fwrite(&data[i], sizeof(float), 1, file);
+		}
+		else
+		{
+			fwrite(data.data(), sizeof(float), data.size(), file);
+		}
+		fclose(file);
+	}
+}
+
+// Switches the layout of every 2D buffer. Results in the old layout can't be reused.
+void setTiledLayout(bool tiled)
+{
+	tiledLayout = tiled;
+	context["tiled_layout"]->setUint(tiled ? 1u : 0u);
+	pipeline.invalidate();
+}
+
+double getMeanSquaredError(const std::vector<float3> &a, const std::vector<float3> &b)
+{
+	double error = 0.0;
+	for(size_t i = 0; i < a.size(); i++)
+	{
+		const float3 diff = a[i] - b[i];
+		error += dot(diff, diff) / 3.0;
+	}
+	return error / a.size();
+}
+
+// Number of shadow rays traced by the probe and adaptive sampling passes,
+// and the number of adaptive samples skipped by the early-out
+void getShadowRayCounts(double &numRays, double &numSaved)
+{
+	std::vector<float> objectIds = readBuffer<float>(pipeline.getBuffer("object_id"));
+	std::vector<float> numSamples = readBuffer<float>(pipeline.getBuffer("num_samples"));
+	std::vector<float> savedSamples = readBuffer<float>(pipeline.getBuffer("saved_samples"));
+	numRays = numSaved = 0.0;
+	for(size_t i = 0; i < objectIds.size(); i++)
+	{
+		if(objectIds[i] == 0.f) continue;
+		numRays += params.num_probes + floor(numSamples[i]);
+		numSaved += savedSamples[i];
+	}
+}
+
+// Targets read back to count the shadow rays
+Pipeline::Names getSoftShadowOutputs()
+{
+	Pipeline::Names outputs;
+	outputs.push_back("blur_v");
+	outputs.push_back("object_id");
+	outputs.push_back("num_samples");
+	outputs.push_back("saved_samples");
+	return outputs;
+}
+
+// Target shown in each debug visualization state
+std::string getStateOutput(State state)
+{
+	switch(state)
+	{
+		case SHOW_DIFFUSE: return "diffuse";
+		case SHOW_H_BLUR: return "blur_h";
+		case SHOW_V_BLUR: return "blur_v_only";
+		case SHOW_D1: return "d1_heatmap";
+		case SHOW_D2_MIN: return "d2_min_heatmap";
+		case SHOW_D2_MAX: return "d2_max_heatmap";
+		case SHOW_BETA: return "beta_heatmap";
+		case SHOW_NUM_SAMPLES: return "num_samples_heatmap";
+		default: return "blur_v";
+	}
+}
+
+// Empties the visibility cache if it holds rays against another light or geometry
+void updateVisibilityCache()
+{
+	if(!useVisibilityCache) return;
+	const uint64_t versions[] = { pipeline.getSourceVersion("light"), pipeline.getSourceVersion("geometry") };
+	const uint64_t version = hashBytes(versions, sizeof(versions));
+	if(version == visibilityCacheVersion) return;
+	context->launch(CLEAR_VISIBILITY_CACHE_PROGRAM, visibilityCacheSize);
+	visibilityCacheVersion = version;
+}
+
+// Uploads the parameters and runs the passes the outputs depend on.
+// Returns the number of passes that ran.
+int executePipeline(const Pipeline::Names &outputs)
+{
+	updateVisibilityCache();
+	renderedParams = params;
+	if(frameGovernor) frameGovernor->apply(renderedParams);
+	context["params"]->setUserData(sizeof(renderedParams), &renderedParams);
+	pipeline.setSourceState("parameters", &renderedParams, sizeof(renderedParams));
+	return pipeline.execute(outputs);
+}
+
+// Key of the ground truth image in the reference cache: a hash of the scene's
+// contents, camera, light, resolution and the ground truth program, which
+// holds the sample settings
+uint64_t getReferenceKey()
+{
+	uint64_t key = hashBytes(scene->getName(), strlen(scene->getName()));
+	const uint64_t contentHash = scene->getContentHash();
+	key = hashBytes(&contentHash, sizeof(contentHash), key);
+	for(const char *name : { "eye", "U", "V", "W" })
+	{
+		const float3 value = context[name]->getFloat3();
+		key = hashBytes(&value, sizeof(value), key);
+	}
+	key = hashBytes(&scene->getLight(), sizeof(ParallelogramLight), key);
+	const RTsize resolution[] = { pipeline.getRenderWidth(), pipeline.getRenderHeight() };
+	key = hashBytes(resolution, sizeof(resolution), key);
+	return hashBytes(cudaFiles["ground_truth"], strlen(cudaFiles["ground_truth"]), key);
+}
+
+// Selects the pixels and samples the ground truth program renders (see ground_truth_farm.h)
+void setGroundTruthUnit(uint2 origin, unsigned firstSample, unsigned numSamples)
+{
+	context["screen_size"]->setUint((unsigned)pipeline.getRenderWidth(), (unsigned)pipeline.getRenderHeight());
+	context["tile_origin"]->setUint(origin.x, origin.y);
+	context["sample_range"]->setUint(firstSample, numSamples);
+}
+
+// Renders a unit of the ground truth into a buffer of its size
+void renderGroundTruthUnit(const GroundTruthUnit &unit, std::vector<float3> &pixels)
+{
+	if(!groundTruthUnitBuffer) groundTruthUnitBuffer = context->createBuffer(RT_BUFFER_OUTPUT, RT_FORMAT_FLOAT3, unit.size.x, unit.size.y);
+	groundTruthUnitBuffer->setSize(unit.size.x, unit.size.y);
+	context["diffuse_buffer"]->set(groundTruthUnitBuffer);
+	setGroundTruthUnit(unit.origin, unit.firstSample, unit.numSamples);
+	context->launch(GROUND_TRUTH_PROGRAM, unit.size.x, unit.size.y);
+	pixels.resize(unit.size.x * unit.size.y);
+	readPixels(groundTruthUnitBuffer, pixels.data());
+}
+
+// View of the ground truth the pipeline is about to render
+GroundTruthJob getGroundTruthJob(uint64_t key)
+{
+	GroundTruthJob job;
+	job.key = key;
+	job.renderScale = pipeline.getRenderScale();
+	job.width = (unsigned)pipeline.getRenderWidth();
+	job.height = (unsigned)pipeline.getRenderHeight();
+	job.eye = context["eye"]->getFloat3();
+	job.U = context["U"]->getFloat3();
+	job.V = context["V"]->getFloat3();
+	job.W = context["W"]->getFloat3();
+	job.light = scene->getLight();
+	return job;
+}
+
+// Worker side of the farm: takes over the view and checks it renders the same image
+std::string startGroundTruthJob(const GroundTruthJob &job)
+{
+	pipeline.setRenderScale(job.renderScale);
+	if(pipeline.getRenderWidth() != job.width || pipeline.getRenderHeight() != job.height) return "resolution differs";
+	context["eye"]->setFloat(job.eye);
+	context["U"]->setFloat(job.U);
+	context["V"]->setFloat(job.V);
+	context["W"]->setFloat(job.W);
+	if(memcmp(&job.light, &scene->getLight(), sizeof(ParallelogramLight)) != 0) scene->setLight(job.light);
+	const uint64_t key = getReferenceKey();
+	if(key != job.key) return "reference key " + ReferenceCache::getKeyString(key) + " differs, the worker runs another scene or build";
+	return std::string();
+}
+
+// Ground truth pass: loads the image from the reference cache, or renders and stores it
+void renderGroundTruth()
+{
+	Buffer buffer = context["ground_truth_buffer"]->getBuffer();
+	const unsigned w = (unsigned)pipeline.getRenderWidth(), h = (unsigned)pipeline.getRenderHeight();
+	if(!referenceCache && !groundTruthFarm)
+	{
+		setGroundTruthUnit(make_uint2(0u, 0u), 0, GROUND_TRUTH_SAMPLES);
+		context->launch(GROUND_TRUTH_PROGRAM, w, h);
+		return;
+	}
+
+	const uint64_t key = getReferenceKey();
+	std::vector<float3> pixels;
+	if(referenceCache && referenceCache->load(key, w, h, pixels))
+	{
+		writePixels(buffer, pixels.data());
+		printf("Ground truth %s loaded from the reference cache\n", ReferenceCache::getKeyString(key).c_str());
+		return;
+	}
+
+	const double start = getElapsedTime();
+	if(groundTruthFarm)
+	{
+		const std::string progressFilename = std::string(referenceDirectory) + "/" + ReferenceCache::getKeyString(key) + ".partial";
+		groundTruthFarm->render(getGroundTruthJob(key), renderGroundTruthUnit, progressFilename, pixels);
+		context["diffuse_buffer"]->set(buffer);
+		writePixels(buffer, pixels.data());
+		if(!referenceCache) return;
+	}
+	else
+	{
+		setGroundTruthUnit(make_uint2(0u, 0u), 0, GROUND_TRUTH_SAMPLES);
+		context->launch(GROUND_TRUTH_PROGRAM, w, h);
+		pixels.resize(w * h);
+		readPixels(buffer, pixels.data());
+	}
+	referenceCache->store(key, w, h, pixels);
+	printf("Ground truth %s rendered in %.1f s, reference cache holds %d images (%.0f MB)\n", ReferenceCache::getKeyString(key).c_str(),
+		   getElapsedTime() - start, referenceCache->getImageCount(), referenceCache->getSize() / (1024.0 * 1024.0));
+}
+
+// Selects the passes of the current filter backend
+void updateFilterBackend()
+{
+	pipeline.setGroupEnabled("gaussian", filterBackend == GAUSSIAN_FILTER);
+	pipeline.setGroupEnabled("box", filterBackend == BOX_FILTER);
+}
+
+// Selects the passes sampling the occluder distances
+void updateDistanceSampling()
+{
+	pipeline.setGroupEnabled("probe distances", !useBlockerMap);
+	pipeline.setGroupEnabled("blocker map", useBlockerMap);
+}
+
+void setVisibilityCacheEnabled(bool enabled)
+{
+	useVisibilityCache = enabled;
+	if(enabled && !visibilityCacheBuffer)
+	{
+		visibilityCacheBuffer = context->createBuffer(RT_BUFFER_INPUT_OUTPUT, RT_FORMAT_UNSIGNED_INT4, visibilityCacheSize);
+		context["visibility_cache"]->setBuffer(visibilityCacheBuffer);
+		visibilityCacheVersion = 0;
+	}
+	context["visibility_cache_enabled"]->setUint(enabled ? 1u : 0u);
+	pipeline.touch("visibility cache");
+}
+
+// Selects the passes launched over the screen or over the pixel lists
+void updatePixelCompaction()
+{
+	pipeline.setGroupEnabled("full screen", !pixelCompaction);
+	pipeline.setGroupEnabled("pixel lists", pixelCompaction);
+}
+
+// Kernel variants. The specialized ones are used when the constants they
+// were compiled for match the scene and the rendered parameters.
+int getLightCount()
+{
+	RTsize numLights;
+	context["lights"]->getBuffer()->getSize(numLights);
+	return (int)numLights;
+}
+
+unsigned getSampleDistancesProgram(bool blockerMap)
+{
+	if(specializedKernels && getLightCount() == SPECIALIZED_NUM_LIGHTS && renderedParams.num_probes == SPECIALIZED_NUM_PROBES)
+	{
+		return blockerMap ? SAMPLE_DISTANCES_BLOCKER_MAP_SPECIALIZED_PROGRAM : SAMPLE_DISTANCES_SPECIALIZED_PROGRAM;
+	}
+	return blockerMap ? SAMPLE_DISTANCES_BLOCKER_MAP_PROGRAM : SAMPLE_DISTANCES_PROGRAM;
+}
+
+unsigned getAdaptiveSamplingProgram()
+{
+	return specializedKernels && getLightCount() == SPECIALIZED_NUM_LIGHTS ? ADAPTIVE_SAMPLING_SPECIALIZED_PROGRAM : ADAPTIVE_SAMPLING_PROGRAM;
+}
+
+// The blur kernel sizes are truncated to at most max_kernel_radius, so the
+// variant unrolled for that radius covers every pixel
+unsigned getGaussianBlurProgram(bool vertical)
+{
+	const int radius = std::max((int)renderedParams.max_kernel_radius, 1);
+	if(!specializedKernels || radius > SPECIALIZED_BLUR_RADII) return vertical ? BLUR_V_PROGRAM : BLUR_H_PROGRAM;
+	return (vertical ? BLUR_V_RADIUS_PROGRAM : BLUR_H_RADIUS_PROGRAM) + radius - 1;
+}
+
+std::string getStateName(State state)
+{
+	switch(state)
+	{
+		case DEFAULT: return "Soft Shadows";
+		case SHOW_DIFFUSE: return "Diffuse";
+		case SHOW_H_BLUR: return "Blur H";
+		case SHOW_V_BLUR: return "Blur V";
+		case SHOW_D1: return "d1";
+		case SHOW_D2_MIN: return "d2 min";
+		case SHOW_D2_MAX: return "d2 max";
+		case SHOW_BETA: return "Beta";
+		case SHOW_NUM_SAMPLES: return "Num Samples";
+		default: return "MISSING";
 	}
-	delete[] output;
+}
 
-	avg = std::accumulate(values.begin(), values.end(), 0.0f) / values.size();
+// Takes over the settings changed by the UI thread
+void applySettings(const RenderSettings &current)
+{
+	state = current.state;
+	params = current.params;
+	scene->animate = current.animate;
+	if(filterBackend != current.filterBackend)
+	{
+		filterBackend = current.filterBackend;
+		updateFilterBackend();
+	}
+	if(occluderCulling != current.occluderCulling)
+	{
+		occluderCulling = current.occluderCulling;
+		scene->setOccluderCullingEnabled(occluderCulling);
+		pipeline.touch("geometry");
+	}
+	if(useBlockerMap != current.useBlockerMap)
+	{
+		useBlockerMap = current.useBlockerMap;
+		updateDistanceSampling();
+	}
+	if(useVisibilityCache != current.useVisibilityCache)
+	{
+		setVisibilityCacheEnabled(current.useVisibilityCache);
+	}
+	if(pixelCompaction != current.pixelCompaction)
+	{
+		pixelCompaction = current.pixelCompaction;
+		updatePixelCompaction();
+	}
+	progressiveRefinement = current.progressiveRefinement;
+}
+
+// Selects the frame whose seeds the sampling passes use
+void setRefinementFrame(unsigned frame)
+{
+	refinementFrame = frame;
+	context["frame_number"]->setUint(frame);
+	context["accumulation_weight"]->setFloat(1.f / (frame + 1));
+	pipeline.setSourceState("frame", &frame, sizeof(frame));
+}
+
+// Advances the progressive refinement if the shown output is rendered from the same
+// sources and settings as the last frame, and starts over otherwise. Once all frames
+// are accumulated, nothing is left to render.
+void updateRefinement(const std::string &output)
+{
+	SoftShadowParameters frameParams = params;
+	if(frameGovernor) frameGovernor->apply(frameParams);
+	uint64_t key = hashBytes(output.data(), output.size());
+	key = hashBytes(&frameParams, sizeof(frameParams), key);
+	for(const char *source : { "camera", "light", "geometry", "visibility cache" })
+	{
+		const uint64_t version = pipeline.getSourceVersion(source);
+		key = hashBytes(&version, sizeof(version), key);
+	}
+	const int options[] = { filterBackend, useBlockerMap, occluderCulling, pixelCompaction, tiledLayout, specializedKernels };
+	key = hashBytes(options, sizeof(options), key);
+	const float renderScale = pipeline.getRenderScale();
+	key = hashBytes(&renderScale, sizeof(renderScale), key);
+
+	if(!progressiveRefinement || key != refinementKey) setRefinementFrame(0);
+	else if(refinementFrame + 1 < maxRefinementFrames) setRefinementFrame(refinementFrame + 1);
+	refinementKey = key;
+}
+
+// Targets the governor reads its probe statistics from
+Pipeline::Names getGovernorOutputs()
+{
+	return Pipeline::Names(1, "probe_statistics");
+}
+
+// Pass timings and probe statistics of the frame just rendered, for the governor
+FrameMeasurements measureFrame(double frameTime)
+{
+	FrameMeasurements frame = {};
+	frame.frameTime = frameTime;
+	frame.filterScalesWithRadius = filterBackend == GAUSSIAN_FILTER;
+	frame.width = (unsigned)pipeline.getRenderWidth();
+	frame.height = (unsigned)pipeline.getRenderHeight();
+	for(const std::string &pass : pipeline.getPassNames())
+	{
+		const double time = pipeline.getPassTime(pass);
+		if(pass.compare(0, 17, "adaptive sampling") == 0) frame.samplingTime += time;
+		else if(pass.compare(0, 13, "gaussian blur") == 0 || pass.compare(0, 8, "box blur") == 0) frame.filterTime += time;
+		else frame.pixelTime += time;
+	}
+
+	// Reduced on the device, so only the slots are read back
+	const std::vector<unsigned> slots = readBuffer<unsigned>(pipeline.getBuffer("probe_statistics"));
+	double sums[NUM_PROBE_STATISTICS] = {};
+	for(size_t i = 0; i < slots.size(); i++) sums[i % NUM_PROBE_STATISTICS] += slots[i];
+	frame.numLit = sums[LIT_PIXEL_COUNT];
+	frame.numPenumbra = sums[PENUMBRA_PIXEL_COUNT];
+	frame.numUmbra = sums[UMBRA_PIXEL_COUNT];
+	frame.penumbraSamples = sums[PENUMBRA_SAMPLE_COUNT];
+	frame.umbraSamples = sums[UMBRA_SAMPLE_COUNT];
+	return frame;
+}
+
+// Renders a frame on the render thread. Returns false if nothing changed
+// since the last frame, in which case the frame is left incomplete.
+bool renderFrame(const RenderSettings &current, Frame &frame)
+{
+	const double frameStart = getElapsedTime();
+	if(frameGovernor)
+	{
+		frameGovernor->setBaseParameters(params);
+		pipeline.setRenderScale(frameGovernor->getSettings().renderScale);
+		pipeline.resetPassTimes();
+	}
+	updateCamera(current.camera);
+	const unsigned changes = scene->update();
+	if(changes & (LIGHT_CHANGED | GEOMETRY_CHANGED)) scene->updateOccluders();
+	if(changes & LIGHT_CHANGED) pipeline.touch("light");
+	if(changes & GEOMETRY_CHANGED) pipeline.touch("geometry");
+
+	// Select the target to show. Only the passes it depends on are run.
+	// The filtered image is shown refined.
+	std::string output = getStateOutput(current.generateDifferenceMap ? DEFAULT : state);
+	if(output == "blur_v" && progressiveRefinement && !current.generateDifferenceMap) output = "accumulated";
+	updateRefinement(output);
+
+	// Render the filtered image without the early-out first, so we can
+	// report the ray savings and quality impact of the early-out
+	std::vector<float3> referenceFiltered;
+	double referenceRays = 0.0, referenceSaved = 0.0;
+	if(current.generateDifferenceMap && params.early_out_confidence <= 1.f)
+	{
+		const float confidence = params.early_out_confidence;
+		params.early_out_confidence = 2.f;
+		executePipeline(getSoftShadowOutputs());
+		referenceFiltered = readBuffer<float3>(pipeline.getBuffer("blur_v"));
+		getShadowRayCounts(referenceRays, referenceSaved);
+		params.early_out_confidence = confidence;
+	}
+
+	Buffer bufferToDisplay;
+	int numRun = 0;
+	frame.heatmapInfo.clear();
+	if(current.generateDifferenceMap)
+	{
+		// Render ground truth image and calculate differences between ground truth and filtered image
+		Pipeline::Names outputs = getSoftShadowOutputs();
+		outputs.push_back("ground_truth");
+		outputs.push_back("difference");
+		numRun = executePipeline(outputs);
+		bufferToDisplay = pipeline.getBuffer("blur_v");
+
+		// Report shadow rays and error against the ground truth
+		std::vector<float3> groundTruth = readBuffer<float3>(pipeline.getBuffer("ground_truth"));
+		double numRays, numSaved;
+		getShadowRayCounts(numRays, numSaved);
+		printf("Early-out confidence %.2f: %.0f shadow rays (%.0f adaptive samples skipped), MSE %g\n",
+			   params.early_out_confidence, numRays, numSaved, getMeanSquaredError(readBuffer<float3>(pipeline.getBuffer("blur_v")), groundTruth));
+		if(!referenceFiltered.empty())
+		{
+			printf("Without early-out: %.0f shadow rays, MSE %g (early-out saves %.1f%% of the rays)\n",
+				   referenceRays, getMeanSquaredError(referenceFiltered, groundTruth), 100.0 * (1.0 - numRays / referenceRays));
+		}
+		
+		// Save all three images
+		std::string timeStamp = getTimeStamp();
+		saveBufferPPM("screenshots/" + timeStamp + " filtered.ppm", pipeline.getBuffer("blur_v"));
+		saveBufferPPM("screenshots/" + timeStamp + " ground_truth " + ReferenceCache::getKeyString(getReferenceKey()) + ".ppm", pipeline.getBuffer("ground_truth"));
+		saveBufferPPM("screenshots/" + timeStamp + " difference.ppm", pipeline.getBuffer("difference"));
+	}
+	else
+	{
+		// Show buffer. The governor also reads the probe statistics.
+		Pipeline::Names outputs(1, output);
+		if(frameGovernor)
+		{
+			for(const std::string &name : getGovernorOutputs())
+			{
+				if(name != output) outputs.push_back(name);
+			}
+		}
+		numRun = executePipeline(outputs);
+		bufferToDisplay = pipeline.getBuffer(output);
+
+		if(output.find("_heatmap") != std::string::npos)
+		{
+			const HeatmapRange &range = heatmapRanges[output];
+			frame.heatmapInfo.push_back("Min: " + std::to_string(range.minValue));
+			frame.heatmapInfo.push_back("Max: " + std::to_string(range.maxValue));
+			frame.heatmapInfo.push_back("Avg: " + std::to_string(range.avgValue));
+		}
+	}
+
+	const std::string stateName = getStateName(state);
+	if(current.saveScreenshot)
+	{
+		std::string timeStamp = getTimeStamp();
+		saveBufferPPM("screenshots/" + timeStamp + " " + stateName + ".ppm", bufferToDisplay);
+	}
+	if(current.printPlan)
+	{
+		pipeline.printPlan(Pipeline::Names(1, output));
+		pipeline.printReuseStats();
+	}
+
+	// The last frame already shows this image
+	static std::string lastOutput;
+	if(numRun == 0 && output == lastOutput)
+	{
+		return false;
+	}
+	lastOutput = output;
+
+	// Copy the image into the frame for the UI thread, at the window's resolution
+	frame.pixels.resize(width * height);
+	const unsigned renderWidth = (unsigned)pipeline.getRenderWidth(), renderHeight = (unsigned)pipeline.getRenderHeight();
+	if(renderWidth == (unsigned)width && renderHeight == (unsigned)height)
+	{
+		readPixels(bufferToDisplay, frame.pixels.data());
+	}
+	else
+	{
+		const std::vector<float3> pixels = readBuffer<float3>(bufferToDisplay);
+		resamplePixels(&pixels[0].x, renderWidth, renderHeight, 3, &frame.pixels[0].x, width, height);
+	}
+
+	// Choose the settings of the next frame from this one
+	std::string governorInfo;
+	if(frameGovernor && !current.generateDifferenceMap)
+	{
+		const FrameMeasurements measurements = measureFrame(1000.0 * (getElapsedTime() - frameStart));
+		const GovernorSettings &used = frameGovernor->getSettings();
+		char line[128];
+		snprintf(line, sizeof(line), "Governor: %.1f / %.1f ms, %d samples, radius %d, scale %.3f",
+				 measurements.frameTime, frameGovernor->getTargetTime(), int(used.maxNumSamples), int(used.maxKernelRadius), used.renderScale);
+		governorInfo = line;
+		frameGovernor->update(measurements);
+	}
+
+	frame.camera = current.camera;
+	frame.info.clear();
+	frame.info.push_back(stateName);
+	frame.info.push_back(std::string("Filter: ") + (filterBackend == BOX_FILTER ? "Box cascade" : "Gaussian"));
+	frame.info.push_back("Render targets: " + std::to_string(pipeline.getAllocatedBytes() >> 20) + " MB (" + std::to_string(pipeline.getNaiveBytes() >> 20) + " MB unaliased)");
+	frame.info.push_back("Occluder culling: " + (occluderCulling ? std::to_string(int(scene->getCulledFraction() * 100.f + 0.5f)) + "% of objects skipped" : std::string("off")));
+	frame.info.push_back(std::string("Distances: ") + (useBlockerMap ? "Blocker map" : "Probes"));
+	frame.info.push_back(std::string("Visibility cache: ") + (useVisibilityCache ? "on" : "off"));
+	frame.info.push_back("Pixel lists: " + (pixelCompaction ? std::to_string(int(100.f * (pixelListStarts[LIT_PIXELS] - pixelListStarts[PENUMBRA_PIXELS]) / std::max(pixelListStarts[NUM_PIXEL_CLASSES], 1u) + 0.5f)) + "% of pixels sampled" : std::string("off")));
+	frame.info.push_back(std::string("Kernels: ") + (specializedKernels ? "Specialized" : "Generic"));
+	frame.info.push_back("Refinement: " + (progressiveRefinement ? std::to_string(refinementFrame + 1) + " / " + std::to_string(maxRefinementFrames) + " frames" : std::string("off")));
+	frame.info.push_back("Early-out confidence: " + (params.early_out_confidence > 1.f ? std::string("off") : std::to_string(params.early_out_confidence)));
+	frame.info.push_back("Passes: " + std::to_string(numRun) + " run, " + std::to_string(pipeline.getLastReusedCount()) + " reused");
+	if(!governorInfo.empty()) frame.info.push_back(governorInfo);
+
+	context->validate();
+	frame.renderTime = getElapsedTime() - frameStart;
+	return true;
+}
+
+void renderLoop()
+{
+	try
+	{
+		unsigned frameNumber = 0;
+		while(!stopRendering)
+		{
+			RenderSettings current;
+			{
+				std::lock_guard<std::mutex> lock(settingsMutex);
+				current = settings;
+				settings.generateDifferenceMap = settings.saveScreenshot = settings.printPlan = false;
+			}
+			applySettings(current);
+
+			// Only publish frames that differ from the last one
+			Frame &frame = frames.beginWrite();
+			frame.number = frameNumber + 1;
+			if(!renderFrame(current, frame))
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			frameNumber++;
+			frames.endWrite();
+
+			if(frameNumber == 1)
+			{
+				printf("Time to first frame: %.1f ms\n", std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count());
+			}
+		}
+	}
+	catch(const Exception &e)
+	{
+		printf("Render thread stopped: %s\n", e.getErrorString().c_str());
+		renderFailed = true;
+	}
+	catch(const std::exception &e)
+	{
+		printf("Render thread stopped: %s\n", e.what());
+		renderFailed = true;
+	}
+}
+
+void startRenderThread()
+{
+	settings.camera = camera;
+	settings.camera.timestamp = getElapsedTime();
+	settings.state = state;
+	settings.filterBackend = filterBackend;
+	settings.useBlockerMap = useBlockerMap;
+	settings.useVisibilityCache = useVisibilityCache;
+	settings.occluderCulling = occluderCulling;
+	settings.pixelCompaction = pixelCompaction;
+	settings.progressiveRefinement = progressiveRefinement;
+	settings.params = params;
+	settings.animate = scene->animate;
+	settings.generateDifferenceMap = settings.saveScreenshot = settings.printPlan = false;
+
+	stopRendering = false;
+	renderThread = std::thread(renderLoop);
+}
+
+void stopRenderThread()
+{
+	if(renderThread.joinable())
+	{
+		stopRendering = true;
+		renderThread.join();
+	}
+}
+
+//--------------------------------------------------------------
+// Presentation
+//--------------------------------------------------------------
+
+// Hands the current camera to the render thread
+void publishCamera()
+{
+	camera.timestamp = getElapsedTime();
+	std::lock_guard<std::mutex> lock(settingsMutex);
+	settings.camera = camera;
+}
+
+void glutIdle()
+{
+	if(renderFailed)
+	{
+		destroyContext();
+		exit(1);
+	}
+
+	static double lastTime = getElapsedTime();
+	const double time = getElapsedTime();
+	moveCamera(float(time - lastTime));
+	lastTime = time;
+	publishCamera();
+
+	// Only redraw when the render thread has completed a new frame
+	if(frames.hasNewFrame())
+	{
+		glutPostRedisplay();
+	}
+	else
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void glutDisplay()
+{
+	const Frame *frame = frames.acquireLatest();
+	if(!frame) return;
+	glPresenter.present(*frame);
+	drawStrings(frame->heatmapInfo, width - 150, 55, 0, -20);
+
+	// Display world info
+	static unsigned frame_count = 0;
+	sutil::displayFps(frame_count++);
+
+	std::vector<std::string> topLeftInfo = frame->info;
+	topLeftInfo.push_back("Frame: " + std::to_string(frame->number) + " (" + std::to_string(int(frame->renderTime * 1000.0)) + " ms)");
+	topLeftInfo.push_back("Input latency: " + std::to_string(int((getElapsedTime() - frame->camera.timestamp) * 1000.0)) + " ms");
+	topLeftInfo.push_back("Yaw: " + std::to_string(frame->camera.yaw));
+	topLeftInfo.push_back("Pitch: " + std::to_string(frame->camera.pitch));
+	topLeftInfo.push_back("Position: [" + std::to_string(frame->camera.position.x) + ", " + std::to_string(frame->camera.position.y) + ", " + std::to_string(frame->camera.position.z) + "]");
+	drawStrings(topLeftInfo, 10, height - 15, 0, -20);
+
+	std::vector<std::string> topRightInfo;
+	topRightInfo.push_back("WASD: Move");
+	topRightInfo.push_back("QE: Up/Down");
+	topRightInfo.push_back("P: Pause Animations");
+	topRightInfo.push_back("M: Toggle Menus");
+	topRightInfo.push_back("O: Generate Diff. Map");
+	topRightInfo.push_back("C: Capture Screen");
+	topRightInfo.push_back("1/2: Prev/Next State");
+	topRightInfo.push_back("+/-: Early-out Confidence");
+	topRightInfo.push_back("F: Toggle Filter");
+	topRightInfo.push_back("G: Print Passes");
+	topRightInfo.push_back("B: Toggle Blocker Map");
+	topRightInfo.push_back("V: Toggle Visibility Cache");
+	topRightInfo.push_back("K: Toggle Occluder Culling");
+	topRightInfo.push_back("L: Toggle Pixel Lists");
+	topRightInfo.push_back("R: Toggle Refinement");
+	drawStrings(topRightInfo, width - 200, height - 15, 0, -20);
+
+	glutSwapBuffers();
 }
 
-Buffer normalizeBuffer(Buffer buffer, bool display = true)
+// Renders the given number of frames without a window, feeding the render
+// thread fresh camera snapshots, and prints frame statistics
+void runHeadless(unsigned numFrames)
 {
-	// Normalize and display the beta buffer
-	float minValue, maxValue, avgValue;
-	getBufferMinMax(buffer, minValue, maxValue, avgValue);
-	context["max_value"]->setFloat(maxValue);
-	context["normalize_buffer"]->set(buffer);
-	context->launch(NORMALIZE_PROGRAM, width, height);
-	
-	sutil::displayBufferGL(context["heatmap_buffer"]->getBuffer());
-
-	std::vector<std::string> strings;
-	strings.push_back("Min: " + std::to_string(minValue));
-	strings.push_back("Max: " + std::to_string(maxValue));
-	strings.push_back("Avg: " + std::to_string(avgValue));
-	drawStrings(strings, width - 150, 55, 0, -20);
-
-	return context["heatmap_buffer"]->getBuffer();
+	HeadlessPresenter presenter;
+	startRenderThread();
+	while(presenter.getPresentedCount() < numFrames && !renderFailed)
+	{
+		publishCamera();
+		if(frames.waitForNewFrame(0.1))
+		{
+			presenter.present(*frames.acquireLatest());
+		}
+	}
+	stopRenderThread();
+	presenter.printStats();
+	pipeline.printReuseStats();
 }
 
-void glutDisplay()
+// Compares the soft shadow passes tracing the full meshes and the shadow
+// proxies: time per frame, shadow rays and error against the ground truth
+void reportShadowProxies(int numRuns)
 {
-	updateCamera();
-	scene->update();
+	scene->animate = false;
+	executePipeline(Pipeline::Names(1, "ground_truth"));
+	const std::vector<float3> groundTruth = readBuffer<float3>(pipeline.getBuffer("ground_truth"));
 
-	// Sample geometry hits
-	context->launch(GEOMETRY_HIT_PROGRAM, width, height);
+	for(int proxies = 0; proxies < 2; proxies++)
+	{
+		scene->setShadowProxiesEnabled(proxies != 0);
+		pipeline.touch("geometry");
+		executePipeline(getSoftShadowOutputs());
 
-	// Sample distance values (and diffuse color)
-	context->launch(SAMPLE_DISTANCES_PROGRAM, width, height);
+		// Touching the light reruns the shadow passes but not the primary rays
+		const double start = getElapsedTime();
+		for(int i = 0; i < numRuns; i++)
+		{
+			pipeline.touch("light");
+			executePipeline(getSoftShadowOutputs());
+		}
+		const double time = (getElapsedTime() - start) / numRuns;
 
-	// Calculate beta
-	context->launch(BLUR_D_H_PROGRAM, width, height);
-	context->launch(CALCULATE_BETA_PROGRAM, width, height);
+		double numRays, numSaved;
+		getShadowRayCounts(numRays, numSaved);
+		printf("%s: %.2f ms per frame, %.0f shadow rays, MSE %g\n", proxies ? "Shadow proxies" : "Full meshes",
+			   1000.0 * time, numRays, getMeanSquaredError(readBuffer<float3>(pipeline.getBuffer("blur_v")), groundTruth));
+	}
+	scene->setShadowProxiesEnabled(true);
+	printf("Proxies are only approximate for open and thin meshes: inflating moves a sheet rather than thickening it, so light can leak past its edges\n");
+}
 
-	context["blur_h_buffer"]->set(diffuseBuffer);
+// Traces primary rays through evenly spread pixels and a shadow ray from each hit to
+// a random point on the light with the CPU BVH, on this thread only, and prints the
+// rays per second of both, against a scalar traversal of the binary BVH as the baseline.
+// The primary rays are also tested against the quad soups with and without SSE.
+void benchmarkCpuRays(int numRays)
+{
+	const float epsilon = 0.1f; // EPSILON in main.cu
+
+	double start = getElapsedTime();
+	WideBVH bvh;
+	scene->buildCpuBVH(bvh);
+	printf("CPU BVH: %d triangles, %d nodes, built in %.1f ms\n", bvh.getTriangleCount(), bvh.getNodeCount(), 1000.0 * (getElapsedTime() - start));
+
+	// Generate the rays up front so only the ray queries are timed
+	float3 u, v, w;
+	getCameraBasis(camera, u, v, w);
+	std::vector<float3> directions(numRays);
+	for(int i = 0; i < numRays; i++)
+	{
+		const long long pixel = (long long)i * width * height / numRays;
+		const float2 d = make_float2(float(pixel % width) / width, float(pixel / width) / height) * 2.f - 1.f;
+		directions[i] = normalize(d.x * u + d.y * v + w);
+	}
 
-	Buffer bufferToDisplay; bool alreadyShown = false;
-	switch(generateDifferenceMap ? DEFAULT : state)
+	// The binary BVH traversed one box and one triangle at a time is the baseline,
+	// and has to find the same hits
+	std::vector<float3> hitPoints;
+	hitPoints.reserve(numRays);
+	std::vector<int> primitives[2];
+	double primaryTimes[2];
+	for(int binary = 0; binary < 2; binary++)
 	{
-		case DEFAULT:
+		primitives[binary].assign(numRays, -1);
+		start = getElapsedTime();
+		for(int i = 0; i < numRays; i++)
 		{
-			context->launch(BLUR_H_PROGRAM, width, height);
-			context->launch(BLUR_V_PROGRAM, width, height);
-			bufferToDisplay = context["blur_v_buffer"]->getBuffer();
+			RayHit hit;
+			if(binary ? bvh.intersectBinary(camera.position, directions[i], epsilon, 1e30f, hit) : bvh.intersect(camera.position, directions[i], epsilon, 1e30f, hit))
+			{
+				primitives[binary][i] = hit.primitive;
+				if(!binary) hitPoints.push_back(hit.position);
+			}
 		}
-		break;
-
-		case SHOW_DIFFUSE:
+		primaryTimes[binary] = getElapsedTime() - start;
+	}
+	int primaryMismatches = 0;
+	for(int i = 0; i < numRays; i++) primaryMismatches += primitives[0][i] != primitives[1][i];
+	printf("Primary rays: %.2f Mrays/s, binary BVH %.2f Mrays/s, %.2fx (%d of %d hit, %d mismatches)\n", numRays / primaryTimes[0] * 1e-6,
+		   numRays / primaryTimes[1] * 1e-6, primaryTimes[1] / primaryTimes[0], (int)hitPoints.size(), numRays, primaryMismatches);
+
+	// Test the same rays against the quad soups four quads at a time and one at a time,
+	// and check both find the same quads
+	const std::vector<QuadSoup> &soups = scene->getQuadSoups();
+	if(!soups.empty())
+	{
+		std::vector<std::pair<int, float>> hits[2];
+		double soupTimes[2];
+		for(int scalar = 0; scalar < 2; scalar++)
 		{
-			bufferToDisplay = context["diffuse_buffer"]->getBuffer();
+			hits[scalar].assign(numRays, std::make_pair(-1, 1e30f));
+			start = getElapsedTime();
+			for(int i = 0; i < numRays; i++)
+			{
+				std::pair<int, float> &hit = hits[scalar][i];
+				int first = 0;
+				for(const QuadSoup &soup : soups)
+				{
+					const int quad = scalar ? soup.intersectScalar(camera.position, directions[i], epsilon, hit.second) : soup.intersect(camera.position, directions[i], epsilon, hit.second);
+					if(quad >= 0) hit.first = first + quad;
+					first += soup.size();
+				}
+			}
+			soupTimes[scalar] = getElapsedTime() - start;
 		}
-		break;
 
-		case SHOW_H_BLUR:
+		int numQuads = 0, numHit = 0, numMismatches = 0;
+		for(const QuadSoup &soup : soups) numQuads += soup.size();
+		for(int i = 0; i < numRays; i++)
 		{
-			context->launch(BLUR_H_PROGRAM, width, height);
-			bufferToDisplay = context["blur_h_buffer"]->getBuffer();
+			numHit += hits[0][i].first >= 0;
+			if(hits[0][i].first != hits[1][i].first || fabsf(hits[0][i].second - hits[1][i].second) > 1e-4f * hits[1][i].second) numMismatches++;
 		}
-		break;
+		printf("Quad soups (%d quads): SSE %.2f Mrays/s, scalar %.2f Mrays/s, %.2fx (%d of %d hit, %d mismatches)\n", numQuads,
+			   numRays / soupTimes[0] * 1e-6, numRays / soupTimes[1] * 1e-6, soupTimes[1] / soupTimes[0], numHit, numRays, numMismatches);
+	}
+	if(hitPoints.empty()) return;
 
-		case SHOW_V_BLUR:
-		{
-			context["blur_h_buffer"]->set(diffuseBuffer);
-			context->launch(BLUR_V_PROGRAM, width, height);
-			bufferToDisplay = context["blur_v_buffer"]->getBuffer();
-		}
-		break;
+	const ParallelogramLight &light = scene->getLight();
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> uniform(0.f, 1.f);
+	std::vector<float3> lightSamples(hitPoints.size());
+	for(float3 &sample : lightSamples) sample = light.corner + light.v1 * uniform(random) + light.v2 * uniform(random);
 
-		case SHOW_D1:
+	std::vector<bool> occluded[2];
+	double shadowTimes[2];
+	for(int binary = 0; binary < 2; binary++)
+	{
+		occluded[binary].assign(hitPoints.size(), false);
+		start = getElapsedTime();
+		for(size_t i = 0; i < hitPoints.size(); i++)
 		{
-			bufferToDisplay = normalizeBuffer(context["d1_buffer"]->getBuffer());
-			alreadyShown = true;
+			const float3 toLight = lightSamples[i] - hitPoints[i];
+			const float distance = length(toLight);
+			RayHit hit;
+			occluded[binary][i] = binary ? bvh.occludedBinary(hitPoints[i], toLight / distance, epsilon, distance - epsilon, hit) :
+										   bvh.occluded(hitPoints[i], toLight / distance, epsilon, distance - epsilon, hit);
 		}
-		break;
+		shadowTimes[binary] = getElapsedTime() - start;
+	}
+	int numOccluded = 0, shadowMismatches = 0;
+	for(size_t i = 0; i < hitPoints.size(); i++)
+	{
+		numOccluded += occluded[0][i];
+		shadowMismatches += occluded[0][i] != occluded[1][i];
+	}
+	printf("Shadow rays: %.2f Mrays/s, binary BVH %.2f Mrays/s, %.2fx (%d of %d occluded, %d mismatches)\n", hitPoints.size() / shadowTimes[0] * 1e-6,
+		   hitPoints.size() / shadowTimes[1] * 1e-6, shadowTimes[1] / shadowTimes[0], numOccluded, (int)hitPoints.size(), shadowMismatches);
+}
+
+// Times every pass of a full frame with two variants of a setting, selected by
+// calling select with 0 and 1, and prints the speedup of the second
+void benchmarkPassVariants(int numRuns, const char *first, const char *second, std::function<void(int)> select)
+{
+	scene->animate = false;
+	std::map<std::string, double> times[2];
+	for(int variant = 0; variant < 2; variant++)
+	{
+		select(variant);
+		executePipeline(getSoftShadowOutputs());
+		pipeline.resetPassTimes();
 
-		case SHOW_D2_MIN:
+		// Touching the camera and light reruns every pass
+		for(int i = 0; i < numRuns; i++)
 		{
-			bufferToDisplay = normalizeBuffer(context["d2_min_buffer"]->getBuffer());
-			alreadyShown = true;
+			pipeline.touch("camera");
+			pipeline.touch("light");
+			executePipeline(getSoftShadowOutputs());
 		}
-		break;
+		for(const std::string &pass : pipeline.getPassNames()) times[variant][pass] = pipeline.getPassTime(pass);
+	}
+
+	printf("%-34s %10s %10s %8s\n", "Pass", first, second, "Speedup");
+	double total[2] = { 0.0, 0.0 };
+	for(const std::string &pass : pipeline.getPassNames())
+	{
+		if(times[0][pass] == 0.0 && times[1][pass] == 0.0) continue;
+		printf("%-34s %7.3f ms %7.3f ms %7.2fx\n", pass.c_str(), times[0][pass], times[1][pass], times[0][pass] / times[1][pass]);
+		total[0] += times[0][pass];
+		total[1] += times[1][pass];
+	}
+	printf("%-34s %7.3f ms %7.3f ms %7.2fx\n", "Total", total[0], total[1], total[0] / total[1]);
+}
+
+// Times every pass of a full frame with the row-major and the tiled layout
+void benchmarkPixelLayouts(int numRuns)
+{
+	const bool wasTiled = tiledLayout;
+	benchmarkPassVariants(numRuns, "Row-major", "Tiled", [](int tiled) { setTiledLayout(tiled != 0); });
+	setTiledLayout(wasTiled);
+}
+
+// Times the generic kernels against the ones specialized for the scene's light
+// count and the radius cap, for every radius cap up to SPECIALIZED_BLUR_RADII
+void benchmarkKernels(int numRuns)
+{
+	const bool wasSpecialized = specializedKernels;
+	const float radius = params.max_kernel_radius;
+	for(int r = 1; r <= SPECIALIZED_BLUR_RADII; r++)
+	{
+		printf("\nmax_kernel_radius %d, %d light(s), %d probes\n", r, getLightCount(), params.num_probes);
+		params.max_kernel_radius = float(r);
+		benchmarkPassVariants(numRuns, "Generic", "Specialized", [](int specialized) { specializedKernels = specialized != 0; });
+	}
+	params.max_kernel_radius = radius;
+	specializedKernels = wasSpecialized;
+}
 
-		case SHOW_D2_MAX:
+// Times every pass of a full frame launched over the screen against the pixel lists,
+// with the light scaled around its center, so the penumbrae cover more or less of it
+void benchmarkPixelLists(int numRuns)
+{
+	const bool wasCompacted = pixelCompaction;
+	const ParallelogramLight light = scene->getLight();
+	for(float scale : { 0.25f, 1.f, 4.f })
+	{
+		ParallelogramLight scaled = light;
+		scaled.v1 = light.v1 * scale;
+		scaled.v2 = light.v2 * scale;
+		scaled.corner = light.corner + (light.v1 + light.v2 - scaled.v1 - scaled.v2) * 0.5f;
+		scene->setLight(scaled);
+		scene->updateOccluders();
+		pipeline.touch("light");
+
+		pixelCompaction = true;
+		updatePixelCompaction();
+		executePipeline(getSoftShadowOutputs());
+		const unsigned *starts = pixelListStarts;
+		printf("\nLight scaled by %.2f: %.1f%% penumbra, %.1f%% umbra pixels\n", scale,
+			   100.0 * (starts[UMBRA_PIXELS] - starts[PENUMBRA_PIXELS]) / std::max(starts[NUM_PIXEL_CLASSES], 1u),
+			   100.0 * (starts[LIT_PIXELS] - starts[UMBRA_PIXELS]) / std::max(starts[NUM_PIXEL_CLASSES], 1u));
+		benchmarkPassVariants(numRuns, "Screen", "Lists", [](int compacted)
 		{
-			bufferToDisplay = normalizeBuffer(context["d2_max_buffer"]->getBuffer());
-			alreadyShown = true;
-		}
-		break;
+			pixelCompaction = compacted != 0;
+			updatePixelCompaction();
+		});
+	}
+	scene->setLight(light);
+	scene->updateOccluders();
+	pipeline.touch("light");
+	pixelCompaction = wasCompacted;
+	updatePixelCompaction();
+}
 
-		case SHOW_BETA:
+//--------------------------------------------------------------
+// Scaling benchmarks
+//--------------------------------------------------------------
+
+// Prints what the scattered scene costs and appends it as a row to the csv file:
+// the time until the scene's objects exist and the time to validate and build the
+// acceleration structures (both including the fixed cost of compiling the kernels),
+// the memory used and the average time of a frame
+void reportScaling(int numInstances, const std::string &csvFilename, const TaskGraph &startup, RTsize availableBefore)
+{
+	scene->animate = false;
+	const double loadTime = startup.getEndTime(startup.getTask("create geometry group"));
+	const TaskGraph::Task buildTask = startup.getTask("validate and build acceleration");
+	const double buildTime = startup.getEndTime(buildTask) - startup.getStartTime(buildTask);
+
+	// Touching the camera and light reruns every pass
+	const int numFrames = 10;
+	executePipeline(getSoftShadowOutputs());
+	const double start = getElapsedTime();
+	for(int i = 0; i < numFrames; i++)
+	{
+		pipeline.touch("camera");
+		pipeline.touch("light");
+		executePipeline(getSoftShadowOutputs());
+	}
+	const double frameTime = 1000.0 * (getElapsedTime() - start) / numFrames;
+
+	const int device = context->getEnabledDevices()[0];
+	const double deviceMemory = double(availableBefore - context->getAvailableDeviceMemory(device)) / (1024.0 * 1024.0);
+	const double hostMemory = double(context->getUsedHostMemory()) / (1024.0 * 1024.0);
+	printf("%d instances: load %.1f ms, build %.1f ms, %.1f MB device, %.1f MB host, %.2f ms per frame\n",
+		   numInstances, loadTime, buildTime, deviceMemory, hostMemory, frameTime);
+
+	FILE *file = fopen(csvFilename.c_str(), "a");
+	if(!file) throw Exception("Could not open " + csvFilename);
+	fprintf(file, "%d,%.1f,%.1f,%.1f,%.1f,%.2f\n", numInstances, loadTime, buildTime, deviceMemory, hostMemory, frameTime);
+	fclose(file);
+}
+
+// Runs this program once per instance count, so every count starts from a fresh
+// context, and collects a row from each run. Runs that fail, e.g. by running out
+// of memory, get a row too. Runs before the context exists, so errors are printed.
+bool runScalingSweep(const char *program, const std::vector<int> &counts, unsigned seed, const std::string &csvFilename)
+{
+	FILE *file = fopen(csvFilename.c_str(), "w");
+	if(!file)
+	{
+		printf("Could not open %s\n", csvFilename.c_str());
+		return false;
+	}
+	fprintf(file, "instances,load_ms,build_ms,device_mb,host_mb,frame_ms\n");
+	fclose(file);
+
+	for(int count : counts)
+	{
+		std::string command = std::string("\"") + program + "\" --scatter " + std::to_string(count) + " --seed " + std::to_string(seed) + " --scaling-row \"" + csvFilename + "\"";
+		printf("%s\n", command.c_str());
+#ifdef _WIN32
+		command = "\"" + command + "\""; // cmd strips the outer quotes
+#endif
+		if(std::system(command.c_str()) != 0)
 		{
-			bufferToDisplay = normalizeBuffer(context["beta_buffer"]->getBuffer());
-			alreadyShown = true;
+			file = fopen(csvFilename.c_str(), "a");
+			if(!file) return false;
+			fprintf(file, "%d,failed,,,,\n", count);
+			fclose(file);
 		}
-		break;
+	}
+	printf("Saved %s\n", csvFilename.c_str());
+	return true;
+}
 
-		case SHOW_NUM_SAMPLES:
+// Renders the ground truth of the current view with the farm, once with this process
+// alone and once each with 1, 2 and 4 worker processes on this machine, and prints
+// how the time scales. Workers get the scene options, so they render the same image.
+void benchmarkGroundTruthFarm(const char *program, const std::string &sceneOptions, unsigned short port)
+{
+	scene->animate = false;
+	const GroundTruthJob job = getGroundTruthJob(getReferenceKey());
+	const std::string progressFilename = std::string(referenceDirectory) + "/farm benchmark.partial";
+	if(!createDirectory(referenceDirectory)) printf("Could not create %s, the progress file can't be written\n", referenceDirectory);
+
+	const int workerCounts[] = { 0, 1, 2, 4 };
+	double times[4];
+	for(int i = 0; i < 4; i++)
+	{
+		const int numWorkers = workerCounts[i];
+		std::unique_ptr<GroundTruthFarm> farm(new GroundTruthFarm(port, 300.0));
+		std::vector<std::thread> workers;
+		for(int j = 0; j < numWorkers; j++)
 		{
-			bufferToDisplay = normalizeBuffer(context["num_samples_buffer"]->getBuffer());
-			alreadyShown = true;
+			std::string command = std::string("\"") + program + "\" --gt-worker 127.0.0.1:" + std::to_string(port) + sceneOptions;
+#ifdef _WIN32
+			command = "\"" + command + "\""; // cmd strips the outer quotes
+#endif
+			workers.push_back(std::thread([command]() { std::system(command.c_str()); }));
 		}
-		break;
 
-		default:
-			bufferToDisplay = context["diffuse_buffer"]->getBuffer();
-			break;
+		// Time the rendering only, not the workers starting up
+		if(!farm->waitForWorkers(numWorkers, 300.0)) printf("Not all %d workers connected\n", numWorkers);
+		remove(progressFilename.c_str());
+		std::vector<float3> pixels;
+		const double start = getElapsedTime();
+		farm->render(job, renderGroundTruthUnit, progressFilename, pixels);
+		times[i] = getElapsedTime() - start;
+
+		// Workers exit when the farm closes their connections
+		farm.reset();
+		for(std::thread &worker : workers) worker.join();
 	}
 
-	if(generateDifferenceMap)
-	{
-		// Render ground truth image
-		context->launch(GROUND_TRUTH_PROGRAM, width, height);
-		
-		// Calculate differences between ground truth and filtered image
-		context->launch(DIFFERENCE_PROGRAM, width, height);
-		
-		// Save all three images
-		std::string timeStamp = getTimeStamp();
-		sutil::displayBufferPPM(("screenshots/" + timeStamp + " filtered.ppm").c_str(), context["blur_v_buffer"]->getBuffer());
-		sutil::displayBufferPPM(("screenshots/" + timeStamp + " ground_truth.ppm").c_str(), context["diffuse_buffer"]->getBuffer());
-		sutil::displayBufferPPM(("screenshots/" + timeStamp + " difference.ppm").c_str(), context["difference_buffer"]->getBuffer());
+	printf("%-8s %10s %8s\n", "Workers", "Time", "Speedup");
+	for(int i = 0; i < 4; i++) printf("%-8d %8.1f s %7.2fx\n", workerCounts[i], times[i], times[0] / times[i]);
+}
 
-		// Toggle difference generation
-		generateDifferenceMap = false;
-	}
-	else
+//--------------------------------------------------------------
+// Render service
+//--------------------------------------------------------------
+
+// Requests with equal keys share the camera and light, and so the G-buffer
+std::vector<float> getViewKey(const RenderRequest &request)
+{
+	const CameraSnapshot &view = request.camera;
+	const float3 &corner = request.lightCorner;
+	return { view.position.x, view.position.y, view.position.z, view.pitch, view.yaw,
+			 request.hasLight ? 1.f : 0.f, corner.x, corner.y, corner.z };
+}
+
+// Target rendered for a requested output
+std::string getRequestTarget(const std::string &output)
+{
+	if(output == "filtered") return "blur_v";
+	if(output == "ground_truth" || output == "ground truth") return "ground_truth";
+	return output;
+}
+
+// Answers render requests until a client asks the service to shut down.
+// Everything queued while a batch renders forms the next batch, which is
+// sorted by view so requests for the same camera and light run one plan:
+// their targets share the G-buffer and every pass runs at most once.
+// Targets render at the native resolution and are resampled to the
+// requested size.
+void runRenderService(unsigned short port)
+{
+	RenderService service(port);
+	printf("Render service listening on 127.0.0.1:%u\n", port);
+	scene->animate = false;
+	const ParallelogramLight defaultLight = scene->getLight();
+
+	while(!service.isStopping())
 	{
-		// Show buffer
-		if(!alreadyShown)
+		std::vector<RenderRequest> requests = service.waitForRequests(0.5);
+		if(requests.empty()) continue;
+		std::stable_sort(requests.begin(), requests.end(), [](const RenderRequest &a, const RenderRequest &b)
+		{
+			return getViewKey(a) < getViewKey(b);
+		});
+
+		int numGroups = 0;
+		for(size_t first = 0, last; first < requests.size(); first = last)
 		{
-			sutil::displayBufferGL(bufferToDisplay);
+			const std::vector<float> key = getViewKey(requests[first]);
+			for(last = first + 1; last < requests.size() && getViewKey(requests[last]) == key; last++);
+			numGroups++;
+
+			// Unknown outputs are answered right away, the others are rendered together
+			Pipeline::Names outputs;
+			std::vector<const RenderRequest*> group;
+			for(size_t i = first; i < last; i++)
+			{
+				const std::string target = getRequestTarget(requests[i].output);
+				if(!pipeline.hasTarget(target))
+				{
+					service.respondError(requests[i], "unknown output '" + requests[i].output + "'");
+					continue;
+				}
+				if(std::find(outputs.begin(), outputs.end(), target) == outputs.end()) outputs.push_back(target);
+				group.push_back(&requests[i]);
+			}
+			if(group.empty()) continue;
+
+			try
+			{
+				const RenderRequest &view = *group.front();
+				updateCamera(view.camera);
+				ParallelogramLight light = defaultLight;
+				if(view.hasLight) light.corner = view.lightCorner;
+				if(memcmp(&light, &scene->getLight(), sizeof(light)) != 0)
+				{
+					scene->setLight(light);
+					scene->updateOccluders();
+				}
+				pipeline.setSourceState("light", &light, sizeof(light));
+				executePipeline(outputs);
+			}
+			catch(const std::exception &e)
+			{
+				for(const RenderRequest *request : group) service.respondError(*request, e.what());
+				continue;
+			}
+
+			for(const RenderRequest *request : group)
+			{
+				Buffer buffer = pipeline.getBuffer(getRequestTarget(request->output));
+				RTsize bufferWidth, bufferHeight;
+				buffer->getSize(bufferWidth, bufferHeight);
+				const unsigned channels = (unsigned)(buffer->getElementSize() / sizeof(float));
+				std::vector<float> pixels(bufferWidth * bufferHeight * channels);
+				readPixels(buffer, pixels.data());
+
+				const unsigned w = request->width ? request->width : width;
+				const unsigned h = request->height ? request->height : height;
+				if(w == bufferWidth && h == bufferHeight)
+				{
+					service.respond(*request, request->output, w, h, channels, pixels);
+					continue;
+				}
+				std::vector<float> resampled(w * h * channels);
+				resamplePixels(pixels.data(), (unsigned)bufferWidth, (unsigned)bufferHeight, channels, resampled.data(), w, h);
+				service.respond(*request, request->output, w, h, channels, resampled);
+			}
 		}
+		service.recordBatch((int)requests.size(), numGroups);
 	}
 
-	std::string stateName = "MISSING";
-	switch(state)
+	printf("%s\n", service.getStats().c_str());
+	pipeline.printReuseStats();
+}
+
+//--------------------------------------------------------------
+// Parameter tuning
+//--------------------------------------------------------------
+
+std::string getPresetFilename()
+{
+	return std::string(presetDirectory) + "/" + scene->getName() + ".txt";
+}
+
+// Searches for the parameters that reach the target error against the ground
+// truth with the fewest shadow rays, and saves them as the scene's preset.
+// A negative target uses the error of the current parameters.
+void tuneScene(double targetError, int maxEvaluations)
+{
+	scene->animate = false;
+	executePipeline(Pipeline::Names(1, "ground_truth"));
+	const std::vector<float3> groundTruth = readBuffer<float3>(pipeline.getBuffer("ground_truth"));
+
+	EvaluateFunc evaluate = [&](const SoftShadowParameters &candidate, double &numRays, double &error)
 	{
-		case DEFAULT: stateName = "Soft Shadows"; break;
-		case SHOW_DIFFUSE: stateName = "Diffuse"; break;
-		case SHOW_H_BLUR: stateName = "Blur H"; break;
-		case SHOW_V_BLUR: stateName = "Blur V"; break;
-		case SHOW_D1: stateName = "d1"; break;
-		case SHOW_D2_MIN: stateName = "d2 min"; break;
-		case SHOW_D2_MAX: stateName = "d2 max"; break;
-		case SHOW_BETA: stateName = "Beta"; break;
-		case SHOW_NUM_SAMPLES: stateName = "Num Samples"; break;
-	}
+		params = candidate;
+		executePipeline(getSoftShadowOutputs());
+		error = getMeanSquaredError(readBuffer<float3>(pipeline.getBuffer("blur_v")), groundTruth);
 
-	if(saveScreenshot) 
+		double numSaved;
+		getShadowRayCounts(numRays, numSaved);
+	};
+
+	if(targetError < 0.0)
 	{
-		std::string timeStamp = getTimeStamp();
-		sutil::displayBufferPPM(("screenshots/" + timeStamp + " " + stateName + ".ppm").c_str(), bufferToDisplay);
-		saveScreenshot = false;
+		double numRays;
+		evaluate(params, numRays, targetError);
 	}
 
-	// Display world info
-	static unsigned frame_count = 0;
-	sutil::displayFps(frame_count++);
-
-	std::vector<std::string> topLeftInfo;
-	topLeftInfo.push_back(stateName);
-	topLeftInfo.push_back("Yaw: " + std::to_string(camera.yaw));
-	topLeftInfo.push_back("Pitch: " + std::to_string(camera.pitch));
-	topLeftInfo.push_back("Position: [" + std::to_string(camera.position.x) + ", " + std::to_string(camera.position.y) + ", " + std::to_string(camera.position.z) + "]");
-	drawStrings(topLeftInfo, 10, height - 15, 0, -20);
+	TuningResult result = tuneParameters(params, targetError, maxEvaluations, evaluate);
+	params = result.params;
 
-	std::vector<std::string> topRightInfo;
-	topRightInfo.push_back("WASD: Move");
-	topRightInfo.push_back("QE: Up/Down");
-	topRightInfo.push_back("P: Pause Animations");
-	topRightInfo.push_back("M: Toggle Menus");
-	topRightInfo.push_back("O: Generate Diff. Map");
-	topRightInfo.push_back("C: Capture Screen");
-	topRightInfo.push_back("1/2: Prev/Next State");
-	drawStrings(topRightInfo, width - 200, height - 15, 0, -20);
+	printf("Best parameters after %d evaluations (%.0f shadow rays, error %g):\n", result.numEvaluations, result.numRays, result.error);
+	printParameters(params);
 
-	glutSwapBuffers();
-	context->validate();
+	const std::string comment = std::string("Tuned for scene '") + scene->getName() + "' with target error " + std::to_string(targetError) +
+		" (" + std::to_string((long long)result.numRays) + " shadow rays, error " + std::to_string(result.error) + ")";
+	if(createDirectory(presetDirectory) && savePreset(getPresetFilename(), params, comment))
+	{
+		printf("Saved preset %s\n", getPresetFilename().c_str());
+	}
+	else
+	{
+		printf("Could not save preset %s\n", getPresetFilename().c_str());
+	}
 }
 
 //--------------------------------------------------------------
@@ -358,34 +1633,50 @@ void setupCamera()
 	camera.yaw = 1.5f;
 }
 
-void updateCamera()
+float3 getCameraForward(const CameraSnapshot &snapshot)
 {
-	const float vfov = 60.0f;
-	const float aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
-
-	float3 fwd = make_float3(
-		cos(camera.pitch) * cos(camera.yaw),
-		sin(camera.pitch),
-		cos(camera.pitch) * sin(camera.yaw)
+	return make_float3(
+		cos(snapshot.pitch) * cos(snapshot.yaw),
+		sin(snapshot.pitch),
+		cos(snapshot.pitch) * sin(snapshot.yaw)
 	);
+}
 
+// Moves the camera relative to the direction it is facing. Runs on the UI thread.
+void moveCamera(float dt)
+{
+	float3 fwd = getCameraForward(camera);
 	float3 right = normalize(cross(make_float3(0.0f, 1.0f, 0.0f), fwd));
 	float3 up = cross(fwd, right);
 
-	// Move the camera relative to the direction it is facing
-	camera.position += right * float((actionState[MOVE_LEFT] - actionState[MOVE_RIGHT]) * move_speed);
-	camera.position += up * float((actionState[MOVE_UP] - actionState[MOVE_DOWN]) * move_speed);
-	camera.position += fwd * float((actionState[MOVE_FORWARD] - actionState[MOVE_BACKWARD]) * move_speed);
+	const float distance = move_speed * dt;
+	camera.position += right * float((actionState[MOVE_LEFT] - actionState[MOVE_RIGHT]) * distance);
+	camera.position += up * float((actionState[MOVE_UP] - actionState[MOVE_DOWN]) * distance);
+	camera.position += fwd * float((actionState[MOVE_FORWARD] - actionState[MOVE_BACKWARD]) * distance);
+}
+
+void getCameraBasis(const CameraSnapshot &snapshot, float3 &camera_u, float3 &camera_v, float3 &camera_w)
+{
+	const float vfov = 60.0f;
+	const float aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
 
-	float3 camera_lookat = camera.position + fwd;
+	float3 camera_lookat = snapshot.position + getCameraForward(snapshot);
 
-	float3 camera_u, camera_v, camera_w;
 	sutil::calculateCameraVariables(
-		camera.position, camera_lookat, make_float3(0.0f, 1.0f, 0.0f),
+		snapshot.position, camera_lookat, make_float3(0.0f, 1.0f, 0.0f),
 		vfov, aspect_ratio,
 		camera_u, camera_v, camera_w, true);
+}
+
+// Sets the camera variables of the context
+void updateCamera(const CameraSnapshot &snapshot)
+{
+	float3 camera_u, camera_v, camera_w;
+	getCameraBasis(snapshot, camera_u, camera_v, camera_w);
 
-	context["eye"]->setFloat(camera.position);
+	context["eye"]->setFloat(snapshot.position);
+	const float cameraState[] = { snapshot.position.x, snapshot.position.y, snapshot.position.z, snapshot.pitch, snapshot.yaw };
+	pipeline.setSourceState("camera", cameraState, sizeof(cameraState));
 	context["U"]->setFloat(camera_u);
 	context["V"]->setFloat(camera_v);
 	context["W"]->setFloat(camera_w);
@@ -436,6 +1727,7 @@ void glutKeyboardPress(unsigned char k, int, int)
 
 void glutKeyboardUp(unsigned char k, int, int)
 {
+	std::lock_guard<std::mutex> lock(settingsMutex);
 	switch( k )
 	{
 	case 'w': actionState[MOVE_FORWARD] = false; break;
@@ -444,13 +1736,313 @@ void glutKeyboardUp(unsigned char k, int, int)
 	case 'd': actionState[MOVE_RIGHT] = false; break;
 	case 'q': actionState[MOVE_UP] = false; break;
 	case 'e': actionState[MOVE_DOWN] = false; break;
-	case 'p': scene->animate = !scene->animate; break;
+	case 'p': settings.animate = !settings.animate; break;
 	case 'm': showMenus = !showMenus; break;
-	case 'o': generateDifferenceMap = true; break;
-	case 'c': saveScreenshot = true; break;
-	case '2': state = State((state + 1) % NUM_STATES); break;
-	case '1': state = State((state - 1 + NUM_STATES) % NUM_STATES); break;
+	case 'o': settings.generateDifferenceMap = true; break;
+	case 'c': settings.saveScreenshot = true; break;
+	case 'f': settings.filterBackend = FilterBackend((settings.filterBackend + 1) % NUM_FILTER_BACKENDS); break;
+	case 'g': settings.printPlan = true; break;
+	case 'b': settings.useBlockerMap = !settings.useBlockerMap; break;
+	case 'v': settings.useVisibilityCache = !settings.useVisibilityCache; break;
+	case 'k': settings.occluderCulling = !settings.occluderCulling; break;
+	case 'l': settings.pixelCompaction = !settings.pixelCompaction; break;
+	case 'r': settings.progressiveRefinement = !settings.progressiveRefinement; break;
+	case '2': settings.state = State((settings.state + 1) % NUM_STATES); break;
+	case '1': settings.state = State((settings.state - 1 + NUM_STATES) % NUM_STATES); break;
+	case '+': settings.params.early_out_confidence = std::min(settings.params.early_out_confidence + 0.05f, 1.05f); break;
+	case '-': settings.params.early_out_confidence = std::max(settings.params.early_out_confidence - 0.05f, 0.f); break;
+	}
+}
+
+//--------------------------------------------------------------
+// Pipeline
+//--------------------------------------------------------------
+
+// Declares a cascade of box filters along one axis
+void addBoxBlurPasses(const std::string &name, bool horizontal, const std::string &input, const std::string &output)
+{
+	// Ping-pong between the output and a temporary target
+	const std::string sources[] = { input, output, "box_temp" };
+	const std::string targets[] = { output, "box_temp", output };
+	for(int i = 0; i < 3; i++)
+	{
+		const std::string pass = name + " " + std::to_string(i + 1);
+		pipeline.addLaunchPass(pass + " prefix sum", horizontal ? BOX_PREFIX_SUM_H_PROGRAM : BOX_PREFIX_SUM_V_PROGRAM,
+							   { sources[i], "object_id", "geometry_normal" }, { "sat", "segment" },
+							   { { "box_input_buffer", sources[i] } },
+							   horizontal ? 1 : width, horizontal ? height : 1);
+		pipeline.addLaunchPass(pass, horizontal ? BOX_BLUR_H_PROGRAM : BOX_BLUR_V_PROGRAM,
+							   { sources[i], "beta", "projected_distances", "sat", "segment" }, { targets[i] },
+							   { { "box_input_buffer", sources[i] }, { "box_output_buffer", targets[i] } });
+	}
+}
+
+// Renders the blocker map from the center of the light. The scenes' lights face away
+// from their normal. The nearest surface found then bounds the blocker search. The map
+// is searched for it on the thread pool (see Pipeline::addStagedPass).
+BlockerMapFrame blockerMapFrame;
+std::vector<float2> blockerMapDepths;
+
+void renderBlockerMap()
+{
+	const ParallelogramLight &light = scene->getLight();
+	BlockerMapFrame &frame = blockerMapFrame;
+	frame.origin = light.corner + (light.v1 + light.v2) * 0.5f;
+	frame.w = -light.normal;
+	frame.u = normalize(light.v1);
+	frame.v = cross(frame.w, frame.u);
+	frame.tan_half_fov = tanf(blockerMapFov * 0.5f * M_PIf / 180.f);
+	frame.light_radius = 0.5f * length(light.v1 + light.v2);
+	frame.near = frame.light_radius;
+	context["blocker_map_frame"]->setUserData(sizeof(frame), &frame);
+	context->launch(BLOCKER_MAP_PROGRAM, blockerMapSize, blockerMapSize);
+	blockerMapDepths = readBuffer<float2>(pipeline.getBuffer("blocker_map"));
+}
+
+void findNearestBlocker()
+{
+	BlockerMapFrame &frame = blockerMapFrame;
+	float nearest = FLT_MAX;
+	for(int y = 0; y < blockerMapSize; y++)
+	{
+		for(int x = 0; x < blockerMapSize; x++)
+		{
+			const float depth = blockerMapDepths[y * blockerMapSize + x].x;
+			if(depth <= 0.f) continue;
+			const float2 uv = (make_float2(float(x), float(y)) + 0.5f) / float(blockerMapSize) * 2.f - 1.f;
+			nearest = std::min(nearest, depth / sqrtf(1.f + dot(uv, uv) * frame.tan_half_fov * frame.tan_half_fov));
+		}
+	}
+	if(nearest < FLT_MAX) frame.near = std::max(nearest, 1.f);
+}
+
+// Fills the distances of the unoccluded pixels with a pull-push pyramid (see distance_fill.cu).
+// Level 1 is packed into the top left of the pyramid buffer and the coarser levels in a row
+// below it, which always fits into the screen's size.
+void fillDistances()
+{
+	std::vector<PyramidLevel> levels(1);
+	levels[0].offset = make_uint2(0, 0);
+	levels[0].size = make_uint2((uint)pipeline.getRenderWidth(), (uint)pipeline.getRenderHeight());
+	levels[0].index = 0;
+	uint2 offset = make_uint2(0, 0);
+	while(levels.back().size.x > 1 || levels.back().size.y > 1)
+	{
+		PyramidLevel level;
+		level.index = (uint)levels.size();
+		level.size = make_uint2((levels.back().size.x + 1) / 2, (levels.back().size.y + 1) / 2);
+		level.offset = offset;
+		offset = level.index == 1 ? make_uint2(0, level.size.y) : make_uint2(offset.x + level.size.x, offset.y);
+		levels.push_back(level);
+	}
+
+	// Pull from the finest level up, then push from the coarsest level down
+	for(size_t i = 1; i < levels.size(); i++)
+	{
+		context["fine_level"]->setUserData(sizeof(PyramidLevel), &levels[i - 1]);
+		context["coarse_level"]->setUserData(sizeof(PyramidLevel), &levels[i]);
+		context->launch(PULL_DISTANCES_PROGRAM, levels[i].size.x, levels[i].size.y);
+	}
+	for(size_t i = levels.size() - 1; i > 0; i--)
+	{
+		context["fine_level"]->setUserData(sizeof(PyramidLevel), &levels[i - 1]);
+		context["coarse_level"]->setUserData(sizeof(PyramidLevel), &levels[i]);
+		context->launch(PUSH_DISTANCES_PROGRAM, levels[i - 1].size.x, levels[i - 1].size.y);
+	}
+}
+
+// Sorts the pixels into the pixel lists (see pixel_compaction.cu). The tiles are
+// counted, the counts are scanned up to a single group of PIXEL_SCAN_GROUP and back
+// down, and each tile writes its pixels from the first entries it was given. Only
+// the first entry of each class is read back.
+void compactPixels()
+{
+	const unsigned tilesX = (unsigned)pipeline.getRenderWidth() / PIXEL_TILE_SIZE, tilesY = (unsigned)pipeline.getRenderHeight() / PIXEL_TILE_SIZE;
+	std::vector<unsigned> offsets(1, 0), sizes(1, tilesX * tilesY);
+	while(sizes.back() > PIXEL_SCAN_GROUP)
+	{
+		offsets.push_back(offsets.back() + sizes.back());
+		sizes.push_back((sizes.back() + PIXEL_SCAN_GROUP - 1) / PIXEL_SCAN_GROUP);
+	}
+	RTsize scanSize;
+	pixelScanBuffer->getSize(scanSize);
+	if(offsets.back() + sizes.back() > scanSize) pixelScanBuffer->setSize(offsets.back() + sizes.back());
+
+	const size_t top = sizes.size() - 1;
+	context->launch(COUNT_PIXEL_CLASSES_PROGRAM, tilesX, tilesY);
+	for(size_t i = 0; i < top; i++)
+	{
+		context["pixel_scan_level"]->setUint(offsets[i], sizes[i], offsets[i + 1]);
+		context->launch(SCAN_PIXEL_GROUPS_PROGRAM, sizes[i + 1]);
+	}
+	context["pixel_scan_level"]->setUint(offsets[top], sizes[top], 0u);
+	context->launch(SCAN_PIXEL_CLASSES_PROGRAM, 1);
+	for(size_t i = top; i-- > 0;)
+	{
+		context["pixel_scan_level"]->setUint(offsets[i], sizes[i], offsets[i + 1]);
+		context->launch(ADD_PIXEL_GROUP_STARTS_PROGRAM, sizes[i]);
+	}
+	context->launch(COMPACT_PIXELS_PROGRAM, tilesX, tilesY);
+
+	// The launches over the lists are sized by the classes' counts
+	memcpy(pixelListStarts, pixelListStartsBuffer->map(), sizeof(pixelListStarts));
+	pixelListStartsBuffer->unmap();
+}
+
+// Launches an entry point over the pixels of the classes first to last, which follow each other in the list
+void launchPixelList(unsigned entryPoint, PixelClass first, PixelClass last)
+{
+	const unsigned count = pixelListStarts[last + 1] - pixelListStarts[first];
+	if(count == 0) return;
+	context["pixel_list_offset"]->setInt((int)pixelListStarts[first]);
+	context->launch(entryPoint, count);
+	context["pixel_list_offset"]->setInt(-1);
+}
+
+void setupPipeline()
+{
+	pipeline.setThreadPool(&threadPool);
+
+	// State the passes depend on, updated before every frame
+	pipeline.addSource("camera");
+	pipeline.addSource("light");
+	pipeline.addSource("geometry");
+	pipeline.addSource("parameters");
+	pipeline.addSource("visibility cache"); // Touched when it is enabled or disabled, not when it fills
+	pipeline.addSource("frame"); // Of the progressive refinement, selects the seeds
+
+	// Render targets. The primary hits are kept, so they are reused while only the light moves.
+	pipeline.addTarget("albedo", RT_FORMAT_FLOAT3, true);
+	pipeline.addTarget("geometry_hit", RT_FORMAT_FLOAT3, true);
+	pipeline.addTarget("geometry_normal", RT_FORMAT_FLOAT3, true);
+	pipeline.addTarget("ffnormal", RT_FORMAT_FLOAT3, true);
+	pipeline.addTarget("object_id", RT_FORMAT_FLOAT, true);
+	pipeline.addTarget("diffuse", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("projected_distances", RT_FORMAT_FLOAT2);
+	pipeline.addTarget("probe", RT_FORMAT_FLOAT4);
+	pipeline.addTarget("num_samples", RT_FORMAT_FLOAT);
+	pipeline.addTarget("saved_samples", RT_FORMAT_FLOAT);
+	pipeline.addTarget("d1", RT_FORMAT_FLOAT);
+	pipeline.addTarget("d2_min", RT_FORMAT_FLOAT);
+	pipeline.addTarget("d2_max", RT_FORMAT_FLOAT);
+	pipeline.addTarget("beta", RT_FORMAT_FLOAT);
+	pipeline.addTarget("blur_h", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("blur_v", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("blur_v_only", RT_FORMAT_FLOAT3); // Vertical blur of the unfiltered image
+	pipeline.addTarget("sat", RT_FORMAT_FLOAT4);
+	pipeline.addTarget("segment", RT_FORMAT_FLOAT2);
+	pipeline.addTarget("box_temp", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("d1_heatmap", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("d2_min_heatmap", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("d2_max_heatmap", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("beta_heatmap", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("num_samples_heatmap", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("ground_truth", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("difference", RT_FORMAT_FLOAT3);
+	pipeline.addTarget("blocker_map", RT_FORMAT_FLOAT2, true, blockerMapSize, blockerMapSize);
+	pipeline.addTarget("distance_pyramid", RT_FORMAT_FLOAT4); // Coarser levels of the distance fill
+	pipeline.addTarget("pixel_list", RT_FORMAT_UNSIGNED_INT, true); // Persistent, so it always matches pixelListStarts
+	pipeline.addTarget("probe_statistics", RT_FORMAT_UNSIGNED_INT, false, NUM_PROBE_STATISTICS, PROBE_STATISTICS_SLOTS);
+
+	// Soft shadow sampling
+	pipeline.addLaunchPass("trace primary rays", GEOMETRY_HIT_PROGRAM,
+						   { "camera", "geometry" }, { "albedo", "object_id", "geometry_hit", "geometry_normal", "ffnormal" });
+	pipeline.beginGroup("probe distances");
+	pipeline.addSelectedLaunchPass("sample distances", []() { return getSampleDistancesProgram(false); },
+						   { "light", "geometry", "parameters", "visibility cache", "frame", "albedo", "object_id", "geometry_hit", "ffnormal" },
+						   { "diffuse", "projected_distances", "probe", "num_samples", "saved_samples", "d1", "d2_min", "d2_max" });
+	pipeline.endGroup();
+
+	// Alternatively bound the occluder distances with the blocker map, which is kept until the light or geometry changes
+	pipeline.beginGroup("blocker map");
+	pipeline.addStagedPass("build blocker map", renderBlockerMap, findNearestBlocker, []()
+	{
+		context["blocker_map_frame"]->setUserData(sizeof(blockerMapFrame), &blockerMapFrame);
+	}, { "light", "geometry" }, { "blocker_map" });
+	pipeline.addSelectedLaunchPass("sample distances with blocker map", []() { return getSampleDistancesProgram(true); },
+						   { "light", "geometry", "parameters", "visibility cache", "frame", "albedo", "object_id", "geometry_hit", "ffnormal", "blocker_map" },
+						   { "diffuse", "projected_distances", "probe", "num_samples", "saved_samples", "d1", "d2_min", "d2_max" });
+	pipeline.endGroup();
+	updateDistanceSampling();
+	pipeline.beginGroup("full screen");
+	pipeline.addSelectedLaunchPass("adaptive sampling", getAdaptiveSamplingProgram,
+						   { "light", "geometry", "parameters", "visibility cache", "frame", "albedo", "diffuse", "object_id", "geometry_hit", "ffnormal", "probe", "num_samples", "saved_samples", "d1", "d2_min", "d2_max" },
+						   { "diffuse", "num_samples", "saved_samples", "d2_min", "d2_max" });
+	pipeline.endGroup();
+
+	// Alternatively sort the pixels by class after the probes, and sample only the occluded ones.
+	// The compaction pass sets the beta of the background pixels.
+	pipeline.beginGroup("pixel lists");
+	pipeline.addPass("compact pixels", compactPixels, { "parameters", "object_id", "probe", "d2_max" }, { "pixel_list", "beta" });
+	pipeline.addPass("adaptive sampling (pixel lists)", []() { launchPixelList(getAdaptiveSamplingProgram(), PENUMBRA_PIXELS, UMBRA_PIXELS); },
+						   { "light", "geometry", "parameters", "visibility cache", "frame", "albedo", "diffuse", "object_id", "geometry_hit", "ffnormal", "probe", "num_samples", "saved_samples", "d1", "d2_min", "d2_max", "pixel_list" },
+						   { "diffuse", "num_samples", "saved_samples", "d2_min", "d2_max" });
+	pipeline.endGroup();
+	pipeline.addPass("fill distances", fillDistances, { "object_id", "d1", "d2_max" }, { "d1", "d2_max", "distance_pyramid" });
+	pipeline.beginGroup("full screen");
+	pipeline.addLaunchPass("calculate beta", CALCULATE_BETA_PROGRAM, { "parameters", "object_id", "geometry_hit", "d1", "d2_max" }, { "beta" });
+	pipeline.endGroup();
+	pipeline.beginGroup("pixel lists");
+	pipeline.addPass("calculate beta (pixel lists)", []() { launchPixelList(CALCULATE_BETA_PROGRAM, PENUMBRA_PIXELS, LIT_PIXELS); },
+						   { "parameters", "object_id", "geometry_hit", "d1", "d2_max", "pixel_list", "beta" }, { "beta" });
+	pipeline.endGroup();
+	updatePixelCompaction();
+
+	// Probe statistics of the governor, summed over 8x8 tiles
+	pipeline.addPass("probe statistics", []()
+	{
+		context->launch(CLEAR_PROBE_STATISTICS_PROGRAM, NUM_PROBE_STATISTICS, PROBE_STATISTICS_SLOTS);
+		context->launch(REDUCE_PROBE_STATISTICS_PROGRAM, pipeline.getRenderWidth() / PIXEL_TILE_SIZE, pipeline.getRenderHeight() / PIXEL_TILE_SIZE);
+	}, { "parameters", "object_id", "probe", "num_samples" }, { "probe_statistics" });
+
+	// Gaussian blur
+	pipeline.beginGroup("gaussian");
+	pipeline.addSelectedLaunchPass("gaussian blur h", []() { return getGaussianBlurProgram(false); },
+						   { "parameters", "diffuse", "beta", "object_id", "projected_distances", "geometry_normal" }, { "blur_h" });
+	pipeline.addSelectedLaunchPass("gaussian blur v", []() { return getGaussianBlurProgram(true); },
+						   { "parameters", "blur_h", "diffuse", "beta", "object_id", "projected_distances", "geometry_normal" }, { "blur_v" });
+	pipeline.addSelectedLaunchPass("gaussian blur v only", []() { return getGaussianBlurProgram(true); },
+						   { "parameters", "diffuse", "beta", "object_id", "projected_distances", "geometry_normal" }, { "blur_v_only" },
+						   { { "blur_h_buffer", "diffuse" }, { "blur_v_buffer", "blur_v_only" } });
+	pipeline.endGroup();
+
+	// Box filter cascades
+	pipeline.beginGroup("box");
+	addBoxBlurPasses("box blur h", true, "diffuse", "blur_h");
+	addBoxBlurPasses("box blur v", false, "blur_h", "blur_v");
+	addBoxBlurPasses("box blur v only", false, "diffuse", "blur_v_only");
+	pipeline.endGroup();
+	updateFilterBackend();
+
+	// Heatmaps of the intermediate buffers
+	const char *heatmapTargets[] = { "d1", "d2_min", "d2_max", "beta", "num_samples" };
+	for(const char *target : heatmapTargets)
+	{
+		const std::string name = target;
+		// The range is reduced on the thread pool, concurrently with the other heatmaps
+		std::shared_ptr<std::vector<float>> values = std::make_shared<std::vector<float>>();
+		HeatmapRange *range = &heatmapRanges[name + "_heatmap"];
+		pipeline.addStagedPass("normalize " + name, [name, values]()
+		{
+			*values = readBuffer<float>(pipeline.getBuffer(name));
+		}, [values, range]()
+		{
+			getMinMax(*values, range->minValue, range->maxValue, range->avgValue);
+		}, [range]()
+		{
+			context["max_value"]->setFloat(range->maxValue);
+			context->launch(NORMALIZE_PROGRAM, pipeline.getRenderWidth(), pipeline.getRenderHeight());
+		}, { name }, { name + "_heatmap" }, { { "normalize_buffer", name }, { "heatmap_buffer", name + "_heatmap" } });
 	}
+
+	// Ground truth and difference map
+	pipeline.addPass("ground truth", renderGroundTruth, { "camera", "light", "geometry" }, { "ground_truth" }, { { "diffuse_buffer", "ground_truth" } });
+	pipeline.addLaunchPass("calculate difference", DIFFERENCE_PROGRAM, { "blur_v", "ground_truth" }, { "difference" },
+						   { { "input_buffer_0", "blur_v" }, { "input_buffer_1", "ground_truth" } });
+
+	// Progressive refinement. The accumulated frames are read back by the next one, so they are persistent.
+	pipeline.addTarget("accumulated", RT_FORMAT_FLOAT3, true);
+	pipeline.addLaunchPass("accumulate", ACCUMULATE_PROGRAM, { "blur_v" }, { "accumulated" });
 }
 
 //--------------------------------------------------------------
@@ -459,98 +2051,408 @@ void glutKeyboardUp(unsigned char k, int, int)
 
 int main(int argc, char* argv[])
 {
+	startTime = std::chrono::high_resolution_clock::now();
 	try
 	{
-		// Init GLUT
-		initWindow(&argc, argv);
+		// Parse arguments
+		std::string presetFilename;
+		bool tune = false;
+		double targetError = -1.0;
+		int maxEvaluations = 200;
+		Pipeline::Names dumpTargets;
+		int headlessFrames = 0;
+		float shadowProxyError = 0.f;
+		int proxyReportRuns = 0;
+		int cpuRays = 0;
+		int layoutBenchmarkRuns = 0;
+		int kernelBenchmarkRuns = 0;
+		int pixelListBenchmarkRuns = 0;
+		int referenceCacheSize = 512; // MB
+		int servicePort = 0;
+		int farmPort = 0;
+		double farmUnitTimeout = 300.0; // s
+		std::string farmWorker; // host:port
+		int farmBenchmarkPort = 0;
+		double frameBudget = 0.0; // ms
+		std::string governorLog = "governor.csv";
+		int scatterInstances = 0;
+		unsigned seed = 1;
+		std::vector<int> scalingSweep;
+		std::string scalingCsv = "scaling.csv";
+		std::string scalingRow;
+		for(int i = 1; i < argc; i++)
+		{
+			const std::string arg = argv[i];
+			if(arg == "--preset" && i + 1 < argc) presetFilename = argv[++i];
+			else if(arg == "--tune") tune = true;
+			else if(arg == "--target-error" && i + 1 < argc) targetError = atof(argv[++i]);
+			else if(arg == "--max-evaluations" && i + 1 < argc) maxEvaluations = atoi(argv[++i]);
+			else if(arg == "--headless" && i + 1 < argc) headlessFrames = atoi(argv[++i]);
+			else if(arg == "--shadow-proxy" && i + 1 < argc) shadowProxyError = (float)atof(argv[++i]);
+			else if(arg == "--proxy-report" && i + 1 < argc) proxyReportRuns = atoi(argv[++i]);
+			else if(arg == "--cpu-rays" && i + 1 < argc) cpuRays = atoi(argv[++i]);
+			else if(arg == "--blocker-map") useBlockerMap = true;
+			else if(arg == "--visibility-cache") useVisibilityCache = true;
+			else if(arg == "--no-occluder-culling") occluderCulling = false;
+			else if(arg == "--no-pixel-lists") pixelCompaction = false;
+			else if(arg == "--no-refinement") progressiveRefinement = false;
+			else if(arg == "--tiled-layout") tiledLayout = true;
+			else if(arg == "--reference-cache-size" && i + 1 < argc) referenceCacheSize = atoi(argv[++i]);
+			else if(arg == "--no-reference-cache") referenceCacheSize = 0;
+			else if(arg == "--layout-benchmark" && i + 1 < argc) layoutBenchmarkRuns = atoi(argv[++i]);
+			else if(arg == "--generic-kernels") specializedKernels = false;
+			else if(arg == "--kernel-benchmark" && i + 1 < argc) kernelBenchmarkRuns = atoi(argv[++i]);
+			else if(arg == "--pixel-list-benchmark" && i + 1 < argc) pixelListBenchmarkRuns = atoi(argv[++i]);
+			else if(arg == "--frame-budget" && i + 1 < argc) frameBudget = atof(argv[++i]);
+			else if(arg == "--governor-log" && i + 1 < argc) governorLog = argv[++i];
+			else if(arg == "--serve" && i + 1 < argc) servicePort = atoi(argv[++i]);
+			else if(arg == "--gt-farm" && i + 1 < argc) farmPort = atoi(argv[++i]);
+			else if(arg == "--gt-unit-timeout" && i + 1 < argc) farmUnitTimeout = atof(argv[++i]);
+			else if(arg == "--gt-worker" && i + 1 < argc) farmWorker = argv[++i];
+			else if(arg == "--gt-farm-benchmark" && i + 1 < argc) farmBenchmarkPort = atoi(argv[++i]);
+			else if(arg == "--scatter" && i + 1 < argc) scatterInstances = atoi(argv[++i]);
+			else if(arg == "--seed" && i + 1 < argc) seed = (unsigned)strtoul(argv[++i], 0, 10);
+			else if(arg == "--scaling-csv" && i + 1 < argc) scalingCsv = argv[++i];
+			else if(arg == "--scaling-row" && i + 1 < argc) scalingRow = argv[++i];
+			else if(arg == "--scaling-sweep" && i + 1 < argc)
+			{
+				std::istringstream counts(argv[++i]);
+				std::string count;
+				while(std::getline(counts, count, ',')) scalingSweep.push_back(atoi(count.c_str()));
+			}
+			else if(arg == "--dump" && i + 1 < argc)
+			{
+				std::istringstream targets(argv[++i]);
+				std::string target;
+				while(std::getline(targets, target, ',')) dumpTargets.push_back(target);
+			}
+			else
+			{
+				printf("Usage: %s [--preset <file>] [--tune [--target-error <mse>] [--max-evaluations <n>]] [--dump <target,...>] [--headless <frames>] [--shadow-proxy <max error> [--proxy-report <runs>]] [--cpu-rays <n>] [--blocker-map] [--visibility-cache] [--no-occluder-culling] [--no-pixel-lists] [--no-refinement] [--tiled-layout] [--layout-benchmark <runs>] [--generic-kernels] [--kernel-benchmark <runs>] [--pixel-list-benchmark <runs>] [--reference-cache-size <MB> | --no-reference-cache] [--frame-budget <ms> [--governor-log <file>]] [--serve <port>] [--gt-farm <port> [--gt-unit-timeout <s>] | --gt-worker <host>:<port> | --gt-farm-benchmark <port>] [--scatter <instances> [--seed <n>] [--scaling-row <csv>]] [--scaling-sweep <instances,...> [--seed <n>] [--scaling-csv <file>]]\n", argv[0]);
+				return 1;
+			}
+		}
+		if(!scalingRow.empty() && scatterInstances <= 0)
+		{
+			printf("--scaling-row needs --scatter\n");
+			return 1;
+		}
+
+		// Each count of the sweep runs in a process of its own
+		if(!scalingSweep.empty())
+		{
+			return runScalingSweep(argv[0], scalingSweep, seed, scalingCsv) ? 0 : 1;
+		}
 
+		// Ground truth images are kept between runs
+		if(referenceCacheSize > 0) referenceCache = new ReferenceCache(referenceDirectory, (size_t)referenceCacheSize * 1024 * 1024);
+
+		// Ground truth images are split among worker processes, which keep their progress in the reference directory
+		if(farmPort > 0)
+		{
+			if(!createDirectory(referenceDirectory)) printf("Could not create %s, ground truth progress won't be kept\n", referenceDirectory);
+			groundTruthFarm = new GroundTruthFarm((unsigned short)farmPort, farmUnitTimeout);
+			printf("Ground truth farm listening on 127.0.0.1:%d\n", farmPort);
+		}
+
+		// Init GLUT, unless running without a window
+		if(headlessFrames <= 0 && proxyReportRuns <= 0 && cpuRays <= 0 && layoutBenchmarkRuns <= 0 && kernelBenchmarkRuns <= 0 && pixelListBenchmarkRuns <= 0 && scalingRow.empty() && servicePort <= 0 && farmWorker.empty() && farmBenchmarkPort <= 0)
+		{
+			initWindow(&argc, argv);
 #ifndef __APPLE__
-		glewInit();
+			glewInit();
 #endif
+		}
 
 		// Create optix context
 		context = Context::create();
 		context->setRayTypeCount(NUM_RAYS);
 		context->setEntryPointCount(NUM_PROGRAMS);
+		const RTsize availableBefore = context->getAvailableDeviceMemory(context->getEnabledDevices()[0]);
+
+		// Build the startup task graph. Cuda files are compiled on the thread pool
+		// while the main thread creates buffers and loads the scene.
+		TaskGraph startup;
+		const char *cudaFileNames[] = { "main", "ground_truth", "gaussian_blur", "box_blur", "parallelogram", "triangle_mesh", "normalize", "calculate_difference", "blocker_map", "distance_fill", "pixel_compaction", "accumulate", "probe_statistics" };
+		for(const char *name : cudaFileNames)
+		{
+			const char **ptx = &cudaFiles[name]; // Insert on the main thread so the map is never modified concurrently
+			startup.addTask(std::string("compile ") + name + ".cu", [name, ptx]()
+			{
+				*ptx = loadCudaFile((std::string(name) + ".cu").c_str());
+			});
+		}
+
+		// Declare the render targets and passes. Buffers are allocated when first used.
+		TaskGraph::Task pipelineTask = startup.addTask("setup pipeline", setupPipeline, {}, true);
+
+		// Set up the ray generation programs
+		startup.addTask("setup programs", []()
+		{
+			// Set ray generation program
+			context->setRayGenerationProgram(SAMPLE_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "sample_distances"));
+			context["params"]->setUserData(sizeof(params), &params);
+
+			// Set adaptive sampling program
+			context->setRayGenerationProgram(ADAPTIVE_SAMPLING_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "adaptive_sampling"));
+			context->setExceptionProgram(ADAPTIVE_SAMPLING_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "exception"));
+
+			// Set calculate beta program
+			context->setRayGenerationProgram(CALCULATE_BETA_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "calculate_beta"));
+
+			// Exception program
+			context->setExceptionProgram(SAMPLE_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "exception"));
+			context["bad_color"]->setFloat(1.0f, 0.0f, 1.0f);
+			context["bg_color"]->setFloat(make_float3(0.34f, 0.55f, 0.85f));
+
+			context->setRayGenerationProgram(GEOMETRY_HIT_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "trace_primary_ray"));
+
+			// Set ray generation program
+			context->setRayGenerationProgram(GROUND_TRUTH_PROGRAM, context->createProgramFromPTXString(cudaFiles["ground_truth"], "trace_ray"));
+			context->setExceptionProgram(GROUND_TRUTH_PROGRAM, context->createProgramFromPTXString(cudaFiles["ground_truth"], "exception"));
+			context->setMissProgram(GROUND_TRUTH_RAY, context->createProgramFromPTXString(cudaFiles["ground_truth"], "miss"));
+			setGroundTruthUnit(make_uint2(0u, 0u), 0, GROUND_TRUTH_SAMPLES);
+
+			// Set blur program
+			context->setRayGenerationProgram(BLUR_H_PROGRAM, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurH"));
+			context->setRayGenerationProgram(BLUR_V_PROGRAM, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurV"));
+			for(int radius = 1; radius <= SPECIALIZED_BLUR_RADII; radius++)
+			{
+				const std::string suffix = "_" + std::to_string(radius);
+				context->setRayGenerationProgram(BLUR_H_RADIUS_PROGRAM + radius - 1, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurH" + suffix));
+				context->setRayGenerationProgram(BLUR_V_RADIUS_PROGRAM + radius - 1, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurV" + suffix));
+			}
+
+			// Set box blur programs
+			context->setRayGenerationProgram(BOX_PREFIX_SUM_H_PROGRAM, context->createProgramFromPTXString(cudaFiles["box_blur"], "prefix_sum_h"));
+			context->setRayGenerationProgram(BOX_BLUR_H_PROGRAM, context->createProgramFromPTXString(cudaFiles["box_blur"], "box_blur_h"));
+			context->setRayGenerationProgram(BOX_PREFIX_SUM_V_PROGRAM, context->createProgramFromPTXString(cudaFiles["box_blur"], "prefix_sum_v"));
+			context->setRayGenerationProgram(BOX_BLUR_V_PROGRAM, context->createProgramFromPTXString(cudaFiles["box_blur"], "box_blur_v"));
+
+			// Set normalize program
+			context->setRayGenerationProgram(NORMALIZE_PROGRAM, context->createProgramFromPTXString(cudaFiles["normalize"], "normalize"));
+
+			// Set normalize program
+			context->setRayGenerationProgram(DIFFERENCE_PROGRAM, context->createProgramFromPTXString(cudaFiles["calculate_difference"], "calculate_difference"));
+
+			// Set distance fill programs
+			context->setRayGenerationProgram(PULL_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["distance_fill"], "pull_distances"));
+			context->setRayGenerationProgram(PUSH_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["distance_fill"], "push_distances"));
+			PyramidLevel level = {};
+			context["fine_level"]->setUserData(sizeof(level), &level);
+			context["coarse_level"]->setUserData(sizeof(level), &level);
+
+			// Set blocker map programs
+			context->setRayGenerationProgram(BLOCKER_MAP_PROGRAM, context->createProgramFromPTXString(cudaFiles["blocker_map"], "build_blocker_map"));
+			context->setRayGenerationProgram(SAMPLE_DISTANCES_BLOCKER_MAP_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "sample_distances_blocker_map"));
+			context->setExceptionProgram(SAMPLE_DISTANCES_BLOCKER_MAP_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "exception"));
+
+			// Sampling kernels specialized for the common light and probe counts
+			const std::pair<unsigned, const char*> specializedPrograms[] = {
+				{ SAMPLE_DISTANCES_SPECIALIZED_PROGRAM, "sample_distances_specialized" },
+				{ SAMPLE_DISTANCES_BLOCKER_MAP_SPECIALIZED_PROGRAM, "sample_distances_blocker_map_specialized" },
+				{ ADAPTIVE_SAMPLING_SPECIALIZED_PROGRAM, "adaptive_sampling_specialized" } };
+			for(const std::pair<unsigned, const char*> &program : specializedPrograms)
+			{
+				context->setRayGenerationProgram(program.first, context->createProgramFromPTXString(cudaFiles["main"], program.second));
+				context->setExceptionProgram(program.first, context->createProgramFromPTXString(cudaFiles["main"], "exception"));
+			}
+			BlockerMapFrame frame = {};
+			context["blocker_map_frame"]->setUserData(sizeof(frame), &frame);
+
+			// Set visibility cache program. A placeholder is bound until the cache is enabled.
+			context->setRayGenerationProgram(CLEAR_VISIBILITY_CACHE_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "clear_visibility_cache"));
+			context["visibility_cache"]->setBuffer(context->createBuffer(RT_BUFFER_INPUT_OUTPUT, RT_FORMAT_UNSIGNED_INT4, 1));
+			setVisibilityCacheEnabled(useVisibilityCache);
+
+			// Set pixel compaction programs. Launches are over the screen unless a pass sets an offset.
+			context->setRayGenerationProgram(COUNT_PIXEL_CLASSES_PROGRAM, context->createProgramFromPTXString(cudaFiles["pixel_compaction"], "count_pixel_classes"));
+			context->setRayGenerationProgram(SCAN_PIXEL_GROUPS_PROGRAM, context->createProgramFromPTXString(cudaFiles["pixel_compaction"], "scan_pixel_groups"));
+			context->setRayGenerationProgram(SCAN_PIXEL_CLASSES_PROGRAM, context->createProgramFromPTXString(cudaFiles["pixel_compaction"], "scan_pixel_classes"));
+			context->setRayGenerationProgram(ADD_PIXEL_GROUP_STARTS_PROGRAM, context->createProgramFromPTXString(cudaFiles["pixel_compaction"], "add_pixel_group_starts"));
+			context->setRayGenerationProgram(COMPACT_PIXELS_PROGRAM, context->createProgramFromPTXString(cudaFiles["pixel_compaction"], "compact_pixels"));
+			pixelScanBuffer = context->createBuffer(RT_BUFFER_INPUT_OUTPUT, RT_FORMAT_UNSIGNED_INT4, 1);
+			context["pixel_scan"]->setBuffer(pixelScanBuffer);
+			pixelListStartsBuffer = context->createBuffer(RT_BUFFER_INPUT_OUTPUT, RT_FORMAT_UNSIGNED_INT, NUM_PIXEL_CLASSES + 1);
+			context["pixel_list_starts"]->setBuffer(pixelListStartsBuffer);
+			context["pixel_list_offset"]->setInt(-1);
+
+			// Set progressive refinement program. Renders outside the render loop use the first frame's seeds.
+			context->setRayGenerationProgram(ACCUMULATE_PROGRAM, context->createProgramFromPTXString(cudaFiles["accumulate"], "accumulate"));
+			setRefinementFrame(0);
+
+			// Set probe statistics programs
+			context->setRayGenerationProgram(CLEAR_PROBE_STATISTICS_PROGRAM, context->createProgramFromPTXString(cudaFiles["probe_statistics"], "clear_probe_statistics"));
+			context->setRayGenerationProgram(REDUCE_PROBE_STATISTICS_PROGRAM, context->createProgramFromPTXString(cudaFiles["probe_statistics"], "reduce_probe_statistics"));
+
+			context["tiled_layout"]->setUint(tiledLayout ? 1u : 0u);
+		}, { pipelineTask,
+			 startup.getTask("compile main.cu"),
+			 startup.getTask("compile ground_truth.cu"),
+			 startup.getTask("compile gaussian_blur.cu"),
+			 startup.getTask("compile box_blur.cu"),
+			 startup.getTask("compile normalize.cu"),
+			 startup.getTask("compile calculate_difference.cu"),
+			 startup.getTask("compile blocker_map.cu"),
+			 startup.getTask("compile distance_fill.cu"),
+			 startup.getTask("compile pixel_compaction.cu"),
+			 startup.getTask("compile accumulate.cu"),
+			 startup.getTask("compile probe_statistics.cu") }, true);
+
+		// Load scene
+		if(scatterInstances > 0) scene = new ScatterScene(scatterInstances, seed);
+		else scene = new SCENE_CLASS();
+		scene->shadowProxyError = shadowProxyError;
+		scene->setOccluderCullingEnabled(occluderCulling);
+		scene->load(startup);
+
+		// Setup camera and force OptiX to compile its kernels and build
+		// the acceleration structures by launching with a size of zero
+		std::vector<TaskGraph::Task> allTasks;
+		for(TaskGraph::Task task = 0; task < startup.getTaskCount(); task++) allTasks.push_back(task);
+		startup.addTask("validate and build acceleration", []()
+		{
+			setupCamera();
+			updateCamera(camera);
+			context->validate();
+			context->launch(GEOMETRY_HIT_PROGRAM, 0, 0);
+		}, allTasks, true);
+
+		startup.run(threadPool);
+		startup.printTimings();
+
+		// Load the parameter preset. Scenes use their own preset if it exists.
+		const bool scenePreset = presetFilename.empty();
+		if(scenePreset) presetFilename = getPresetFilename();
+		if(loadPreset(presetFilename, params))
+		{
+			printf("Loaded preset %s\n", presetFilename.c_str());
+			printParameters(params);
+		}
+		else if(!scenePreset)
+		{
+			throw Exception("Could not open preset " + presetFilename);
+		}
+
+		// Render only the passes the requested targets need and save them
+		if(!dumpTargets.empty())
+		{
+			pipeline.printPlan(dumpTargets);
+			executePipeline(dumpTargets);
+			const std::string timeStamp = getTimeStamp();
+			for(const std::string &target : dumpTargets)
+			{
+				// Float targets hold values outside [0, 1], e.g. beta and sample counts, so keep them raw
+				const Buffer buffer = pipeline.getBuffer(target);
+				const RTformat format = buffer->getFormat();
+				const bool isFloat = format == RT_FORMAT_FLOAT || format == RT_FORMAT_FLOAT2 || format == RT_FORMAT_FLOAT3 || format == RT_FORMAT_FLOAT4;
+				if(isFloat) saveBufferPFM("screenshots/" + timeStamp + " " + target + ".pfm", buffer);
+				else saveBufferPPM("screenshots/" + timeStamp + " " + target + ".ppm", buffer);
+			}
+			destroyContext();
+			return 0;
+		}
+
+		if(!scalingRow.empty())
+		{
+			reportScaling(scatterInstances, scalingRow, startup, availableBefore);
+			destroyContext();
+			return 0;
+		}
+
+		if(layoutBenchmarkRuns > 0)
+		{
+			benchmarkPixelLayouts(layoutBenchmarkRuns);
+			destroyContext();
+			return 0;
+		}
+
+		if(kernelBenchmarkRuns > 0)
+		{
+			benchmarkKernels(kernelBenchmarkRuns);
+			destroyContext();
+			return 0;
+		}
+
+		if(pixelListBenchmarkRuns > 0)
+		{
+			benchmarkPixelLists(pixelListBenchmarkRuns);
+			destroyContext();
+			return 0;
+		}
+
+		if(farmBenchmarkPort > 0)
+		{
+			char proxyOption[64];
+			snprintf(proxyOption, sizeof(proxyOption), " --shadow-proxy %.9g", shadowProxyError);
+			std::string sceneOptions = shadowProxyError > 0.f ? proxyOption : "";
+			if(scatterInstances > 0) sceneOptions += " --scatter " + std::to_string(scatterInstances) + " --seed " + std::to_string(seed);
+			benchmarkGroundTruthFarm(argv[0], sceneOptions, (unsigned short)farmBenchmarkPort);
+			destroyContext();
+			return 0;
+		}
+
+		if(cpuRays > 0)
+		{
+			benchmarkCpuRays(cpuRays);
+			destroyContext();
+			return 0;
+		}
+
+		if(proxyReportRuns > 0)
+		{
+			if(!scene->hasShadowProxies())
+			{
+				throw Exception("--proxy-report needs --shadow-proxy with an error above zero");
+			}
+			reportShadowProxies(proxyReportRuns);
+			destroyContext();
+			return 0;
+		}
+
+		if(tune)
+		{
+			// Evaluations have to be independent of each other
+			if(useVisibilityCache)
+			{
+				printf("Tuning without the visibility cache\n");
+				setVisibilityCacheEnabled(false);
+			}
+			tuneScene(targetError, maxEvaluations);
+			destroyContext();
+			return 0;
+		}
+
+		if(!farmWorker.empty())
+		{
+			const size_t colon = farmWorker.rfind(':');
+			if(colon == std::string::npos) throw Exception("--gt-worker expects <host>:<port>");
+			scene->animate = false;
+			runGroundTruthWorker(farmWorker.substr(0, colon), (unsigned short)atoi(farmWorker.c_str() + colon + 1), startGroundTruthJob, renderGroundTruthUnit);
+			destroyContext();
+			return 0;
+		}
+
+		if(servicePort > 0)
+		{
+			runRenderService((unsigned short)servicePort);
+			destroyContext();
+			return 0;
+		}
+
+		// Interactive and headless frames stay within the budget
+		if(frameBudget > 0.0)
+		{
+			frameGovernor = new FrameGovernor(frameBudget, params, governorLog);
+			printf("Frame budget %.1f ms, governor settings logged to %s\n", frameBudget, governorLog.c_str());
+		}
 
-		// Load CUDA programs
-		cudaFiles["main"]          = loadCudaFile("main.cu");
-		cudaFiles["ground_truth"]  = loadCudaFile("ground_truth.cu");
-		cudaFiles["gaussian_blur"] = loadCudaFile("gaussian_blur.cu");
-		cudaFiles["parallelogram"] = loadCudaFile("parallelogram.cu");
-		cudaFiles["normalize"]     = loadCudaFile("normalize.cu");
-		cudaFiles["calculate_difference"] = loadCudaFile("calculate_difference.cu");
-
-		// Create output buffer
-		diffuseBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		differenceBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		geometryHitBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		geometryNormalBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		ffnormalBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		projectedDistancesBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT2, width, height, false);
-		objectIdBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		d1Buffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		d2MinBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		d2MaxBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		betaBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		blurHBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		blurVBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-		numSamplesBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT, width, height, false);
-		heatmapBuffer = sutil::createOutputBuffer(context, RT_FORMAT_FLOAT3, width, height, false);
-
-		// Set ray generation program
-		context->setRayGenerationProgram(SAMPLE_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "sample_distances"));
-		context["diffuse_buffer"]->set(diffuseBuffer);
-		context["beta_buffer"]->set(betaBuffer);
-		context["d1_buffer"]->set(d1Buffer);
-		context["d2_min_buffer"]->set(d2MinBuffer);
-		context["d2_max_buffer"]->set(d2MaxBuffer);
-		context["ffnormal_buffer"]->set(ffnormalBuffer);
-		context["object_id_buffer"]->set(objectIdBuffer);
-		context["projected_distances_buffer"]->set(projectedDistancesBuffer);
-		context["num_samples_buffer"]->set(numSamplesBuffer);
-
-		// Set calculate beta program
-		context->setRayGenerationProgram(BLUR_D_H_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "blur_d_h"));
-		context->setRayGenerationProgram(CALCULATE_BETA_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "calculate_beta"));
-
-		// Exception program
-		context->setExceptionProgram(SAMPLE_DISTANCES_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "exception"));
-		context["bad_color"]->setFloat(1.0f, 0.0f, 1.0f);
-		context["bg_color"]->setFloat(make_float3(0.34f, 0.55f, 0.85f));
-
-		context->setRayGenerationProgram(GEOMETRY_HIT_PROGRAM, context->createProgramFromPTXString(cudaFiles["main"], "trace_primary_ray"));
-		context["geometry_hit_buffer"]->setBuffer(geometryHitBuffer);
-		context["geometry_normal_buffer"]->setBuffer(geometryNormalBuffer);
-
-		// Set ray generation program
-		context->setRayGenerationProgram(GROUND_TRUTH_PROGRAM, context->createProgramFromPTXString(cudaFiles["ground_truth"], "trace_ray"));
-		context->setExceptionProgram(GROUND_TRUTH_PROGRAM, context->createProgramFromPTXString(cudaFiles["ground_truth"], "exception"));
-		context->setMissProgram(GROUND_TRUTH_RAY, context->createProgramFromPTXString(cudaFiles["ground_truth"], "miss"));
-
-		// Set blur program
-		context->setRayGenerationProgram(BLUR_H_PROGRAM, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurH"));
-		context->setRayGenerationProgram(BLUR_V_PROGRAM, context->createProgramFromPTXString(cudaFiles["gaussian_blur"], "blurV"));
-		context["blur_h_buffer"]->set(blurHBuffer);
-		context["blur_v_buffer"]->set(blurVBuffer);
-
-		// Set normalize program
-		context->setRayGenerationProgram(NORMALIZE_PROGRAM, context->createProgramFromPTXString(cudaFiles["normalize"], "normalize"));
-		context["normalize_buffer"]->set(betaBuffer);
-		context["heatmap_buffer"]->set(heatmapBuffer);
-
-		// Set normalize program
-		context->setRayGenerationProgram(DIFFERENCE_PROGRAM, context->createProgramFromPTXString(cudaFiles["calculate_difference"], "calculate_difference"));
-		context["difference_buffer"]->set(differenceBuffer);
-		context["input_buffer_0"]->set(blurVBuffer);
-		context["input_buffer_1"]->set(diffuseBuffer);
-
-		// Setup scene and camera
-		scene = new SCENE_CLASS();
-		setupCamera();
-		updateCamera();
-
-		context->validate();
+		if(headlessFrames > 0)
+		{
+			runHeadless(headlessFrames);
+			destroyContext();
+			return renderFailed ? 1 : 0;
+		}
 
 		// Initialize GL state
 		glMatrixMode(GL_PROJECTION);
@@ -562,8 +2464,11 @@ int main(int argc, char* argv[])
 
 		glViewport(0, 0, width, height);
 
+		// Render on a separate thread from now on
+		startRenderThread();
+
 		glutDisplayFunc(glutDisplay);
-		glutIdleFunc(glutDisplay);
+		glutIdleFunc(glutIdle);
 		glutCloseFunc(destroyContext);
 		glutMotionFunc(glutMouseMotion);
 		glutMouseFunc(glutMousePress);
@@ -584,8 +2489,17 @@ void initWindow(int* argc, char** argv)
 
 void destroyContext()
 {
+	stopRenderThread();
+	delete frameGovernor;
+	frameGovernor = 0;
+	delete groundTruthFarm;
+	groundTruthFarm = 0;
 	if(context)
 	{
+		visibilityCacheBuffer = 0;
+		groundTruthUnitBuffer = 0;
+		pixelScanBuffer = 0;
+		pixelListStartsBuffer = 0;
 		context->destroy();
 		context = 0;
 	}
@@ -30,6 +30,9 @@
 #include <optixu/optixu_matrix_namespace.h>
 #include "structs.h"
 #include "random.h"
+#include "pixel_layout.h"
+#include "visibility_cache.h"
+#include "pixel_list.h"
 
 using namespace optix;
 
@@ -43,6 +46,7 @@ using namespace optix;
 // Input pixel-coordinate
 rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
 
+rtBuffer<float3, 2> albedo_buffer;              // Surface color of the primary hit
 rtBuffer<float3, 2> diffuse_buffer;             // Diffuse color buffer
 rtBuffer<float,  2> beta_buffer;                // Beta buffer (gaussian standard deviation)
 rtBuffer<float,  2> d1_buffer;                  // Distance to light source
@@ -54,9 +58,15 @@ rtBuffer<float3, 2> ffnormal_buffer;            // For shading
 rtBuffer<float,  2> object_id_buffer;           // Object id buffer
 rtBuffer<float,  2> num_samples_buffer;         // Sample number buffer
 rtBuffer<float2, 2> projected_distances_buffer; // Projected distances buffer (offset of screen-space gaussian)
+rtBuffer<float4, 2> probe_buffer;               // Unnormalized color and number of occluded probes
+rtBuffer<float,  2> saved_samples_buffer;       // Adaptive samples skipped by the early-out
+rtBuffer<float2, 2> blocker_map_buffer;         // Distances from the light's center to the surfaces of a texel (see blocker_map.cu)
 
-// Scene geometry objects
+// Scene geometry objects. Shadow rays trace simplified meshes where available,
+// and only the objects that can occlude their receiver (see Scene::updateOccluders).
 rtDeclareVariable(rtObject, scene_geometry, , );
+rtDeclareVariable(rtObject, shadow_geometry, , );
+rtBuffer<uint> occluder_sets; // Occluder selector child of every object id
 
 // Pinhole camera variables
 rtDeclareVariable(float3, eye, , );
@@ -75,9 +85,9 @@ rtBuffer<ParallelogramLight> lights;
 // Geometry hit variables
 rtDeclareVariable(float3, geometric_normal, attribute geometric_normal, );
 rtDeclareVariable(float3, shading_normal, attribute shading_normal, );
-rtDeclareVariable(float3, diffuse_color, , );
+rtDeclareVariable(float3, hit_color, attribute hit_color, );
 rtDeclareVariable(float, t_hit, rtIntersectionDistance, );
-rtDeclareVariable(uint, object_id, , );
+rtDeclareVariable(uint, hit_object_id, attribute hit_object_id, );
 
 // Miss and exception color
 rtDeclareVariable(float3, bg_color, , );
@@ -89,7 +99,7 @@ rtDeclareVariable(float3, bad_color, , );
 
 RT_PROGRAM void trace_primary_ray()
 {
-	size_t2 screen = diffuse_buffer.size(); // Screen size
+	size_t2 screen = albedo_buffer.size(); // Screen size
 	float2 d = make_float2(launch_index) / make_float2(screen) * 2.f - 1.f; // Pixel coordinate in [-1, 1]
 	float3 ray_origin = eye;
 	float3 ray_direction = normalize(d.x*U + d.y*V + W);
@@ -109,11 +119,11 @@ RT_PROGRAM void trace_primary_ray()
 	rtTrace(scene_geometry, ray, prd);
 
 	// Set resulting geometry hit coordinate
-	diffuse_buffer[launch_index] = prd.color;
-	object_id_buffer[launch_index] = prd.object_id;
-	geometry_hit_buffer[launch_index] = prd.geometry_hit;
-	geometry_normal_buffer[launch_index] = prd.geometry_normal;
-	ffnormal_buffer[launch_index] = prd.ffnormal;
+	PIXEL(albedo_buffer, launch_index) = prd.color;
+	PIXEL(object_id_buffer, launch_index) = prd.object_id;
+	PIXEL(geometry_hit_buffer, launch_index) = prd.geometry_hit;
+	PIXEL(geometry_normal_buffer, launch_index) = prd.geometry_normal;
+	PIXEL(ffnormal_buffer, launch_index) = prd.ffnormal;
 }
 
 RT_PROGRAM void sample_geometry_hit()
@@ -123,19 +133,31 @@ RT_PROGRAM void sample_geometry_hit()
 	float3 ffnormal = faceforward(world_shade_normal, -ray.direction, world_geo_normal);
 	float3 hit_point = ray.origin + t_hit * ray.direction;
 
-	prd_geometry_hit.color = diffuse_color;
-	prd_geometry_hit.object_id = float(object_id);
+	prd_geometry_hit.color = hit_color;
+	prd_geometry_hit.object_id = float(hit_object_id);
 	prd_geometry_hit.geometry_hit = hit_point;
 	prd_geometry_hit.geometry_normal = world_geo_normal;
 	prd_geometry_hit.ffnormal = ffnormal;
 }
 
+// Visit program of the occluder selector. Other rays, like those of
+// the blocker map, traverse all objects in child 0.
+RT_PROGRAM void visit_occluders()
+{
+	rtIntersectChild(ray.ray_type == SHADOW_RAY ? prd_shadow.occluder_set : 0);
+}
+
 //--------------------------------------------------------------
 // Distance sampling + adaptive sampling
 //--------------------------------------------------------------
 
-RT_PROGRAM void sample_distances_to_light(unsigned int& seed, float3 &color, ParallelogramLight light,
-										  float3 ffnormal, float3 hit_point, float& d2_min, float& d2_max)
+// Distance shadow rays start at. Beyond the error of the shadow proxies when a receiver
+// can hit its own proxy, which lies up to that far above its surface (see Scene::updateOccluders).
+rtDeclareVariable(float, shadow_ray_offset, , );
+
+// Returns true if the shadow ray was occluded. Without tracing, the light is assumed visible.
+bool sample_distances_to_light(uint2 pixel, unsigned int& seed, float3 &color, ParallelogramLight light,
+							   float3 ffnormal, float3 hit_point, float& d2_min, float& d2_max, bool trace = true)
 {
 	// Choose random point on light
 	const float z1 = rnd(seed);
@@ -151,9 +173,13 @@ RT_PROGRAM void sample_distances_to_light(unsigned int& seed, float3 &color, Par
 		// Cast shadow ray
 		PerRayData_shadow shadow_prd;
 		shadow_prd.hit = false;
+		shadow_prd.occluder_set = occluder_sets[(uint)PIXEL(object_id_buffer, pixel)];
 
-		Ray shadow_ray(hit_point, L, SHADOW_RAY, EPSILON, Ldist);
-		rtTrace(scene_geometry, shadow_ray, shadow_prd);
+		if(trace)
+		{
+			Ray shadow_ray(hit_point, L, SHADOW_RAY, max(EPSILON, shadow_ray_offset), Ldist);
+			rtTrace(shadow_geometry, shadow_ray, shadow_prd);
+		}
 
 		// If light source was occluded
 		if(shadow_prd.hit)
@@ -171,55 +197,173 @@ RT_PROGRAM void sample_distances_to_light(unsigned int& seed, float3 &color, Par
 			{
 				d2_max = d2;
 			}
+			return true;
 		}
 		else
 		{
 			const float3 Kd = make_float3(0.6f, 0.7f, 0.8f);
-			color += Kd * nDl * diffuse_buffer[launch_index];
+			color += Kd * nDl * PIXEL(albedo_buffer, pixel);
 		}
 	}
+	return false;
 }
 
-// Constants from the paper
-const float k = 3.f;
-const float alpha = 1.f;
-const float mu = 2.f;
-const float max_num_samples = 100.f;
-const float max_beta = 10.f; // This is primarily for debug visualization
+// Tunable constants (see SoftShadowParameters)
+rtDeclareVariable(SoftShadowParameters, params, , );
 
-// Standard deviation of Gaussian of the light
-const float sigma = 130.f * 2.f;
+// Frame of the progressive refinement, varies the seeds (see accumulate.cu)
+rtDeclareVariable(unsigned int, frame_number, , );
 
-RT_PROGRAM void sample_distances()
+// Average world-space distance to the neighboring pixels
+float projected_pixel_distance(uint2 pixel)
+{
+	size_t2 screen = geometry_hit_buffer.size();
+	float3 hit_point = PIXEL(geometry_hit_buffer, pixel);
+	float d = 0.f;
+	if(pixel.x > 0)            d += length(PIXEL(geometry_hit_buffer, make_uint2(pixel.x - 1, pixel.y)) - hit_point);
+	if(pixel.y > 0)            d += length(PIXEL(geometry_hit_buffer, make_uint2(pixel.x, pixel.y - 1)) - hit_point);
+	if(pixel.x + 1 < screen.x) d += length(PIXEL(geometry_hit_buffer, make_uint2(pixel.x + 1, pixel.y)) - hit_point);
+	if(pixel.y + 1 < screen.y) d += length(PIXEL(geometry_hit_buffer, make_uint2(pixel.x, pixel.y + 1)) - hit_point);
+	return d / 4.f;
+}
+
+// World-space distance to the nearest neighboring pixel on the same object, 0 if there is none
+float object_pixel_distance(uint2 pixel)
 {
+	size_t2 screen = geometry_hit_buffer.size();
+	const float3 hit_point = PIXEL(geometry_hit_buffer, pixel);
+	const float object_id = PIXEL(object_id_buffer, pixel);
+	const int2 offsets[4] = { make_int2(-1, 0), make_int2(1, 0), make_int2(0, -1), make_int2(0, 1) };
+	float d = FLT_MAX;
+	for(int i = 0; i < 4; i++)
+	{
+		// Exploiting integer underflow when pos < 0
+		const uint2 pos = make_uint2(pixel.x + offsets[i].x, pixel.y + offsets[i].y);
+		if(pos.x >= screen.x || pos.y >= screen.y || PIXEL(object_id_buffer, pos) != object_id) continue;
+		d = fminf(d, length(PIXEL(geometry_hit_buffer, pos) - hit_point));
+	}
+	return d < FLT_MAX ? d : 0.f;
+}
+
+// Key of the pixel's cell in the visibility cache (see visibility_cache.h)
+uint3 pixel_cache_key(uint2 pixel, float3 hit_point, float3 ffnormal, int light)
+{
+	return visibility_cache_key(hit_point, ffnormal, PIXEL(object_id_buffer, pixel), light, object_pixel_distance(pixel));
+}
+
+//--------------------------------------------------------------
+// Blocker search
+//--------------------------------------------------------------
+
+rtDeclareVariable(BlockerMapFrame, blocker_map_frame, , );
+
+#define BLOCKER_SEARCH_SAMPLES 8 // Texels looked up along each axis
+
+// Searches the blocker map around the receiver, like the blocker search of PCSS, and
+// widens the occluder distances by the blockers found. A surface seen in the map is a
+// blocker if the line from the receiver through it hits the light. Both the nearest and
+// the farthest surface of a texel are tested. Returns false if the receiver is outside the map.
+bool search_blockers(ParallelogramLight light, float3 ffnormal, float3 hit_point, float& d2_min, float& d2_max)
+{
+	const BlockerMapFrame frame = blocker_map_frame;
+	const float3 receiver = hit_point - frame.origin;
+	const float z = dot(receiver, frame.w);
+	if(z <= frame.near) return false;
+
+	const float2 uv = make_float2(dot(receiver, frame.u), dot(receiver, frame.v)) / (z * frame.tan_half_fov);
+	if(fabsf(uv.x) > 1.f || fabsf(uv.y) > 1.f) return false;
+
+	// Blockers are no nearer to the light than frame.near, which bounds how far
+	// from the receiver they appear in the map
+	const float radius = frame.light_radius * (z - frame.near) / (z * frame.near * frame.tan_half_fov);
+
+	size_t2 size = blocker_map_buffer.size();
+	const float v1_length2 = dot(light.v1, light.v1);
+	const float v2_length2 = dot(light.v2, light.v2);
+	for(int i = 0; i < BLOCKER_SEARCH_SAMPLES; i++)
+	{
+		for(int j = 0; j < BLOCKER_SEARCH_SAMPLES; j++)
+		{
+			const float2 offset = (make_float2(i, j) + 0.5f) / BLOCKER_SEARCH_SAMPLES * 2.f - 1.f;
+			const float2 sample_uv = uv + offset * radius;
+			if(fabsf(sample_uv.x) >= 1.f || fabsf(sample_uv.y) >= 1.f) continue;
+
+			const float2 texel_position = (sample_uv * 0.5f + 0.5f) * make_float2(size);
+			const uint2 texel = make_uint2((unsigned int)texel_position.x, (unsigned int)texel_position.y);
+			const float2 depths = PIXEL(blocker_map_buffer, texel);
+			if(depths.y <= 0.f) continue;
+
+			// Surfaces through the center of the texel
+			const float2 texel_uv = (make_float2(texel) + 0.5f) / make_float2(size) * 2.f - 1.f;
+			const float3 direction = normalize(frame.w + (texel_uv.x * frame.u + texel_uv.y * frame.v) * frame.tan_half_fov);
+			for(int k = 0; k < (depths.x < depths.y ? 2 : 1); k++)
+			{
+				const float3 blocker = frame.origin + (k == 0 ? depths.x : depths.y) * direction;
+
+				// It must be above the receiver's surface, and the line through it must hit the light
+				const float3 to_blocker = blocker - hit_point;
+				if(dot(to_blocker, ffnormal) <= EPSILON) continue;
+				const float to_light = dot(to_blocker, light.normal);
+				if(fabsf(to_light) < 1e-6f) continue;
+				const float t = dot(frame.origin - hit_point, light.normal) / to_light;
+				if(t <= 1.f) continue;
+				const float3 on_light = hit_point + to_blocker * t - light.corner;
+				const float a1 = dot(on_light, light.v1) / v1_length2;
+				const float a2 = dot(on_light, light.v2) / v2_length2;
+				if(a1 < 0.f || a1 > 1.f || a2 < 0.f || a2 > 1.f) continue;
+
+				const float d2 = (t - 1.f) * length(to_blocker);
+				d2_min = fminf(d2_min, d2);
+				d2_max = fmaxf(d2_max, d2);
+			}
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------------------------
+// Probe pass
+//--------------------------------------------------------------
+
+// The probes are always traced, as a thin occluder can fall between the texels of
+// the blocker map. With the map, the blockers it finds widen the distances sampled
+// by the probes, e.g. where every probe missed an occluder. Pixels in
+// cells the visibility cache knows to be fully lit or occluded trace no rays.
+// Unoccluded pixels are shaded here, so the adaptive sampling pass over
+// the pixel lists skips them. NUM_LIGHTS and NUM_PROBES above 0 fix the
+// loop counts at compile time.
+template<int NUM_LIGHTS, int NUM_PROBES>
+void probe_distances(bool use_blocker_map)
+{
+	// Always launched over the screen
+	const uint2 pixel = launch_index;
+
 	// Set default values if the ray from the previous pass missed
-	if(object_id_buffer[launch_index] == 0.f)
+	if(PIXEL(object_id_buffer, pixel) == 0.f)
 	{
-		diffuse_buffer[launch_index] = bg_color;
-		projected_distances_buffer[launch_index] = make_float2(0.f);
-		num_samples_buffer[launch_index] = 0.f;
-		d1_buffer[launch_index] = 0.f;
-		d2_min_buffer[launch_index] = 0.f;
-		d2_max_buffer[launch_index] = 0.f;
+		PIXEL(diffuse_buffer, pixel) = bg_color;
+		PIXEL(projected_distances_buffer, pixel) = make_float2(0.f);
+		PIXEL(probe_buffer, pixel) = make_float4(0.f);
+		PIXEL(num_samples_buffer, pixel) = 0.f;
+		PIXEL(saved_samples_buffer, pixel) = 0.f;
+		PIXEL(d1_buffer, pixel) = 0.f;
+		PIXEL(d2_min_buffer, pixel) = 0.f;
+		PIXEL(d2_max_buffer, pixel) = 0.f;
 		return;
 	}
 
 	size_t2 screen = geometry_hit_buffer.size();
-	float3 ffnormal = ffnormal_buffer[launch_index];
-	float3 hit_point = geometry_hit_buffer[launch_index];
-
-	// Calculate projected distance per pixel
-	float d = 0.f;
-	if(launch_index.x > 0)        d += length(geometry_hit_buffer[make_uint2(launch_index.x - 1, launch_index.y)] - hit_point);
-	if(launch_index.y > 0)        d += length(geometry_hit_buffer[make_uint2(launch_index.x, launch_index.y - 1)] - hit_point);
-	if(launch_index.x < screen.x) d += length(geometry_hit_buffer[make_uint2(launch_index.x + 1, launch_index.y)] - hit_point);
-	if(launch_index.y < screen.y) d += length(geometry_hit_buffer[make_uint2(launch_index.x, launch_index.y + 1)] - hit_point);
-	d /= 4.f;
-	const float omega_max_pix = 1.f / d;
+	float3 ffnormal = PIXEL(ffnormal_buffer, pixel);
+	float3 hit_point = PIXEL(geometry_hit_buffer, pixel);
 
 	float3 color = make_float3(0.0f);
-	unsigned int seed = tea<16>(screen.x*launch_index.y + launch_index.x, 0/*frame_number*/);
-	for(int i = 0; i < lights.size(); ++i)
+	float num_occluded = 0.f;
+	bool lit = true;
+	unsigned int seed = tea<16>(screen.x*pixel.y + pixel.x, 2u*frame_number);
+	const int num_lights = NUM_LIGHTS > 0 ? NUM_LIGHTS : (int)lights.size();
+	const int num_probes = NUM_PROBES > 0 ? NUM_PROBES : params.num_probes;
+#pragma unroll
+	for(int i = 0; i < num_lights; ++i)
 	{
 		ParallelogramLight light = lights[i];
 		const float3 light_center = light.corner + light.v1 * 0.5f + light.v2 * 0.5f;
@@ -232,150 +376,249 @@ RT_PROGRAM void sample_distances()
 		projection_matrix.setCol(2, light.normal);
 
 		float3 p_projected = projection_matrix * hit_point;
-		projected_distances_buffer[launch_index] = make_float2(p_projected);
+		PIXEL(projected_distances_buffer, pixel) = make_float2(p_projected);
 
-		// Send 9 rays
+		// Send the initial probe rays
 		float d2_min = FLT_MAX;  // Min distance from light to occluder
 		float d2_max = -FLT_MAX; // Max distance from light to occluder
 		float d1 = length(hit_point - light_center); // Distance from light to receiver
-		for(int j = 0; j < 9; j++)
+		num_occluded = 0.f;
+		const uint3 cache_key = visibility_cache_enabled ? pixel_cache_key(pixel, hit_point, ffnormal, i) : make_uint3(0u);
+		const float cached_visibility = visibility_cache_query(cache_key, d2_min, d2_max);
+		if(cached_visibility == 0.f)
+		{
+			num_occluded = (float)num_probes;
+		}
+		else
+		{
+			const bool trace = cached_visibility < 0.f;
+#pragma unroll
+			for(int j = 0; j < num_probes; j++)
+			{
+				if(sample_distances_to_light(pixel, seed, color, light, ffnormal, hit_point, d2_min, d2_max, trace))
+				{
+					num_occluded += 1.f;
+				}
+			}
+			if(trace) visibility_cache_record(cache_key, (unsigned int)num_probes, (unsigned int)num_occluded, d2_min, d2_max);
+		}
+		if(use_blocker_map) search_blockers(light, ffnormal, hit_point, d2_min, d2_max);
+
+		// Set values for unoccluded pixels
+		lit = d2_max <= 0.f;
+		if(lit)
 		{
-			sample_distances_to_light(seed, color, light, ffnormal, hit_point, d2_min, d2_max);
+			d1 = d2_min = d2_max = 0.f;
 		}
 
-		// If this pixel was occluded (that is, d2_max > 0)
+		// Set sampled distances
+		PIXEL(d1_buffer, pixel) = d1;
+		PIXEL(d2_min_buffer, pixel) = d2_min;
+		PIXEL(d2_max_buffer, pixel) = d2_max;
+	}
+
+	// Store the unnormalized color and the number of occluded probes
+	// for the adaptive sampling pass
+	PIXEL(probe_buffer, pixel) = make_float4(color, num_occluded);
+	if(lit)
+	{
+		PIXEL(diffuse_buffer, pixel) = color / (float)num_probes;
+		PIXEL(num_samples_buffer, pixel) = 0.f;
+		PIXEL(saved_samples_buffer, pixel) = 0.f;
+	}
+}
+
+RT_PROGRAM void sample_distances()
+{
+	probe_distances<0, 0>(false);
+}
+
+RT_PROGRAM void sample_distances_blocker_map()
+{
+	probe_distances<0, 0>(true);
+}
+
+RT_PROGRAM void sample_distances_specialized()
+{
+	probe_distances<SPECIALIZED_NUM_LIGHTS, SPECIALIZED_NUM_PROBES>(false);
+}
+
+RT_PROGRAM void sample_distances_blocker_map_specialized()
+{
+	probe_distances<SPECIALIZED_NUM_LIGHTS, SPECIALIZED_NUM_PROBES>(true);
+}
+
+// Confidence in [0, 1] that a pixel is fully occluded (umbra) or fully lit.
+// All probes must agree, every one occluded or none. The confidence is then
+// how little the occluder distances are spread out, and how many neighboring
+// pixels on the same object agree.
+float early_out_classify(uint2 pixel, float num_occluded, float d2_min, float d2_max)
+{
+	const bool umbra = num_occluded >= params.num_probes;
+	if(!umbra && num_occluded > 0.f) return 0.f;
+
+	// In deep umbra, every probe hits the same occluder at nearly the same distance
+	const float spread_agreement = umbra ? max(1.f - (d2_max - d2_min) / d2_max, 0.f) : 1.f;
+
+	// Neighbor agreement: fraction of the 4-neighbors on the same object that are in the same class
+	size_t2 screen = probe_buffer.size();
+	const float object_id = PIXEL(object_id_buffer, pixel);
+	const int2 offsets[4] = { make_int2(-1, 0), make_int2(1, 0), make_int2(0, -1), make_int2(0, 1) };
+	float num_neighbors = 0.f, num_agreeing = 0.f;
+	for(int i = 0; i < 4; i++)
+	{
+		// Exploiting integer underflow when pos < 0
+		const uint2 pos = make_uint2(pixel.x + offsets[i].x, pixel.y + offsets[i].y);
+		if(pos.x >= screen.x || pos.y >= screen.y || PIXEL(object_id_buffer, pos) != object_id) continue;
+
+		const float neighbor_occluded = PIXEL(probe_buffer, pos).w;
+		num_neighbors += 1.f;
+		if(umbra ? neighbor_occluded == params.num_probes : neighbor_occluded == 0.f) num_agreeing += 1.f;
+	}
+	const float neighbor_agreement = num_neighbors > 0.f ? num_agreeing / num_neighbors : 0.f;
+
+	return spread_agreement * neighbor_agreement;
+}
+
+// NUM_LIGHTS above 0 fixes the light count at compile time. The number
+// of adaptive samples depends on the pixel, so that loop stays generic.
+// Launched over the screen or over the occluded pixels of the pixel lists.
+template<int NUM_LIGHTS>
+void adaptive_sampling_pass()
+{
+	const uint2 pixel = launch_pixel(launch_index);
+
+	// Background pixels were set by the probe pass
+	if(PIXEL(object_id_buffer, pixel) == 0.f)
+	{
+		return;
+	}
+
+	size_t2 screen = geometry_hit_buffer.size();
+	float3 ffnormal = PIXEL(ffnormal_buffer, pixel);
+	float3 hit_point = PIXEL(geometry_hit_buffer, pixel);
+	const float omega_max_pix = 1.f / projected_pixel_distance(pixel);
+
+	const float4 probe = PIXEL(probe_buffer, pixel);
+	float3 color = make_float3(probe);
+	unsigned int seed = tea<16>(screen.x*pixel.y + pixel.x, 2u*frame_number + 1u);
+	const int num_lights = NUM_LIGHTS > 0 ? NUM_LIGHTS : (int)lights.size();
+#pragma unroll
+	for(int i = 0; i < num_lights; ++i)
+	{
+		ParallelogramLight light = lights[i];
+		float d1 = PIXEL(d1_buffer, pixel);
+		float d2_min = PIXEL(d2_min_buffer, pixel);
+		float d2_max = PIXEL(d2_max_buffer, pixel);
+
+		// If this pixel was occluded (that is, d2_max > 0). Pixels without occluders
+		// take no adaptive samples, so only those with occluder distances but no
+		// occluded probe (blockers found in the blocker map) are classified as lit.
 		if(d2_max > 0.f)
 		{
 			const float s1 = max(d1 / d2_min, 1.f) - 1.f;
 			float s2 = max(d1 / d2_max, 1.f) - 1.f;
-			float inv_s2 = alpha / (1.f + s2);
+			float inv_s2 = params.alpha / (1.f + s2);
 
 			// Calculate pixel area and light area
 			const float Ap = 1.f / (omega_max_pix * omega_max_pix);
-			const float Al = 4.f * sigma * sigma;
+			const float Al = 4.f * params.sigma * params.sigma;
 
 			// Calcuate number of additional samples
-			const float num_samples = min(4.f * powf(1.f + mu * (s1 / s2), 2.f) * powf(mu * 2 / s2 * sqrtf(Ap / Al) + inv_s2, 2.f), max_num_samples);
-			num_samples_buffer[launch_index] = num_samples;
+			float num_samples = min(4.f * powf(1.f + params.mu * (s1 / s2), 2.f) * powf(params.mu * 2 / s2 * sqrtf(Ap / Al) + inv_s2, 2.f), params.max_num_samples);
+
+			// Skip the additional samples if the pixel is clearly in umbra or fully lit,
+			// or its cell in the visibility cache is
+			const uint3 cache_key = visibility_cache_enabled ? pixel_cache_key(pixel, hit_point, ffnormal, i) : make_uint3(0u);
+			if(visibility_cache_query(cache_key, d2_min, d2_max) >= 0.f)
+			{
+				PIXEL(saved_samples_buffer, pixel) = 0.f;
+				num_samples = 0.f;
+			}
+			else if(early_out_classify(pixel, probe.w, d2_min, d2_max) >= params.early_out_confidence)
+			{
+				PIXEL(saved_samples_buffer, pixel) = floorf(num_samples);
+				num_samples = 0.f;
+			}
+			else
+			{
+				PIXEL(saved_samples_buffer, pixel) = 0.f;
+			}
+			PIXEL(num_samples_buffer, pixel) = num_samples;
 
+			unsigned int num_occluded = 0u;
 			for(int j = 0; j < (int)num_samples; j++)
 			{
-				sample_distances_to_light(seed, color, light, ffnormal, hit_point, d2_min, d2_max);
+				if(sample_distances_to_light(pixel, seed, color, light, ffnormal, hit_point, d2_min, d2_max)) num_occluded++;
 			}
+			visibility_cache_record(cache_key, (unsigned int)num_samples, num_occluded, d2_min, d2_max);
 
-			color /= 9.f + num_samples;
+			color /= params.num_probes + num_samples;
 		}
 		else
 		{
 			// Set values for unoccluded pixels
-			num_samples_buffer[launch_index] = 0.f;
-			color /= 9.f;
-			d1 = d2_min = d2_max = 0.f;
+			PIXEL(num_samples_buffer, pixel) = 0.f;
+			PIXEL(saved_samples_buffer, pixel) = 0.f;
+			color /= params.num_probes;
 		}
 
 		// Set sampled distances
-		d1_buffer[launch_index] = d1;
-		d2_min_buffer[launch_index] = d2_min;
-		d2_max_buffer[launch_index] = d2_max;
+		PIXEL(d2_min_buffer, pixel) = d2_min;
+		PIXEL(d2_max_buffer, pixel) = d2_max;
 	}
 
 	// Set sampled color
-	diffuse_buffer[launch_index] = color;
+	PIXEL(diffuse_buffer, pixel) = color;
 }
 
-//-----------------------------------------------------------------------------
-// Calculate beta
-//-----------------------------------------------------------------------------
-
-float gauss1D(const float x, const float std)
+RT_PROGRAM void adaptive_sampling()
 {
-	const float sqrt_2_pi = sqrtf(2.f * M_PIf);
-	return expf(-(x * x) / (2.f * std * std)) / (sqrt_2_pi * std);
+	adaptive_sampling_pass<0>();
 }
 
-RT_PROGRAM void blur_d_h()
+RT_PROGRAM void adaptive_sampling_specialized()
 {
-	size_t2 screen = geometry_hit_buffer.size();
-
-	// Get d1, d2_max from previous pass
-	float d2_max = d2_max_buffer[launch_index];
-	float d1 = d1_buffer[launch_index];
-
-	// For unocculded pixel, blur d1 and d2_max in a 5 px radius
-	if(d2_max == 0.f)
-	{
-		float sum = 0.f;
-		for(int i = -5; i <= 5; i++)
-		{
-			const uint2 pos = make_uint2(launch_index.x + i, launch_index.y);
-			if(pos.x >= screen.x) continue;
-			const float w = gauss1D(i, 5.f);
-			d1 += d1_buffer[pos] * w;
-			d2_max += d2_max_buffer[pos] * w;
-			sum += w;
-		}
+	adaptive_sampling_pass<SPECIALIZED_NUM_LIGHTS>();
+}
 
-		// Store average
-		d1_buffer[launch_index] = d1 / sum;
-		d2_max_buffer[launch_index] = d2_max / sum;
-	}
+RT_PROGRAM void clear_visibility_cache()
+{
+	visibility_cache[launch_index.x] = make_uint4(0u);
 }
 
+//-----------------------------------------------------------------------------
+// Calculate beta
+//-----------------------------------------------------------------------------
+
+// Launched over the screen or over the pixels with geometry of the pixel
+// lists, whose background pixels were set by the compaction pass
 RT_PROGRAM void calculate_beta()
 {
+	const uint2 pixel = launch_pixel(launch_index);
+
 	// Set default values if the ray from the previous pass missed
-	if(object_id_buffer[launch_index] == 0.f)
+	if(PIXEL(object_id_buffer, pixel) == 0.f)
 	{
-		beta_buffer[launch_index] = 0.f;
+		PIXEL(beta_buffer, pixel) = 0.f;
 		return;
 	}
 
 	// Calculate projected distance per pixel
-	size_t2 screen = geometry_hit_buffer.size();
-	float3 hit_point = geometry_hit_buffer[launch_index];
-	float d = 0.f;
-	if(launch_index.x > 0)        d += length(geometry_hit_buffer[make_uint2(launch_index.x - 1, launch_index.y)] - hit_point);
-	if(launch_index.y > 0)        d += length(geometry_hit_buffer[make_uint2(launch_index.x, launch_index.y - 1)] - hit_point);
-	if(launch_index.x < screen.x) d += length(geometry_hit_buffer[make_uint2(launch_index.x + 1, launch_index.y)] - hit_point);
-	if(launch_index.y < screen.y) d += length(geometry_hit_buffer[make_uint2(launch_index.x, launch_index.y + 1)] - hit_point);
-	d /= 4.f;
-	const float omega_max_pix = 1.f / d;
-
-	// Get d1, d2_max from previous pass
-	float d2_max = d2_max_buffer[launch_index];
-	float d1 = d1_buffer[launch_index];
-
-	// For unocculded pixel, take the average in a 5 pixel radius
-	if(d2_max == 0.f)
-	{
-		float sum = 0.f;
-		for(int i = -5; i <= 5; i++)
-		{
-			const uint2 pos = make_uint2(launch_index.x, launch_index.y + i);
-			if(pos.y >= screen.y) continue;
-			const float w = gauss1D(i, 5.f);
-			d1 += d1_buffer[pos] * w;
-			d2_max += d2_max_buffer[pos] * w;
-			sum += w;
-		}
-
-		// Get average
-		d1 /= sum;
-		d2_max /= sum;
+	const float omega_max_pix = 1.f / projected_pixel_distance(pixel);
 
-		// Write back (for debug visualization)
-		//d1_buffer[launch_index] = d1;
-		//d2_max_buffer[launch_index] = d2_max;
-	}
+	// Unoccluded pixels hold the distances filled in from the occluded ones (see distance_fill.cu)
+	const float d2_max = PIXEL(d2_max_buffer, pixel);
+	const float d1 = PIXEL(d1_buffer, pixel);
 
 	// Update s2 and inv_s2
 	const float s2 = max(d1 / d2_max, 1.f) - 1.f;
-	const float inv_s2 = alpha / (1.f + s2);
+	const float inv_s2 = params.alpha / (1.f + s2);
 	const float omega_max_x = inv_s2 * omega_max_pix;
 
 	// Calculate filter width at current pixel
-	const float beta = 1.f / k * 1.f / mu * max(sigma * s2, 1.f / omega_max_x);
-	beta_buffer[launch_index] = max(min(beta, max_beta), 1.f);
+	const float beta = 1.f / params.k * 1.f / params.mu * max(params.sigma * s2, 1.f / omega_max_x);
+	PIXEL(beta_buffer, pixel) = max(min(beta, params.max_beta), 1.f);
 }
 
 //-----------------------------------------------------------------------------
@@ -406,5 +649,5 @@ RT_PROGRAM void distances_miss()
 
 RT_PROGRAM void exception()
 {
-	diffuse_buffer[launch_index] = bad_color;
+	PIXEL(diffuse_buffer, launch_pixel(launch_index)) = bad_color;
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <optixu/optixu_math_namespace.h>
+#include "pixel_layout.h"
 
 using namespace optix;
 
@@ -14,7 +15,7 @@ rtDeclareVariable(float, max_value, , );
 
 RT_PROGRAM void normalize()
 {
-	float greyValue = normalize_buffer[launch_index] / max_value;
+	float greyValue = PIXEL(normalize_buffer, launch_index) / max_value;
 	float3 heat = make_float3(0.f, 0.f, 0.f);
 
 	heat.x = smoothstep(0.5f, 0.8f, greyValue);
@@ -32,5 +33,5 @@ RT_PROGRAM void normalize()
 		heat.z *= greyValue / 0.3f;
 	}
 
-	heatmap_buffer[launch_index] = heat;
+	PIXEL(heatmap_buffer, launch_index) = heat;
 }
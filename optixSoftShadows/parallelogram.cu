@@ -30,34 +30,42 @@
 
 using namespace optix;
 
-rtDeclareVariable(float4, plane, , );
-rtDeclareVariable(float3, v1, , );
-rtDeclareVariable(float3, v2, , );
-rtDeclareVariable(float3, anchor, , );
-rtDeclareVariable(int, lgt_instance, , ) = {0};
+//--------------------------------------------------------------
+// Quad soup intersection - one primitive per parallelogram
+//--------------------------------------------------------------
+
+rtBuffer<float4> quad_planes;     // Normal and distance to the origin
+rtBuffer<float3> quad_anchors;
+rtBuffer<float3> quad_v1;         // Edges scaled by 1 / length^2
+rtBuffer<float3> quad_v2;
+rtBuffer<float3> quad_colors;
+rtBuffer<uint>   quad_object_ids;
 
 rtDeclareVariable(float3, texcoord, attribute texcoord, ); 
 rtDeclareVariable(float3, geometric_normal, attribute geometric_normal, ); 
 rtDeclareVariable(float3, shading_normal, attribute shading_normal, ); 
-rtDeclareVariable(int, lgt_idx, attribute lgt_idx, ); 
+rtDeclareVariable(float3, hit_color, attribute hit_color, );
+rtDeclareVariable(uint, hit_object_id, attribute hit_object_id, );
 rtDeclareVariable(optix::Ray, ray, rtCurrentRay, );
 
 RT_PROGRAM void intersect(int primIdx)
 {
+  const float4 plane = quad_planes[primIdx];
   float3 n = make_float3( plane );
   float dt = dot(ray.direction, n );
   float t = (plane.w - dot(n, ray.origin))/dt;
   if( t > ray.tmin && t < ray.tmax ) {
     float3 p = ray.origin + ray.direction * t;
-    float3 vi = p - anchor;
-    float a1 = dot(v1, vi);
+    float3 vi = p - quad_anchors[primIdx];
+    float a1 = dot(quad_v1[primIdx], vi);
     if(a1 >= 0 && a1 <= 1){
-      float a2 = dot(v2, vi);
+      float a2 = dot(quad_v2[primIdx], vi);
       if(a2 >= 0 && a2 <= 1){
         if( rtPotentialIntersection( t ) ) {
           shading_normal = geometric_normal = n;
           texcoord = make_float3(a1,a2,0);
-          lgt_idx = lgt_instance;
+          hit_color = quad_colors[primIdx];
+          hit_object_id = quad_object_ids[primIdx];
           rtReportIntersection( 0 );
         }
       }
@@ -65,15 +73,17 @@ RT_PROGRAM void intersect(int primIdx)
   }
 }
 
-RT_PROGRAM void bounds (int, float result[6])
+RT_PROGRAM void bounds (int primIdx, float result[6])
 {
   // v1 and v2 are scaled by 1./length^2.  Rescale back to normal for the bounds computation.
+  const float3 v1   = quad_v1[primIdx];
+  const float3 v2   = quad_v2[primIdx];
   const float3 tv1  = v1 / dot( v1, v1 );
   const float3 tv2  = v2 / dot( v2, v2 );
-  const float3 p00  = anchor;
-  const float3 p01  = anchor + tv1;
-  const float3 p10  = anchor + tv2;
-  const float3 p11  = anchor + tv1 + tv2;
+  const float3 p00  = quad_anchors[primIdx];
+  const float3 p01  = p00 + tv1;
+  const float3 p10  = p00 + tv2;
+  const float3 p11  = p00 + tv1 + tv2;
   const float  area = length(cross(tv1, tv2));
   
   optix::Aabb* aabb = (optix::Aabb*)result;
@@ -85,4 +95,3 @@ RT_PROGRAM void bounds (int, float result[6])
     aabb->invalidate();
   }
 }
-
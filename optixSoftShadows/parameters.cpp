@@ -0,0 +1,196 @@
+#include "parameters.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <algorithm>
+
+//--------------------------------------------------------------
+// Parameter table
+//--------------------------------------------------------------
+
+struct ParameterInfo
+{
+	const char *name;
+	size_t      offset;           // Offset into SoftShadowParameters
+	bool        integer;          // Stored as an int
+	bool        tuned;            // Searched by the tuner
+	float       minValue, maxValue; // Range searched by the tuner
+};
+
+// sigma follows from the light's size, so the tuner leaves it alone
+static const ParameterInfo parameterInfos[] =
+{
+	{ "k",                    offsetof(SoftShadowParameters, k),                    false, true,  0.5f,  8.f    },
+	{ "alpha",                offsetof(SoftShadowParameters, alpha),                false, true,  0.25f, 4.f    },
+	{ "mu",                   offsetof(SoftShadowParameters, mu),                   false, true,  0.25f, 8.f    },
+	{ "sigma",                offsetof(SoftShadowParameters, sigma),                false, false, 10.f,  1000.f },
+	{ "max_num_samples",      offsetof(SoftShadowParameters, max_num_samples),      false, true,  0.f,   400.f  },
+	{ "max_beta",             offsetof(SoftShadowParameters, max_beta),             false, true,  1.f,   50.f   },
+	{ "num_probes",           offsetof(SoftShadowParameters, num_probes),           true,  true,  1.f,   32.f   },
+	{ "max_kernel_radius",    offsetof(SoftShadowParameters, max_kernel_radius),    false, true,  1.f,   40.f   },
+	{ "early_out_confidence", offsetof(SoftShadowParameters, early_out_confidence), false, true,  0.5f,  1.05f  },
+};
+
+static const int numParameters = sizeof(parameterInfos) / sizeof(parameterInfos[0]);
+
+static const ParameterInfo *findParameter(const char *name)
+{
+	for(int i = 0; i < numParameters; i++)
+	{
+		if(strcmp(parameterInfos[i].name, name) == 0) return &parameterInfos[i];
+	}
+	return 0;
+}
+
+static float getValue(const SoftShadowParameters &params, const ParameterInfo &info)
+{
+	const char *value = reinterpret_cast<const char*>(&params) + info.offset;
+	return info.integer ? float(*reinterpret_cast<const int*>(value)) : *reinterpret_cast<const float*>(value);
+}
+
+static void setValue(SoftShadowParameters &params, const ParameterInfo &info, float value)
+{
+	char *dst = reinterpret_cast<char*>(&params) + info.offset;
+	if(info.integer) *reinterpret_cast<int*>(dst) = int(floorf(value + 0.5f));
+	else *reinterpret_cast<float*>(dst) = value;
+}
+
+//--------------------------------------------------------------
+// Parameter presets
+//--------------------------------------------------------------
+
+SoftShadowParameters getDefaultParameters()
+{
+	SoftShadowParameters params;
+	params.k = 3.f;
+	params.alpha = 1.f;
+	params.mu = 2.f;
+	params.sigma = 130.f * 2.f;
+	params.max_num_samples = 100.f;
+	params.max_beta = 10.f;
+	params.num_probes = 9;
+	params.max_kernel_radius = 10.f;
+	params.early_out_confidence = 0.9f;
+	return params;
+}
+
+bool loadPreset(const std::string &filename, SoftShadowParameters &params)
+{
+	FILE *file = fopen(filename.c_str(), "r");
+	if(!file)
+	{
+		return false;
+	}
+
+	char line[256];
+	while(fgets(line, sizeof(line), file))
+	{
+		char name[64];
+		float value;
+		if(line[0] == '#' || sscanf(line, "%63s %f", name, &value) != 2) continue;
+
+		const ParameterInfo *info = findParameter(name);
+		if(!info)
+		{
+			printf("Unknown parameter '%s' in %s\n", name, filename.c_str());
+			continue;
+		}
+		setValue(params, *info, value);
+	}
+	fclose(file);
+	return true;
+}
+
+bool savePreset(const std::string &filename, const SoftShadowParameters &params, const std::string &comment)
+{
+	FILE *file = fopen(filename.c_str(), "w");
+	if(!file)
+	{
+		return false;
+	}
+
+	fprintf(file, "# %s\n", comment.c_str());
+	for(int i = 0; i < numParameters; i++)
+	{
+		fprintf(file, "%s %g\n", parameterInfos[i].name, getValue(params, parameterInfos[i]));
+	}
+	fclose(file);
+	return true;
+}
+
+void printParameters(const SoftShadowParameters &params)
+{
+	for(int i = 0; i < numParameters; i++)
+	{
+		printf("  %-22s %g\n", parameterInfos[i].name, getValue(params, parameterInfos[i]));
+	}
+}
+
+//--------------------------------------------------------------
+// Auto-tuner
+//--------------------------------------------------------------
+
+// Candidates reaching the target error beat those that don't. Among those
+// that do, fewer rays win. Among those that don't, lower error wins.
+static bool isBetter(const TuningResult &a, const TuningResult &b, double targetError)
+{
+	const bool aReaches = a.error <= targetError, bReaches = b.error <= targetError;
+	if(aReaches != bReaches) return aReaches;
+	return aReaches ? a.numRays < b.numRays : a.error < b.error;
+}
+
+TuningResult tuneParameters(const SoftShadowParameters &initial, double targetError, int maxEvaluations, EvaluateFunc evaluate)
+{
+	TuningResult best;
+	best.params = initial;
+	evaluate(best.params, best.numRays, best.error);
+	best.numEvaluations = 1;
+	printf("Tuning for error <= %g, initial: %.0f shadow rays, error %g\n", targetError, best.numRays, best.error);
+
+	// Steps start at a quarter of each parameter's range and are halved
+	// whenever a full sweep over all parameters finds no improvement
+	float stepScale = 0.25f;
+	while(best.numEvaluations < maxEvaluations && stepScale >= 1.f / 64.f)
+	{
+		bool improved = false;
+		for(int i = 0; i < numParameters && best.numEvaluations < maxEvaluations; i++)
+		{
+			const ParameterInfo &info = parameterInfos[i];
+			if(!info.tuned) continue;
+			float step = (info.maxValue - info.minValue) * stepScale;
+			if(info.integer) step = std::max(floorf(step + 0.5f), 1.f);
+
+			for(int direction = -1; direction <= 1 && best.numEvaluations < maxEvaluations; direction += 2)
+			{
+				const float current = getValue(best.params, info);
+				TuningResult candidate = best;
+				setValue(candidate.params, info, std::min(std::max(current + direction * step, info.minValue), info.maxValue));
+				if(getValue(candidate.params, info) == current) continue;
+
+				evaluate(candidate.params, candidate.numRays, candidate.error);
+				best.numEvaluations++;
+				if(isBetter(candidate, best, targetError))
+				{
+					candidate.numEvaluations = best.numEvaluations;
+					best = candidate;
+					improved = true;
+					printf("[%3d] %s = %g: %.0f shadow rays, error %g\n", best.numEvaluations, info.name, getValue(best.params, info), best.numRays, best.error);
+					break;
+				}
+			}
+		}
+
+		if(!improved)
+		{
+			stepScale *= 0.5f;
+		}
+	}
+
+	if(best.error > targetError)
+	{
+		printf("Could not reach the target error, best error is %g\n", best.error);
+	}
+	return best;
+}
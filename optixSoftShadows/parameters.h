@@ -0,0 +1,41 @@
+#pragma once
+
+#include "structs.h"
+
+#include <string>
+#include <functional>
+
+//--------------------------------------------------------------
+// Parameter presets
+//--------------------------------------------------------------
+
+// Constants from the paper
+SoftShadowParameters getDefaultParameters();
+
+// Presets are text files with one "name value" pair per line.
+// Parameters missing from the file keep their current value.
+bool loadPreset(const std::string &filename, SoftShadowParameters &params);
+bool savePreset(const std::string &filename, const SoftShadowParameters &params, const std::string &comment);
+
+void printParameters(const SoftShadowParameters &params);
+
+//--------------------------------------------------------------
+// Auto-tuner
+//
+// Pattern search over the parameters for the set that reaches
+// the target error with the fewest shadow rays. Renders are
+// deterministic (fixed seeds), so every evaluation is exact.
+//--------------------------------------------------------------
+
+// Renders with the given parameters and returns the number of
+// shadow rays traced and the error against the ground truth
+typedef std::function<void(const SoftShadowParameters &params, double &numRays, double &error)> EvaluateFunc;
+
+struct TuningResult
+{
+	SoftShadowParameters params;
+	double numRays, error;
+	int numEvaluations;
+};
+
+TuningResult tuneParameters(const SoftShadowParameters &initial, double targetError, int maxEvaluations, EvaluateFunc evaluate);
@@ -0,0 +1,660 @@
+#include "pipeline.h"
+#include "util.h"
+
+#include <limits.h>
+
+static size_t getFormatSize(RTformat format)
+{
+	switch(format)
+	{
+		case RT_FORMAT_FLOAT: return sizeof(float);
+		case RT_FORMAT_FLOAT2: return sizeof(float2);
+		case RT_FORMAT_FLOAT3: return sizeof(float3);
+		case RT_FORMAT_FLOAT4: return sizeof(float4);
+		default: throw Exception("Unsupported render target format");
+	}
+}
+
+// Target versions are derived from the versions they depend on
+static uint64_t combineVersion(uint64_t hash, uint64_t value)
+{
+	return hashBytes(&value, sizeof(value), hash);
+}
+
+//--------------------------------------------------------------
+// Declarations
+//--------------------------------------------------------------
+
+void Pipeline::addTarget(const std::string &name, RTformat format, bool persistent, RTsize targetWidth, RTsize targetHeight)
+{
+	Target target;
+	target.name = name;
+	target.format = format;
+	target.width = targetWidth;
+	target.height = targetHeight;
+	target.source = false;
+	target.persistent = persistent;
+	target.screenSized = targetWidth == (RTsize)width && targetHeight == (RTsize)height;
+	if(target.screenSized)
+	{
+		target.width = renderWidth;
+		target.height = renderHeight;
+	}
+	target.version = 0;
+	targets.push_back(target);
+	persistentBuffers.push_back(-1);
+
+	// Bind a placeholder so the context validates before the target is allocated
+	context[name + "_buffer"]->set(getPlaceholder(format));
+}
+
+void Pipeline::addSource(const std::string &name)
+{
+	Target source;
+	source.name = name;
+	source.format = RT_FORMAT_UNKNOWN;
+	source.width = source.height = 0;
+	source.source = true;
+	source.persistent = false;
+	source.screenSized = false;
+	source.version = 0;
+	targets.push_back(source);
+	persistentBuffers.push_back(-1);
+}
+
+void Pipeline::touch(const std::string &name)
+{
+	targets[getSourceIndex(name)].version++;
+}
+
+void Pipeline::setSourceState(const std::string &name, const void *data, size_t size)
+{
+	targets[getSourceIndex(name)].version = hashBytes(data, size);
+}
+
+uint64_t Pipeline::getSourceVersion(const std::string &name) const
+{
+	return targets[getSourceIndex(name)].version;
+}
+
+void Pipeline::addPass(const std::string &name, std::function<void()> func, const Names &inputs, const Names &outputs, const Bindings &bindings)
+{
+	Pass pass;
+	pass.name = name;
+	pass.group = currentGroup;
+	pass.func = func;
+	for(const std::string &input : inputs) pass.inputs.push_back(getTargetIndex(input));
+	for(const std::string &output : outputs)
+	{
+		const int target = getTargetIndex(output);
+		if(targets[target].source) throw Exception("Pass '" + name + "' writes source '" + output + "'");
+		pass.outputs.push_back(target);
+	}
+	for(const std::pair<std::string, std::string> &binding : bindings)
+	{
+		const int target = getTargetIndex(binding.second);
+		pass.bindings.push_back(std::make_pair(binding.first, target));
+		context[binding.first]->set(getPlaceholder(targets[target].format));
+	}
+	passes.push_back(pass);
+}
+
+void Pipeline::addStagedPass(const std::string &name, std::function<void()> begin, std::function<void()> host, std::function<void()> end, const Names &inputs, const Names &outputs, const Bindings &bindings)
+{
+	addPass(name, begin, inputs, outputs, bindings);
+	passes.back().host = host;
+	passes.back().end = end;
+}
+
+void Pipeline::addLaunchPass(const std::string &name, unsigned entryPoint, const Names &inputs, const Names &outputs, const Bindings &bindings, RTsize launchWidth, RTsize launchHeight)
+{
+	addSelectedLaunchPass(name, [entryPoint]() { return entryPoint; }, inputs, outputs, bindings, launchWidth, launchHeight);
+}
+
+void Pipeline::addSelectedLaunchPass(const std::string &name, std::function<unsigned()> selectEntryPoint, const Names &inputs, const Names &outputs, const Bindings &bindings, RTsize launchWidth, RTsize launchHeight)
+{
+	// Dimensions spanning the screen follow the render scale
+	const bool scaleX = launchWidth == (RTsize)width, scaleY = launchHeight == (RTsize)height;
+	addPass(name, [this, selectEntryPoint, launchWidth, launchHeight, scaleX, scaleY]()
+	{
+		context->launch(selectEntryPoint(), scaleX ? renderWidth : launchWidth, scaleY ? renderHeight : launchHeight);
+	}, inputs, outputs, bindings);
+}
+
+void Pipeline::setGroupEnabled(const std::string &group, bool enabled)
+{
+	disabledGroups[group] = !enabled;
+}
+
+int Pipeline::getTargetIndex(const std::string &name) const
+{
+	for(size_t i = 0; i < targets.size(); i++)
+	{
+		if(targets[i].name == name) return (int)i;
+	}
+	throw Exception("Unknown render target '" + name + "'");
+}
+
+int Pipeline::getSourceIndex(const std::string &name) const
+{
+	const int index = getTargetIndex(name);
+	if(!targets[index].source) throw Exception("'" + name + "' is not a source");
+	return index;
+}
+
+int Pipeline::allocateBuffer(const Target &target)
+{
+	buffers.push_back(sutil::createOutputBuffer(context, target.format, target.width, target.height, false));
+	bufferFormats.push_back(target.format);
+	bufferSizes.push_back(std::make_pair(target.width, target.height));
+	bufferScreenSized.push_back(target.screenSized);
+	bufferContents.push_back(std::make_pair(-1, 0ull));
+	return (int)buffers.size() - 1;
+}
+
+Buffer Pipeline::getPlaceholder(RTformat format)
+{
+	Buffer &placeholder = placeholders[format];
+	if(!placeholder)
+	{
+		placeholder = sutil::createOutputBuffer(context, format, 1, 1, false);
+	}
+	return placeholder;
+}
+
+//--------------------------------------------------------------
+// Planning
+//--------------------------------------------------------------
+
+// Walks the passes backwards from the outputs. The last enabled pass writing a
+// needed target is run, and its inputs become needed instead.
+std::vector<int> Pipeline::resolve(const std::vector<int> &outputs) const
+{
+	std::vector<bool> needed(targets.size(), false);
+	for(int output : outputs) needed[output] = true;
+
+	std::vector<int> result;
+	for(int i = (int)passes.size() - 1; i >= 0; i--)
+	{
+		const Pass &pass = passes[i];
+		std::map<std::string, bool>::const_iterator itr = disabledGroups.find(pass.group);
+		if(itr != disabledGroups.end() && itr->second) continue;
+
+		bool producesNeeded = false;
+		for(int output : pass.outputs) producesNeeded = producesNeeded || needed[output];
+		if(!producesNeeded) continue;
+
+		result.push_back(i);
+		for(int output : pass.outputs) needed[output] = false;
+		for(int input : pass.inputs) needed[input] = true;
+	}
+
+	for(size_t i = 0; i < targets.size(); i++)
+	{
+		if(needed[i] && !targets[i].source) throw Exception("No pass produces '" + targets[i].name + "'");
+	}
+	std::reverse(result.begin(), result.end());
+	return result;
+}
+
+const Pipeline::Plan &Pipeline::getPlan(const Names &outputNames)
+{
+	std::vector<int> outputs;
+	for(const std::string &name : outputNames) outputs.push_back(getTargetIndex(name));
+	const std::vector<int> passList = resolve(outputs);
+
+	std::string key;
+	for(int pass : passList) key += std::to_string(pass) + ",";
+	key += "|";
+	for(const std::string &name : outputNames) key += name + ",";
+
+	std::map<std::string, Plan>::iterator itr = plans.find(key);
+	if(itr != plans.end())
+	{
+		return itr->second;
+	}
+
+	// A pass depends on the last writer of the targets it reads and writes,
+	// and on the readers of the targets it overwrites
+	std::vector<int> levels(passList.size(), 0);
+	std::vector<int> lastWriter(targets.size(), -1);
+	std::vector<std::vector<int>> readers(targets.size());
+	for(size_t i = 0; i < passList.size(); i++)
+	{
+		const Pass &pass = passes[passList[i]];
+		for(int input : pass.inputs)
+		{
+			if(lastWriter[input] >= 0) levels[i] = std::max(levels[i], levels[lastWriter[input]] + 1);
+		}
+		for(int output : pass.outputs)
+		{
+			if(lastWriter[output] >= 0) levels[i] = std::max(levels[i], levels[lastWriter[output]] + 1);
+			for(int reader : readers[output]) levels[i] = std::max(levels[i], levels[reader] + 1);
+		}
+
+		for(int input : pass.inputs) readers[input].push_back((int)i);
+		for(int output : pass.outputs)
+		{
+			lastWriter[output] = (int)i;
+			readers[output].clear();
+		}
+	}
+
+	// Run the passes level by level
+	std::vector<int> order(passList.size());
+	for(size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&levels](int a, int b) { return levels[a] < levels[b]; });
+
+	Plan plan;
+	for(int i : order)
+	{
+		plan.passes.push_back(passList[i]);
+		plan.levels.push_back(levels[i]);
+	}
+
+	// Find the first and last pass using each target
+	const int numPasses = (int)plan.passes.size();
+	std::vector<int> first(targets.size(), -1), last(targets.size(), -1);
+	for(int i = 0; i < numPasses; i++)
+	{
+		const Pass &pass = passes[plan.passes[i]];
+		for(int input : pass.inputs)
+		{
+			if(targets[input].source) continue;
+			if(first[input] < 0)
+			{
+				throw Exception("Pass '" + pass.name + "' reads '" + targets[input].name + "' before any pass writes it");
+			}
+			last[input] = i;
+		}
+		for(int output : pass.outputs)
+		{
+			if(first[output] < 0) first[output] = i;
+			last[output] = i;
+		}
+	}
+	for(int output : outputs)
+	{
+		last[output] = numPasses;
+	}
+
+	// Assign targets to buffers in the order they are first written. A buffer
+	// can be reused once the last pass using its previous target has run.
+	// Buffers of persistent targets are never reused.
+	const size_t numBuffers = buffers.size();
+	std::vector<int> busyUntil(buffers.size(), -1);
+	for(int buffer : persistentBuffers)
+	{
+		if(buffer >= 0) busyUntil[buffer] = INT_MAX;
+	}
+	plan.targetBuffers.assign(targets.size(), -1);
+	for(int i = 0; i < numPasses; i++)
+	{
+		for(int output : passes[plan.passes[i]].outputs)
+		{
+			if(first[output] != i || plan.targetBuffers[output] >= 0) continue;
+
+			if(targets[output].persistent)
+			{
+				if(persistentBuffers[output] < 0)
+				{
+					persistentBuffers[output] = allocateBuffer(targets[output]);
+					busyUntil.push_back(INT_MAX);
+				}
+				plan.targetBuffers[output] = persistentBuffers[output];
+				continue;
+			}
+
+			int buffer = -1;
+			for(size_t j = 0; j < buffers.size() && buffer < 0; j++)
+			{
+				if(bufferFormats[j] == targets[output].format && bufferSizes[j] == std::make_pair(targets[output].width, targets[output].height) &&
+				   bufferScreenSized[j] == targets[output].screenSized && busyUntil[j] < i) buffer = (int)j;
+			}
+			if(buffer < 0)
+			{
+				buffer = allocateBuffer(targets[output]);
+				busyUntil.push_back(-1);
+			}
+			busyUntil[buffer] = last[output];
+			plan.targetBuffers[output] = buffer;
+		}
+	}
+
+	if(buffers.size() != numBuffers)
+	{
+		printMemoryUsage();
+	}
+	return plans[key] = plan;
+}
+
+//--------------------------------------------------------------
+// Execution
+//--------------------------------------------------------------
+
+void Pipeline::bind(const Plan &plan, const Pass &pass)
+{
+	for(int input : pass.inputs)
+	{
+		if(targets[input].source) continue;
+		context[targets[input].name + "_buffer"]->set(buffers[plan.targetBuffers[input]]);
+	}
+	for(int output : pass.outputs)
+	{
+		context[targets[output].name + "_buffer"]->set(buffers[plan.targetBuffers[output]]);
+	}
+	for(const std::pair<std::string, int> &binding : pass.bindings)
+	{
+		context[binding.first]->set(buffers[plan.targetBuffers[binding.second]]);
+	}
+}
+
+int Pipeline::execute(const Names &outputNames)
+{
+	const Plan &plan = getPlan(outputNames);
+	currentPlan = &plan;
+
+	// Derive the version of every pass output from the pass and the versions
+	// of its inputs, and remember which pass output each input reads
+	const int numPasses = (int)plan.passes.size();
+	std::vector<uint64_t> targetVersions(targets.size());
+	std::vector<std::pair<int, int>> targetWriters(targets.size(), std::make_pair(-1, -1));
+	for(size_t i = 0; i < targets.size(); i++) targetVersions[i] = targets[i].version;
+
+	std::vector<std::vector<uint64_t>> outputVersions(numPasses);
+	std::vector<std::vector<std::pair<int, int>>> inputWriters(numPasses); // Pass and output index, -1 for sources
+	for(int i = 0; i < numPasses; i++)
+	{
+		const Pass &pass = passes[plan.passes[i]];
+		uint64_t signature = combineVersion(hashBytes(pass.name.data(), pass.name.size()), plan.passes[i]);
+		for(int input : pass.inputs)
+		{
+			signature = combineVersion(signature, targetVersions[input]);
+			inputWriters[i].push_back(targetWriters[input]);
+		}
+		for(size_t j = 0; j < pass.outputs.size(); j++)
+		{
+			const int output = pass.outputs[j];
+			outputVersions[i].push_back(combineVersion(signature, output));
+			targetVersions[output] = outputVersions[i].back();
+			targetWriters[output] = std::make_pair(i, (int)j);
+		}
+	}
+
+	// A pass runs if an output version that is needed isn't held by its buffer.
+	// The inputs of running passes are needed, and a running pass writing a
+	// buffer invalidates what later passes writing the same buffer produced.
+	std::vector<bool> run(numPasses, false);
+	bool changed = true;
+	while(changed)
+	{
+		changed = false;
+
+		std::vector<std::vector<bool>> needed(numPasses);
+		for(int i = 0; i < numPasses; i++) needed[i].assign(passes[plan.passes[i]].outputs.size(), false);
+		for(const std::string &name : outputNames)
+		{
+			const std::pair<int, int> writer = targetWriters[getTargetIndex(name)];
+			needed[writer.first][writer.second] = true;
+		}
+
+		for(int i = numPasses - 1; i >= 0; i--)
+		{
+			const Pass &pass = passes[plan.passes[i]];
+			for(size_t j = 0; j < pass.outputs.size() && !run[i]; j++)
+			{
+				const int buffer = plan.targetBuffers[pass.outputs[j]];
+				if(needed[i][j] && bufferContents[buffer] != std::make_pair(pass.outputs[j], outputVersions[i][j]))
+				{
+					run[i] = changed = true;
+				}
+			}
+			if(!run[i]) continue;
+
+			for(const std::pair<int, int> &writer : inputWriters[i])
+			{
+				if(writer.first >= 0) needed[writer.first][writer.second] = true;
+			}
+		}
+
+		std::vector<bool> overwritten(buffers.size(), false);
+		for(int i = 0; i < numPasses; i++)
+		{
+			const Pass &pass = passes[plan.passes[i]];
+			for(int output : pass.outputs)
+			{
+				if(!run[i] && overwritten[plan.targetBuffers[output]]) run[i] = changed = true;
+			}
+			if(!run[i]) continue;
+
+			for(int output : pass.outputs) overwritten[plan.targetBuffers[output]] = true;
+		}
+	}
+
+	// Run the passes level by level. The host stages of a level run on the pool
+	// while the following passes of the level start, and the level's end stages
+	// run once they have all finished.
+	typedef std::chrono::high_resolution_clock Clock;
+	int numRun = 0;
+	for(int levelStart = 0; levelStart < numPasses; )
+	{
+		int levelEnd = levelStart;
+		while(levelEnd < numPasses && plan.levels[levelEnd] == plan.levels[levelStart]) levelEnd++;
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		int numHostRunning = 0;
+		std::exception_ptr error;
+		std::vector<double> hostTimes(levelEnd - levelStart, 0.0);
+		for(int i = levelStart; i < levelEnd; i++)
+		{
+			Pass &pass = passes[plan.passes[i]];
+			if(!run[i])
+			{
+				pass.numReused++;
+				continue;
+			}
+
+			// Host stages still running reference this frame, so wait for them before rethrowing
+			const Clock::time_point start = Clock::now();
+			try
+			{
+				bind(plan, pass);
+				pass.func();
+			}
+			catch(...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if(!error) error = std::current_exception();
+				break;
+			}
+			pass.totalTime += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			if(!pass.host) continue;
+
+			double &hostTime = hostTimes[i - levelStart];
+			std::function<void()> job = [&pass, &hostTime, &mutex, &condition, &numHostRunning, &error]()
+			{
+				const Clock::time_point hostStart = Clock::now();
+				try
+				{
+					pass.host();
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if(!error) error = std::current_exception();
+				}
+				hostTime = std::chrono::duration<double, std::milli>(Clock::now() - hostStart).count();
+				std::lock_guard<std::mutex> lock(mutex);
+				numHostRunning--;
+				condition.notify_all();
+			};
+			if(!pool)
+			{
+				numHostRunning++;
+				job();
+				continue;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				numHostRunning++;
+			}
+			pool->enqueue(job);
+		}
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&numHostRunning]() { return numHostRunning == 0; });
+		}
+		if(error) std::rethrow_exception(error);
+
+		for(int i = levelStart; i < levelEnd; i++)
+		{
+			if(!run[i]) continue;
+			Pass &pass = passes[plan.passes[i]];
+			pass.totalTime += hostTimes[i - levelStart];
+			if(pass.end)
+			{
+				bind(plan, pass);
+				const Clock::time_point start = Clock::now();
+				pass.end();
+				pass.totalTime += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+			}
+			pass.numTimedRuns++;
+			pass.numRuns++;
+			numRun++;
+			for(size_t j = 0; j < pass.outputs.size(); j++)
+			{
+				bufferContents[plan.targetBuffers[pass.outputs[j]]] = std::make_pair(pass.outputs[j], outputVersions[i][j]);
+			}
+		}
+		levelStart = levelEnd;
+	}
+	lastReusedCount = numPasses - numRun;
+	return numRun;
+}
+
+void Pipeline::printPlan(const Names &outputs)
+{
+	const Plan &plan = getPlan(outputs);
+	std::string names;
+	for(const std::string &output : outputs) names += (names.empty() ? "" : ", ") + output;
+	printf("Passes producing %s:\n", names.c_str());
+	for(size_t i = 0; i < plan.passes.size(); i++)
+	{
+		const Pass &pass = passes[plan.passes[i]];
+		printf("  %2d  %s%s\n", plan.levels[i], pass.name.c_str(), pass.host ? " (host stage runs concurrently)" : "");
+	}
+}
+
+void Pipeline::printReuseStats() const
+{
+	printf("Pass reuse:\n");
+	for(const Pass &pass : passes)
+	{
+		const int total = pass.numRuns + pass.numReused;
+		if(total == 0) continue;
+		printf("  %-28s %6d runs, %6d reused (%.0f%%)\n", pass.name.c_str(), pass.numRuns, pass.numReused, 100.0 * pass.numReused / total);
+	}
+}
+
+Pipeline::Names Pipeline::getPassNames() const
+{
+	Names names;
+	for(const Pass &pass : passes) names.push_back(pass.name);
+	return names;
+}
+
+double Pipeline::getPassTime(const std::string &name) const
+{
+	for(const Pass &pass : passes)
+	{
+		if(pass.name == name) return pass.numTimedRuns ? pass.totalTime / pass.numTimedRuns : 0.0;
+	}
+	throw Exception("Unknown pass '" + name + "'");
+}
+
+void Pipeline::resetPassTimes()
+{
+	for(Pass &pass : passes)
+	{
+		pass.numTimedRuns = 0;
+		pass.totalTime = 0.0;
+	}
+}
+
+void Pipeline::invalidate()
+{
+	for(std::pair<int, uint64_t> &contents : bufferContents) contents = std::make_pair(-1, 0ull);
+}
+
+void Pipeline::setRenderScale(float scale)
+{
+	const RTsize tile = 8;
+	const RTsize newWidth = std::max(tile, RTsize(width * scale / tile + 0.5f) * tile);
+	const RTsize newHeight = std::max(tile, RTsize(height * scale / tile + 0.5f) * tile);
+	renderScale = scale;
+	if(newWidth == renderWidth && newHeight == renderHeight) return;
+
+	for(Target &target : targets)
+	{
+		if(!target.screenSized) continue;
+		target.width = newWidth;
+		target.height = newHeight;
+	}
+	for(size_t i = 0; i < buffers.size(); i++)
+	{
+		if(!bufferScreenSized[i]) continue;
+		buffers[i]->setSize(newWidth, newHeight);
+		bufferSizes[i] = std::make_pair(newWidth, newHeight);
+	}
+	renderWidth = newWidth;
+	renderHeight = newHeight;
+	invalidate();
+}
+
+bool Pipeline::hasTarget(const std::string &name) const
+{
+	for(const Target &target : targets)
+	{
+		if(!target.source && target.name == name) return true;
+	}
+	return false;
+}
+
+Buffer Pipeline::getBuffer(const std::string &target) const
+{
+	const int index = getTargetIndex(target);
+	if(!currentPlan || currentPlan->targetBuffers[index] < 0)
+	{
+		throw Exception("Render target '" + target + "' was not produced by the last sequence");
+	}
+	return buffers[currentPlan->targetBuffers[index]];
+}
+
+//--------------------------------------------------------------
+// Memory usage
+//--------------------------------------------------------------
+
+size_t Pipeline::getAllocatedBytes() const
+{
+	size_t bytes = 0;
+	for(size_t i = 0; i < buffers.size(); i++) bytes += getFormatSize(bufferFormats[i]) * bufferSizes[i].first * bufferSizes[i].second;
+	return bytes;
+}
+
+size_t Pipeline::getNaiveBytes() const
+{
+	size_t bytes = 0;
+	for(const Target &target : targets)
+	{
+		if(!target.source) bytes += getFormatSize(target.format) * target.width * target.height;
+	}
+	return bytes;
+}
+
+void Pipeline::printMemoryUsage() const
+{
+	const int numTargets = (int)std::count_if(targets.begin(), targets.end(), [](const Target &target) { return !target.source; });
+	printf("Render targets: %.1f MB in %d buffers (%.1f MB for %d targets without aliasing)\n",
+		   getAllocatedBytes() / (1024.0 * 1024.0), (int)buffers.size(), getNaiveBytes() / (1024.0 * 1024.0), numTargets);
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "common.h"
+#include "tasks.h"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+
+//--------------------------------------------------------------
+// Render pipeline
+//
+// Passes declare the render targets they read and write, in the
+// order they run. Targets are screen-sized unless declared with
+// another size. Requesting a set of outputs runs only the passes
+// those outputs depend on: the last pass writing a target
+// produces it, and a pass reading a target it writes (e.g. one
+// only touching some pixels) depends on earlier writers.
+//
+// Within a plan, each target lives from its first producer to
+// its last consumer, and targets with non-overlapping lifetimes
+// share a buffer. Buffers are allocated the first time a plan
+// needs them, so debug-only targets cost nothing until shown.
+//
+// Sources stand for state outside the pipeline (camera, light,
+// parameters). Every target version is derived from the passes
+// and source versions it was produced from, and passes whose
+// outputs are still held by their buffers are skipped. Targets
+// marked persistent get a buffer of their own, so they survive
+// until their sources change.
+//
+// The render scale shrinks the screen-sized targets and launches,
+// trading resolution for time.
+//--------------------------------------------------------------
+
+class Pipeline
+{
+public:
+	typedef std::vector<std::string> Names;
+	typedef std::vector<std::pair<std::string, std::string>> Bindings; // Context variable and target
+
+	// Declares a render target. It is bound to the context variable <name>_buffer
+	// whenever a pass reading or writing it runs.
+	// Persistent targets are never aliased. Targets only share buffers of the same size.
+	void addTarget(const std::string &name, RTformat format, bool persistent = false, RTsize targetWidth = width, RTsize targetHeight = height);
+
+	// Declares a source passes can list as an input
+	void addSource(const std::string &name);
+
+	// Marks a source as changed
+	void touch(const std::string &name);
+
+	// Sets a source to a version derived from its state, so returning
+	// to an earlier state makes earlier results valid again
+	void setSourceState(const std::string &name, const void *data, size_t size);
+	uint64_t getSourceVersion(const std::string &name) const;
+
+	// Declares a pass. Bindings bind additional context variables to
+	// targets while the pass runs, e.g. { "box_input_buffer", "diffuse" }.
+	void addPass(const std::string &name, std::function<void()> func, const Names &inputs, const Names &outputs, const Bindings &bindings = Bindings());
+
+	// Declares a pass split into stages around work that doesn't need the context,
+	// e.g. reducing a buffer read back by begin. begin and end run on the thread
+	// calling execute(), host runs on the thread pool in between. The host stages of
+	// the passes on one level run concurrently with each other and with the rest of
+	// the level, and end runs once the whole level has been started.
+	void addStagedPass(const std::string &name, std::function<void()> begin, std::function<void()> host, std::function<void()> end, const Names &inputs, const Names &outputs, const Bindings &bindings = Bindings());
+
+	// Declares a pass that launches an entry point
+	void addLaunchPass(const std::string &name, unsigned entryPoint, const Names &inputs, const Names &outputs, const Bindings &bindings = Bindings(), RTsize launchWidth = width, RTsize launchHeight = height);
+
+	// Declares a pass that launches the entry point chosen each time it runs, e.g. among
+	// variants of a kernel that produce the same result
+	void addSelectedLaunchPass(const std::string &name, std::function<unsigned()> selectEntryPoint, const Names &inputs, const Names &outputs, const Bindings &bindings = Bindings(), RTsize launchWidth = width, RTsize launchHeight = height);
+
+	// Passes declared between beginGroup() and endGroup() belong to the group.
+	// Disabled groups are ignored when resolving dependencies, which selects
+	// between alternative passes producing the same target.
+	void beginGroup(const std::string &group) { currentGroup = group; }
+	void endGroup() { currentGroup.clear(); }
+	void setGroupEnabled(const std::string &group, bool enabled);
+
+	// Runs the passes the outputs depend on, skipping those whose results
+	// are still valid. The outputs are kept alive until the end, so they
+	// can be read with getBuffer(). Returns the number of passes run.
+	int execute(const Names &outputs);
+	int getLastReusedCount() const { return lastReusedCount; }
+
+	// Prints the passes the outputs depend on. Passes on the same level don't
+	// depend on each other. Launches are serialized by the context, so what runs
+	// concurrently within a level are the host stages of staged passes.
+	void printPlan(const Names &outputs);
+
+	// Pool running the host stages, they run inline without one
+	void setThreadPool(ThreadPool *threadPool) { pool = threadPool; }
+
+	// Buffer holding the target in the last executed plan
+	Buffer getBuffer(const std::string &target) const;
+	bool hasTarget(const std::string &name) const;
+
+	// Prints how often each pass ran and was skipped
+	void printReuseStats() const;
+
+	// Average time of a pass in ms over its runs since the last reset, 0 if it didn't run
+	Names getPassNames() const;
+	double getPassTime(const std::string &pass) const;
+	void resetPassTimes();
+
+	// Forgets every result, e.g. after the layout of all buffers changed
+	void invalidate();
+
+	// Resizes the screen-sized targets and launches to the scaled screen size,
+	// rounded to whole 8x8 tiles. Forgets every result if the size changes.
+	void setRenderScale(float scale);
+	float getRenderScale() const { return renderScale; }
+	RTsize getRenderWidth() const { return renderWidth; }
+	RTsize getRenderHeight() const { return renderHeight; }
+
+	// Memory of the allocated buffers versus one buffer per target
+	size_t getAllocatedBytes() const;
+	size_t getNaiveBytes() const;
+	void printMemoryUsage() const;
+
+private:
+	struct Target
+	{
+		std::string name;
+		RTformat format;
+		RTsize width, height;
+		bool source;      // No buffer, only a version
+		bool persistent;
+		bool screenSized; // Follows the render scale
+		uint64_t version; // Sources only
+	};
+
+	struct Pass
+	{
+		std::string name;
+		std::string group;
+		std::function<void()> func;
+		std::function<void()> host, end; // Staged passes only
+		std::vector<int> inputs, outputs;
+		std::vector<std::pair<std::string, int>> bindings;
+		int numRuns = 0, numReused = 0;
+		int numTimedRuns = 0;
+		double totalTime = 0.0; // In ms, since the last reset
+	};
+
+	// Passes to run, their dependency level, and the buffer of each target (-1 if unused)
+	struct Plan
+	{
+		std::vector<int> passes;
+		std::vector<int> levels;
+		std::vector<int> targetBuffers;
+	};
+
+	int getTargetIndex(const std::string &name) const;
+	int getSourceIndex(const std::string &name) const;
+	int allocateBuffer(const Target &target);
+	Buffer getPlaceholder(RTformat format);
+	std::vector<int> resolve(const std::vector<int> &outputs) const;
+	const Plan &getPlan(const Names &outputs);
+	void bind(const Plan &plan, const Pass &pass);
+
+	std::vector<Target> targets;
+	std::vector<Pass> passes;
+	std::vector<Buffer> buffers;
+	std::vector<RTformat> bufferFormats;
+	std::vector<std::pair<RTsize, RTsize>> bufferSizes;
+	std::vector<bool> bufferScreenSized;                  // Buffers resized by the render scale
+	std::vector<std::pair<int, uint64_t>> bufferContents; // Target and version each buffer holds
+	std::vector<int> persistentBuffers;                   // Buffer of each persistent target, -1 if none
+	std::map<RTformat, Buffer> placeholders; // 1x1 buffers bound to unused targets
+	std::map<std::string, Plan> plans;       // Cached by passes and outputs
+	std::map<std::string, bool> disabledGroups;
+	std::string currentGroup;
+	const Plan *currentPlan = 0;
+	ThreadPool *pool = 0;
+	int lastReusedCount = 0;
+	float renderScale = 1.f;
+	RTsize renderWidth = width, renderHeight = height;
+};
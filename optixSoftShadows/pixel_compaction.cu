@@ -0,0 +1,132 @@
+#include <optixu/optixu_math_namespace.h>
+#include "structs.h"
+#include "pixel_layout.h"
+#include "pixel_list.h"
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Pixel compaction
+//
+// Builds the pixel lists (see pixel_list.h) with one thread per
+// 8x8 tile. The first launch counts the pixels of each class in
+// every tile. The counts are scanned in groups of
+// PIXEL_SCAN_GROUP, each group's total going to the level above,
+// until a single group is left. That one is scanned together
+// with the class totals, which gives the first entry of each
+// class, and the levels below add their group's first entries
+// back down to the tiles. The last launch writes each tile's
+// pixels there. The host only reads back pixel_list_starts, the
+// first entry of each class, to size the launches over the
+// lists. Background pixels get their beta here, as the beta pass
+// skips them.
+//--------------------------------------------------------------
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+rtDeclareVariable(uint2, launch_dim, rtLaunchDim, );
+rtBuffer<float,  2> object_id_buffer;
+rtBuffer<float4, 2> probe_buffer;
+rtBuffer<float,  2> d2_max_buffer;
+rtBuffer<float,  2> beta_buffer;
+rtBuffer<unsigned int, 1> pixel_list_starts;   // First entry of each class, and the size of the list
+rtBuffer<uint4,  1> pixel_scan;                // Counts, then first entries, of each class per tile, followed by the coarser levels
+rtDeclareVariable(uint3, pixel_scan_level, , ); // Offset and size of the level a launch works on, and offset of the level above
+rtDeclareVariable(SoftShadowParameters, params, , );
+
+// Classes as the adaptive sampling pass tells them apart
+unsigned int pixel_class(uint2 pixel)
+{
+	if(PIXEL(object_id_buffer, pixel) == 0.f) return BACKGROUND_PIXELS;
+	if(PIXEL(d2_max_buffer, pixel) <= 0.f) return LIT_PIXELS;
+	return PIXEL(probe_buffer, pixel).w >= params.num_probes ? UMBRA_PIXELS : PENUMBRA_PIXELS;
+}
+
+// Launched over the tiles
+RT_PROGRAM void count_pixel_classes()
+{
+	unsigned int counts[NUM_PIXEL_CLASSES] = { 0u, 0u, 0u, 0u };
+	for(unsigned int y = 0; y < PIXEL_TILE_SIZE; y++)
+	{
+		for(unsigned int x = 0; x < PIXEL_TILE_SIZE; x++)
+		{
+			counts[pixel_class(make_uint2(launch_index.x * PIXEL_TILE_SIZE + x, launch_index.y * PIXEL_TILE_SIZE + y))]++;
+		}
+	}
+	pixel_scan[launch_index.y * launch_dim.x + launch_index.x] = make_uint4(counts[0], counts[1], counts[2], counts[3]);
+}
+
+// Launched over the groups of a level. Replaces the counts of the group by their
+// prefix sums and stores the group's total in the level above.
+RT_PROGRAM void scan_pixel_groups()
+{
+	const unsigned int first = launch_index.x * PIXEL_SCAN_GROUP;
+	const unsigned int end = min(first + PIXEL_SCAN_GROUP, pixel_scan_level.y);
+	unsigned int sums[NUM_PIXEL_CLASSES] = { 0u, 0u, 0u, 0u };
+	for(unsigned int i = first; i < end; i++)
+	{
+		const uint4 counts = pixel_scan[pixel_scan_level.x + i];
+		pixel_scan[pixel_scan_level.x + i] = make_uint4(sums[0], sums[1], sums[2], sums[3]);
+		sums[0] += counts.x;
+		sums[1] += counts.y;
+		sums[2] += counts.z;
+		sums[3] += counts.w;
+	}
+	pixel_scan[pixel_scan_level.z + launch_index.x] = make_uint4(sums[0], sums[1], sums[2], sums[3]);
+}
+
+// Launched once over the top level, at most one group. Sets the first entry of
+// each class, and offsets the prefix sums by it.
+RT_PROGRAM void scan_pixel_classes()
+{
+	unsigned int sums[NUM_PIXEL_CLASSES] = { 0u, 0u, 0u, 0u };
+	for(unsigned int i = 0; i < pixel_scan_level.y; i++)
+	{
+		const uint4 counts = pixel_scan[pixel_scan_level.x + i];
+		pixel_scan[pixel_scan_level.x + i] = make_uint4(sums[0], sums[1], sums[2], sums[3]);
+		sums[0] += counts.x;
+		sums[1] += counts.y;
+		sums[2] += counts.z;
+		sums[3] += counts.w;
+	}
+
+	unsigned int starts[NUM_PIXEL_CLASSES + 1];
+	starts[0] = 0u;
+	for(unsigned int c = 0; c < NUM_PIXEL_CLASSES; c++)
+	{
+		starts[c + 1] = starts[c] + sums[c];
+		pixel_list_starts[c] = starts[c];
+	}
+	pixel_list_starts[NUM_PIXEL_CLASSES] = starts[NUM_PIXEL_CLASSES];
+
+	for(unsigned int i = 0; i < pixel_scan_level.y; i++)
+	{
+		const uint4 prefix = pixel_scan[pixel_scan_level.x + i];
+		pixel_scan[pixel_scan_level.x + i] = make_uint4(prefix.x + starts[0], prefix.y + starts[1], prefix.z + starts[2], prefix.w + starts[3]);
+	}
+}
+
+// Launched over the elements of a level below the top. Adds the first entries of
+// the element's group, which makes them the element's own.
+RT_PROGRAM void add_pixel_group_starts()
+{
+	const uint4 group = pixel_scan[pixel_scan_level.z + launch_index.x / PIXEL_SCAN_GROUP];
+	const uint4 prefix = pixel_scan[pixel_scan_level.x + launch_index.x];
+	pixel_scan[pixel_scan_level.x + launch_index.x] = make_uint4(prefix.x + group.x, prefix.y + group.y, prefix.z + group.z, prefix.w + group.w);
+}
+
+// Launched over the tiles
+RT_PROGRAM void compact_pixels()
+{
+	const uint4 first = pixel_scan[launch_index.y * launch_dim.x + launch_index.x];
+	unsigned int entries[NUM_PIXEL_CLASSES] = { first.x, first.y, first.z, first.w };
+	for(unsigned int y = 0; y < PIXEL_TILE_SIZE; y++)
+	{
+		for(unsigned int x = 0; x < PIXEL_TILE_SIZE; x++)
+		{
+			const uint2 pixel = make_uint2(launch_index.x * PIXEL_TILE_SIZE + x, launch_index.y * PIXEL_TILE_SIZE + y);
+			const unsigned int c = pixel_class(pixel);
+			pixel_list_buffer[pixel_list_position(entries[c]++)] = (pixel.y << 16) | pixel.x;
+			if(c == BACKGROUND_PIXELS) PIXEL(beta_buffer, pixel) = 0.f;
+		}
+	}
+}
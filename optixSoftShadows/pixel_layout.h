@@ -0,0 +1,43 @@
+#pragma once
+
+#include <optixu/optixu_math_namespace.h>
+
+//--------------------------------------------------------------
+// Pixel layout of the 2D buffers
+//
+// In the tiled layout, the pixels of every 8x8 tile are stored
+// next to each other, tiles in row-major order, so vertical taps
+// and neighbors stay within a few cache lines instead of landing
+// a whole row apart. Buffers keep their size, only the position
+// each pixel is stored at changes. Buffers whose size is not a
+// multiple of the tile size stay row-major.
+//
+// Every pass reads and writes pixels through PIXEL(), and the
+// host converts to row-major when it reads buffers back.
+//--------------------------------------------------------------
+
+#define PIXEL_TILE_SIZE 8
+
+// Position a pixel is stored at in a buffer of the given size
+static __host__ __device__ __inline__ optix::uint2 tiled_pixel_index(optix::uint2 pixel, optix::uint2 size)
+{
+	if(size.x % PIXEL_TILE_SIZE != 0 || size.y % PIXEL_TILE_SIZE != 0) return pixel;
+
+	// A row of tiles fills exactly PIXEL_TILE_SIZE rows of the buffer
+	const unsigned int offset = (pixel.x / PIXEL_TILE_SIZE) * PIXEL_TILE_SIZE * PIXEL_TILE_SIZE +
+								(pixel.y % PIXEL_TILE_SIZE) * PIXEL_TILE_SIZE +
+								pixel.x % PIXEL_TILE_SIZE;
+	return optix::make_uint2(offset % size.x, pixel.y - pixel.y % PIXEL_TILE_SIZE + offset / size.x);
+}
+
+#ifdef __CUDACC__
+rtDeclareVariable(unsigned int, tiled_layout, , ); // Set by the host for all programs
+
+static __device__ __inline__ optix::uint2 pixel_index(optix::uint2 pixel, optix::size_t2 size)
+{
+	return tiled_layout ? tiled_pixel_index(pixel, optix::make_uint2((unsigned int)size.x, (unsigned int)size.y)) : pixel;
+}
+
+// Element of a 2D buffer at a pixel, in the current layout
+#define PIXEL(buffer, pixel) buffer[pixel_index(pixel, buffer.size())]
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <optixu/optixu_math_namespace.h>
+
+//--------------------------------------------------------------
+// Pixel lists
+//
+// After the probe pass, the compaction pass sorts the pixels by
+// what the later passes have left to do with them, one class
+// after the other and each class by 8x8 tile, in scan order
+// within the tile (see pixel_compaction.cu). Passes only needed
+// by some classes are launched in 1D over a range of the list
+// instead of over the screen, so their cost follows the number
+// of pixels in those classes. The host reads where the classes
+// start back after the compaction to size those launches.
+//
+// Entries hold the pixel's y in the high and x in the low 16
+// bits. The list is stored in a screen-sized buffer, row by row.
+//--------------------------------------------------------------
+
+#define PIXEL_SCAN_GROUP 32u // Elements a thread of the compaction's scan sums
+
+enum PixelClass
+{
+	PENUMBRA_PIXELS,   // Some probes occluded
+	UMBRA_PIXELS,      // All probes occluded
+	LIT_PIXELS,        // No occluder found, shaded by the probe pass
+	BACKGROUND_PIXELS, // No geometry
+	NUM_PIXEL_CLASSES
+};
+
+#ifdef __CUDACC__
+rtBuffer<unsigned int, 2> pixel_list_buffer;
+rtDeclareVariable(int, pixel_list_offset, , ); // First entry of the launch, -1 for launches over the screen
+
+static __device__ __inline__ optix::uint2 pixel_list_position(unsigned int entry)
+{
+	const unsigned int width = (unsigned int)pixel_list_buffer.size().x;
+	return optix::make_uint2(entry % width, entry / width);
+}
+
+// Pixel a thread works on, given its launch index
+static __device__ __inline__ optix::uint2 launch_pixel(optix::uint2 launch_index)
+{
+	if(pixel_list_offset < 0) return launch_index;
+	const unsigned int packed = pixel_list_buffer[pixel_list_position((unsigned int)pixel_list_offset + launch_index.x)];
+	return optix::make_uint2(packed & 0xffffu, packed >> 16);
+}
+#endif
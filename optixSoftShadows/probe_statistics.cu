@@ -0,0 +1,65 @@
+#include <optixu/optixu_math_namespace.h>
+#include "structs.h"
+#include "pixel_layout.h"
+#include "probe_statistics.h"
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Probe statistics
+//
+// Counts the geometry pixels by how many of their probes were
+// occluded, and sums the adaptive samples traced for them, so
+// the governor reads back a few numbers instead of the screen.
+// Each thread sums an 8x8 tile, which the tiled layout stores in
+// one piece, and adds it to one of a few slots to keep the
+// atomics from all landing on the same address.
+//--------------------------------------------------------------
+
+rtDeclareVariable(uint2, launch_index, rtLaunchIndex, );
+rtDeclareVariable(uint2, launch_dim, rtLaunchDim, );
+rtBuffer<float,  2> object_id_buffer;
+rtBuffer<float4, 2> probe_buffer;
+rtBuffer<float,  2> num_samples_buffer;
+rtBuffer<unsigned int, 2> probe_statistics_buffer; // NUM_PROBE_STATISTICS by PROBE_STATISTICS_SLOTS
+rtDeclareVariable(SoftShadowParameters, params, , );
+
+RT_PROGRAM void clear_probe_statistics()
+{
+	probe_statistics_buffer[launch_index] = 0u;
+}
+
+RT_PROGRAM void reduce_probe_statistics()
+{
+	unsigned int sums[NUM_PROBE_STATISTICS] = { 0u, 0u, 0u, 0u, 0u };
+	for(unsigned int y = 0; y < PIXEL_TILE_SIZE; y++)
+	{
+		for(unsigned int x = 0; x < PIXEL_TILE_SIZE; x++)
+		{
+			const uint2 pixel = make_uint2(launch_index.x * PIXEL_TILE_SIZE + x, launch_index.y * PIXEL_TILE_SIZE + y);
+			if(PIXEL(object_id_buffer, pixel) == 0.f) continue;
+			const float num_occluded = PIXEL(probe_buffer, pixel).w;
+			const unsigned int num_samples = (unsigned int)PIXEL(num_samples_buffer, pixel);
+			if(num_occluded == 0.f)
+			{
+				sums[LIT_PIXEL_COUNT]++;
+			}
+			else if(num_occluded >= params.num_probes)
+			{
+				sums[UMBRA_PIXEL_COUNT]++;
+				sums[UMBRA_SAMPLE_COUNT] += num_samples;
+			}
+			else
+			{
+				sums[PENUMBRA_PIXEL_COUNT]++;
+				sums[PENUMBRA_SAMPLE_COUNT] += num_samples;
+			}
+		}
+	}
+
+	const unsigned int slot = (launch_index.y * launch_dim.x + launch_index.x) % PROBE_STATISTICS_SLOTS;
+	for(unsigned int i = 0; i < NUM_PROBE_STATISTICS; i++)
+	{
+		if(sums[i] > 0u) atomicAdd(&probe_statistics_buffer[make_uint2(i, slot)], sums[i]);
+	}
+}
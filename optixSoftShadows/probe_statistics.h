@@ -0,0 +1,22 @@
+#pragma once
+
+//--------------------------------------------------------------
+// Probe statistics
+//
+// Sums the probe statistics pass (see probe_statistics.cu) keeps
+// for the governor. The buffer has a column per sum and a row per
+// slot, the host adds up the slots. Its width isn't a multiple of
+// the tile size, so it stays row-major in the tiled layout.
+//--------------------------------------------------------------
+
+#define PROBE_STATISTICS_SLOTS 32
+
+enum ProbeStatistic
+{
+	LIT_PIXEL_COUNT,
+	PENUMBRA_PIXEL_COUNT,
+	UMBRA_PIXEL_COUNT,
+	PENUMBRA_SAMPLE_COUNT, // Adaptive samples, whole ones
+	UMBRA_SAMPLE_COUNT,
+	NUM_PROBE_STATISTICS
+};
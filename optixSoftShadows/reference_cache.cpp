@@ -0,0 +1,149 @@
+#include "reference_cache.h"
+#include "util.h"
+
+#include <fstream>
+
+// Written before the pixels of every image
+struct ReferenceHeader
+{
+	char magic[4];
+	uint32_t width, height;
+	uint64_t key;
+};
+
+static const char referenceMagic[4] = { 'G', 'T', 'C', '1' };
+
+ReferenceCache::ReferenceCache(const std::string &directory, size_t maxBytes)
+	: directory(directory), maxBytes(maxBytes)
+{
+	if(!createDirectory(directory)) printf("Could not create %s, references won't be cached\n", directory.c_str());
+	loadIndex();
+}
+
+std::string ReferenceCache::getKeyString(uint64_t key)
+{
+	char name[17];
+	snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+	return name;
+}
+
+std::string ReferenceCache::getFilename(uint64_t key) const
+{
+	return directory + "/" + getKeyString(key) + ".gt";
+}
+
+bool ReferenceCache::load(uint64_t key, unsigned width, unsigned height, std::vector<float3> &pixels)
+{
+	std::map<uint64_t, Entry>::iterator entry = entries.find(key);
+	if(entry == entries.end())
+	{
+		numMisses++;
+		return false;
+	}
+
+	// Files that went missing or don't match are dropped
+	std::ifstream file(getFilename(key), std::ios::binary);
+	ReferenceHeader header;
+	pixels.resize(width * height);
+	if(!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+	   memcmp(header.magic, referenceMagic, sizeof(referenceMagic)) != 0 ||
+	   header.width != width || header.height != height || header.key != key ||
+	   !file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(float3)))
+	{
+		file.close();
+		remove(getFilename(key).c_str());
+		totalBytes -= entry->second.bytes;
+		entries.erase(entry);
+		saveIndex();
+		numMisses++;
+		return false;
+	}
+
+	entry->second.lastUsed = ++useCounter;
+	saveIndex();
+	numHits++;
+	return true;
+}
+
+// Images are written to a temporary file first, so other processes never load a partial one
+void ReferenceCache::store(uint64_t key, unsigned width, unsigned height, const std::vector<float3> &pixels)
+{
+	const std::string tempFilename = getTempFilename(getFilename(key));
+	std::ofstream file(tempFilename, std::ios::binary);
+	ReferenceHeader header;
+	memcpy(header.magic, referenceMagic, sizeof(referenceMagic));
+	header.width = width;
+	header.height = height;
+	header.key = key;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float3));
+	file.close();
+	if(!file || !replaceFile(tempFilename, getFilename(key)))
+	{
+		remove(tempFilename.c_str());
+		printf("Could not write %s, reference not cached\n", getFilename(key).c_str());
+		return;
+	}
+
+	Entry &entry = entries[key];
+	totalBytes -= entry.bytes;
+	entry.bytes = sizeof(header) + pixels.size() * sizeof(float3);
+	entry.lastUsed = ++useCounter;
+	totalBytes += entry.bytes;
+	evict();
+	saveIndex();
+}
+
+// Removes the least recently used images until the cache fits, always keeping the newest one
+void ReferenceCache::evict()
+{
+	while(totalBytes > maxBytes && entries.size() > 1)
+	{
+		std::map<uint64_t, Entry>::iterator oldest = entries.begin();
+		for(std::map<uint64_t, Entry>::iterator entry = entries.begin(); entry != entries.end(); ++entry)
+		{
+			if(entry->second.lastUsed < oldest->second.lastUsed) oldest = entry;
+		}
+		remove(getFilename(oldest->first).c_str());
+		totalBytes -= oldest->second.bytes;
+		entries.erase(oldest);
+	}
+}
+
+// One line per image: key, size in bytes and last use. Images other processes added
+// since are merged in, as long as their files still exist.
+void ReferenceCache::loadIndex()
+{
+	std::ifstream file(directory + "/index.txt");
+	std::string key;
+	Entry entry;
+	while(file >> key >> entry.bytes >> entry.lastUsed)
+	{
+		const uint64_t value = strtoull(key.c_str(), 0, 16);
+		useCounter = std::max(useCounter, entry.lastUsed);
+		if(entries.count(value) || !std::ifstream(getFilename(value))) continue;
+		entries[value] = entry;
+		totalBytes += entry.bytes;
+	}
+	evict();
+}
+
+// Processes sharing the directory each replace the whole index, so it is written
+// to a temporary file and moved over the old one, which other processes then
+// either see entirely or not at all
+void ReferenceCache::saveIndex()
+{
+	loadIndex();
+	const std::string filename = directory + "/index.txt", tempFilename = getTempFilename(filename);
+	std::ofstream file(tempFilename);
+	for(const std::pair<const uint64_t, Entry> &entry : entries)
+	{
+		file << getKeyString(entry.first) << " " << entry.second.bytes << " " << entry.second.lastUsed << "\n";
+	}
+	file.close();
+	if(!file || !replaceFile(tempFilename, filename))
+	{
+		remove(tempFilename.c_str());
+		printf("Could not write %s\n", filename.c_str());
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdint.h>
+
+//--------------------------------------------------------------
+// Reference image cache
+//
+// Ground truth images are stored in a directory, one file per
+// key. The key is a hash of everything the image depends on, so
+// an image that was rendered once is loaded instead of rendered
+// again. An index keeps the size and last use of every image,
+// and the least recently used ones are evicted once the cache
+// grows beyond its size limit. Several processes can share the
+// directory: files are replaced in one step, and each process
+// merges the images others added into the index it writes.
+//--------------------------------------------------------------
+
+class ReferenceCache
+{
+public:
+	ReferenceCache(const std::string &directory, size_t maxBytes);
+
+	// Returns false if the image isn't cached
+	bool load(uint64_t key, unsigned width, unsigned height, std::vector<float3> &pixels);
+	void store(uint64_t key, unsigned width, unsigned height, const std::vector<float3> &pixels);
+
+	size_t getSize() const { return totalBytes; }
+	int getImageCount() const { return (int)entries.size(); }
+	int getHitCount() const { return numHits; }
+	int getMissCount() const { return numMisses; }
+
+	static std::string getKeyString(uint64_t key);
+
+private:
+	struct Entry
+	{
+		size_t bytes = 0;
+		uint64_t lastUsed = 0; // Value of useCounter when last loaded or stored
+	};
+
+	std::string getFilename(uint64_t key) const;
+	void loadIndex();
+	void saveIndex();
+	void evict();
+
+	std::string directory;
+	size_t maxBytes, totalBytes = 0;
+	std::map<uint64_t, Entry> entries;
+	uint64_t useCounter = 0;
+	int numHits = 0, numMisses = 0;
+};
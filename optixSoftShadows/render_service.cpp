@@ -0,0 +1,267 @@
+// Sockets have to be included before anything including windows.h
+#include "sockets.h"
+#include "render_service.h"
+#include "util.h"
+
+//--------------------------------------------------------------
+// Network thread
+//--------------------------------------------------------------
+
+RenderService::RenderService(unsigned short port)
+	: stopping(false)
+{
+	startSockets();
+	listener = openLoopbackListener(port, 8);
+	if(listener == INVALID_SOCKET_VALUE)
+	{
+		stopSockets();
+		throw Exception("Could not listen on port " + std::to_string(port));
+	}
+
+	thread = std::thread(&RenderService::run, this);
+}
+
+RenderService::~RenderService()
+{
+	stopping = true;
+	thread.join();
+	connections.clear();
+	closesocket(listener);
+	stopSockets();
+}
+
+void RenderService::run()
+{
+	while(!stopping)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		uintptr_t maxSocket = listener;
+		for(const Connection &connection : connections)
+		{
+			FD_SET(connection.socket->socket, &readable);
+			maxSocket = std::max(maxSocket, connection.socket->socket);
+		}
+
+		// Wake up regularly to notice when the service stops
+		timeval timeout = { 0, 100000 };
+		if(select((int)maxSocket + 1, &readable, 0, 0, &timeout) <= 0) continue;
+
+		if(FD_ISSET(listener, &readable))
+		{
+			const uintptr_t socket = accept(listener, 0, 0);
+			if(socket == INVALID_SOCKET_VALUE) continue;
+			setSendTimeout(socket, SOCKET_SEND_TIMEOUT);
+			std::lock_guard<std::mutex> lock(connectionMutex);
+			Connection connection;
+			connection.id = nextConnection++;
+			connection.socket = std::make_shared<Socket>(socket);
+			connections.push_back(connection);
+		}
+
+		// Only this thread adds and removes connections, so reading them needs no lock
+		std::vector<int> closed;
+		for(Connection &connection : connections)
+		{
+			if(!FD_ISSET(connection.socket->socket, &readable)) continue;
+
+			char data[4096];
+			const int size = (int)recv(connection.socket->socket, data, sizeof(data), 0);
+			if(size <= 0)
+			{
+				closed.push_back(connection.id);
+				continue;
+			}
+			connection.received.append(data, size);
+
+			size_t end;
+			while((end = connection.received.find('\n')) != std::string::npos)
+			{
+				std::string line = connection.received.substr(0, end);
+				connection.received.erase(0, end + 1);
+				if(!line.empty() && line.back() == '\r') line.pop_back();
+				if(!line.empty()) handleLine(connection, line);
+			}
+		}
+		for(int client : closed) closeConnection(client);
+	}
+	queueCondition.notify_all();
+}
+
+void RenderService::handleLine(Connection &connection, const std::string &line)
+{
+	std::istringstream tokens(line);
+	std::string command;
+	tokens >> command;
+
+	RenderRequest request = {};
+	request.client = connection.id;
+	if(command == "stats")
+	{
+		sendAll(connection.id, getStats() + "\n");
+		return;
+	}
+	if(command == "shutdown")
+	{
+		stopping = true;
+		queueCondition.notify_all();
+		return;
+	}
+	if(command != "render")
+	{
+		respondError(request, "unknown command '" + command + "'");
+		return;
+	}
+
+	request.output = "filtered";
+	bool hasCamera = false, valid = true;
+	std::string token;
+	while(tokens >> token)
+	{
+		const size_t equals = token.find('=');
+		const std::string key = token.substr(0, equals);
+		const std::string value = equals == std::string::npos ? std::string() : token.substr(equals + 1);
+		float3 &position = request.camera.position;
+		float3 &corner = request.lightCorner;
+		if(key == "id") request.id = (unsigned)strtoul(value.c_str(), 0, 10);
+		else if(key == "output") request.output = value;
+		else if(key == "camera") hasCamera = sscanf(value.c_str(), "%f,%f,%f,%f,%f", &position.x, &position.y, &position.z, &request.camera.pitch, &request.camera.yaw) == 5;
+		else if(key == "light") valid = valid && (request.hasLight = sscanf(value.c_str(), "%f,%f,%f", &corner.x, &corner.y, &corner.z) == 3);
+		else if(key == "size") valid = valid && sscanf(value.c_str(), "%u,%u", &request.width, &request.height) == 2 && request.width > 0 && request.height > 0;
+		else valid = false;
+	}
+	if(!valid || !hasCamera)
+	{
+		respondError(request, hasCamera ? "malformed request" : "missing camera");
+		return;
+	}
+
+	request.receivedTime = request.camera.timestamp = getElapsedTime();
+	{
+		std::lock_guard<std::mutex> lock(metricsMutex);
+		if(firstRequestTime < 0.0) firstRequestTime = request.receivedTime;
+	}
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		queue.push_back(request);
+	}
+	queueCondition.notify_all();
+}
+
+RenderService::Socket::~Socket()
+{
+	closesocket(socket);
+}
+
+bool RenderService::sendAll(int client, const std::string &line, const char *data, size_t size)
+{
+	// Only the lookup is locked, so a slow client doesn't hold up the network thread
+	std::shared_ptr<Socket> socket;
+	{
+		std::lock_guard<std::mutex> lock(connectionMutex);
+		for(const Connection &connection : connections)
+		{
+			if(connection.id == client) socket = connection.socket;
+		}
+	}
+	if(!socket) return false;
+
+	std::lock_guard<std::mutex> lock(socket->sendMutex);
+	const std::pair<const char*, size_t> parts[2] = { std::make_pair(line.data(), line.size()), std::make_pair(data, size) };
+	for(std::pair<const char*, size_t> part : parts)
+	{
+		while(part.second > 0 && !socket->broken)
+		{
+			const int sent = (int)send(socket->socket, part.first, (int)std::min(part.second, (size_t)1 << 20), MSG_NOSIGNAL);
+			if(sent <= 0)
+			{
+				// Timed out or failed partway, the network thread sees the shutdown and closes the connection
+				socket->broken = true;
+				shutdown(socket->socket, SHUT_RDWR);
+			}
+			else
+			{
+				part.first += sent;
+				part.second -= sent;
+			}
+		}
+	}
+	return !socket->broken;
+}
+
+void RenderService::closeConnection(int client)
+{
+	std::lock_guard<std::mutex> lock(connectionMutex);
+	for(size_t i = 0; i < connections.size(); i++)
+	{
+		if(connections[i].id != client) continue;
+		connections.erase(connections.begin() + i);
+		return;
+	}
+}
+
+//--------------------------------------------------------------
+// Rendering thread
+//--------------------------------------------------------------
+
+std::vector<RenderRequest> RenderService::waitForRequests(double timeout)
+{
+	std::unique_lock<std::mutex> lock(queueMutex);
+	queueCondition.wait_for(lock, std::chrono::duration<double>(timeout), [this]() { return !queue.empty() || stopping; });
+	std::vector<RenderRequest> requests(queue.begin(), queue.end());
+	queue.clear();
+	return requests;
+}
+
+void RenderService::respond(const RenderRequest &request, const std::string &output, unsigned width, unsigned height, unsigned channels, const std::vector<float> &data)
+{
+	const double latency = 1000.0 * (getElapsedTime() - request.receivedTime);
+	char header[256];
+	snprintf(header, sizeof(header), "frame id=%u output=%s width=%u height=%u channels=%u latency_ms=%.2f\n",
+			 request.id, output.c_str(), width, height, channels, latency);
+	if(!sendAll(request.client, header, reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float)))
+	{
+		printf("Request %u: client disconnected\n", request.id);
+	}
+
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	latencies.push_back(1000.0 * (getElapsedTime() - request.receivedTime));
+	lastResponseTime = getElapsedTime();
+}
+
+void RenderService::respondError(const RenderRequest &request, const std::string &message)
+{
+	const std::string line = "error id=" + std::to_string(request.id) + " " + message + "\n";
+	sendAll(request.client, line);
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	numErrors++;
+}
+
+void RenderService::recordBatch(int numRequests, int numBatchGBuffers)
+{
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	numBatches++;
+	numBatchedRequests += numRequests;
+	numGBuffers += numBatchGBuffers;
+}
+
+std::string RenderService::getStats() const
+{
+	std::lock_guard<std::mutex> lock(metricsMutex);
+	std::vector<double> sorted = latencies;
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](double p) { return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))]; };
+	const double average = sorted.empty() ? 0.0 : std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+	const double duration = lastResponseTime - firstRequestTime;
+
+	char stats[512];
+	snprintf(stats, sizeof(stats), "stats requests=%d errors=%d batches=%d requests_per_batch=%.2f requests_per_gbuffer=%.2f "
+			 "throughput=%.2f/s latency_avg_ms=%.2f latency_p50_ms=%.2f latency_p95_ms=%.2f latency_max_ms=%.2f",
+			 (int)latencies.size(), numErrors, numBatches,
+			 numBatches ? double(numBatchedRequests) / numBatches : 0.0,
+			 numGBuffers ? double(numBatchedRequests) / numGBuffers : 0.0,
+			 duration > 0.0 ? latencies.size() / duration : 0.0,
+			 average, percentile(0.5), percentile(0.95), percentile(1.0));
+	return stats;
+}
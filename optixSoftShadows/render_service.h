@@ -0,0 +1,109 @@
+#pragma once
+
+#include "frames.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+//--------------------------------------------------------------
+// Render service
+//
+// Listens on a local TCP port for render requests, one per line:
+//
+//   render id=<n> output=<target> camera=<x>,<y>,<z>,<pitch>,<yaw>
+//          [light=<x>,<y>,<z>] [size=<width>,<height>]
+//   stats
+//   shutdown
+//
+// A network thread accepts connections and parses requests into
+// a queue. The thread owning the OptiX context takes everything
+// queued at once, renders it and answers each request with
+//
+//   frame id=<n> output=<target> width=<w> height=<h> channels=<c> latency_ms=<t>
+//
+// followed by width * height * channels row-major floats, or
+// with "error id=<n> <message>". Stats are answered with a
+// single "stats ..." line.
+//--------------------------------------------------------------
+
+struct RenderRequest
+{
+	int client;            // Connection the result is sent to
+	unsigned id;           // Chosen by the client, echoed in the response
+	std::string output;    // Render target, or an alias like "filtered"
+	CameraSnapshot camera;
+	bool hasLight;         // Moves the light's corner if set
+	float3 lightCorner;
+	unsigned width, height; // 0 for the native resolution
+	double receivedTime;
+};
+
+class RenderService
+{
+public:
+	// Listens on 127.0.0.1:port, throws if the port can't be opened
+	RenderService(unsigned short port);
+	~RenderService();
+
+	// Waits up to timeout seconds for requests and returns all queued ones
+	std::vector<RenderRequest> waitForRequests(double timeout);
+
+	// Sends a result. Data holds the row-major pixels with the given number of floats each.
+	void respond(const RenderRequest &request, const std::string &output, unsigned width, unsigned height, unsigned channels, const std::vector<float> &data);
+	void respondError(const RenderRequest &request, const std::string &message);
+
+	// Records a batch of requests that was rendered with the given number of G-buffers
+	void recordBatch(int numRequests, int numGBuffers);
+
+	std::string getStats() const;
+	bool isStopping() const { return stopping; }
+
+private:
+	// Closed when the last sender lets go of it, so sending needs no lock on the connections
+	struct Socket
+	{
+		uintptr_t socket;
+		std::mutex sendMutex; // Keeps the messages of different threads apart
+		bool broken = false;  // A send failed partway, the stream can't be continued
+		Socket(uintptr_t socket) : socket(socket) {}
+		~Socket();
+	};
+
+	struct Connection
+	{
+		int id;
+		std::shared_ptr<Socket> socket;
+		std::string received; // Partial line
+	};
+
+	void run();
+	void handleLine(Connection &connection, const std::string &line);
+	// Sends a line, followed by size bytes of data, without other messages in between
+	bool sendAll(int client, const std::string &line, const char *data = 0, size_t size = 0);
+	void closeConnection(int client);
+
+	uintptr_t listener;
+	std::thread thread;
+	std::atomic<bool> stopping;
+
+	std::vector<Connection> connections;
+	int nextConnection = 1;
+	mutable std::mutex connectionMutex; // Guards connections against the rendering thread looking up a client
+
+	std::deque<RenderRequest> queue;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+
+	// Metrics
+	mutable std::mutex metricsMutex;
+	std::vector<double> latencies; // In ms, from receiving a request until its result was sent
+	double firstRequestTime = -1.0, lastResponseTime = 0.0;
+	int numBatches = 0, numBatchedRequests = 0, numGBuffers = 0, numErrors = 0;
+};
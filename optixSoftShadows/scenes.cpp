@@ -1,11 +1,415 @@
 #include "scenes.h"
 #include "geometry.h"
+#include "util.h"
+
+#include <random>
+
+//--------------------------------------------------------------
+// Scene loading tasks
+//--------------------------------------------------------------
+
+TaskGraph::Task Scene::addLightTask(TaskGraph &graph)
+{
+	return graph.addTask("upload light", [this]()
+	{
+		lightBuffer = context->createBuffer(RT_BUFFER_INPUT);
+		lightBuffer->setFormat(RT_FORMAT_USER);
+		lightBuffer->setElementSize(sizeof(ParallelogramLight));
+		lightBuffer->setSize(1u);
+		memcpy(lightBuffer->map(), &light, sizeof(light));
+		lightBuffer->unmap();
+		context["lights"]->setBuffer(lightBuffer);
+	}, {}, true);
+}
+
+TaskGraph::Task Scene::addMaterialTask(TaskGraph &graph)
+{
+	return graph.addTask("create material", [this]()
+	{
+		diffuse = createDiffuseMaterial();
+	}, { graph.getTask("compile main.cu"), graph.getTask("compile ground_truth.cu") }, true);
+}
+
+TaskGraph::Task Scene::addMeshTask(TaskGraph &graph, const std::string &filename, const float3 &color, const Matrix4x4 &transformationMatrix, const std::vector<TaskGraph::Task> &dependencies)
+{
+	// Parse the file on the thread pool, then upload it on the main thread
+	std::shared_ptr<MeshData> mesh = std::make_shared<MeshData>();
+	std::shared_ptr<MeshData> proxy = std::make_shared<MeshData>();
+	const float proxyError = shadowProxyError;
+	TaskGraph::Task parse = graph.addTask("parse " + filename, [mesh, proxy, proxyError, filename, transformationMatrix]()
+	{
+		loadObj(filename, *mesh, transformationMatrix);
+		if(proxyError > 0.f)
+		{
+			simplifyMesh(*mesh, proxyError, *proxy);
+			printf("Shadow proxy of %s: %d -> %d triangles\n", filename.c_str(), (int)mesh->indices.size(), (int)proxy->indices.size());
+		}
+	});
+
+	std::vector<TaskGraph::Task> createDependencies = dependencies;
+	createDependencies.push_back(parse);
+	createDependencies.push_back(graph.getTask("compile triangle_mesh.cu"));
+	return graph.addTask("create " + filename, [this, mesh, proxy, color]()
+	{
+		GeometryInstance gi = createMesh(*mesh, diffuse, color);
+		GeometryInstance proxyGi = proxy->indices.empty() ? gi : createProxy(*proxy, diffuse, gi);
+		addInstance(gi, proxyGi);
+		addOccluder(gi["object_id"]->getUint(), mesh->positions, false, gi, proxyGi);
+		cpuMeshes.push_back(mesh);
+		hashMesh(*mesh, color);
+	}, createDependencies, true);
+}
+
+TaskGraph::Task Scene::addAccelerationTask(TaskGraph &graph, const std::string &builder, const std::vector<TaskGraph::Task> &dependencies)
+{
+	return graph.addTask("create geometry group", [this, builder]()
+	{
+		sceneGroup = context->createGeometryGroup(gis.begin(), gis.end());
+		sceneGroup->setAcceleration(context->createAcceleration(builder));
+		context["scene_geometry"]->set(sceneGroup);
+
+		// Shadow rays share the scene's group unless some mesh has a proxy
+		shadowGroup = sceneGroup;
+		bool hasProxies = false;
+		for(size_t i = 0; i < gis.size(); i++)
+			if(shadowGis[i].get() != gis[i].get()) hasProxies = true;
+		if(hasProxies)
+		{
+			shadowGroup = context->createGeometryGroup(shadowGis.begin(), shadowGis.end());
+			shadowGroup->setAcceleration(context->createAcceleration(builder));
+		}
+
+		// Instances are traced through their transforms, next to the scene's group
+		auto createInstanceGroup = [this, builder](GeometryGroup group)
+		{
+			Group instances = context->createGroup();
+			instances->setAcceleration(context->createAcceleration(builder));
+			instances->setChildCount((uint)transforms.size() + 1);
+			instances->setChild(0, group);
+			for(size_t i = 0; i < transforms.size(); i++) instances->setChild((uint)i + 1, transforms[i]);
+			return instances;
+		};
+		if(!transforms.empty())
+		{
+			instanceGroup = createInstanceGroup(sceneGroup);
+			shadowInstanceGroup = hasProxies ? createInstanceGroup(shadowGroup) : instanceGroup;
+			context["scene_geometry"]->set(instanceGroup);
+		}
+
+		// Shadow rays of every object trace the selector child given by its object id
+		occluderSetBuffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_UNSIGNED_INT, maxObjectId + 1);
+		context["occluder_sets"]->setBuffer(occluderSetBuffer);
+		occluderSelector = context->createSelector();
+		occluderSelector->setVisitProgram(getProgram("main", "visit_occluders"));
+		updateOccluders();
+	}, dependencies, true);
+}
+
+void Scene::addInstance(GeometryInstance gi, GeometryInstance shadowProxy)
+{
+	gis.push_back(gi);
+	shadowGis.push_back(shadowProxy.get() ? shadowProxy : gi);
+}
+
+void Scene::addOccluder(uint objectId, const std::vector<float3> &positions, bool planar, GeometryInstance full, GeometryInstance proxy)
+{
+	Occluder occluder;
+	occluder.objectId = objectId;
+	occluder.lower = make_float3(FLT_MAX);
+	occluder.upper = make_float3(-FLT_MAX);
+	for(const float3 &position : positions)
+	{
+		occluder.lower = fminf(occluder.lower, position);
+		occluder.upper = fmaxf(occluder.upper, position);
+	}
+	occluder.planar = planar;
+	maxObjectId = std::max(maxObjectId, objectId);
+
+	// Proxies stay within the bounds of their mesh
+	occluder.full = context->createGeometryGroup();
+	occluder.full->setAcceleration(context->createAcceleration("Trbvh"));
+	occluder.full->addChild(full);
+	occluder.proxy = occluder.full;
+	if(proxy.get() != full.get())
+	{
+		occluder.proxy = context->createGeometryGroup();
+		occluder.proxy->setAcceleration(context->createAcceleration("Trbvh"));
+		occluder.proxy->addChild(proxy);
+	}
+	occluders.push_back(occluder);
+}
+
+void Scene::addQuadSoup(const QuadSoup& quads)
+{
+	GeometryInstance soup = createQuadSoup(quads, diffuse);
+	addInstance(soup);
+	quadSoups.push_back(quads);
+	std::shared_ptr<MeshData> mesh = std::make_shared<MeshData>();
+	quads.getTriangles(*mesh);
+	cpuMeshes.push_back(mesh);
+	hashMesh(*mesh, make_float3(0.f));
+	contentHash = hashBytes(quads.getColors().data(), quads.getColors().size() * sizeof(float3), contentHash);
+
+	// Every quad is an occluder of its own
+	std::vector<uint> objectIds;
+	std::vector<GeometryInstance> quadGis = splitQuadSoup(soup, objectIds);
+	for(size_t i = 0; i < quadGis.size(); i++)
+	{
+		const std::vector<float3> corners(mesh->positions.begin() + 4 * i, mesh->positions.begin() + 4 * i + 4);
+		addOccluder(objectIds[i], corners, true, quadGis[i], quadGis[i]);
+	}
+}
+
+static uint64_t hashMeshData(const MeshData &mesh)
+{
+	uint64_t hash = hashBytes(mesh.positions.data(), mesh.positions.size() * sizeof(float3));
+	hash = hashBytes(mesh.normals.data(), mesh.normals.size() * sizeof(float3), hash);
+	return hashBytes(mesh.indices.data(), mesh.indices.size() * sizeof(int3), hash);
+}
+
+void Scene::addMeshInstance(Geometry geometry, Acceleration acceleration, std::shared_ptr<MeshData> mesh, const float3 &color, const Matrix4x4 &matrix)
+{
+	GeometryInstance gi = createMeshInstance(geometry, diffuse, color);
+	maxObjectId = std::max(maxObjectId, gi["object_id"]->getUint());
+
+	GeometryGroup group = context->createGeometryGroup();
+	group->setAcceleration(acceleration);
+	group->addChild(gi);
+	Transform transform = context->createTransform();
+	transform->setChild(group);
+	transform->setMatrix(false, matrix.getData(), 0);
+	transforms.push_back(transform);
+	cpuInstances.push_back(std::make_pair(mesh, matrix));
+
+	// Meshes are hashed once, however often they are instanced
+	std::map<const MeshData*, uint64_t>::iterator meshHash = meshHashes.find(mesh.get());
+	if(meshHash == meshHashes.end())
+	{
+		meshHash = meshHashes.insert(std::make_pair(mesh.get(), hashMeshData(*mesh))).first;
+	}
+	contentHash = hashBytes(&meshHash->second, sizeof(meshHash->second), contentHash);
+	contentHash = hashBytes(matrix.getData(), 16 * sizeof(float), contentHash);
+	contentHash = hashBytes(&color, sizeof(color), contentHash);
+}
+
+void Scene::hashMesh(const MeshData &mesh, const float3 &color)
+{
+	const uint64_t meshHash = hashMeshData(mesh);
+	contentHash = hashBytes(&meshHash, sizeof(meshHash), contentHash);
+	contentHash = hashBytes(&color, sizeof(color), contentHash);
+}
+
+void Scene::buildCpuBVH(WideBVH& bvh) const
+{
+	for(const std::shared_ptr<MeshData> &mesh : cpuMeshes)
+	{
+		bvh.addMesh(*mesh);
+	}
+	for(const std::pair<std::shared_ptr<MeshData>, Matrix4x4> &instance : cpuInstances)
+	{
+		MeshData mesh = *instance.first;
+		for(float3 &position : mesh.positions) position = make_float3(instance.second * make_float4(position, 1.f));
+		bvh.addMesh(mesh);
+	}
+	bvh.build();
+}
+
+void Scene::setLight(const ParallelogramLight &newLight)
+{
+	light = newLight;
+	memcpy(lightBuffer->map(), &light, sizeof(light));
+	lightBuffer->unmap();
+	context["lights"]->setBuffer(lightBuffer);
+}
+
+void Scene::setShadowProxiesEnabled(bool enabled)
+{
+	shadowProxiesEnabled = enabled;
+	clearOccluderSets();
+	updateOccluders();
+}
+
+//--------------------------------------------------------------
+// Occluder culling
+//--------------------------------------------------------------
+
+// Planes of the convex hull of the points, as normal and distance with the normal
+// facing outwards. Brute force, meant for a handful of points.
+static std::vector<float4> getHullPlanes(const std::vector<float3> &points, float epsilon)
+{
+	std::vector<float4> planes;
+	const size_t n = points.size();
+	for(size_t i = 0; i < n; i++)
+	{
+		for(size_t j = i + 1; j < n; j++)
+		{
+			for(size_t k = j + 1; k < n; k++)
+			{
+				const float3 normal = cross(points[j] - points[i], points[k] - points[i]);
+				if(length(normal) < epsilon * epsilon) continue;
+				const float3 unitNormal = normalize(normal);
+				const float distance = dot(unitNormal, points[i]);
+
+				bool above = false, below = false;
+				for(const float3 &point : points)
+				{
+					const float d = dot(unitNormal, point) - distance;
+					above |= d > epsilon;
+					below |= d < -epsilon;
+				}
+				if(above && below) continue;
+				planes.push_back(above ? make_float4(-unitNormal, -distance) : make_float4(unitNormal, distance));
+			}
+		}
+	}
+	return planes;
+}
+
+// True if the box lies outside one of the planes. Touching counts as outside.
+static bool isOutside(const std::vector<float4> &planes, const float3 &lower, const float3 &upper, float epsilon)
+{
+	for(const float4 &plane : planes)
+	{
+		// Corner of the box furthest in the plane's inward direction
+		const float3 corner = make_float3(plane.x > 0.f ? lower.x : upper.x, plane.y > 0.f ? lower.y : upper.y, plane.z > 0.f ? lower.z : upper.z);
+		if(dot(make_float3(plane), corner) - plane.w >= -epsilon) return true;
+	}
+	return false;
+}
+
+void Scene::setOccluderCullingEnabled(bool enabled)
+{
+	occluderCulling = enabled;
+	updateOccluders();
+}
+
+void Scene::clearOccluderSets()
+{
+	for(std::pair<const std::vector<int>, Group> &set : occluderSets)
+	{
+		set.second->destroy();
+	}
+	occluderSets.clear();
+}
+
+void Scene::updateOccluders()
+{
+	// Receivers tracing their own proxy start their shadow rays beyond it. With occluder
+	// culling, they trace their full mesh instead.
+	const bool proxies = shadowProxiesEnabled && hasShadowProxies();
+	context["shadow_ray_offset"]->setFloat(proxies ? 2.f * shadowProxyError : 0.f);
+
+	// The occluder sets grow with the square of the number of objects, so instanced
+	// scenes always trace everything
+	if(!transforms.empty())
+	{
+		context["shadow_geometry"]->set(shadowProxiesEnabled ? shadowInstanceGroup : instanceGroup);
+		culledFraction = 0.f;
+		return;
+	}
+
+	GeometryGroup all = shadowProxiesEnabled ? shadowGroup : sceneGroup;
+	if(!occluderCulling || occluders.empty())
+	{
+		context["shadow_geometry"]->set(all);
+		culledFraction = 0.f;
+		return;
+	}
+	context["shadow_ray_offset"]->setFloat(0.f);
+
+	// An object can only occlude a receiver if it intersects the hull of the receiver and the light
+	const float3 lightCorners[] = { light.corner, light.corner + light.v1, light.corner + light.v2, light.corner + light.v1 + light.v2 };
+	std::map<std::vector<int>, Group> sets;
+	std::vector<std::vector<int>> receiverSets(occluders.size());
+	size_t numCulled = 0;
+	for(size_t i = 0; i < occluders.size(); i++)
+	{
+		const Occluder &receiver = occluders[i];
+		std::vector<float3> hull(lightCorners, lightCorners + 4);
+		for(int corner = 0; corner < 8; corner++)
+		{
+			hull.push_back(make_float3(corner & 1 ? receiver.upper.x : receiver.lower.x,
+									   corner & 2 ? receiver.upper.y : receiver.lower.y,
+									   corner & 4 ? receiver.upper.z : receiver.lower.z));
+		}
+		float3 hullLower = make_float3(FLT_MAX), hullUpper = make_float3(-FLT_MAX);
+		for(const float3 &point : hull)
+		{
+			hullLower = fminf(hullLower, point);
+			hullUpper = fmaxf(hullUpper, point);
+		}
+		const float epsilon = 1e-4f * length(hullUpper - hullLower);
+		const std::vector<float4> planes = getHullPlanes(hull, epsilon);
+
+		auto canOcclude = [&](const Occluder &occluder)
+		{
+			if(&occluder == &receiver) return !receiver.planar;
+			const bool overlaps = occluder.lower.x < hullUpper.x - epsilon && occluder.upper.x > hullLower.x + epsilon &&
+								  occluder.lower.y < hullUpper.y - epsilon && occluder.upper.y > hullLower.y + epsilon &&
+								  occluder.lower.z < hullUpper.z - epsilon && occluder.upper.z > hullLower.z + epsilon;
+			return overlaps && !isOutside(planes, occluder.lower, occluder.upper, epsilon);
+		};
+
+		// A receiver shadowing itself traces its full mesh, stored as ~index, as its
+		// proxy lies above its surface
+		std::vector<int> &visible = receiverSets[i];
+		for(size_t j = 0; j < occluders.size(); j++)
+		{
+			if(canOcclude(occluders[j])) visible.push_back(j == i && shadowProxiesEnabled ? ~(int)j : (int)j);
+			else numCulled++;
+		}
+
+		// Receivers seeing the same occluders share a group, kept while the set is in use
+		if(sets.count(visible)) continue;
+		std::map<std::vector<int>, Group>::iterator cached = occluderSets.find(visible);
+		if(cached != occluderSets.end())
+		{
+			sets[visible] = cached->second;
+			occluderSets.erase(cached);
+			continue;
+		}
+		Group group = context->createGroup();
+		group->setAcceleration(context->createAcceleration("Trbvh"));
+		group->setChildCount((uint)visible.size());
+		for(size_t k = 0; k < visible.size(); k++)
+		{
+			if(visible[k] < 0) group->setChild((uint)k, occluders[~visible[k]].full);
+			else group->setChild((uint)k, shadowProxiesEnabled ? occluders[visible[k]].proxy : occluders[visible[k]].full);
+		}
+		sets[visible] = group;
+	}
+	clearOccluderSets();
+	occluderSets.swap(sets);
+	culledFraction = float(numCulled) / float(occluders.size() * occluders.size());
+
+	// Rays other than shadow rays visit child 0
+	occluderSelector->setChildCount((uint)occluderSets.size() + 1);
+	occluderSelector->setChild(0, all);
+	std::map<std::vector<int>, uint> children;
+	for(std::pair<const std::vector<int>, Group> &set : occluderSets)
+	{
+		const uint child = (uint)children.size() + 1;
+		occluderSelector->setChild(child, set.second);
+		children[set.first] = child;
+	}
+
+	RTsize numObjectIds;
+	occluderSetBuffer->getSize(numObjectIds);
+	uint *objectSets = static_cast<uint*>(occluderSetBuffer->map());
+	std::fill(objectSets, objectSets + numObjectIds, 0u);
+	for(size_t i = 0; i < occluders.size(); i++)
+	{
+		objectSets[occluders[i].objectId] = children[receiverSets[i]];
+	}
+	occluderSetBuffer->unmap();
+	context["shadow_geometry"]->set(occluderSelector);
+}
 
 //--------------------------------------------------------------
 // Default Scene
 //--------------------------------------------------------------
 
-DefaultScene::DefaultScene()
+void DefaultScene::load(TaskGraph &graph)
 {
 	// Setup light
 	light.corner = make_float3(343.0f, 520.0f, 227.0f);
@@ -14,147 +418,115 @@ DefaultScene::DefaultScene()
 	light.normal = normalize(cross(light.v1, light.v2));
 	light.emission = make_float3(15.0f, 15.0f, 5.0f);
 
-	lightBuffer = context->createBuffer(RT_BUFFER_INPUT);
-	lightBuffer->setFormat(RT_FORMAT_USER);
-	lightBuffer->setElementSize(sizeof(ParallelogramLight));
-	lightBuffer->setSize(1u);
-	memcpy(lightBuffer->map(), &light, sizeof(light));
-	lightBuffer->unmap();
-	context["lights"]->setBuffer(lightBuffer);
+	TaskGraph::Task lightTask = addLightTask(graph);
+	TaskGraph::Task materialTask = addMaterialTask(graph);
+	TaskGraph::Task geometryTask = graph.addTask("create parallelograms", [this]()
+	{
+		QuadSoup quads;
+		const float3 white = make_float3(0.8f, 0.8f, 0.8f);
+		const float3 green = make_float3(0.05f, 0.8f, 0.05f);
+		const float3 red = make_float3(0.8f, 0.05f, 0.05f);
 
-	// Material
-	Material diffuse = context->createMaterial();
-	diffuse->setClosestHitProgram(GROUND_TRUTH_RAY, context->createProgramFromPTXString(cudaFiles["ground_truth"], "diffuse"));
-	diffuse->setClosestHitProgram(GEOMETRY_HIT_RAY, context->createProgramFromPTXString(cudaFiles["main"], "sample_geometry_hit"));
-	diffuse->setAnyHitProgram(SHADOW_RAY, context->createProgramFromPTXString(cudaFiles["main"], "shadow"));
+		// Floor
+		quads.add(make_float3(0.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, 560.0f),
+				  make_float3(560.0f, 0.0f, 0.0f),
+				  white);
 
-	diffuse["Ka"]->setFloat(0.3f, 0.3f, 0.3f);
-	diffuse["Kd"]->setFloat(0.6f, 0.7f, 0.8f);
-	diffuse["Ks"]->setFloat(0.8f, 0.9f, 0.8f);
-	diffuse["phong_exp"]->setFloat(88);
-	diffuse["reflectivity_n"]->setFloat(0.2f, 0.2f, 0.2f);
+		// Ceiling
+		quads.add(make_float3(0.0f, 560.0f, 0.0f),
+				  make_float3(560.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, 560.0f),
+				  white);
 
-	// create geometry instances
-	std::vector<GeometryInstance> gis;
+		// Back wall
+		quads.add(make_float3(0.0f, 0.0f, 560.0f),
+				  make_float3(0.0f, 560.0f, 0.0f),
+				  make_float3(560.0f, 0.0f, 0.0f),
+				  white);
 
-	const float3 white = make_float3(0.8f, 0.8f, 0.8f);
-	const float3 green = make_float3(0.05f, 0.8f, 0.05f);
-	const float3 red = make_float3(0.8f, 0.05f, 0.05f);
-	const float3 light_em = make_float3(15.0f, 15.0f, 5.0f);
+		// Right wall
+		quads.add(make_float3(0.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 560.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, 560.0f),
+				  green);
 
-	// Floor
-	gis.push_back(createParallelogram(make_float3(0.0f, 0.0f, 0.0f),
-									  make_float3(0.0f, 0.0f, 560.0f),
-									  make_float3(560.0f, 0.0f, 0.0f),
-									  diffuse,
-									  white));
-
-	// Ceiling
-	gis.push_back(createParallelogram(make_float3(0.0f, 560.0f, 0.0f),
-									  make_float3(560.0f, 0.0f, 0.0f),
-									  make_float3(0.0f, 0.0f, 560.0f),
-									  diffuse,
-									  white));
-
-	// Back wall
-	gis.push_back(createParallelogram(make_float3(0.0f, 0.0f, 560.0f),
-									  make_float3(0.0f, 560.0f, 0.0f),
-									  make_float3(560.0f, 0.0f, 0.0f),
-									  diffuse,
-									  white));
-
-	// Right wall
-	gis.push_back(createParallelogram(make_float3(0.0f, 0.0f, 0.0f),
-									  make_float3(0.0f, 560.0f, 0.0f),
-									  make_float3(0.0f, 0.0f, 560.0f),
-									  diffuse,
-									  green));
-
-	// Left wall
-	gis.push_back(createParallelogram(make_float3(560.0f, 0.0f, 0.0f),
-									  make_float3(0.0f, 0.0f, 560.0f),
-									  make_float3(0.0f, 560.0f, 0.0f),
-									  diffuse,
-									  red));
-
-	// Short block
-	gis.push_back(createParallelogram(make_float3(130.0f, 165.0f, 65.0f),
-									  make_float3(-48.0f, 0.0f, 160.0f),
-									  make_float3(160.0f, 0.0f, 49.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(290.0f, 0.0f, 114.0f),
-									  make_float3(0.0f, 165.0f, 0.0f),
-									  make_float3(-50.0f, 0.0f, 158.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(130.0f, 0.0f, 65.0f),
-									  make_float3(0.0f, 165.0f, 0.0f),
-									  make_float3(160.0f, 0.0f, 49.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(82.0f, 0.0f, 225.0f),
-									  make_float3(0.0f, 165.0f, 0.0f),
-									  make_float3(48.0f, 0.0f, -160.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(240.0f, 0.0f, 272.0f),
-									  make_float3(0.0f, 165.0f, 0.0f),
-									  make_float3(-158.0f, 0.0f, -47.0f),
-									  diffuse,
-									  white));
-
-	// Tall block
-	gis.push_back(createParallelogram(make_float3(423.0f, 330.0f, 247.0f),
-									  make_float3(-158.0f, 0.0f, 49.0f),
-									  make_float3(49.0f, 0.0f, 159.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(423.0f, 0.0f, 247.0f),
-									  make_float3(0.0f, 330.0f, 0.0f),
-									  make_float3(49.0f, 0.0f, 159.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(472.0f, 0.0f, 406.0f),
-									  make_float3(0.0f, 330.0f, 0.0f),
-									  make_float3(-158.0f, 0.0f, 50.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(314.0f, 0.0f, 456.0f),
-									  make_float3(0.0f, 330.0f, 0.0f),
-									  make_float3(-49.0f, 0.0f, -160.0f),
-									  diffuse,
-									  white));
-	gis.push_back(createParallelogram(make_float3(265.0f, 0.0f, 296.0f),
-									  make_float3(0.0f, 330.0f, 0.0f),
-									  make_float3(158.0f, 0.0f, -49.0f),
-									  diffuse,
-									  white));
-
-	// Create geometry group
-	GeometryGroup geometry_group = context->createGeometryGroup(gis.begin(), gis.end());
-	geometry_group->setAcceleration(context->createAcceleration("NoAccel"));
-	context["scene_geometry"]->set(geometry_group);
-}
-
-void DefaultScene::update()
+		// Left wall
+		quads.add(make_float3(560.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, 560.0f),
+				  make_float3(0.0f, 560.0f, 0.0f),
+				  red);
+
+		// Short block
+		quads.add(make_float3(130.0f, 165.0f, 65.0f),
+				  make_float3(-48.0f, 0.0f, 160.0f),
+				  make_float3(160.0f, 0.0f, 49.0f),
+				  white);
+		quads.add(make_float3(290.0f, 0.0f, 114.0f),
+				  make_float3(0.0f, 165.0f, 0.0f),
+				  make_float3(-50.0f, 0.0f, 158.0f),
+				  white);
+		quads.add(make_float3(130.0f, 0.0f, 65.0f),
+				  make_float3(0.0f, 165.0f, 0.0f),
+				  make_float3(160.0f, 0.0f, 49.0f),
+				  white);
+		quads.add(make_float3(82.0f, 0.0f, 225.0f),
+				  make_float3(0.0f, 165.0f, 0.0f),
+				  make_float3(48.0f, 0.0f, -160.0f),
+				  white);
+		quads.add(make_float3(240.0f, 0.0f, 272.0f),
+				  make_float3(0.0f, 165.0f, 0.0f),
+				  make_float3(-158.0f, 0.0f, -47.0f),
+				  white);
+
+		// Tall block
+		quads.add(make_float3(423.0f, 330.0f, 247.0f),
+				  make_float3(-158.0f, 0.0f, 49.0f),
+				  make_float3(49.0f, 0.0f, 159.0f),
+				  white);
+		quads.add(make_float3(423.0f, 0.0f, 247.0f),
+				  make_float3(0.0f, 330.0f, 0.0f),
+				  make_float3(49.0f, 0.0f, 159.0f),
+				  white);
+		quads.add(make_float3(472.0f, 0.0f, 406.0f),
+				  make_float3(0.0f, 330.0f, 0.0f),
+				  make_float3(-158.0f, 0.0f, 50.0f),
+				  white);
+		quads.add(make_float3(314.0f, 0.0f, 456.0f),
+				  make_float3(0.0f, 330.0f, 0.0f),
+				  make_float3(-49.0f, 0.0f, -160.0f),
+				  white);
+		quads.add(make_float3(265.0f, 0.0f, 296.0f),
+				  make_float3(0.0f, 330.0f, 0.0f),
+				  make_float3(158.0f, 0.0f, -49.0f),
+				  white);
+
+		addQuadSoup(quads);
+	}, { materialTask, graph.getTask("compile parallelogram.cu") }, true);
+
+	addAccelerationTask(graph, "Trbvh", { lightTask, geometryTask });
+}
+
+unsigned DefaultScene::update()
 {
 	if(animate)
 	{
-		light.corner = make_float3(343.0f + cos(glutGet(GLUT_ELAPSED_TIME) / 1000.f) * 100.f,
+		light.corner = make_float3(343.0f + cos(float(getElapsedTime())) * 100.f,
 								   520.0f,
-								   227.0f + sin(glutGet(GLUT_ELAPSED_TIME) / 1000.f) * 100.f);
+								   227.0f + sin(float(getElapsedTime())) * 100.f);
 		memcpy(lightBuffer->map(), &light, sizeof(light));
 		lightBuffer->unmap();
 		context["lights"]->setBuffer(lightBuffer);
+		return LIGHT_CHANGED;
 	}
+	return 0;
 }
 
 //--------------------------------------------------------------
 // Grid Scene
 //--------------------------------------------------------------
 
-GridScene::GridScene()
+void GridScene::load(TaskGraph &graph)
 {
 	// Setup light
 	light.corner = make_float3(400.0f, 520.0f, 500.0f);
@@ -163,63 +535,159 @@ GridScene::GridScene()
 	light.normal = normalize(cross(light.v1, light.v2));
 	light.emission = make_float3(15.0f, 15.0f, 5.0f);
 
-	lightBuffer = context->createBuffer(RT_BUFFER_INPUT);
-	lightBuffer->setFormat(RT_FORMAT_USER);
-	lightBuffer->setElementSize(sizeof(ParallelogramLight));
-	lightBuffer->setSize(1u);
-	memcpy(lightBuffer->map(), &light, sizeof(light));
-	lightBuffer->unmap();
-	context["lights"]->setBuffer(lightBuffer);
-
-	// Material
-	Material diffuse = context->createMaterial();
-	diffuse->setClosestHitProgram(GROUND_TRUTH_RAY, context->createProgramFromPTXString(cudaFiles["ground_truth"], "diffuse"));
-	diffuse->setClosestHitProgram(GEOMETRY_HIT_RAY, context->createProgramFromPTXString(cudaFiles["main"], "sample_geometry_hit"));
-	diffuse->setAnyHitProgram(SHADOW_RAY, context->createProgramFromPTXString(cudaFiles["main"], "shadow"));
-
-	diffuse["Ka"]->setFloat(0.3f, 0.3f, 0.3f);
-	diffuse["Kd"]->setFloat(0.6f, 0.7f, 0.8f);
-	diffuse["Ks"]->setFloat(0.8f, 0.9f, 0.8f);
-	diffuse["phong_exp"]->setFloat(88);
-	diffuse["reflectivity_n"]->setFloat(0.2f, 0.2f, 0.2f);
-
-	// create geometry instances
-	std::vector<GeometryInstance> gis;
+	TaskGraph::Task lightTask = addLightTask(graph);
+	TaskGraph::Task materialTask = addMaterialTask(graph);
 
-	const float3 white = make_float3(0.8f, 0.8f, 0.8f);
 	const float3 green = make_float3(0.05f, 0.8f, 0.05f);
-	const float3 red = make_float3(0.8f, 0.05f, 0.05f);
 	const float3 blue = make_float3(0.5f, 0.5f, 0.8f);
 
 	// Floor
-	gis.push_back(createParallelogram(make_float3(0.0f, 0.0f, 0.0f),
-									  make_float3(0.0f, 0.0f, 1000.0f),
-									  make_float3(1000.0f, 0.0f, 0.0f),
-									  diffuse,
-									  make_float3(0.8f, 0.8f, 0.5f)));
+	TaskGraph::Task floorTask = graph.addTask("create floor", [this]()
+	{
+		QuadSoup quads;
+		quads.add(make_float3(0.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, 1000.0f),
+				  make_float3(1000.0f, 0.0f, 0.0f),
+				  make_float3(0.8f, 0.8f, 0.5f));
+		addQuadSoup(quads);
+	}, { materialTask, graph.getTask("compile parallelogram.cu") }, true);
 
-	// Load mesh
+	// Load meshes (each upload depends on the previous one to keep object ids deterministic)
 	Matrix4x4 matrix;
 	matrix = Matrix4x4::translate(make_float3(500, 80, 500)) * Matrix4x4::scale(make_float3(20, 20, 20)) * Matrix4x4::rotate(35, make_float3(1.0f, 0.0f, 0.0f)) * Matrix4x4::rotate(15, make_float3(0.0f, 1.0f, 0.0f));
-	gis.push_back(loadMesh("meshes/grid.obj", diffuse, blue, matrix));
+	TaskGraph::Task gridTask = addMeshTask(graph, "meshes/grid.obj", blue, matrix, { floorTask });
 	matrix = Matrix4x4::translate(make_float3(300, 0, 300)) * Matrix4x4::scale(make_float3(80, 80, 80));
-	gis.push_back(loadMesh("meshes/daisy2.obj", diffuse, green, matrix));
+	TaskGraph::Task daisyTask = addMeshTask(graph, "meshes/daisy2.obj", green, matrix, { gridTask });
 
-	// Create geometry group
-	GeometryGroup geometry_group = context->createGeometryGroup(gis.begin(), gis.end());
-	geometry_group->setAcceleration(context->createAcceleration("Trbvh"/*"NoAccel"*/));
-	context["scene_geometry"]->set(geometry_group);
+	addAccelerationTask(graph, "Trbvh"/*"NoAccel"*/, { lightTask, daisyTask });
 }
 
-void GridScene::update()
+unsigned GridScene::update()
 {
 	/*if(animate)
 	{
-		light.corner = make_float3(343.0f + cos(glutGet(GLUT_ELAPSED_TIME) / 1000.f) * 100.f,
+		light.corner = make_float3(343.0f + cos(float(getElapsedTime())) * 100.f,
 								   520.0f,
-								   227.0f + sin(glutGet(GLUT_ELAPSED_TIME) / 1000.f) * 100.f);
+								   227.0f + sin(float(getElapsedTime())) * 100.f);
 		memcpy(lightBuffer->map(), &light, sizeof(light));
 		lightBuffer->unmap();
 		context["lights"]->setBuffer(lightBuffer);
+		return LIGHT_CHANGED;
 	}*/
+	return 0;
+}
+
+//--------------------------------------------------------------
+// Scatter Scene
+//--------------------------------------------------------------
+
+struct ScatterMesh
+{
+	const char *filename;
+	float scale;  // Scale of an average instance
+	float height; // Above the ground
+	float3 color;
+};
+
+static const ScatterMesh scatterMeshes[] =
+{
+	{ "meshes/grass1.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/grass2.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/grass3.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/grass4.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/grass5.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/grass6.obj", 40.f, 0.f, make_float3(0.2f, 0.6f, 0.1f) },
+	{ "meshes/daisy1.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/daisy2.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/daisy3.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/daisy4.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/daisy5.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/daisy6.obj", 80.f, 0.f, make_float3(0.8f, 0.8f, 0.6f) },
+	{ "meshes/cow.obj", 500.f, 1.f, make_float3(0.6f, 0.4f, 0.3f) },
+	{ "meshes/fish.obj", 120.f, 40.f, make_float3(0.9f, 0.5f, 0.1f) },
+};
+
+static const float scatterSize = 1000.f; // Side of the ground plane
+
+void ScatterScene::load(TaskGraph &graph)
+{
+	// Setup light
+	light.corner = make_float3(435.0f, 900.0f, 435.0f);
+	light.v1 = make_float3(-130.0f, 0.0f, 0.0f);
+	light.v2 = make_float3(0.0f, 0.0f, 130.0f);
+	light.normal = normalize(cross(light.v1, light.v2));
+	light.emission = make_float3(15.0f, 15.0f, 5.0f);
+
+	TaskGraph::Task lightTask = addLightTask(graph);
+	TaskGraph::Task materialTask = addMaterialTask(graph);
+
+	// Ground
+	TaskGraph::Task groundTask = graph.addTask("create ground", [this]()
+	{
+		QuadSoup quads;
+		quads.add(make_float3(0.0f, 0.0f, 0.0f),
+				  make_float3(0.0f, 0.0f, scatterSize),
+				  make_float3(scatterSize, 0.0f, 0.0f),
+				  make_float3(0.8f, 0.8f, 0.5f));
+		addQuadSoup(quads);
+	}, { materialTask, graph.getTask("compile parallelogram.cu") }, true);
+
+	// Parse every mesh once on the thread pool and upload it on the main thread
+	const int numMeshes = sizeof(scatterMeshes) / sizeof(scatterMeshes[0]);
+	std::vector<std::shared_ptr<MeshData>> meshes;
+	std::shared_ptr<std::vector<Geometry>> geometries = std::make_shared<std::vector<Geometry>>(numMeshes);
+	std::vector<TaskGraph::Task> instanceDependencies = { groundTask };
+	for(int i = 0; i < numMeshes; i++)
+	{
+		std::shared_ptr<MeshData> mesh = std::make_shared<MeshData>();
+		const std::string filename = scatterMeshes[i].filename;
+		TaskGraph::Task parse = graph.addTask("parse " + filename, [mesh, filename]()
+		{
+			loadObj(filename, *mesh);
+		});
+		instanceDependencies.push_back(graph.addTask("upload " + filename, [mesh, geometries, i]()
+		{
+			(*geometries)[i] = createMeshGeometry(*mesh);
+		}, { parse, graph.getTask("compile triangle_mesh.cu") }, true));
+		meshes.push_back(mesh);
+	}
+
+	// Instances are created in order on the main thread, which keeps object ids deterministic
+	TaskGraph::Task instancesTask = graph.addTask("scatter instances", [this, meshes, geometries, numMeshes]()
+	{
+		std::vector<Acceleration> accelerations(numMeshes);
+		for(Acceleration &acceleration : accelerations) acceleration = context->createAcceleration("Trbvh");
+
+		// Raw generator output, since the distributions differ between standard libraries
+		std::mt19937 random(seed);
+		auto uniform = [&random]() { return float(random() / 4294967296.0); };
+		for(int i = 0; i < numInstances; i++)
+		{
+			const int index = std::min(int(uniform() * numMeshes), numMeshes - 1);
+			const ScatterMesh &scatterMesh = scatterMeshes[index];
+			const float3 position = make_float3(uniform() * scatterSize, scatterMesh.height, uniform() * scatterSize);
+			const float angle = uniform() * 2.f * M_PIf;
+			const float scale = scatterMesh.scale * (0.75f + 0.5f * uniform());
+			const Matrix4x4 matrix = Matrix4x4::translate(position) * Matrix4x4::rotate(angle, make_float3(0.0f, 1.0f, 0.0f)) * Matrix4x4::scale(make_float3(scale));
+			addMeshInstance((*geometries)[index], accelerations[index], meshes[index], scatterMesh.color, matrix);
+		}
+		printf("Scattered %d instances of %d meshes\n", numInstances, numMeshes);
+	}, instanceDependencies, true);
+
+	addAccelerationTask(graph, "Trbvh", { lightTask, instancesTask });
+}
+
+unsigned ScatterScene::update()
+{
+	if(animate)
+	{
+		light.corner = make_float3(435.0f + cos(float(getElapsedTime())) * 200.f,
+								   900.0f,
+								   435.0f + sin(float(getElapsedTime())) * 200.f);
+		memcpy(lightBuffer->map(), &light, sizeof(light));
+		lightBuffer->unmap();
+		context["lights"]->setBuffer(lightBuffer);
+		return LIGHT_CHANGED;
+	}
+	return 0;
 }
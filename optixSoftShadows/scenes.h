@@ -2,33 +2,136 @@
 
 #include "common.h"
 #include "structs.h"
+#include "tasks.h"
+#include "bvh.h"
+
+// What Scene::update() changed
+enum SceneChange
+{
+	LIGHT_CHANGED    = 1,
+	GEOMETRY_CHANGED = 2
+};
 
 class Scene
 {
 public:
-	virtual void update() = 0;
+	virtual ~Scene() {}
+
+	// Adds the tasks that create this scene (loading meshes, creating
+	// geometry and the acceleration structure) to the startup graph
+	virtual void load(TaskGraph &graph) = 0;
+
+	// Animates the scene, returns a combination of SceneChange flags
+	virtual unsigned update() = 0;
+
+	// Name used for the scene's parameter preset
+	virtual const char *getName() const = 0;
+
+	// Shadow rays trace the proxies instead of the full meshes when enabled
+	void setShadowProxiesEnabled(bool enabled);
+	bool hasShadowProxies() const { return shadowGroup.get() != sceneGroup.get(); }
+
+	// Restricts the shadow rays from every object to the objects that can occlude it
+	// from the light. updateOccluders() has to be called whenever the light moves.
+	void setOccluderCullingEnabled(bool enabled);
+	void updateOccluders();
+	float getCulledFraction() const { return culledFraction; } // Of all receiver and occluder pairs
+
+	// Builds a CPU BVH of the full meshes, instances and quads
+	void buildCpuBVH(WideBVH& bvh) const;
+
+	// Quad soups added by the scene, kept for CPU ray queries
+	const std::vector<QuadSoup>& getQuadSoups() const { return quadSoups; }
+
+	const ParallelogramLight& getLight() const { return light; }
+
+	// Replaces the light and uploads it. Call updateOccluders() afterwards.
+	void setLight(const ParallelogramLight &newLight);
+
+	// Hash of the geometry, transforms and colors of everything loaded
+	uint64_t getContentHash() const { return contentHash; }
 
 	bool animate = true;
+	float shadowProxyError = 0.f; // Max vertex error of the meshes' shadow proxies, 0 for none. Set before load().
+
+protected:
+	TaskGraph::Task addLightTask(TaskGraph &graph);
+	TaskGraph::Task addMaterialTask(TaskGraph &graph);
+	TaskGraph::Task addMeshTask(TaskGraph &graph, const std::string &filename, const float3 &color, const Matrix4x4 &transformationMatrix, const std::vector<TaskGraph::Task> &dependencies);
+	TaskGraph::Task addAccelerationTask(TaskGraph &graph, const std::string &builder, const std::vector<TaskGraph::Task> &dependencies);
+
+	// Adds an instance traced by all rays, or by all but shadow rays if it has a proxy
+	void addInstance(GeometryInstance gi, GeometryInstance shadowProxy = GeometryInstance());
+	void addQuadSoup(const QuadSoup& quads);
+	void hashMesh(const MeshData &mesh, const float3 &color);
+
+	// Places an instance of mesh geometry uploaded with createMeshGeometry(). Instances share
+	// the geometry and the acceleration structure, and are traced through a transform.
+	void addMeshInstance(Geometry geometry, Acceleration acceleration, std::shared_ptr<MeshData> mesh, const float3 &color, const Matrix4x4 &matrix);
+
+	// An object shadow rays can be restricted to, with an acceleration structure of its own
+	struct Occluder
+	{
+		uint objectId;
+		float3 lower, upper;       // World-space bounds
+		bool planar;               // Never shadows itself
+		GeometryGroup full, proxy; // Proxy is the full mesh if there is none
+	};
+	void addOccluder(uint objectId, const std::vector<float3> &positions, bool planar, GeometryInstance full, GeometryInstance proxy);
+	void clearOccluderSets();
+
+	ParallelogramLight light;
+	Buffer lightBuffer;
+	Material diffuse;
+	std::vector<GeometryInstance> gis;
+	std::vector<GeometryInstance> shadowGis;
+	GeometryGroup sceneGroup, shadowGroup;
+	std::vector<std::shared_ptr<MeshData>> cpuMeshes; // Kept for CPU ray queries
+	std::vector<QuadSoup> quadSoups;
+	std::vector<std::pair<std::shared_ptr<MeshData>, Matrix4x4>> cpuInstances;
+	std::vector<Transform> transforms;
+	Group instanceGroup, shadowInstanceGroup; // The scene's groups and the transforms, if there are any
+	uint maxObjectId = 0;
+	uint64_t contentHash = 0;
+	std::map<const MeshData*, uint64_t> meshHashes; // Of the meshes instanced
+
+	std::vector<Occluder> occluders;
+	std::map<std::vector<int>, Group> occluderSets; // Groups of the occluders (by index) some receiver can see
+	Selector occluderSelector;                      // Child 0 holds everything, the others the occluder sets
+	Buffer occluderSetBuffer;                       // Selector child of every object id
+	bool shadowProxiesEnabled = true, occluderCulling = true;
+	float culledFraction = 0.f;
 };
 
 class DefaultScene : public Scene
 {
 public:
-	DefaultScene();
-	void update();
-
-private:
-	ParallelogramLight light;
-	Buffer lightBuffer;
+	void load(TaskGraph &graph);
+	unsigned update();
+	const char *getName() const { return "default"; }
 };
 
 class GridScene : public Scene
 {
 public:
-	GridScene();
-	void update();
+	void load(TaskGraph &graph);
+	unsigned update();
+	const char *getName() const { return "grid"; }
+};
+
+// Instances of the meshes in meshes/ scattered on a ground plane with random
+// transforms, for measuring how the renderer scales with the number of objects.
+// The same seed always gives the same scene.
+class ScatterScene : public Scene
+{
+public:
+	ScatterScene(int numInstances, unsigned seed) : numInstances(numInstances), seed(seed) {}
+
+	void load(TaskGraph &graph);
+	unsigned update();
+	const char *getName() const { return "scatter"; }
 
 private:
-	ParallelogramLight light;
-	Buffer lightBuffer;
+	int numInstances;
+	unsigned seed;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+//--------------------------------------------------------------
+// Platform socket headers
+//
+// Included before anything including windows.h. Sockets are
+// stored as uintptr_t, which holds both SOCKET and int.
+//--------------------------------------------------------------
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  pragma comment(lib, "Ws2_32.lib")
+typedef int socklen_t;
+#  define SHUT_RDWR SD_BOTH
+#else
+#  include <sys/socket.h>
+#  include <sys/select.h>
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
+#  include <netdb.h>
+#  include <sys/time.h>
+#  include <unistd.h>
+#  define closesocket close
+#endif
+#include <stdint.h>
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+#define INVALID_SOCKET_VALUE (~(uintptr_t)0)
+
+// Sends to a peer that stopped reading fail after this, instead of stalling the sender
+#define SOCKET_SEND_TIMEOUT 2000 // ms
+
+// Pairs around any use of sockets, Windows counts them
+inline void startSockets()
+{
+#ifdef _WIN32
+	WSADATA data;
+	WSAStartup(MAKEWORD(2, 2), &data);
+#endif
+}
+
+inline void stopSockets()
+{
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+// Only local clients can connect, remote ones go through a tunnel.
+// Returns INVALID_SOCKET_VALUE if the port can't be listened on.
+inline uintptr_t openLoopbackListener(unsigned short port, int backlog)
+{
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	const uintptr_t listener = socket(AF_INET, SOCK_STREAM, 0);
+	if(listener == INVALID_SOCKET_VALUE) return INVALID_SOCKET_VALUE;
+	const int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+	if(bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, backlog) != 0)
+	{
+		closesocket(listener);
+		return INVALID_SOCKET_VALUE;
+	}
+	return listener;
+}
+
+// Makes sends fail after the given time instead of blocking on a peer that stopped reading
+inline void setSendTimeout(uintptr_t socket, int milliseconds)
+{
+#ifdef _WIN32
+	const DWORD timeout = milliseconds;
+#else
+	const timeval timeout = { milliseconds / 1000, (milliseconds % 1000) * 1000 };
+#endif
+	setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
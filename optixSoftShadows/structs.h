@@ -30,6 +30,26 @@ struct ParallelogramLight
 	float3 emission;
 };
 
+// Perspective view from the center of the light, facing away from its normal,
+// in which the blocker map is rendered
+struct BlockerMapFrame
+{
+	float3 origin;       // Center of the light
+	float3 u, v, w;      // Map axes and view direction
+	float  tan_half_fov; // Map covers [-1, 1] * tan_half_fov along u and v
+	float  light_radius; // Half the diagonal of the light
+	float  near;         // Nearest surface along w, bounds the blocker search
+};
+
+// Level of the distance pyramid. Levels above 0 are packed into
+// one screen-sized buffer, level 0 is the screen's pixels.
+struct PyramidLevel
+{
+	uint2        offset; // Of the level in the pyramid buffer
+	uint2        size;
+	unsigned int index;
+};
+
 //--------------------------------------------------------------
 // Per-ray data structs
 //--------------------------------------------------------------
@@ -60,4 +80,26 @@ struct PerRayData_shadow
 {
 	bool hit;
 	float3 hit_point;
-};
\ No newline at end of file
+	unsigned int occluder_set; // Child of the occluder selector to trace (see visit_occluders)
+};
+
+//--------------------------------------------------------------
+// Runtime parameters
+//--------------------------------------------------------------
+
+// Constants the specialized kernels are compiled for. The generic
+// kernels handle everything else.
+#define SPECIALIZED_BLUR_RADII 10 // blurH_<r> and blurV_<r> for r = 1..10
+#define SPECIALIZED_NUM_LIGHTS 1
+#define SPECIALIZED_NUM_PROBES 9
+
+struct SoftShadowParameters
+{
+	float k, alpha, mu;         // Constants from the paper
+	float sigma;                // Standard deviation of Gaussian of the light
+	float max_num_samples;      // Max number of adaptive samples per pixel
+	float max_beta;             // Max filter width (primarily for debug visualization)
+	int   num_probes;           // Number of initial shadow rays per pixel
+	float max_kernel_radius;    // Max radius of the gaussian blur in pixels
+	float early_out_confidence; // Min confidence to skip the adaptive samples (> 1 disables)
+};
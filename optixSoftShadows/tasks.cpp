@@ -0,0 +1,203 @@
+#include "tasks.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+
+//--------------------------------------------------------------
+// Thread pool
+//--------------------------------------------------------------
+
+ThreadPool::ThreadPool(unsigned numThreads) :
+	stopping(false)
+{
+	numThreads = std::max(numThreads, 1u);
+	for(unsigned i = 0; i < numThreads; i++)
+	{
+		workers.push_back(std::thread([this]()
+		{
+			while(true)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					condition.wait(lock, [this]() { return stopping || !jobs.empty(); });
+					if(stopping && jobs.empty()) return;
+					job = std::move(jobs.front());
+					jobs.pop();
+				}
+				job();
+			}
+		}));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for(std::thread &worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::enqueue(std::function<void()> job)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		jobs.push(std::move(job));
+	}
+	condition.notify_one();
+}
+
+//--------------------------------------------------------------
+// Task graph
+//--------------------------------------------------------------
+
+TaskGraph::TaskGraph() :
+	numRemaining(0),
+	runTime(0.0),
+	pool(0)
+{
+}
+
+TaskGraph::Task TaskGraph::addTask(const std::string &name, std::function<void()> func, const std::vector<Task> &dependencies, bool mainThread)
+{
+	const Task task = (Task)tasks.size();
+
+	TaskInfo info;
+	info.name = name;
+	info.func = func;
+	info.numDependencies = (int)dependencies.size();
+	info.mainThread = mainThread;
+	info.startTime = info.endTime = 0.0;
+	tasks.push_back(info);
+
+	// Tasks can only depend on tasks added before them, so the graph is always acyclic
+	for(Task dependency : dependencies)
+	{
+		if(dependency < 0 || dependency >= task)
+			throw std::runtime_error("Task '" + name + "' has an invalid dependency");
+		tasks[dependency].dependents.push_back(task);
+	}
+	return task;
+}
+
+TaskGraph::Task TaskGraph::getTask(const std::string &name) const
+{
+	for(size_t i = 0; i < tasks.size(); i++)
+	{
+		if(tasks[i].name == name) return (Task)i;
+	}
+	return -1;
+}
+
+void TaskGraph::execute(Task task)
+{
+	TaskInfo &info = tasks[task];
+	info.startTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+
+	// Skip the remaining work once a task has failed
+	bool failed;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		failed = error != nullptr;
+	}
+	if(!failed)
+	{
+		try
+		{
+			info.func();
+		}
+		catch(...)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if(!error) error = std::current_exception();
+		}
+	}
+
+	info.endTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+
+	// Schedule the dependents that are now ready
+	std::unique_lock<std::mutex> lock(mutex);
+	for(Task dependent : info.dependents)
+	{
+		if(--tasks[dependent].numDependencies == 0)
+		{
+			schedule(dependent);
+		}
+	}
+	numRemaining--;
+	condition.notify_all();
+}
+
+void TaskGraph::schedule(Task task)
+{
+	if(tasks[task].mainThread)
+	{
+		mainThreadQueue.push(task);
+		condition.notify_all();
+	}
+	else
+	{
+		pool->enqueue([this, task]() { execute(task); });
+	}
+}
+
+void TaskGraph::run(ThreadPool &threadPool)
+{
+	runStart = std::chrono::high_resolution_clock::now();
+	pool = &threadPool;
+
+	std::unique_lock<std::mutex> lock(mutex);
+	numRemaining = (int)tasks.size();
+	for(size_t i = 0; i < tasks.size(); i++)
+	{
+		if(tasks[i].numDependencies == 0)
+		{
+			schedule((Task)i);
+		}
+	}
+
+	// Run main-thread tasks on this thread until everything is done
+	while(numRemaining > 0)
+	{
+		condition.wait(lock, [this]() { return numRemaining == 0 || !mainThreadQueue.empty(); });
+		if(!mainThreadQueue.empty())
+		{
+			const Task task = mainThreadQueue.front();
+			mainThreadQueue.pop();
+			lock.unlock();
+			execute(task);
+			lock.lock();
+		}
+	}
+
+	runTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+
+	if(error)
+	{
+		std::rethrow_exception(error);
+	}
+}
+
+void TaskGraph::printTimings() const
+{
+	std::vector<const TaskInfo*> sorted;
+	for(const TaskInfo &info : tasks) sorted.push_back(&info);
+	std::sort(sorted.begin(), sorted.end(), [](const TaskInfo *a, const TaskInfo *b) { return a->startTime < b->startTime; });
+
+	double taskTime = 0.0;
+	printf("%-40s %10s %10s\n", "Task", "Start", "Duration");
+	for(const TaskInfo *info : sorted)
+	{
+		const double duration = info->endTime - info->startTime;
+		printf("%-40s %7.1f ms %7.1f ms%s\n", info->name.c_str(), info->startTime, duration, info->mainThread ? " (main thread)" : "");
+		taskTime += duration;
+	}
+	printf("Total: %.1f ms (%.1f ms of task time on %u threads)\n", runTime, taskTime, pool ? pool->getThreadCount() : 0);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+//--------------------------------------------------------------
+// Thread pool
+//--------------------------------------------------------------
+
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned numThreads = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	// Queue a job to be run by one of the worker threads
+	void enqueue(std::function<void()> job);
+
+	unsigned getThreadCount() const { return (unsigned)workers.size(); }
+
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping;
+};
+
+//--------------------------------------------------------------
+// Task graph
+//
+// Tasks run as soon as all their dependencies have finished.
+// Tasks marked as main-thread tasks (everything that touches
+// the OptiX context) run on the thread calling run(), the rest
+// run on the thread pool.
+//--------------------------------------------------------------
+
+class TaskGraph
+{
+public:
+	typedef int Task;
+
+	TaskGraph();
+
+	// Add a task, returns a handle other tasks can depend on
+	Task addTask(const std::string &name, std::function<void()> func, const std::vector<Task> &dependencies = std::vector<Task>(), bool mainThread = false);
+
+	// Find a task by name, returns -1 if there is no such task
+	Task getTask(const std::string &name) const;
+	int getTaskCount() const { return (int)tasks.size(); }
+
+	// Run all tasks and block until they have finished.
+	// Rethrows the first exception thrown by a task.
+	void run(ThreadPool &pool);
+
+	// Print when each task started and how long it took
+	void printTimings() const;
+
+	// Timings of the last run in ms, relative to its start
+	double getRunTime() const { return runTime; }
+	double getStartTime(Task task) const { return tasks[task].startTime; }
+	double getEndTime(Task task) const { return tasks[task].endTime; }
+
+private:
+	struct TaskInfo
+	{
+		std::string name;
+		std::function<void()> func;
+		std::vector<Task> dependents;
+		int numDependencies;
+		bool mainThread;
+		double startTime, endTime; // In ms, relative to the start of run()
+	};
+
+	void execute(Task task);
+	void schedule(Task task);
+
+	std::vector<TaskInfo> tasks;
+	std::queue<Task> mainThreadQueue;
+	int numRemaining;
+	std::exception_ptr error;
+	std::chrono::high_resolution_clock::time_point runStart;
+	double runTime;
+
+	ThreadPool *pool;
+	std::mutex mutex;
+	std::condition_variable condition;
+};
@@ -0,0 +1,74 @@
+#include <optixu/optixu_math_namespace.h>
+#include <optixu/optixu_aabb_namespace.h>
+
+using namespace optix;
+
+//--------------------------------------------------------------
+// Triangle mesh intersection
+//--------------------------------------------------------------
+
+rtBuffer<float3> vertex_buffer;
+rtBuffer<float3> normal_buffer; // Empty if the mesh has no vertex normals
+rtBuffer<int3>   index_buffer;
+
+rtDeclareVariable(float3, geometric_normal, attribute geometric_normal, );
+rtDeclareVariable(float3, shading_normal, attribute shading_normal, );
+rtDeclareVariable(float3, hit_color, attribute hit_color, );
+rtDeclareVariable(uint, hit_object_id, attribute hit_object_id, );
+rtDeclareVariable(Ray, ray, rtCurrentRay, );
+
+// The whole mesh has one color and object id
+rtDeclareVariable(float3, diffuse_color, , );
+rtDeclareVariable(uint, object_id, , );
+
+RT_PROGRAM void intersect(int primIdx)
+{
+	const int3 v_idx = index_buffer[primIdx];
+	const float3 p0 = vertex_buffer[v_idx.x];
+	const float3 p1 = vertex_buffer[v_idx.y];
+	const float3 p2 = vertex_buffer[v_idx.z];
+
+	float3 n;
+	float t, beta, gamma;
+	if(intersect_triangle(ray, p0, p1, p2, n, t, beta, gamma))
+	{
+		if(rtPotentialIntersection(t))
+		{
+			geometric_normal = normalize(n);
+			if(normal_buffer.size() == 0)
+			{
+				shading_normal = geometric_normal;
+			}
+			else
+			{
+				const float3 n0 = normal_buffer[v_idx.x];
+				const float3 n1 = normal_buffer[v_idx.y];
+				const float3 n2 = normal_buffer[v_idx.z];
+				shading_normal = normalize(n1 * beta + n2 * gamma + n0 * (1.f - beta - gamma));
+			}
+			hit_color = diffuse_color;
+			hit_object_id = object_id;
+			rtReportIntersection(0);
+		}
+	}
+}
+
+RT_PROGRAM void bounds(int primIdx, float result[6])
+{
+	const int3 v_idx = index_buffer[primIdx];
+	const float3 p0 = vertex_buffer[v_idx.x];
+	const float3 p1 = vertex_buffer[v_idx.y];
+	const float3 p2 = vertex_buffer[v_idx.z];
+
+	Aabb* aabb = (Aabb*)result;
+	const float area = length(cross(p1 - p0, p2 - p0));
+	if(area > 0.f && !isinf(area))
+	{
+		aabb->m_min = fminf(fminf(p0, p1), p2);
+		aabb->m_max = fmaxf(fmaxf(p0, p1), p2);
+	}
+	else
+	{
+		aabb->invalidate();
+	}
+}
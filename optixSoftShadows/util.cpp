@@ -14,6 +14,19 @@
 #include <sstream>
 #include <map>
 #include <memory>
+#include <chrono>
+#include <errno.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace optix;
 
@@ -45,7 +58,8 @@ static bool readSourceFile(std::string &str, const std::string &filename)
 	return false;
 }
 
-static std::string g_nvrtcLog;
+// Thread local so cuda files can be compiled concurrently
+static thread_local std::string g_nvrtcLog;
 
 static void getPtxFromCuString(std::string &ptx, const char* cu_source, const char* name, const char** log_string)
 {
@@ -125,3 +139,47 @@ std::string getTimeStamp()
 	strftime(name, sizeof(name), LOGNAME_FORMAT, localtime(&now));
 	return name;
 }
+
+static const std::chrono::steady_clock::time_point g_startTime = std::chrono::steady_clock::now();
+
+double getElapsedTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - g_startTime).count();
+}
+
+bool createDirectory(const std::string &path)
+{
+#ifdef _WIN32
+	return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+std::string getTempFilename(const std::string &filename)
+{
+#ifdef _WIN32
+	return filename + "." + std::to_string(_getpid()) + ".tmp";
+#else
+	return filename + "." + std::to_string(getpid()) + ".tmp";
+#endif
+}
+
+bool replaceFile(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash)
+{
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	for(size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
@@ -3,10 +3,27 @@
 #include <string>
 #include <stdio.h>
 #include <time.h>
+#include <stdint.h>
 
 
 const char* loadCudaFile(
 	const char* filename,
 	const char** log = nullptr);
 
-std::string getTimeStamp();
\ No newline at end of file
+std::string getTimeStamp();
+
+// Seconds since the program started
+double getElapsedTime();
+
+// Creates a directory unless it exists. Returns false if it can't be created.
+bool createDirectory(const std::string &path);
+
+// Name of a file next to the given one that no other process writes to
+std::string getTempFilename(const std::string &filename);
+
+// Moves a file over another one in a single step, so other processes
+// see either the old or the new file. Returns false on failure.
+bool replaceFile(const std::string &from, const std::string &to);
+
+// FNV-1a hash of a block of memory, continuing from the given hash
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull);
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <optixu/optixu_math_namespace.h>
+
+//--------------------------------------------------------------
+// World-space visibility cache
+//
+// Shadow ray results are accumulated in a hash table of cells
+// keyed on the quantized hit position, normal, object and light,
+// so neighboring pixels, other views and later frames querying
+// nearly the same surface points share them. Cells are about
+// VISIBILITY_CACHE_CELL_PIXELS pixels wide, rounded to a power of
+// two, so views at similar distances land in the same cells.
+//
+// Entries are claimed and updated with atomics, without locks.
+// Each holds a fingerprint of its key (0 if empty), a word with
+// the quadrants of the cell sampled (high 4 bits), the number of
+// samples (14 bits) and of occluded samples (low 14 bits), and the
+// occluder distances: ~d2_min and d2_max as float bits, which
+// order like unsigned ints for positive floats. Distances are
+// published before the counts including them. The host clears
+// the table when the light or geometry changes.
+//
+// Only cells sampled in all four quadrants whose samples all
+// agree, fully lit or fully occluded, answer queries, so a cell
+// only partly covered by a penumbra isn't taken for lit from the
+// pixels of one corner. Penumbrae are traced as before.
+//--------------------------------------------------------------
+
+#define VISIBILITY_CACHE_CELL_PIXELS 4.f  // Cell size in pixels
+#define VISIBILITY_CACHE_MIN_SAMPLES 32u  // Samples before a cell answers queries
+#define VISIBILITY_CACHE_MAX_SAMPLES 1024u // Samples after which a cell stops accumulating
+#define VISIBILITY_CACHE_PROBES      8u   // Slots searched for a key
+
+#ifdef __CUDACC__
+rtBuffer<optix::uint4, 1> visibility_cache;
+rtDeclareVariable(unsigned int, visibility_cache_enabled, , ); // Set by the host for all programs
+
+// Murmur3 mixing steps
+static __device__ __inline__ unsigned int hash_combine(unsigned int hash, unsigned int value)
+{
+	value *= 0xcc9e2d51u;
+	value = (value << 15) | (value >> 17);
+	value *= 0x1b873593u;
+	hash ^= value;
+	hash = (hash << 13) | (hash >> 19);
+	return hash * 5u + 0xe6546b64u;
+}
+
+static __device__ __inline__ unsigned int hash_finalize(unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	return hash ^ (hash >> 16);
+}
+
+#define VISIBILITY_CACHE_COUNT_BITS 14u
+#define VISIBILITY_CACHE_COUNT_MASK ((1u << VISIBILITY_CACHE_COUNT_BITS) - 1u)
+#define VISIBILITY_CACHE_ALL_QUADRANTS (0xfu << (2u * VISIBILITY_CACHE_COUNT_BITS))
+
+// Slot, fingerprint and quadrant bit of the cell around a hit point.
+// footprint is the world-space size of a pixel there.
+static __device__ __inline__ optix::uint3 visibility_cache_key(optix::float3 hit_point, optix::float3 normal, float object_id, int light, float footprint)
+{
+	const int level = (int)ceilf(log2f(fmaxf(footprint * VISIBILITY_CACHE_CELL_PIXELS, 1e-6f)));
+	const float cell_size = exp2f((float)level);
+
+	// Normals are quantized to their major axis and its sign
+	const optix::float3 a = optix::make_float3(fabsf(normal.x), fabsf(normal.y), fabsf(normal.z));
+	const unsigned int axis = a.x > a.y ? (a.x > a.z ? 0u : 2u) : (a.y > a.z ? 1u : 2u);
+	const float major = axis == 0u ? normal.x : (axis == 1u ? normal.y : normal.z);
+
+	const unsigned int values[] = { (unsigned int)level,
+									(unsigned int)(int)floorf(hit_point.x / cell_size),
+									(unsigned int)(int)floorf(hit_point.y / cell_size),
+									(unsigned int)(int)floorf(hit_point.z / cell_size),
+									axis * 2u + (major < 0.f ? 1u : 0u),
+									(unsigned int)object_id,
+									(unsigned int)light };
+	unsigned int slot = 0x9747b28cu, fingerprint = 0x2545f491u;
+	for(int i = 0; i < 7; i++)
+	{
+		slot = hash_combine(slot, values[i]);
+		fingerprint = hash_combine(fingerprint, values[i]);
+	}
+
+	// Quadrant of the cell along the two axes in its plane
+	const float p[3] = { hit_point.x, hit_point.y, hit_point.z };
+	const unsigned int u = (unsigned int)(int)floorf(p[(axis + 1u) % 3u] * 2.f / cell_size) & 1u;
+	const unsigned int v = (unsigned int)(int)floorf(p[(axis + 2u) % 3u] * 2.f / cell_size) & 1u;
+	const unsigned int quadrant = 1u << (2u * VISIBILITY_CACHE_COUNT_BITS + u + 2u * v);
+	return optix::make_uint3(hash_finalize(slot), hash_finalize(fingerprint) | 1u, quadrant);
+}
+
+// Slot holding the key, -1 if there is none. Inserting claims an empty slot for it.
+static __device__ __inline__ int visibility_cache_find(optix::uint3 key, bool insert)
+{
+	const unsigned int size = (unsigned int)visibility_cache.size();
+	for(unsigned int i = 0; i < VISIBILITY_CACHE_PROBES; i++)
+	{
+		const unsigned int slot = (key.x + i) % size;
+		unsigned int stored = visibility_cache[slot].x;
+		if(stored == 0u && insert)
+		{
+			stored = atomicCAS(&visibility_cache[slot].x, 0u, key.y);
+			if(stored == 0u) stored = key.y;
+		}
+		if(stored == key.y) return (int)slot;
+		if(stored == 0u) return -1;
+	}
+	return -1;
+}
+
+// Visibility of the cell if its samples agree: 1 if lit, 0 if occluded
+// (with the occluder distances), -1 if unknown
+static __device__ __inline__ float visibility_cache_query(optix::uint3 key, float &d2_min, float &d2_max)
+{
+	if(!visibility_cache_enabled) return -1.f;
+	const int slot = visibility_cache_find(key, false);
+	if(slot < 0) return -1.f;
+
+	// The counts are read before the distances they were published after
+	const unsigned int counts = visibility_cache[slot].y;
+	const unsigned int num_samples = (counts >> VISIBILITY_CACHE_COUNT_BITS) & VISIBILITY_CACHE_COUNT_MASK, num_occluded = counts & VISIBILITY_CACHE_COUNT_MASK;
+	if(num_samples < VISIBILITY_CACHE_MIN_SAMPLES || (counts & VISIBILITY_CACHE_ALL_QUADRANTS) != VISIBILITY_CACHE_ALL_QUADRANTS) return -1.f;
+	if(num_occluded == 0u) return 1.f;
+	if(num_occluded < num_samples) return -1.f;
+	__threadfence();
+	const unsigned int d2_min_bits = visibility_cache[slot].z, d2_max_bits = visibility_cache[slot].w;
+	if(d2_min_bits == 0u || d2_max_bits == 0u) return -1.f;
+	d2_min = __uint_as_float(~d2_min_bits);
+	d2_max = __uint_as_float(d2_max_bits);
+	return 0.f;
+}
+
+// Adds traced samples to the cell
+static __device__ __inline__ void visibility_cache_record(optix::uint3 key, unsigned int num_samples, unsigned int num_occluded, float d2_min, float d2_max)
+{
+	if(!visibility_cache_enabled || num_samples == 0u) return;
+	const int slot = visibility_cache_find(key, true);
+	if(slot < 0 || ((visibility_cache[slot].y >> VISIBILITY_CACHE_COUNT_BITS) & VISIBILITY_CACHE_COUNT_MASK) >= VISIBILITY_CACHE_MAX_SAMPLES) return;
+
+	if(num_occluded > 0u)
+	{
+		atomicMax(&visibility_cache[slot].z, ~__float_as_uint(d2_min));
+		atomicMax(&visibility_cache[slot].w, __float_as_uint(d2_max));
+		__threadfence();
+	}
+	atomicAdd(&visibility_cache[slot].y, (num_samples << VISIBILITY_CACHE_COUNT_BITS) + num_occluded);
+	atomicOr(&visibility_cache[slot].y, key.z);
+}
+#endif